@@ -0,0 +1,129 @@
+/*
+ * libsunxidisp - Sunxi display control library
+ *
+ * The display layer of sunxi_hdmi_fb (DE1/DE2 backends and the unified
+ * dispatch) for programs that want to switch modes in-process instead of
+ * running the utility. Built from sunxi_hdmi_fb.c with -DSUNXI_DISP_LIB,
+ * optionally with -DSUNXI_DE1_ONLY or -DSUNXI_DE2_ONLY; see the build lines
+ * at the top of that file.
+ *
+ * Every call takes a context for one screen. Nothing is printed: calls
+ * return a SUNXI_DISP_* code, the last error message is kept in the
+ * context, and diagnostics go to an optional log callback. A context must
+ * not be used by two threads at once; separate contexts (e.g. one per
+ * screen) may be used concurrently.
+ *
+ * Calls that change the display (set_mode, hdmi_on/off, setup_fb,
+ * setup_layer_scaling and switch_async) hold the screen's lock file, which
+ * the utility also uses, so they do not interleave with changes made by
+ * other processes. A call that cannot get it within 30 s returns
+ * SUNXI_DISP_ERR_BUSY.
+ *
+ * Copyright (c) 2024
+ * License: MIT
+ */
+#ifndef SUNXI_DISP_H
+#define SUNXI_DISP_H
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Return codes. Errors are negative; SUNXI_DISP_UNCHANGED is a success */
+#define SUNXI_DISP_OK               0
+#define SUNXI_DISP_UNCHANGED        1   /* State already active, no ioctl issued */
+#define SUNXI_DISP_ERR_NODEV        (-1)    /* /dev/disp or /dev/fbN unusable */
+#define SUNXI_DISP_ERR_IO           (-2)    /* Driver rejected a request */
+#define SUNXI_DISP_ERR_UNSUPPORTED  (-3)    /* Not supported by the sink or DE */
+#define SUNXI_DISP_ERR_INVALID      (-4)    /* Bad argument */
+#define SUNXI_DISP_ERR_NOMEM        (-5)    /* Out of memory */
+#define SUNXI_DISP_ERR_TIMEOUT      (-6)    /* Switch not confirmed, rolled back */
+#define SUNXI_DISP_ERR_BUSY         (-7)    /* Switch in progress or screen locked */
+
+/* Log levels passed to the callback */
+#define SUNXI_DISP_LOG_ERROR        0
+#define SUNXI_DISP_LOG_INFO         1
+#define SUNXI_DISP_LOG_DEBUG        2
+
+/* Context flags (sunxi_disp_set_flags) */
+#define SUNXI_DISP_FORCE            0x1 /* Skip sink support checks (-f) */
+#define SUNXI_DISP_REAPPLY          0x2 /* Reissue ioctls even when unchanged */
+#define SUNXI_DISP_DEBUG            0x4 /* Emit SUNXI_DISP_LOG_DEBUG messages */
+
+/* HDMI output type as returned by sunxi_disp_output_type() */
+#define SUNXI_DISP_OUTPUT_HDMI      4
+
+typedef struct sunxi_disp sunxi_disp_t;
+
+/* msg is one line without the trailing newline */
+typedef void (*sunxi_disp_log_fn)(void *arg, int level, const char *msg);
+
+/*
+ * Open a context for screen (0 or 1). The display device is shared by all
+ * contexts of the process and detection runs once, on the first open.
+ */
+int sunxi_disp_open(sunxi_disp_t **ctx, unsigned int screen);
+void sunxi_disp_close(sunxi_disp_t *ctx);
+
+void sunxi_disp_set_log(sunxi_disp_t *ctx, sunxi_disp_log_fn fn, void *arg);
+/* Flags apply to the later calls on ctx (and a switch they start) */
+void sunxi_disp_set_flags(sunxi_disp_t *ctx, unsigned int flags);
+
+const char *sunxi_disp_strerror(int err);
+/* Message of the last failed call on ctx, "" if none */
+const char *sunxi_disp_last_error(const sunxi_disp_t *ctx);
+
+/* 1 for DE1 (A10/A20), 2 for DE2 (H3/H5/A64) */
+int sunxi_disp_de_version(const sunxi_disp_t *ctx);
+
+/* Mode number for a name such as "720p60" */
+int sunxi_disp_mode_lookup(const char *name);
+int sunxi_disp_mode_info(int mode, uint32_t *width, uint32_t *height, uint32_t *refresh);
+
+int sunxi_disp_screen_size(sunxi_disp_t *ctx, uint32_t *width, uint32_t *height);
+int sunxi_disp_output_type(sunxi_disp_t *ctx);
+/* 1 = sink connected, 0 = not */
+int sunxi_disp_hdmi_hpd(sunxi_disp_t *ctx);
+/* Current HDMI mode number */
+int sunxi_disp_hdmi_mode(sunxi_disp_t *ctx);
+/* 1 = supported, 0 = not (EDID, cached per boot) */
+int sunxi_disp_hdmi_mode_supported(sunxi_disp_t *ctx, int mode);
+
+/* Switch HDMI mode; SUNXI_DISP_UNCHANGED if already active */
+int sunxi_disp_hdmi_set_mode(sunxi_disp_t *ctx, int mode);
+int sunxi_disp_hdmi_on(sunxi_disp_t *ctx);
+int sunxi_disp_hdmi_off(sunxi_disp_t *ctx);
+
+/*
+ * Size the framebuffer to fb_w x fb_h at depth bpp and scale it to
+ * scn_w x scn_h (0 = the screen size), as 'fb' in the utility.
+ */
+int sunxi_disp_setup_fb(sunxi_disp_t *ctx, uint32_t fb_w, uint32_t fb_h,
+                        uint32_t scn_w, uint32_t scn_h, int depth);
+/* Scale by reprogramming the layer windows, keeping the allocation */
+int sunxi_disp_setup_layer_scaling(sunxi_disp_t *ctx, uint32_t fb_w, uint32_t fb_h,
+                                   uint32_t scn_w, uint32_t scn_h, int depth);
+
+/*
+ * Start a mode change and return at once. mode is the new HDMI mode, or -1
+ * to keep it; a non-zero fb_w also resizes the framebuffer to
+ * fb_w x fb_h @ depth, scaled to the (new) screen size. Returns an eventfd
+ * that becomes readable when the switch is complete: the mode reads back
+ * and the first vblank in it has passed. If that takes longer than
+ * timeout_ms (0 = 5 s), or a step fails, the previous mode is restored.
+ * Poll the fd, then call sunxi_disp_switch_result(), which also closes it.
+ * No other call may be made on ctx in between. The switch holds the
+ * screen's lock file while it runs.
+ */
+int sunxi_disp_switch_async(sunxi_disp_t *ctx, int mode, uint32_t fb_w, uint32_t fb_h,
+                            int depth, unsigned int timeout_ms);
+/* Wait for the switch if not done yet: OK, UNCHANGED or an error (TIMEOUT) */
+int sunxi_disp_switch_result(sunxi_disp_t *ctx);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* SUNXI_DISP_H */
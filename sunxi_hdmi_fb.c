@@ -13,19 +13,41 @@
  * - Linux 3.4 kernel source for sun8iw7 (H3) display driver
  *
  * Compile with:
- *   arm-linux-gnueabihf-gcc -o sunxi_hdmi_fb sunxi_hdmi_fb.c
+ *   arm-linux-gnueabihf-gcc -o sunxi_hdmi_fb sunxi_hdmi_fb.c -pthread
+ * Add -mfpu=neon to use the NEON framebuffer kernels on ARMv7.
+ *
+ * Single-backend build (e.g. for an initramfs), DE1 or DE2 only:
+ *   arm-linux-gnueabihf-gcc -Os -DSUNXI_DE1_ONLY -o sunxi_hdmi_fb sunxi_hdmi_fb.c -pthread
+ *
+ * libsunxidisp, the display layer without the CLI (API in sunxi_disp.h;
+ * the -DSUNXI_DE*_ONLY flags apply here too):
+ *   arm-linux-gnueabihf-gcc -O2 -DSUNXI_DISP_LIB -fPIC -shared \
+ *       -o libsunxidisp.so sunxi_hdmi_fb.c -pthread
+ *   arm-linux-gnueabihf-gcc -O2 -DSUNXI_DISP_LIB -c -o sunxi_disp.o sunxi_hdmi_fb.c
+ *   arm-linux-gnueabihf-ar rcs libsunxidisp.a sunxi_disp.o
  *
  * Copyright (c) 2024
  * License: MIT
  */
 
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <fcntl.h>
 #include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/file.h>
 #include <sys/ioctl.h>
 #include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <sys/utsname.h>
+#include <poll.h>
+#include <pthread.h>
+#include <linux/netlink.h>
 #include <stdint.h>
 #include <stddef.h>
 #include <errno.h>
@@ -33,12 +55,61 @@
 #include <linux/fb.h>
 #include <linux/types.h>
 #include <stdbool.h>
+#include <time.h>
+
+#ifdef SUNXI_DISP_LIB
+/*
+ * Library build: the code below reports through printf/fprintf/perror like
+ * the CLI does. Those calls are routed to the calling context instead of
+ * stdout/stderr: errors are kept for sunxi_disp_last_error() and everything
+ * goes to the log callback, if one is set. Other FILE streams are written
+ * as usual. The CLI-only sections are compiled out, which leaves helpers
+ * that only they use.
+ */
+#include <stdarg.h>
+#include "sunxi_disp.h"
+#pragma GCC diagnostic ignored "-Wunused-function"
+#pragma GCC diagnostic ignored "-Wunused-variable"
+
+static int lib_printf(const char *fmt, ...) __attribute__((format(printf, 1, 2)));
+static int lib_fprintf(FILE *f, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+static void lib_perror(const char *s);
+static __thread sunxi_disp_t *g_ctx;    /* Context of the call in progress */
+#undef printf
+#undef fprintf
+#undef perror
+#define printf(...)         lib_printf(__VA_ARGS__)
+#define fprintf(f, ...)     lib_fprintf(f, __VA_ARGS__)
+#define perror(s)           lib_perror(s)
+#else
+/*
+ * A thread with no terminal of its own (a detached async switch, see
+ * mode_async_worker()) sets g_mute. Its stdout/stderr messages are dropped
+ * rather than written to whatever the daemon has on fds 1 and 2 by then.
+ */
+static __thread int g_mute;
+#define printf(...)         (g_mute ? 0 : printf(__VA_ARGS__))
+#define fprintf(f, ...)     ((g_mute && ((f) == stdout || (f) == stderr)) ? 0 : \
+                             fprintf(f, __VA_ARGS__))
+#define perror(s)           (g_mute ? (void)0 : perror(s))
+#endif
 
 /* Device paths */
 #define DISP_DEV    "/dev/disp"
 #define FB_DEV      "/dev/fb0"
+#define FB_DEV_FMT  "/dev/fb%u"     /* Per-screen fbdev in parallel runs */
 #define HDMI_STATE  "/sys/class/switch/hdmi/state"
 #define CPUINFO     "/proc/cpuinfo"
+#define DAEMON_SOCKET "/run/sunxi_hdmi_fb.sock"
+#define CAPS_CACHE  "/run/sunxi_hdmi_fb.caps"
+#define BOOT_ID     "/proc/sys/kernel/random/boot_id"
+#define BOARD_MODEL "/proc/device-tree/model"
+#define MEMINFO     "/proc/meminfo"
+#define MATCH_STATE "/run/sunxi_hdmi_fb.match"
+#define SNAPSHOT_FILE "/etc/sunxi_hdmi_fb.snapshot"
+#define BLANK_STATE "/run/sunxi_hdmi_fb.blank"
+#define LOCK_FILE_FMT "/run/sunxi_hdmi_fb.%u.lock"
+#define PENDING_FILE "/run/sunxi_hdmi_fb.pending"
 
 /*
  * ============================================================================
@@ -51,7 +122,30 @@ typedef enum {
     DE_VERSION_2,   /* H3/H5/A64 (sun8iw7/sun50iw1) - Display Engine 2.0 */
 } de_version_t;
 
+/*
+ * -DSUNXI_DE1_ONLY / -DSUNXI_DE2_ONLY turn g_de_version into a constant:
+ * every dispatch switch folds to one backend, and the other backend, its
+ * tables and the detection probes are not emitted.
+ */
+#if defined(SUNXI_DE1_ONLY) && defined(SUNXI_DE2_ONLY)
+#error "SUNXI_DE1_ONLY and SUNXI_DE2_ONLY are mutually exclusive"
+#elif defined(SUNXI_DE1_ONLY)
+#define g_de_version    DE_VERSION_1
+#define HAVE_DE1        1
+#define HAVE_DE2        0
+#elif defined(SUNXI_DE2_ONLY)
+#define g_de_version    DE_VERSION_2
+#define HAVE_DE1        0
+#define HAVE_DE2        1
+#else
 static de_version_t g_de_version = DE_VERSION_UNKNOWN;
+#define HAVE_DE1        1
+#define HAVE_DE2        1
+#endif
+#define DE_SINGLE       (!HAVE_DE1 || !HAVE_DE2)
+static int g_de_preset = 0;     /* DE version given by a snapshot, skip detection */
+
+#define CAPS_MAX_SCREENS 2
 
 /*
  * ============================================================================
@@ -116,7 +210,10 @@ typedef enum {
 #define DE1_CMD_SCN_GET_WIDTH       0x08
 #define DE1_CMD_SCN_GET_HEIGHT      0x09
 #define DE1_CMD_GET_OUTPUT_TYPE     0x0a
+#define DE1_CMD_START_CMD_CACHE     0x10
+#define DE1_CMD_EXECUTE_CMD_CACHE   0x11    /* EXECUTE_CMD_AND_STOP_CACHE */
 #define DE1_CMD_SET_SCREEN_SIZE     0x1f
+#define DE1_CMD_SET_BKCOLOR         0x3f
 
 #define DE1_CMD_LAYER_REQUEST       0x40
 #define DE1_CMD_LAYER_RELEASE       0x41
@@ -142,6 +239,10 @@ typedef enum {
 #define DE1_CMD_FB_RELEASE          0x281
 #define DE1_CMD_FB_GET_PARA         0x282
 
+/* sunxi fbdev: layer handle behind /dev/fbN on screen 0/1 (unsigned long out) */
+#define DE1_FBIOGET_LAYER_HDL_0     0x4700
+#define DE1_FBIOGET_LAYER_HDL_1     0x4701
+
 /* DE1 pixel formats */
 typedef enum {
     DE1_FORMAT_1BPP         = 0x0,
@@ -268,6 +369,13 @@ typedef struct {
 #define DE2_CMD_FB_REQUEST          0x280
 #define DE2_CMD_FB_RELEASE          0x281
 
+/* DE2 mixer topology searched for the fbdev layer */
+#define DE2_MAX_CHANNELS            4
+#define DE2_MAX_LAYERS              4
+
+/* Layer crop rectangles are 32.32 fixed point */
+#define DE2_CROP_SHIFT              32
+
 /* DE2 pixel formats */
 typedef enum {
     DE2_FORMAT_ARGB_8888    = 0x00,
@@ -282,6 +390,11 @@ typedef enum {
     DE2_FORMAT_BGR_888      = 0x09,
     DE2_FORMAT_RGB_565      = 0x0a,
     DE2_FORMAT_BGR_565      = 0x0b,
+    /* YUV formats (VI channels only) */
+    DE2_FORMAT_YUV422_I_YUYV    = 0x43,
+    DE2_FORMAT_YUV420_P         = 0x48,
+    DE2_FORMAT_YUV420_SP_UVUV   = 0x4c,     /* NV12 */
+    DE2_FORMAT_YUV420_SP_VUVU   = 0x4d,     /* NV21 */
 } de2_pixel_format;
 
 typedef enum {
@@ -413,10 +526,37 @@ static const mode_info_t mode_table[] = {
  * ============================================================================
  */
 static int g_disp_fd = -1;
-static int g_fb_fd = -1;
-static uint32_t g_screen = 0;
-static int g_verbose = 0;
-static int g_force = 0;
+
+/*
+ * Screen context: the screen the calling thread works on and its fbdev
+ * handle. These are per thread, so 'screens' and '-s 0,1' can drive both
+ * screens at once with the same helpers; a single-screen run is simply
+ * the main thread on screen 0 or the -s screen.
+ */
+static __thread int g_fb_fd = -1;
+static __thread uint32_t g_fb_index = 0;    /* /dev/fbN and DE1 fb_id */
+static __thread uint32_t g_screen = 0;
+static uint32_t g_screen_mask = 0;          /* -s 0,1: bit per screen, 0 = single */
+
+/* Serialises the process-wide caches (capabilities, ioctl statistics) */
+static pthread_mutex_t g_shared_lock = PTHREAD_MUTEX_INITIALIZER;
+/* Per thread as well: library contexts on other threads set their own */
+static __thread int g_verbose = 0;
+static __thread int g_force = 0;
+static int g_client = 0;
+static int g_no_cache = 0;
+static __thread int g_reapply = 0;
+static int g_stats = 0;     /* 0 = off, 1 = text summary, 2 = JSON */
+static __thread uint32_t g_buffers = 0; /* FB buffer count (-b), 0 = path default */
+static __thread uint32_t g_virt_w = 0;  /* virtual=WxH override, 0 = from buffers */
+static __thread uint32_t g_virt_h = 0;
+
+/*
+ * Returned by hdmi_init()/setup_fb_with_scaling() when the requested state
+ * is already active and no ioctl was issued. Callers treat it as success.
+ */
+#define STATE_UNCHANGED 1
+static const char *g_socket_path = DAEMON_SOCKET;
 
 /* Debug macro */
 #define DEBUG(fmt, ...) do { \
@@ -426,6 +566,43 @@ static int g_force = 0;
     } \
 } while(0)
 
+/* The per-thread flags, copied into the threads a command starts */
+typedef struct {
+    int         verbose;
+    int         force;
+    int         reapply;
+    uint32_t    buffers;
+    uint32_t    virt_w, virt_h;
+} run_flags_t;
+
+static void run_flags_save(run_flags_t *f)
+{
+    f->verbose = g_verbose;
+    f->force = g_force;
+    f->reapply = g_reapply;
+    f->buffers = g_buffers;
+    f->virt_w = g_virt_w;
+    f->virt_h = g_virt_h;
+}
+
+static void run_flags_load(const run_flags_t *f)
+{
+    g_verbose = f->verbose;
+    g_force = f->force;
+    g_reapply = f->reapply;
+    g_buffers = f->buffers;
+    g_virt_w = f->virt_w;
+    g_virt_h = f->virt_h;
+}
+
+/* Milliseconds elapsed on CLOCK_MONOTONIC since t0 */
+static double elapsed_ms(const struct timespec *t0)
+{
+    struct timespec t1;
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    return (t1.tv_sec - t0->tv_sec) * 1e3 + (t1.tv_nsec - t0->tv_nsec) / 1e6;
+}
+
 /*
  * ============================================================================
  * Signal Handlers
@@ -451,12 +628,36 @@ static void install_signal_handlers(void)
     sigaction(SIGABRT, &sa, NULL);
 }
 
+/* Set by SIGTERM/SIGINT in long-running commands (daemon, watch) */
+static volatile sig_atomic_t g_stop_requested = 0;
+
+static void stop_handler(int sig)
+{
+    (void)sig;
+    g_stop_requested = 1;
+}
+
+/* Set while daemon_serve() runs a request: commands must not block it */
+static int g_in_daemon = 0;
+
+/* No SA_RESTART: blocking accept()/poll() must return on SIGTERM/SIGINT */
+static void install_stop_handlers(void)
+{
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = stop_handler;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGTERM, &sa, NULL);
+    sigaction(SIGINT, &sa, NULL);
+}
+
 /*
  * ============================================================================
  * Display Engine Version Detection
  * ============================================================================
  */
 
+#if !DE_SINGLE
 /* Detect SoC type from /proc/cpuinfo */
 static de_version_t detect_soc_from_cpuinfo(void)
 {
@@ -511,9 +712,16 @@ static de_version_t detect_by_ioctl_probe(int fd)
     return DE_VERSION_UNKNOWN;
 }
 
+#endif /* !DE_SINGLE */
+
 /* Main detection function */
 static de_version_t detect_de_version(int fd)
 {
+#if DE_SINGLE
+    (void)fd;
+    DEBUG("Single-backend build, no detection");
+    return g_de_version;
+#else
     de_version_t ver;
 
     /* Try cpuinfo first */
@@ -531,6 +739,7 @@ static de_version_t detect_de_version(int fd)
     /* Default to DE1 for older kernels without proper detection */
     DEBUG("Could not detect DE version, defaulting to DE1 (A20)");
     return DE_VERSION_1;
+#endif
 }
 
 static const char* de_version_name(de_version_t ver)
@@ -542,6 +751,213 @@ static const char* de_version_name(de_version_t ver)
     }
 }
 
+/* Adopt a DE version from the cache or a snapshot; checked in fixed builds */
+static int de_version_set(de_version_t ver)
+{
+#if DE_SINGLE
+    if (ver != g_de_version) {
+        fprintf(stderr, "Built for %s only, display reports %s\n",
+                de_version_name(g_de_version), de_version_name(ver));
+        return -1;
+    }
+#else
+    g_de_version = ver;
+#endif
+    return 0;
+}
+
+/* Count screens by asking for each screen's output type */
+static uint32_t detect_screen_count(int fd, de_version_t ver)
+{
+    unsigned int cmd = (ver == DE_VERSION_2) ? DE2_CMD_GET_OUTPUT_TYPE : DE1_CMD_GET_OUTPUT_TYPE;
+    uint32_t count = 1;
+
+    for (uint32_t s = 1; s < CAPS_MAX_SCREENS; s++) {
+        unsigned long args[4] = {s, 0, 0, 0};
+        if (ioctl(fd, cmd, args) < 0) break;
+        count = s + 1;
+    }
+    DEBUG("Detected %u screen(s)", count);
+    return count;
+}
+
+/*
+ * ============================================================================
+ * Capability Cache
+ * ============================================================================
+ *
+ * Detection results are kept in a small binary record under /run so later
+ * runs can skip /proc/cpuinfo parsing and probe ioctls. The record is keyed
+ * by kernel release, board model and boot ID; any mismatch discards it.
+ *
+ * HDMI mode support answers are cached per screen together with the HPD
+ * state they were observed under and the sink they came from (a hash of
+ * its EDID base block). They are only trusted while the sink is connected
+ * and unchanged: a disconnect seen by any run clears them, and so does a
+ * different EDID, e.g. after a swap made while nothing was running.
+ */
+#define CAPS_MAGIC      0x43464853  /* "SHFC" */
+#define CAPS_VERSION    2
+
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    char     kernel[65];
+    char     board[64];
+    char     boot_id[40];
+    uint32_t de_version;
+    uint32_t screen_count;
+    uint32_t mode_probed[CAPS_MAX_SCREENS];     /* bit n: mode n was queried */
+    uint32_t mode_supported[CAPS_MAX_SCREENS];  /* bit n: mode n supported */
+    uint32_t sink_id[CAPS_MAX_SCREENS];         /* EDID hash of that sink, 0 = none */
+} caps_cache_t;
+
+static caps_cache_t g_caps;
+static int g_caps_dirty = 0;
+
+/* Read a small text file into buf (NUL-terminated, empty on error) */
+static void read_text_file_all(const char *path, char *buf, size_t size)
+{
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    ssize_t n = -1;
+
+    memset(buf, 0, size);
+    if (fd >= 0) {
+        n = read(fd, buf, size - 1);
+        close(fd);
+    }
+    buf[n > 0 ? n : 0] = '\0';
+}
+
+/* Read the first line of a small text file */
+static void read_text_file(const char *path, char *buf, size_t size)
+{
+    read_text_file_all(path, buf, size);
+    buf[strcspn(buf, "\n")] = '\0';
+}
+
+/* Fill in the fields the cache is keyed on */
+static void caps_make_key(caps_cache_t *c)
+{
+    struct utsname uts;
+
+    memset(c, 0, sizeof(*c));
+    c->magic = CAPS_MAGIC;
+    c->version = CAPS_VERSION;
+    if (uname(&uts) == 0)
+        snprintf(c->kernel, sizeof(c->kernel), "%s", uts.release);
+    read_text_file(BOARD_MODEL, c->board, sizeof(c->board));
+    read_text_file(BOOT_ID, c->boot_id, sizeof(c->boot_id));
+}
+
+static int caps_load(void)
+{
+    caps_cache_t key, rec;
+    ssize_t n;
+    int fd;
+
+    if (g_no_cache) return -1;
+
+    fd = open(CAPS_CACHE, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return -1;
+    n = read(fd, &rec, sizeof(rec));
+    close(fd);
+
+    caps_make_key(&key);
+    if (n != (ssize_t)sizeof(rec) || rec.magic != CAPS_MAGIC ||
+        rec.version != CAPS_VERSION ||
+        strcmp(rec.kernel, key.kernel) != 0 ||
+        strcmp(rec.board, key.board) != 0 ||
+        strcmp(rec.boot_id, key.boot_id) != 0) {
+        DEBUG("Capability cache stale or invalid, ignoring");
+        return -1;
+    }
+
+    if (rec.de_version != DE_VERSION_1 && rec.de_version != DE_VERSION_2) return -1;
+    if (rec.screen_count < 1 || rec.screen_count > CAPS_MAX_SCREENS) return -1;
+
+    g_caps = rec;
+    DEBUG("Capability cache hit: %s, %u screen(s)",
+          de_version_name((de_version_t)rec.de_version), rec.screen_count);
+    return 0;
+}
+
+static void caps_save(void)
+{
+    char tmp[sizeof(CAPS_CACHE) + 16];
+    int fd;
+
+    if (g_no_cache || !g_caps_dirty || g_caps.magic != CAPS_MAGIC) return;
+
+    snprintf(tmp, sizeof(tmp), "%s.%d", CAPS_CACHE, (int)getpid());
+    fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        DEBUG("Cannot write capability cache: %s", strerror(errno));
+        return;
+    }
+    if (write(fd, &g_caps, sizeof(g_caps)) != (ssize_t)sizeof(g_caps) ||
+        close(fd) < 0 || rename(tmp, CAPS_CACHE) < 0) {
+        DEBUG("Failed to store capability cache: %s", strerror(errno));
+        unlink(tmp);
+        return;
+    }
+    g_caps_dirty = 0;
+}
+
+static void caps_clear_modes(uint32_t screen)
+{
+    if (screen >= CAPS_MAX_SCREENS) return;
+    if (g_caps.mode_probed[screen] == 0) return;
+    pthread_mutex_lock(&g_shared_lock);
+    g_caps.mode_probed[screen] = 0;
+    g_caps.mode_supported[screen] = 0;
+    g_caps_dirty = 1;
+    pthread_mutex_unlock(&g_shared_lock);
+}
+
+/* Returns 1 and sets *supported if the answer is cached for this HPD state and sink */
+static int caps_mode_lookup(uint32_t screen, disp_tv_mode mode, int hpd, uint32_t sink,
+                            int *supported)
+{
+    if (g_no_cache || screen >= CAPS_MAX_SCREENS || (unsigned)mode >= 32) return 0;
+
+    if (hpd <= 0) {
+        /* Sink gone (or unknown): whatever we knew about it is stale */
+        caps_clear_modes(screen);
+        return 0;
+    }
+    if (g_caps.sink_id[screen] != sink) {
+        DEBUG("caps: screen %u sink changed (%08x -> %08x), dropping cached modes",
+              screen, g_caps.sink_id[screen], sink);
+        caps_clear_modes(screen);
+        return 0;
+    }
+    if (!(g_caps.mode_probed[screen] & (1u << mode))) return 0;
+
+    *supported = (g_caps.mode_supported[screen] >> mode) & 1;
+    return 1;
+}
+
+static void caps_mode_store(uint32_t screen, disp_tv_mode mode, int hpd, uint32_t sink,
+                            int supported)
+{
+    if (screen >= CAPS_MAX_SCREENS || (unsigned)mode >= 32 || hpd <= 0) return;
+
+    pthread_mutex_lock(&g_shared_lock);
+    if (g_caps.sink_id[screen] != sink) {
+        g_caps.mode_probed[screen] = 0;
+        g_caps.mode_supported[screen] = 0;
+        g_caps.sink_id[screen] = sink;
+    }
+    g_caps.mode_probed[screen] |= 1u << mode;
+    if (supported)
+        g_caps.mode_supported[screen] |= 1u << mode;
+    else
+        g_caps.mode_supported[screen] &= ~(1u << mode);
+    g_caps_dirty = 1;
+    pthread_mutex_unlock(&g_shared_lock);
+}
+
 /*
  * ============================================================================
  * Device Open/Close
@@ -557,8 +973,22 @@ static int disp_open(void)
         return -1;
     }
 
-    /* Detect display engine version */
-    g_de_version = detect_de_version(g_disp_fd);
+    /* Detect display engine version, unless a valid cached record exists */
+    if (g_de_preset) {
+        DEBUG("Display Engine taken from snapshot");
+    } else if (caps_load() == 0) {
+        if (de_version_set((de_version_t)g_caps.de_version) < 0) {
+            close(g_disp_fd);
+            g_disp_fd = -1;
+            return -1;
+        }
+    } else {
+        de_version_set(detect_de_version(g_disp_fd));
+        caps_make_key(&g_caps);
+        g_caps.de_version = g_de_version;
+        g_caps.screen_count = detect_screen_count(g_disp_fd, g_de_version);
+        g_caps_dirty = 1;
+    }
     DEBUG("Display Engine: %s", de_version_name(g_de_version));
 
     return 0;
@@ -572,6 +1002,272 @@ static void disp_close(void)
     }
 }
 
+/* The fbdev handle is opened once and shared by all framebuffer helpers */
+static int fb_open(void)
+{
+    if (g_fb_fd >= 0) return 0;
+
+    if (g_fb_index == 0) {
+        g_fb_fd = open(FB_DEV, O_RDWR | O_CLOEXEC);
+    } else {
+        char path[32];
+        snprintf(path, sizeof(path), FB_DEV_FMT, g_fb_index);
+        g_fb_fd = open(path, O_RDWR | O_CLOEXEC);
+    }
+    if (g_fb_fd < 0) {
+        fprintf(stderr, "Failed to open " FB_DEV_FMT ": %s\n", g_fb_index, strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+static void fb_close(void)
+{
+    if (g_fb_fd >= 0) {
+        close(g_fb_fd);
+        g_fb_fd = -1;
+    }
+}
+
+/*
+ * ============================================================================
+ * ioctl Statistics
+ * ============================================================================
+ *
+ * Every display and fbdev ioctl is timed on CLOCK_MONOTONIC. With --stats
+ * the samples are kept per command and summarised (count, min/avg/p99/max,
+ * errno breakdown) after the command, as text or JSON (--stats=json).
+ */
+typedef struct {
+    de_version_t    de;         /* DE_VERSION_UNKNOWN: fbdev request */
+    unsigned long   cmd;
+    const char     *name;
+} ioctl_name_t;
+
+static const ioctl_name_t ioctl_names[] = {
+#if HAVE_DE1
+    { DE_VERSION_1, DE1_CMD_SCN_GET_WIDTH,      "SCN_GET_WIDTH" },
+    { DE_VERSION_1, DE1_CMD_SCN_GET_HEIGHT,     "SCN_GET_HEIGHT" },
+    { DE_VERSION_1, DE1_CMD_GET_OUTPUT_TYPE,    "GET_OUTPUT_TYPE" },
+    { DE_VERSION_1, DE1_CMD_START_CMD_CACHE,    "START_CMD_CACHE" },
+    { DE_VERSION_1, DE1_CMD_EXECUTE_CMD_CACHE,  "EXECUTE_CMD_CACHE" },
+    { DE_VERSION_1, DE1_CMD_SET_SCREEN_SIZE,    "SET_SCREEN_SIZE" },
+    { DE_VERSION_1, DE1_CMD_SET_BKCOLOR,        "SET_BKCOLOR" },
+    { DE_VERSION_1, DE1_CMD_LAYER_REQUEST,      "LAYER_REQUEST" },
+    { DE_VERSION_1, DE1_CMD_LAYER_RELEASE,      "LAYER_RELEASE" },
+    { DE_VERSION_1, DE1_CMD_LAYER_OPEN,         "LAYER_OPEN" },
+    { DE_VERSION_1, DE1_CMD_LAYER_CLOSE,        "LAYER_CLOSE" },
+    { DE_VERSION_1, DE1_CMD_LAYER_SET_FB,       "LAYER_SET_FB" },
+    { DE_VERSION_1, DE1_CMD_LAYER_GET_FB,       "LAYER_GET_FB" },
+    { DE_VERSION_1, DE1_CMD_LAYER_SET_SRC_WIN,  "LAYER_SET_SRC_WIN" },
+    { DE_VERSION_1, DE1_CMD_LAYER_GET_SRC_WIN,  "LAYER_GET_SRC_WIN" },
+    { DE_VERSION_1, DE1_CMD_LAYER_SET_SCN_WIN,  "LAYER_SET_SCN_WIN" },
+    { DE_VERSION_1, DE1_CMD_LAYER_GET_SCN_WIN,  "LAYER_GET_SCN_WIN" },
+    { DE_VERSION_1, DE1_CMD_LAYER_SET_PARA,     "LAYER_SET_PARA" },
+    { DE_VERSION_1, DE1_CMD_LAYER_GET_PARA,     "LAYER_GET_PARA" },
+    { DE_VERSION_1, DE1_CMD_HDMI_ON,            "HDMI_ON" },
+    { DE_VERSION_1, DE1_CMD_HDMI_OFF,           "HDMI_OFF" },
+    { DE_VERSION_1, DE1_CMD_HDMI_SET_MODE,      "HDMI_SET_MODE" },
+    { DE_VERSION_1, DE1_CMD_HDMI_GET_MODE,      "HDMI_GET_MODE" },
+    { DE_VERSION_1, DE1_CMD_HDMI_SUPPORT_MODE,  "HDMI_SUPPORT_MODE" },
+    { DE_VERSION_1, DE1_CMD_HDMI_GET_HPD,       "HDMI_GET_HPD" },
+    { DE_VERSION_1, DE1_CMD_FB_REQUEST,         "FB_REQUEST" },
+    { DE_VERSION_1, DE1_CMD_FB_RELEASE,         "FB_RELEASE" },
+    { DE_VERSION_1, DE1_CMD_FB_GET_PARA,        "FB_GET_PARA" },
+#endif
+#if HAVE_DE2
+    { DE_VERSION_2, DE2_CMD_SET_BKCOLOR,        "SET_BKCOLOR" },
+    { DE_VERSION_2, DE2_CMD_GET_SCN_WIDTH,      "GET_SCN_WIDTH" },
+    { DE_VERSION_2, DE2_CMD_GET_SCN_HEIGHT,     "GET_SCN_HEIGHT" },
+    { DE_VERSION_2, DE2_CMD_GET_OUTPUT_TYPE,    "GET_OUTPUT_TYPE" },
+    { DE_VERSION_2, DE2_CMD_DEVICE_SWITCH,      "DEVICE_SWITCH" },
+    { DE_VERSION_2, DE2_CMD_GET_OUTPUT,         "GET_OUTPUT" },
+    { DE_VERSION_2, DE2_CMD_LAYER_ENABLE,       "LAYER_ENABLE" },
+    { DE_VERSION_2, DE2_CMD_LAYER_DISABLE,      "LAYER_DISABLE" },
+    { DE_VERSION_2, DE2_CMD_LAYER_SET_INFO,     "LAYER_SET_INFO" },
+    { DE_VERSION_2, DE2_CMD_LAYER_GET_INFO,     "LAYER_GET_INFO" },
+    { DE_VERSION_2, DE2_CMD_LAYER_SET_CONFIG,   "LAYER_SET_CONFIG" },
+    { DE_VERSION_2, DE2_CMD_LAYER_GET_CONFIG,   "LAYER_GET_CONFIG" },
+    { DE_VERSION_2, DE2_CMD_HDMI_SUPPORT_MODE,  "HDMI_SUPPORT_MODE" },
+    { DE_VERSION_2, DE2_CMD_HDMI_GET_EDID,      "HDMI_GET_EDID" },
+    { DE_VERSION_2, DE2_CMD_FB_REQUEST,         "FB_REQUEST" },
+    { DE_VERSION_2, DE2_CMD_FB_RELEASE,         "FB_RELEASE" },
+#endif
+    { DE_VERSION_UNKNOWN, FBIOGET_VSCREENINFO,  "FBIOGET_VSCREENINFO" },
+    { DE_VERSION_UNKNOWN, FBIOPUT_VSCREENINFO,  "FBIOPUT_VSCREENINFO" },
+    { DE_VERSION_UNKNOWN, FBIOGET_FSCREENINFO,  "FBIOGET_FSCREENINFO" },
+    { DE_VERSION_UNKNOWN, FBIOPAN_DISPLAY,      "FBIOPAN_DISPLAY" },
+    { DE_VERSION_UNKNOWN, FBIO_WAITFORVSYNC,    "FBIO_WAITFORVSYNC" },
+    { DE_VERSION_UNKNOWN, DE1_FBIOGET_LAYER_HDL_0, "FBIOGET_LAYER_HDL_0" },
+    { DE_VERSION_UNKNOWN, DE1_FBIOGET_LAYER_HDL_1, "FBIOGET_LAYER_HDL_1" },
+    { DE_VERSION_UNKNOWN, 0, NULL }
+};
+
+#define STATS_MAX_CMDS      64
+#define STATS_MAX_SAMPLES   4096
+#define STATS_MAX_ERRNOS    4
+
+typedef struct {
+    de_version_t    de;
+    unsigned long   cmd;
+    uint32_t        count;
+    uint32_t        errors;
+    double          total_us;
+    double          min_us;
+    double          max_us;
+    float          *samples;    /* First STATS_MAX_SAMPLES calls, for p99 */
+    uint32_t        nsamples;
+    int             err_no[STATS_MAX_ERRNOS];
+    uint32_t        err_count[STATS_MAX_ERRNOS + 1];  /* Last slot: other */
+} ioctl_stat_t;
+
+static ioctl_stat_t g_ioctl_stats[STATS_MAX_CMDS];
+static int g_ioctl_nstats = 0;
+
+static const char *ioctl_name(de_version_t de, unsigned long cmd)
+{
+    for (int i = 0; ioctl_names[i].name; i++) {
+        if (ioctl_names[i].de == de && ioctl_names[i].cmd == cmd)
+            return ioctl_names[i].name;
+    }
+    return NULL;
+}
+
+static void stats_update(de_version_t de, unsigned long cmd, double us, int ret, int err)
+{
+    ioctl_stat_t *st = NULL;
+
+    for (int i = 0; i < g_ioctl_nstats; i++) {
+        if (g_ioctl_stats[i].de == de && g_ioctl_stats[i].cmd == cmd) {
+            st = &g_ioctl_stats[i];
+            break;
+        }
+    }
+    if (!st) {
+        if (g_ioctl_nstats >= STATS_MAX_CMDS) return;
+        st = &g_ioctl_stats[g_ioctl_nstats++];
+        memset(st, 0, sizeof(*st));
+        st->de = de;
+        st->cmd = cmd;
+        st->min_us = us;
+        st->samples = malloc(STATS_MAX_SAMPLES * sizeof(float));
+    }
+
+    st->count++;
+    st->total_us += us;
+    if (us < st->min_us) st->min_us = us;
+    if (us > st->max_us) st->max_us = us;
+    if (st->samples && st->nsamples < STATS_MAX_SAMPLES)
+        st->samples[st->nsamples++] = (float)us;
+
+    if (ret < 0) {
+        int slot;
+        st->errors++;
+        for (slot = 0; slot < STATS_MAX_ERRNOS; slot++) {
+            if (st->err_no[slot] == err || st->err_no[slot] == 0) break;
+        }
+        if (slot < STATS_MAX_ERRNOS) st->err_no[slot] = err;
+        st->err_count[slot]++;
+    }
+}
+
+static void stats_record(de_version_t de, unsigned long cmd, double us, int ret, int err)
+{
+    if (!g_stats) return;
+    pthread_mutex_lock(&g_shared_lock);
+    stats_update(de, cmd, us, ret, err);
+    pthread_mutex_unlock(&g_shared_lock);
+}
+
+static void stats_reset(void)
+{
+    for (int i = 0; i < g_ioctl_nstats; i++)
+        free(g_ioctl_stats[i].samples);
+    g_ioctl_nstats = 0;
+}
+
+static int cmp_float(const void *a, const void *b)
+{
+    float fa = *(const float *)a, fb = *(const float *)b;
+    return (fa > fb) - (fa < fb);
+}
+
+static double stats_p99(ioctl_stat_t *st)
+{
+    uint32_t idx;
+
+    if (!st->samples || st->nsamples == 0) return st->max_us;
+    qsort(st->samples, st->nsamples, sizeof(float), cmp_float);
+    idx = (st->nsamples * 99 + 99) / 100;
+    return st->samples[idx > 0 ? idx - 1 : 0];
+}
+
+static void stats_print(void)
+{
+    double total = 0;
+
+    if (!g_stats) return;
+
+    fflush(stdout);
+    if (g_stats == 2) {
+        printf("{\"de\": \"%s\", \"ioctls\": [", de_version_name(g_de_version));
+    } else {
+        printf("\n--- ioctl statistics (us) ---\n");
+        printf("  %-20s %6s %10s %10s %10s %10s %12s  errors\n",
+               "command", "count", "min", "avg", "p99", "max", "total");
+    }
+
+    for (int i = 0; i < g_ioctl_nstats; i++) {
+        ioctl_stat_t *st = &g_ioctl_stats[i];
+        const char *name = ioctl_name(st->de, st->cmd);
+        char fallback[24];
+        double p99 = stats_p99(st);
+
+        if (!name) {
+            snprintf(fallback, sizeof(fallback), "0x%lx", st->cmd);
+            name = fallback;
+        }
+        total += st->total_us;
+
+        if (g_stats == 2) {
+            printf("%s{\"name\": \"%s\", \"cmd\": %lu, \"count\": %u, \"errors\": %u, "
+                   "\"min_us\": %.1f, \"avg_us\": %.1f, \"p99_us\": %.1f, "
+                   "\"max_us\": %.1f, \"total_us\": %.1f, \"errno\": {",
+                   i ? ", " : "", name, st->cmd, st->count, st->errors,
+                   st->min_us, st->total_us / st->count, p99, st->max_us, st->total_us);
+            int first = 1;
+            for (int e = 0; e <= STATS_MAX_ERRNOS; e++) {
+                if (!st->err_count[e]) continue;
+                if (e < STATS_MAX_ERRNOS)
+                    printf("%s\"%d\": %u", first ? "" : ", ", st->err_no[e], st->err_count[e]);
+                else
+                    printf("%s\"other\": %u", first ? "" : ", ", st->err_count[e]);
+                first = 0;
+            }
+            printf("}}");
+        } else {
+            printf("  %-20s %6u %10.1f %10.1f %10.1f %10.1f %12.1f ",
+                   name, st->count, st->min_us, st->total_us / st->count,
+                   p99, st->max_us, st->total_us);
+            if (st->errors == 0) printf(" -");
+            for (int e = 0; e <= STATS_MAX_ERRNOS; e++) {
+                if (!st->err_count[e]) continue;
+                if (e < STATS_MAX_ERRNOS)
+                    printf(" %s:%u", strerror(st->err_no[e]), st->err_count[e]);
+                else
+                    printf(" other:%u", st->err_count[e]);
+            }
+            printf("\n");
+        }
+    }
+
+    if (g_stats == 2)
+        printf("], \"total_us\": %.1f}\n", total);
+    else
+        printf("  %-20s %6s %10s %10s %10s %10s %12.1f\n", "total", "", "", "", "", "", total);
+    fflush(stdout);
+}
+
 /*
  * ============================================================================
  * Low-level ioctl wrapper
@@ -579,6 +1275,8 @@ static void disp_close(void)
  */
 static int disp_ioctl(unsigned int cmd, unsigned long *args)
 {
+    struct timespec t0;
+
     if (g_disp_fd < 0) {
         fprintf(stderr, "Display device not open\n");
         return -1;
@@ -587,10 +1285,30 @@ static int disp_ioctl(unsigned int cmd, unsigned long *args)
     DEBUG("ioctl: cmd=0x%x args={%lu, %lu, 0x%lx, %lu}",
           cmd, args[0], args[1], args[2], args[3]);
 
+    clock_gettime(CLOCK_MONOTONIC, &t0);
     int ret = ioctl(g_disp_fd, cmd, args);
     int saved_errno = errno;
+    double us = elapsed_ms(&t0) * 1000.0;
+
+    DEBUG("ioctl: returned %d (errno=%d) in %.1f us", ret, saved_errno, us);
+    stats_record(g_de_version, cmd, us, ret, saved_errno);
+
+    errno = saved_errno;
+    return ret;
+}
+
+/* fbdev counterpart of disp_ioctl(), timed the same way */
+static int fb_ioctl(unsigned long req, void *arg)
+{
+    struct timespec t0;
+
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    int ret = ioctl(g_fb_fd, req, arg);
+    int saved_errno = errno;
+    double us = elapsed_ms(&t0) * 1000.0;
 
-    DEBUG("ioctl: returned %d (errno=%d)", ret, saved_errno);
+    DEBUG("fb ioctl: req=0x%lx returned %d (errno=%d) in %.1f us", req, ret, saved_errno, us);
+    stats_record(DE_VERSION_UNKNOWN, req, us, ret, saved_errno);
 
     errno = saved_errno;
     return ret;
@@ -630,12 +1348,140 @@ static const mode_info_t* get_mode_info(disp_tv_mode mode)
     return NULL;
 }
 
+/* Cached mode support check shared by both backends (see Unified API) */
+static int hdmi_mode_supported(disp_tv_mode mode);
+
+/* Per-screen change lock (see Display Lock) */
+static int display_lock(void);
+static void display_unlock(void);
+
+/*
+ * Layer transactions: callers stage changes to several layers and commit
+ * them together (see layer_txn_commit()). A layer is channel:layer on DE2
+ * and a layer handle on DE1 (channel unused).
+ */
+#define LAYER_TXN_MAX       16
+
+#define LAYER_SET_ENABLE    0x01
+#define LAYER_SET_CROP      0x02
+#define LAYER_SET_WIN       0x04
+#define LAYER_SET_ZORDER    0x08
+#define LAYER_SET_ALPHA     0x10
+
+typedef struct {
+    uint32_t    channel;
+    uint32_t    layer;
+    uint32_t    set;        /* LAYER_SET_* mask of the fields below */
+    int         enable;
+    disp_rect   crop;       /* Source region, pixels */
+    disp_rect   win;        /* Screen window */
+    int         zorder;
+    int         alpha;      /* Global alpha 0-255, -1 = per-pixel */
+} layer_change_t;
+
+typedef struct {
+    int             count;
+    layer_change_t  changes[LAYER_TXN_MAX];
+} layer_txn_t;
+
+/*
+ * ============================================================================
+ * Framebuffer Memory Budget
+ * ============================================================================
+ *
+ * The fbdev buffer comes from the same CMA pool as the video decoder and
+ * GPU. Before a reallocation, the request is checked against CmaFree in
+ * /proc/meminfo: the old buffer is released first, so its size counts as
+ * available. A warning is printed if the new buffer will not fit, or if it
+ * leaves less than FB_CMA_MIN_FREE_KB for everyone else.
+ */
+#define FB_CMA_MIN_FREE_KB  16384
+
+/* Value of a "Key:   N kB" line in /proc/meminfo, or -1 */
+static long meminfo_kb(const char *key)
+{
+    char buf[8192];
+    size_t klen = strlen(key);
+    char *p;
+
+    read_text_file_all(MEMINFO, buf, sizeof(buf));
+    for (p = buf; p && *p; p = strchr(p, '\n'), p = p ? p + 1 : NULL) {
+        if (strncmp(p, key, klen) == 0 && p[klen] == ':')
+            return strtol(p + klen + 1, NULL, 10);
+    }
+    return -1;
+}
+
+/*
+ * Virtual size for a w x h framebuffer: virtual=WxH if given, else
+ * def_nbuf pages (or -b). Returns -1 if the override cannot hold w x h.
+ */
+static int fb_virtual_size(uint32_t w, uint32_t h, uint32_t def_nbuf,
+                           uint32_t *xv, uint32_t *yv)
+{
+    uint32_t nbuf = g_buffers ? g_buffers : def_nbuf;
+
+    if (w == 0 || h == 0) {
+        fprintf(stderr, "Invalid framebuffer size %ux%u\n", w, h);
+        return -1;
+    }
+    *xv = g_virt_w ? g_virt_w : w;
+    *yv = g_virt_h ? g_virt_h : h * nbuf;
+    if (*xv < w || *yv < h) {
+        fprintf(stderr, "Virtual size %ux%u is smaller than the framebuffer %ux%u\n",
+                *xv, *yv, w, h);
+        return -1;
+    }
+    return 0;
+}
+
+/* Warn if allocating xv x yv @ depth would exhaust CMA; cur_len is freed first */
+static void fb_mem_check(uint32_t xv, uint32_t yv, int depth, uint32_t cur_len)
+{
+    long total = meminfo_kb("CmaTotal");
+    long avail = meminfo_kb("CmaFree");
+    long need = (long)(((uint64_t)xv * yv * (depth / 8) + 4095) / 4096 * 4);
+
+    if (total < 0 || avail < 0) {
+        DEBUG("fb_mem_check: no CMA figures in " MEMINFO);
+        return;
+    }
+    avail += cur_len / 1024;
+    fflush(stdout);
+    DEBUG("fb_mem_check: need %ld kB, %ld kB available of %ld kB CMA", need, avail, total);
+
+    if (need > avail) {
+        fprintf(stderr, "Warning: %ux%u @ %d bpp needs %.1f MiB but only %.1f MiB of CMA "
+                "is free - the allocation will likely fail\n",
+                xv, yv, depth, need / 1024.0, avail / 1024.0);
+    } else if (avail - need < FB_CMA_MIN_FREE_KB) {
+        fprintf(stderr, "Warning: %ux%u @ %d bpp leaves %.1f MiB of CMA for other users "
+                "(video decoder, GPU); consider fewer buffers (-b 1)\n",
+                xv, yv, depth, (avail - need) / 1024.0);
+    }
+}
+
 /*
  * ============================================================================
  * DE1 (A20) Implementation
  * ============================================================================
  */
 
+/* HPD state from the switch class node; -1 if unavailable */
+static int hdmi_get_hpd_sysfs(void)
+{
+    FILE *f = fopen(HDMI_STATE, "r");
+    if (f) {
+        int state = 0;
+        if (fscanf(f, "%d", &state) == 1) {
+            fclose(f);
+            return state;
+        }
+        fclose(f);
+    }
+    return -1;
+}
+
 static int de1_get_screen_size(uint32_t *width, uint32_t *height)
 {
     unsigned long args[4] = {g_screen, 0, 0, 0};
@@ -700,9 +1546,10 @@ static int de1_hdmi_set_mode(disp_tv_mode mode)
     return disp_ioctl(DE1_CMD_HDMI_SET_MODE, args);
 }
 
-static int de1_hdmi_init(disp_tv_mode mode)
+/* force skips the EDID check */
+static int de1_hdmi_init(disp_tv_mode mode, int force)
 {
-    if (!g_force && !de1_hdmi_mode_supported(mode)) {
+    if (!force && !hdmi_mode_supported(mode)) {
         fprintf(stderr, "HDMI mode %d not supported (use -f to force)\n", mode);
         return -1;
     }
@@ -727,21 +1574,53 @@ static int de1_fb_request(uint32_t fb_id, de1_fb_create_para_t *para)
     return disp_ioctl(DE1_CMD_FB_REQUEST, args);
 }
 
+static int de1_fb_get_para(uint32_t fb_id, de1_fb_create_para_t *para)
+{
+    unsigned long args[4] = {fb_id, (unsigned long)para, 0, 0};
+    memset(para, 0, sizeof(*para));
+    return disp_ioctl(DE1_CMD_FB_GET_PARA, args);
+}
+
 static int de1_setup_fb_with_scaling(uint32_t fb_id, uint32_t fb_w, uint32_t fb_h,
                                      uint32_t scn_w, uint32_t scn_h, int depth)
 {
     de1_fb_create_para_t para;
     int needs_scaling = (fb_w != scn_w || fb_h != scn_h);
+    uint32_t xv, yv, nbuf, cur_len = 0;
+    int have_para;
 
     DEBUG("DE1 setup: fb=%ux%u scn=%ux%u depth=%d scaling=%d",
           fb_w, fb_h, scn_w, scn_h, depth, needs_scaling);
 
+    /* DE1 allocates whole pages: the virtual size must be N x fb_h */
+    if (fb_virtual_size(fb_w, fb_h, 1, &xv, &yv) < 0) return -1;
+    if (xv != fb_w || yv % fb_h != 0 || yv / fb_h > 3) {
+        fprintf(stderr, "DE1 needs a virtual size of %ux(1-3 x %u), got %ux%u\n",
+                fb_w, fb_h, xv, yv);
+        return -1;
+    }
+    nbuf = yv / fb_h;
+
+    /* Skip the release/request cycle if the FB is already set up this way */
+    have_para = de1_fb_get_para(fb_id, &para) >= 0;
+    if (have_para) cur_len = para.smem_len;
+    if (!g_reapply && have_para &&
+        para.mode == (needs_scaling ? DE1_LAYER_WORK_MODE_SCALER : DE1_LAYER_WORK_MODE_NORMAL) &&
+        ((g_buffers == 0 && g_virt_h == 0) || para.buffer_num == nbuf) &&
+        para.width == fb_w && para.height == fb_h &&
+        para.output_width == scn_w && para.output_height == scn_h) {
+        printf("Framebuffer already configured: %dx%d -> %dx%d (no-op)\n",
+               fb_w, fb_h, scn_w, scn_h);
+        return STATE_UNCHANGED;
+    }
+
+    fb_mem_check(xv, yv, depth, cur_len);
     de1_fb_release(fb_id);
 
     memset(&para, 0, sizeof(para));
-    para.fb_mode = DE1_FB_MODE_SCREEN0;
+    para.fb_mode = g_screen ? DE1_FB_MODE_SCREEN1 : DE1_FB_MODE_SCREEN0;
     para.mode = needs_scaling ? DE1_LAYER_WORK_MODE_SCALER : DE1_LAYER_WORK_MODE_NORMAL;
-    para.buffer_num = 1;
+    para.buffer_num = nbuf;
     para.width = fb_w;
     para.height = fb_h;
     para.output_width = scn_w;
@@ -755,7 +1634,7 @@ static int de1_setup_fb_with_scaling(uint32_t fb_id, uint32_t fb_w, uint32_t fb_
 
     if (needs_scaling) {
         printf("Hardware scaling enabled: %dx%d -> %dx%d\n", fb_w, fb_h, scn_w, scn_h);
-        printf("NOTE: Scaling mode is incompatible with Mali/EGL. Run 'noscale' first.\n");
+        printf("NOTE: Scaling mode is incompatible with Mali/EGL; the layer method keeps it working.\n");
     } else {
         printf("Framebuffer configured: %dx%d (no scaling)\n", fb_w, fb_h);
     }
@@ -763,9 +1642,208 @@ static int de1_setup_fb_with_scaling(uint32_t fb_id, uint32_t fb_w, uint32_t fb_
     return 0;
 }
 
-/*
- * ============================================================================
- * DE2 (H3) Implementation
+static int de1_set_bkcolor(const disp_color *color)
+{
+    unsigned long args[4] = {g_screen, (unsigned long)color, 0, 0};
+    return disp_ioctl(DE1_CMD_SET_BKCOLOR, args);
+}
+
+/* The fbdev keeps one layer handle per screen; take the one on g_screen */
+static int de1_fb_layer_handle(unsigned long *hlayer)
+{
+    if (fb_open() < 0) return -1;
+    return fb_ioctl(g_screen ? DE1_FBIOGET_LAYER_HDL_1 : DE1_FBIOGET_LAYER_HDL_0,
+                    hlayer) < 0 ? -1 : 0;
+}
+
+static int de1_layer_enable(unsigned long hlayer, int enable)
+{
+    unsigned long args[4] = {g_screen, hlayer, 0, 0};
+    return disp_ioctl(enable ? DE1_CMD_LAYER_OPEN : DE1_CMD_LAYER_CLOSE, args);
+}
+
+static int de1_layer_get_para(unsigned long hlayer, de1_layer_info_t *info)
+{
+    unsigned long args[4] = {g_screen, hlayer, (unsigned long)info, 0};
+    memset(info, 0, sizeof(*info));
+    return disp_ioctl(DE1_CMD_LAYER_GET_PARA, args);
+}
+
+static int de1_layer_set_para(unsigned long hlayer, de1_layer_info_t *info)
+{
+    unsigned long args[4] = {g_screen, hlayer, (unsigned long)info, 0};
+    return disp_ioctl(DE1_CMD_LAYER_SET_PARA, args);
+}
+
+/* Framebuffer region the layer shows */
+static int de1_layer_set_src_win(unsigned long hlayer, disp_rect *rect)
+{
+    unsigned long args[4] = {g_screen, hlayer, (unsigned long)rect, 0};
+    return disp_ioctl(DE1_CMD_LAYER_SET_SRC_WIN, args);
+}
+
+/* Screen region it is scaled to */
+static int de1_layer_set_scn_win(unsigned long hlayer, disp_rect *rect)
+{
+    unsigned long args[4] = {g_screen, hlayer, (unsigned long)rect, 0};
+    return disp_ioctl(DE1_CMD_LAYER_SET_SCN_WIN, args);
+}
+
+static int de1_rect_eq(const disp_rect *a, const disp_rect *b)
+{
+    return a->x == b->x && a->y == b->y && a->width == b->width && a->height == b->height;
+}
+
+/*
+ * Scale by reprogramming the windows of the layer /dev/fb0 is shown on,
+ * the approach of setup_scaling_layer() in a20_hdmi_fb.c but without
+ * requesting a second layer. The framebuffer is not released, so its
+ * address and any Mali/EGL surface on it stay valid. A layer already in
+ * scaler mode only needs SET_SRC_WIN and SET_SCN_WIN; a normal layer is
+ * switched with one SET_PARA, for which the driver claims a scaler. Both
+ * run inside the command cache, so the change lands at a single vblank.
+ */
+static int de1_setup_layer_scaling(uint32_t fb_w, uint32_t fb_h,
+                                   uint32_t scn_w, uint32_t scn_h, int depth)
+{
+    struct fb_var_screeninfo vinfo;
+    de1_layer_info_t info;
+    disp_rect src, scn;
+    de1_layer_work_mode mode;
+    unsigned long hlayer, args[4] = {g_screen, 0, 0, 0};
+    int ret, err = 0;
+
+    DEBUG("DE1 layer setup: fb=%ux%u scn=%ux%u depth=%d", fb_w, fb_h, scn_w, scn_h, depth);
+
+    if (fb_open() < 0) return -1;
+    if (fb_ioctl(FBIOGET_VSCREENINFO, &vinfo) < 0) {
+        perror("FBIOGET_VSCREENINFO failed");
+        return -1;
+    }
+    if (fb_w > vinfo.xres || fb_h > vinfo.yres) {
+        fprintf(stderr, "Layer scaling needs %ux%u <= current FB %ux%u "
+                "(fb set %ux%ux%d first, or use the fbdev method)\n",
+                fb_w, fb_h, vinfo.xres, vinfo.yres, fb_w, fb_h, depth);
+        return -1;
+    }
+    if (vinfo.bits_per_pixel != (unsigned)depth) {
+        fprintf(stderr, "Layer scaling cannot change depth %u -> %d (use fbdev method)\n",
+                vinfo.bits_per_pixel, depth);
+        return -1;
+    }
+
+    if (de1_fb_layer_handle(&hlayer) < 0) {
+        fprintf(stderr, "Could not get the DE1 layer of " FB_DEV "\n");
+        return -1;
+    }
+    if (de1_layer_get_para(hlayer, &info) < 0) {
+        perror("DE1 LAYER_GET_PARA failed");
+        return -1;
+    }
+
+    src.x = (__s32)vinfo.xoffset;
+    src.y = (__s32)vinfo.yoffset;
+    src.width = fb_w;
+    src.height = fb_h;
+    scn.x = 0;
+    scn.y = 0;
+    scn.width = scn_w;
+    scn.height = scn_h;
+    mode = (fb_w != scn_w || fb_h != scn_h) ? DE1_LAYER_WORK_MODE_SCALER : info.mode;
+    DEBUG("DE1 layer %lu: mode %d -> %d, src %ux%u -> %ux%u, scn %ux%u -> %ux%u", hlayer,
+          info.mode, mode, info.src_win.width, info.src_win.height, fb_w, fb_h,
+          info.scn_win.width, info.scn_win.height, scn_w, scn_h);
+
+    if (!g_reapply && info.mode == mode &&
+        de1_rect_eq(&info.src_win, &src) && de1_rect_eq(&info.scn_win, &scn)) {
+        printf("Layer already scaling %ux%u -> %ux%u (no-op)\n", fb_w, fb_h, scn_w, scn_h);
+        return STATE_UNCHANGED;
+    }
+
+    if (disp_ioctl(DE1_CMD_START_CMD_CACHE, args) < 0)
+        DEBUG("DE1 START_CMD_CACHE failed (errno=%d), windows apply one by one", errno);
+    if (info.mode == mode) {
+        ret = de1_layer_set_src_win(hlayer, &src);
+        if (ret == 0) ret = de1_layer_set_scn_win(hlayer, &scn);
+    } else {
+        info.mode = mode;
+        info.src_win = src;
+        info.scn_win = scn;
+        ret = de1_layer_set_para(hlayer, &info);
+    }
+    if (ret < 0) err = errno;
+    if (disp_ioctl(DE1_CMD_EXECUTE_CMD_CACHE, args) < 0)
+        DEBUG("DE1 EXECUTE_CMD_AND_STOP_CACHE failed (errno=%d)", errno);
+
+    if (ret < 0) {
+        fprintf(stderr, "DE1 layer window update failed: %s%s\n", strerror(err),
+                mode == DE1_LAYER_WORK_MODE_SCALER ? " (no free scaler?)" : "");
+        errno = err;
+        return -1;
+    }
+
+    printf("DE1 layer scaling: %ux%u of %ux%u buffer -> %ux%u (no reallocation)\n",
+           fb_w, fb_h, vinfo.xres, vinfo.yres, scn_w, scn_h);
+    return 0;
+}
+
+/*
+ * DE1 has no array form of LAYER_SET_PARA. The closest equivalent is the
+ * driver's command cache: between START_CMD_CACHE and
+ * EXECUTE_CMD_AND_STOP_CACHE, layer register writes are held back and
+ * applied together at the next vblank. Window-only changes use
+ * SET_SCN_WIN; anything else reads the layer with GET_PARA and writes it
+ * back once with SET_PARA.
+ */
+static int de1_layer_txn_commit(const layer_txn_t *txn)
+{
+    unsigned long args[4] = {g_screen, 0, 0, 0};
+    int ret = 0;
+
+    if (disp_ioctl(DE1_CMD_START_CMD_CACHE, args) < 0)
+        DEBUG("DE1 START_CMD_CACHE failed (errno=%d), changes apply one by one", errno);
+
+    for (int i = 0; i < txn->count && ret == 0; i++) {
+        const layer_change_t *c = &txn->changes[i];
+        unsigned long largs[4] = {g_screen, c->layer, 0, 0};
+
+        if ((c->set & ~LAYER_SET_ENABLE) == LAYER_SET_WIN) {
+            disp_rect win = c->win;
+            largs[2] = (unsigned long)&win;
+            ret = disp_ioctl(DE1_CMD_LAYER_SET_SCN_WIN, largs);
+        } else if (c->set & ~LAYER_SET_ENABLE) {
+            de1_layer_info_t info;
+            memset(&info, 0, sizeof(info));
+            largs[2] = (unsigned long)&info;
+            ret = disp_ioctl(DE1_CMD_LAYER_GET_PARA, largs);
+            if (ret < 0) break;
+            if (c->set & LAYER_SET_CROP) info.src_win = c->crop;
+            if (c->set & LAYER_SET_WIN) info.scn_win = c->win;
+            if (c->set & LAYER_SET_ZORDER) info.prio = (__u8)c->zorder;
+            if (c->set & LAYER_SET_ALPHA) {
+                info.alpha_en = c->alpha >= 0;
+                info.alpha_val = c->alpha >= 0 ? (__u16)c->alpha : 0xff;
+            }
+            ret = disp_ioctl(DE1_CMD_LAYER_SET_PARA, largs);
+        }
+        if (ret == 0 && (c->set & LAYER_SET_ENABLE)) {
+            largs[2] = 0;
+            ret = disp_ioctl(c->enable ? DE1_CMD_LAYER_OPEN : DE1_CMD_LAYER_CLOSE, largs);
+        }
+        if (ret < 0)
+            fprintf(stderr, "DE1 layer %u update failed: %s\n", c->layer, strerror(errno));
+    }
+
+    /* Always flush the cache, or later layer writes would stay queued */
+    if (disp_ioctl(DE1_CMD_EXECUTE_CMD_CACHE, args) < 0)
+        DEBUG("DE1 EXECUTE_CMD_AND_STOP_CACHE failed (errno=%d)", errno);
+
+    return ret < 0 ? -1 : 0;
+}
+
+/*
+ * ============================================================================
+ * DE2 (H3) Implementation
  * ============================================================================
  */
 
@@ -802,16 +1880,7 @@ static int de2_hdmi_mode_supported(disp_tv_mode mode)
 static int de2_hdmi_get_hpd(void)
 {
     /* DE2 doesn't have a direct HPD ioctl - use sysfs */
-    FILE *f = fopen(HDMI_STATE, "r");
-    if (f) {
-        int state = 0;
-        if (fscanf(f, "%d", &state) == 1) {
-            fclose(f);
-            return state;
-        }
-        fclose(f);
-    }
-    return -1;
+    return hdmi_get_hpd_sysfs();
 }
 
 static disp_tv_mode de2_hdmi_get_mode(void)
@@ -837,9 +1906,10 @@ static int de2_device_switch(disp_output_type type, disp_tv_mode mode)
     return ret;
 }
 
-static int de2_hdmi_init(disp_tv_mode mode)
+/* force skips the EDID check */
+static int de2_hdmi_init(disp_tv_mode mode, int force)
 {
-    if (!g_force && !de2_hdmi_mode_supported(mode)) {
+    if (!force && !hdmi_mode_supported(mode)) {
         fprintf(stderr, "HDMI mode %d not supported (use -f to force)\n", mode);
         return -1;
     }
@@ -863,8 +1933,10 @@ static int de2_setup_fb_with_scaling(uint32_t fb_id, uint32_t fb_w, uint32_t fb_
                                      uint32_t scn_w, uint32_t scn_h, int depth)
 {
     struct fb_var_screeninfo vinfo;
-    int fd;
+    struct fb_fix_screeninfo finfo;
     int needs_scaling = (fb_w != scn_w || fb_h != scn_h);
+    uint32_t xv, yv;
+    int changed = 0;
 
     (void)fb_id;  /* Not used on DE2 */
 
@@ -875,26 +1947,27 @@ static int de2_setup_fb_with_scaling(uint32_t fb_id, uint32_t fb_w, uint32_t fb_
      * On DE2, scaling is automatic. We just need to set the FB resolution
      * via standard fbdev. The display engine will scale to screen size.
      */
-    fd = open(FB_DEV, O_RDWR);
-    if (fd < 0) {
-        perror("Failed to open " FB_DEV);
-        return -1;
-    }
+    if (fb_open() < 0) return -1;
+    if (fb_virtual_size(fb_w, fb_h, 2, &xv, &yv) < 0) return -1;  /* Double buffer by default */
 
-    if (ioctl(fd, FBIOGET_VSCREENINFO, &vinfo) < 0) {
+    if (fb_ioctl(FBIOGET_VSCREENINFO, &vinfo) < 0) {
         perror("FBIOGET_VSCREENINFO failed");
-        close(fd);
         return -1;
     }
 
     /* Only change if different from current */
-    if (vinfo.xres != fb_w || vinfo.yres != fb_h ||
-        vinfo.bits_per_pixel != (unsigned)depth) {
+    if (g_reapply || vinfo.xres != fb_w || vinfo.yres != fb_h ||
+        vinfo.bits_per_pixel != (unsigned)depth ||
+        ((g_buffers || g_virt_w) && (vinfo.xres_virtual != xv || vinfo.yres_virtual != yv))) {
+
+        if (fb_ioctl(FBIOGET_FSCREENINFO, &finfo) == 0)
+            fb_mem_check(xv, yv, depth, finfo.smem_len);
 
         vinfo.xres = fb_w;
         vinfo.yres = fb_h;
-        vinfo.xres_virtual = fb_w;
-        vinfo.yres_virtual = fb_h * 2;  /* Double buffer */
+        vinfo.xres_virtual = xv;
+        vinfo.yres_virtual = yv;
+        vinfo.yoffset = 0;
         vinfo.bits_per_pixel = depth;
 
         /* Set color format */
@@ -911,19 +1984,18 @@ static int de2_setup_fb_with_scaling(uint32_t fb_id, uint32_t fb_w, uint32_t fb_
             vinfo.transp.length = (depth == 32) ? 8 : 0;
         }
 
-        if (ioctl(fd, FBIOPUT_VSCREENINFO, &vinfo) < 0) {
+        if (fb_ioctl(FBIOPUT_VSCREENINFO, &vinfo) < 0) {
             perror("FBIOPUT_VSCREENINFO failed");
-            close(fd);
             return -1;
         }
 
-        printf("Framebuffer set to: %dx%d @ %dbpp\n", fb_w, fb_h, depth);
+        printf("Framebuffer set to: %dx%d @ %dbpp, virtual %ux%u (%u buffer%s)\n",
+               fb_w, fb_h, depth, xv, yv, yv / fb_h, yv / fb_h == 1 ? "" : "s");
+        changed = 1;
     } else {
-        printf("Framebuffer already at: %dx%d @ %dbpp\n", fb_w, fb_h, depth);
+        printf("Framebuffer already at: %dx%d @ %dbpp (no-op)\n", fb_w, fb_h, depth);
     }
 
-    close(fd);
-
     if (needs_scaling) {
         printf("DE2 auto-scaling: %dx%d -> %dx%d (handled by hardware)\n",
                fb_w, fb_h, scn_w, scn_h);
@@ -931,492 +2003,7223 @@ static int de2_setup_fb_with_scaling(uint32_t fb_id, uint32_t fb_w, uint32_t fb_
         printf("No scaling needed (1:1)\n");
     }
 
-    return 0;
+    return changed ? 0 : STATE_UNCHANGED;
 }
 
 /*
- * ============================================================================
- * Unified API (dispatches to DE1 or DE2)
- * ============================================================================
+ * DE2 layer-window scaling:
+ * Instead of resizing the fbdev buffer, keep the current allocation and
+ * point the fbdev layer's crop rectangle at the top-left fb_w x fb_h
+ * region, with screen_win set to the output size. This is a register
+ * update only - no CMA reallocation. The fbdev var info keeps reporting
+ * the full buffer size; clients render into the cropped region using the
+ * existing line_length. A later FBIOPAN_DISPLAY resets the crop.
  */
+static int g_de2_fb_channel[CAPS_MAX_SCREENS] = { -1, -1 };
+static int g_de2_fb_layer[CAPS_MAX_SCREENS] = { -1, -1 };
 
-static int get_screen_size(uint32_t *width, uint32_t *height)
+static int de2_layer_get_config(de2_layer_config *cfg, unsigned int count)
 {
-    switch (g_de_version) {
-        case DE_VERSION_1: return de1_get_screen_size(width, height);
-        case DE_VERSION_2: return de2_get_screen_size(width, height);
-        default: return -1;
-    }
+    unsigned long args[4] = {g_screen, (unsigned long)cfg, count, 0};
+    return disp_ioctl(DE2_CMD_LAYER_GET_CONFIG, args);
 }
 
-static int get_output_type(void)
+static int de2_layer_set_config(de2_layer_config *cfg, unsigned int count)
 {
-    switch (g_de_version) {
-        case DE_VERSION_1: return de1_get_output_type();
-        case DE_VERSION_2: return de2_get_output_type();
-        default: return -1;
-    }
+    unsigned long args[4] = {g_screen, (unsigned long)cfg, count, 0};
+    return disp_ioctl(DE2_CMD_LAYER_SET_CONFIG, args);
 }
 
-static int hdmi_get_hpd(void)
+static int de2_set_bkcolor(const disp_color *color)
 {
-    /* Try sysfs first (works for both) */
-    FILE *f = fopen(HDMI_STATE, "r");
-    if (f) {
-        int state = 0;
-        if (fscanf(f, "%d", &state) == 1) {
-            fclose(f);
-            return state;
-        }
-        fclose(f);
-    }
-
-    switch (g_de_version) {
-        case DE_VERSION_1: return de1_hdmi_get_hpd();
-        case DE_VERSION_2: return de2_hdmi_get_hpd();
-        default: return -1;
-    }
+    unsigned long args[4] = {g_screen, (unsigned long)color, 0, 0};
+    return disp_ioctl(DE2_CMD_SET_BKCOLOR, args);
 }
 
-static int hdmi_mode_supported(disp_tv_mode mode)
+/* Find the enabled layer scanning out the fbdev memory */
+static int de2_fb_layer_find(de2_layer_config *cfg)
 {
-    switch (g_de_version) {
-        case DE_VERSION_1: return de1_hdmi_mode_supported(mode);
-        case DE_VERSION_2: return de2_hdmi_mode_supported(mode);
-        default: return 0;
-    }
-}
+    struct fb_fix_screeninfo finfo;
 
-static disp_tv_mode hdmi_get_mode(void)
-{
-    switch (g_de_version) {
-        case DE_VERSION_1: return de1_hdmi_get_mode();
-        case DE_VERSION_2: return de2_hdmi_get_mode();
-        default: return (disp_tv_mode)-1;
+    if (g_screen < CAPS_MAX_SCREENS && g_de2_fb_channel[g_screen] >= 0) {
+        memset(cfg, 0, sizeof(*cfg));
+        cfg->channel = g_de2_fb_channel[g_screen];
+        cfg->layer_id = g_de2_fb_layer[g_screen];
+        return de2_layer_get_config(cfg, 1);
     }
-}
 
-static int hdmi_init(disp_tv_mode mode)
-{
-    switch (g_de_version) {
-        case DE_VERSION_1: return de1_hdmi_init(mode);
-        case DE_VERSION_2: return de2_hdmi_init(mode);
-        default: return -1;
+    if (fb_open() < 0) return -1;
+    if (fb_ioctl(FBIOGET_FSCREENINFO, &finfo) < 0) {
+        perror("FBIOGET_FSCREENINFO failed");
+        return -1;
     }
-}
 
-/* Default HDMI mode when current mode is unknown/unsupported */
-static int hdmi_on(void)
-{
-    disp_tv_mode mode;
-    int ret;
-    int saved_force;
-
-    switch (g_de_version) {
-        case DE_VERSION_1:
-            /* Try simple on first */
-            ret = de1_hdmi_on();
-            if (ret < 0) {
-                /* Fall back to init with default mode, force it */
-                DEBUG("Simple HDMI on failed, forcing default mode %d", DEFAULT_HDMI_MODE);
-                saved_force = g_force;
-                g_force = 1;  /* Force mode - can't check EDID when off */
-                ret = de1_hdmi_init(DEFAULT_HDMI_MODE);
-                g_force = saved_force;
-            }
-            return ret;
-        case DE_VERSION_2:
-            /* Get current mode, use default if invalid or unsupported (like 480i) */
-            mode = hdmi_get_mode();
-            DEBUG("hdmi_on DE2: current mode = %d", mode);
-            if ((int)mode <= 0 || mode == DISP_TV_MOD_480I || mode == DISP_TV_MOD_576I) {
-                DEBUG("Current mode %d invalid/unsuitable, using default %d", mode, DEFAULT_HDMI_MODE);
-                mode = DEFAULT_HDMI_MODE;
+    for (int ch = 0; ch < DE2_MAX_CHANNELS; ch++) {
+        for (int l = 0; l < DE2_MAX_LAYERS; l++) {
+            memset(cfg, 0, sizeof(*cfg));
+            cfg->channel = ch;
+            cfg->layer_id = l;
+            if (de2_layer_get_config(cfg, 1) < 0) continue;
+            if (!cfg->enable || cfg->info.mode != DE2_LAYER_MODE_BUFFER) continue;
+            if (cfg->info.fb.addr[0] >= finfo.smem_start &&
+                cfg->info.fb.addr[0] < finfo.smem_start + finfo.smem_len) {
+                DEBUG("fbdev layer: channel %d layer %d", ch, l);
+                if (g_screen < CAPS_MAX_SCREENS) {
+                    g_de2_fb_channel[g_screen] = ch;
+                    g_de2_fb_layer[g_screen] = l;
+                }
+                return 0;
             }
-            DEBUG("hdmi_on DE2: will use mode %d", mode);
-            /* Force the mode - can't reliably check EDID when HDMI is off */
-            saved_force = g_force;
-            g_force = 1;
-            ret = de2_hdmi_init(mode);
-            DEBUG("hdmi_on DE2: de2_hdmi_init returned %d", ret);
-            g_force = saved_force;
-            return ret;
-        default:
-            return -1;
-    }
-}
-
-static int hdmi_off(void)
-{
-    switch (g_de_version) {
-        case DE_VERSION_1: return de1_hdmi_off();
-        case DE_VERSION_2: return de2_hdmi_off();
-        default: return -1;
+        }
     }
-}
 
-static int setup_fb_with_scaling(uint32_t fb_id, uint32_t fb_w, uint32_t fb_h,
-                                 uint32_t scn_w, uint32_t scn_h, int depth)
-{
-    switch (g_de_version) {
-        case DE_VERSION_1:
-            return de1_setup_fb_with_scaling(fb_id, fb_w, fb_h, scn_w, scn_h, depth);
-        case DE_VERSION_2:
-            return de2_setup_fb_with_scaling(fb_id, fb_w, fb_h, scn_w, scn_h, depth);
-        default:
-            return -1;
-    }
+    fprintf(stderr, "Could not find the DE2 layer showing " FB_DEV "\n");
+    return -1;
 }
 
-/*
- * ============================================================================
- * Framebuffer Configuration via fbdev
- * ============================================================================
- */
-static int fb_configure(uint32_t width, uint32_t height, int depth)
+static int de2_setup_layer_scaling(uint32_t fb_w, uint32_t fb_h,
+                                   uint32_t scn_w, uint32_t scn_h, int depth)
 {
     struct fb_var_screeninfo vinfo;
-    struct fb_fix_screeninfo finfo;
+    de2_layer_config cfg;
+    de2_rect64 crop;
 
-    g_fb_fd = open(FB_DEV, O_RDWR);
-    if (g_fb_fd < 0) {
-        perror("Failed to open " FB_DEV);
+    DEBUG("DE2 layer setup: fb=%ux%u scn=%ux%u depth=%d", fb_w, fb_h, scn_w, scn_h, depth);
+
+    if (fb_open() < 0) return -1;
+    if (fb_ioctl(FBIOGET_VSCREENINFO, &vinfo) < 0) {
+        perror("FBIOGET_VSCREENINFO failed");
         return -1;
     }
 
-    if (ioctl(g_fb_fd, FBIOGET_VSCREENINFO, &vinfo) < 0) {
-        perror("FBIOGET_VSCREENINFO failed");
-        close(g_fb_fd);
-        g_fb_fd = -1;
+    if (fb_w > vinfo.xres || fb_h > vinfo.yres) {
+        fprintf(stderr, "Layer scaling needs %ux%u <= current FB %ux%u (use fbdev method)\n",
+                fb_w, fb_h, vinfo.xres, vinfo.yres);
+        return -1;
+    }
+    if (vinfo.bits_per_pixel != (unsigned)depth) {
+        fprintf(stderr, "Layer scaling cannot change depth %u -> %d (use fbdev method)\n",
+                vinfo.bits_per_pixel, depth);
         return -1;
     }
 
-    vinfo.xres = width;
-    vinfo.yres = height;
-    vinfo.xres_virtual = width;
-    vinfo.yres_virtual = height;
-    vinfo.bits_per_pixel = depth;
+    if (de2_fb_layer_find(&cfg) < 0) return -1;
 
-    if (depth == 16) {
-        vinfo.red.offset = 11; vinfo.red.length = 5;
-        vinfo.green.offset = 5; vinfo.green.length = 6;
-        vinfo.blue.offset = 0; vinfo.blue.length = 5;
-        vinfo.transp.offset = 0; vinfo.transp.length = 0;
-    } else if (depth == 24 || depth == 32) {
-        vinfo.red.offset = 16; vinfo.red.length = 8;
-        vinfo.green.offset = 8; vinfo.green.length = 8;
-        vinfo.blue.offset = 0; vinfo.blue.length = 8;
-        vinfo.transp.offset = (depth == 32) ? 24 : 0;
-        vinfo.transp.length = (depth == 32) ? 8 : 0;
-    }
+    crop.x = (long long)vinfo.xoffset << DE2_CROP_SHIFT;
+    crop.y = (long long)vinfo.yoffset << DE2_CROP_SHIFT;
+    crop.width = (long long)fb_w << DE2_CROP_SHIFT;
+    crop.height = (long long)fb_h << DE2_CROP_SHIFT;
 
-    if (ioctl(g_fb_fd, FBIOPUT_VSCREENINFO, &vinfo) < 0) {
-        perror("FBIOPUT_VSCREENINFO failed");
-        close(g_fb_fd);
-        g_fb_fd = -1;
-        return -1;
+    if (!g_reapply &&
+        cfg.info.fb.crop.x == crop.x && cfg.info.fb.crop.y == crop.y &&
+        cfg.info.fb.crop.width == crop.width && cfg.info.fb.crop.height == crop.height &&
+        cfg.info.screen_win.x == 0 && cfg.info.screen_win.y == 0 &&
+        cfg.info.screen_win.width == scn_w && cfg.info.screen_win.height == scn_h) {
+        printf("Layer already scaling %ux%u -> %ux%u (no-op)\n", fb_w, fb_h, scn_w, scn_h);
+        return STATE_UNCHANGED;
     }
 
-    if (ioctl(g_fb_fd, FBIOGET_FSCREENINFO, &finfo) < 0) {
-        perror("FBIOGET_FSCREENINFO failed");
-        close(g_fb_fd);
-        g_fb_fd = -1;
+    cfg.info.fb.crop = crop;
+    cfg.info.screen_win.x = 0;
+    cfg.info.screen_win.y = 0;
+    cfg.info.screen_win.width = scn_w;
+    cfg.info.screen_win.height = scn_h;
+
+    if (de2_layer_set_config(&cfg, 1) < 0) {
+        perror("DE2 LAYER_SET_CONFIG failed");
         return -1;
     }
 
-    printf("Framebuffer configured: %dx%d @ %d bpp\n",
-           vinfo.xres, vinfo.yres, vinfo.bits_per_pixel);
-    printf("Line length: %d bytes, Total size: %d bytes\n",
-           finfo.line_length, finfo.smem_len);
-
+    printf("DE2 layer scaling: %ux%u of %ux%u buffer -> %ux%u (no reallocation)\n",
+           fb_w, fb_h, vinfo.xres, vinfo.yres, scn_w, scn_h);
     return 0;
 }
 
-static int get_fb_info(struct fb_var_screeninfo *vinfo, struct fb_fix_screeninfo *finfo)
+/*
+ * DE2 dynamic render resolution:
+ * The fbdev buffer stays allocated at its full size. Each adjustment
+ * rewrites only the crop rectangle of the fbdev layer; screen_win stays
+ * the full screen, so the scaler stretches the rendered region to fill it.
+ * The driver latches layer config at the next vblank, so a change never
+ * tears mid-frame. drs_frame() is the controller: it is fed measured frame
+ * times and moves the scale down after `hysteresis` consecutive frames over
+ * budget, and up after twice that many comfortably under it.
+ */
+#define DRS_DEFAULT_MIN_PCT     50
+#define DRS_DEFAULT_STEP_PCT    10
+#define DRS_DEFAULT_HYSTERESIS  3
+#define DRS_HEADROOM            0.80    /* Under budget = below 80% of target */
+
+typedef struct {
+    int                 active;
+    de2_layer_config    cfg;            /* fbdev layer, fetched once */
+    uint32_t            buf_w, buf_h;   /* Full buffer (crop at 100%) */
+    uint32_t            scn_w, scn_h;
+    uint32_t            render_w, render_h;
+    double              target_ms;
+    int                 scale_pct;
+    int                 min_pct;
+    int                 step_pct;
+    int                 hysteresis;
+    int                 over, under;    /* Consecutive frames out of band */
+    uint32_t            frames, changes;
+} drs_state_t;
+
+static drs_state_t g_drs[CAPS_MAX_SCREENS];
+
+/* Program the crop for scale_pct; the next vblank picks it up */
+static int drs_apply(drs_state_t *d)
 {
-    int fd = open(FB_DEV, O_RDONLY);
-    if (fd < 0) return -1;
+    struct fb_var_screeninfo vinfo;
+    uint32_t w = (d->buf_w * (uint32_t)d->scale_pct / 100) & ~1u;
+    uint32_t h = (d->buf_h * (uint32_t)d->scale_pct / 100) & ~1u;
 
-    if (vinfo && ioctl(fd, FBIOGET_VSCREENINFO, vinfo) < 0) {
-        close(fd);
+    if (w < 16) w = 16;
+    if (h < 16) h = 16;
+
+    /* Follow the pan offset so double-buffered clients keep working */
+    if (fb_ioctl(FBIOGET_VSCREENINFO, &vinfo) < 0) {
+        perror("FBIOGET_VSCREENINFO failed");
         return -1;
     }
 
-    if (finfo && ioctl(fd, FBIOGET_FSCREENINFO, finfo) < 0) {
-        close(fd);
+    d->cfg.info.fb.crop.x = (long long)vinfo.xoffset << DE2_CROP_SHIFT;
+    d->cfg.info.fb.crop.y = (long long)vinfo.yoffset << DE2_CROP_SHIFT;
+    d->cfg.info.fb.crop.width = (long long)w << DE2_CROP_SHIFT;
+    d->cfg.info.fb.crop.height = (long long)h << DE2_CROP_SHIFT;
+    d->cfg.info.screen_win.x = 0;
+    d->cfg.info.screen_win.y = 0;
+    d->cfg.info.screen_win.width = d->scn_w;
+    d->cfg.info.screen_win.height = d->scn_h;
+
+    /* Locked per step, so a long-running loop doesn't starve other changes */
+    if (display_lock() < 0) return -1;
+    if (de2_layer_set_config(&d->cfg, 1) < 0) {
+        perror("DE2 LAYER_SET_CONFIG failed");
+        display_unlock();
         return -1;
     }
+    display_unlock();
 
-    close(fd);
+    d->render_w = w;
+    d->render_h = h;
+    d->changes++;
+    DEBUG("drs: scale %d%% -> render %ux%u of %ux%u", d->scale_pct, w, h, d->buf_w, d->buf_h);
     return 0;
 }
 
 /*
- * ============================================================================
- * Information Display
- * ============================================================================
+ * Start controlling the current screen. target_ms is the frame budget,
+ * min_pct the lowest scale allowed, hysteresis the number of frames over
+ * budget before stepping down (0 selects the defaults).
  */
-static void show_info(void)
+static int drs_begin(double target_ms, int min_pct, int hysteresis)
 {
-    uint32_t width, height;
-    disp_tv_mode mode;
-    const mode_info_t *info;
-    int hpd, output_type;
     struct fb_var_screeninfo vinfo;
-    struct fb_fix_screeninfo finfo;
-
-    printf("=== Sunxi Display Information ===\n\n");
+    drs_state_t *d;
 
-    printf("Display Engine: %s\n", de_version_name(g_de_version));
-    printf("Screen: %u\n", g_screen);
+    if (g_de_version != DE_VERSION_2) {
+        fprintf(stderr, "Dynamic resolution needs the DE2 layer crop (not available on %s)\n",
+                de_version_name(g_de_version));
+        return -1;
+    }
+    if (g_screen >= CAPS_MAX_SCREENS) return -1;
+    d = &g_drs[g_screen];
+    memset(d, 0, sizeof(*d));
 
-    output_type = get_output_type();
-    printf("Output type: ");
-    switch (output_type) {
-        case DISP_OUTPUT_TYPE_NONE: printf("None\n"); break;
-        case DISP_OUTPUT_TYPE_LCD:  printf("LCD\n"); break;
-        case DISP_OUTPUT_TYPE_TV:   printf("TV\n"); break;
-        case DISP_OUTPUT_TYPE_HDMI: printf("HDMI\n"); break;
-        case DISP_OUTPUT_TYPE_VGA:  printf("VGA\n"); break;
-        default: printf("Unknown (%d)\n", output_type); break;
+    if (fb_open() < 0) return -1;
+    if (fb_ioctl(FBIOGET_VSCREENINFO, &vinfo) < 0) {
+        perror("FBIOGET_VSCREENINFO failed");
+        return -1;
+    }
+    if (de2_get_screen_size(&d->scn_w, &d->scn_h) < 0) {
+        fprintf(stderr, "Failed to get screen size\n");
+        return -1;
     }
+    if (de2_fb_layer_find(&d->cfg) < 0) return -1;
+
+    d->buf_w = vinfo.xres;
+    d->buf_h = vinfo.yres;
+    d->target_ms = target_ms;
+    d->min_pct = (min_pct > 0 && min_pct <= 100) ? min_pct : DRS_DEFAULT_MIN_PCT;
+    d->step_pct = DRS_DEFAULT_STEP_PCT;
+    d->hysteresis = hysteresis > 0 ? hysteresis : DRS_DEFAULT_HYSTERESIS;
+    d->scale_pct = 100;
+    if (drs_apply(d) < 0) return -1;
+    d->changes = 0;
+    d->active = 1;
+    return 0;
+}
 
-    hpd = hdmi_get_hpd();
-    printf("HDMI Hot Plug: %s (raw: %d)\n",
-           hpd > 0 ? "Connected" : (hpd == 0 ? "Disconnected" : "Error"), hpd);
+/* Force a scale; returns 0 and leaves the render size in the state */
+static int drs_set_scale(int pct)
+{
+    drs_state_t *d = &g_drs[g_screen < CAPS_MAX_SCREENS ? g_screen : 0];
+
+    if (!d->active) return -1;
+    if (pct < d->min_pct) pct = d->min_pct;
+    if (pct > 100) pct = 100;
+    d->over = d->under = 0;
+    if (pct == d->scale_pct) return 0;
+    d->scale_pct = pct;
+    return drs_apply(d);
+}
 
-    mode = hdmi_get_mode();
-    info = get_mode_info(mode);
-    printf("Current HDMI mode: %d", (int)mode);
-    if (info) {
-        printf(" = %s (%dx%d @ %dHz)\n",
-               info->name, info->width, info->height, info->refresh);
+/*
+ * Feed one measured frame time. Returns 1 if the render size changed
+ * (read it from render_w/render_h), 0 if not, -1 on error.
+ */
+static int drs_frame(double frame_ms)
+{
+    drs_state_t *d = &g_drs[g_screen < CAPS_MAX_SCREENS ? g_screen : 0];
+    int pct = -1;
+
+    if (!d->active) return -1;
+    d->frames++;
+
+    if (frame_ms > d->target_ms) {
+        d->under = 0;
+        if (++d->over >= d->hysteresis && d->scale_pct > d->min_pct)
+            pct = d->scale_pct - d->step_pct;
+    } else if (frame_ms < d->target_ms * DRS_HEADROOM) {
+        d->over = 0;
+        if (++d->under >= 2 * d->hysteresis && d->scale_pct < 100)
+            pct = d->scale_pct + d->step_pct;
     } else {
-        printf(" (not in table)\n");
+        d->over = d->under = 0;
     }
 
-    if (get_screen_size(&width, &height) == 0) {
-        printf("Screen size: %ux%u\n", width, height);
-    } else {
-        printf("Screen size: failed to read\n");
-    }
+    if (pct < 0) return 0;
+    if (drs_set_scale(pct) < 0) return -1;
+    return 1;
+}
 
-    printf("\n--- Framebuffer (" FB_DEV ") ---\n");
-    if (get_fb_info(&vinfo, &finfo) == 0) {
-        printf("Resolution: %ux%u", vinfo.xres, vinfo.yres);
-        if (vinfo.xres_virtual != vinfo.xres || vinfo.yres_virtual != vinfo.yres) {
-            printf(" (virtual: %ux%u)", vinfo.xres_virtual, vinfo.yres_virtual);
-        }
-        printf("\n");
-        printf("Color depth: %u bpp\n", vinfo.bits_per_pixel);
-        printf("Color format: R%u@%u G%u@%u B%u@%u",
-               vinfo.red.length, vinfo.red.offset,
-               vinfo.green.length, vinfo.green.offset,
-               vinfo.blue.length, vinfo.blue.offset);
-        if (vinfo.transp.length > 0) {
-            printf(" A%u@%u", vinfo.transp.length, vinfo.transp.offset);
-        }
-        printf("\n");
-        printf("Line length: %u bytes\n", finfo.line_length);
-        printf("Memory size: %u bytes (%.2f MB)\n",
-               finfo.smem_len, finfo.smem_len / (1024.0 * 1024.0));
-        printf("Physical address: 0x%lx\n", finfo.smem_start);
+/* Return to the full buffer and stop controlling */
+static int drs_end(void)
+{
+    drs_state_t *d = &g_drs[g_screen < CAPS_MAX_SCREENS ? g_screen : 0];
+    int ret = 0;
 
-        if (get_screen_size(&width, &height) == 0) {
-            if (vinfo.xres != width || vinfo.yres != height) {
-                printf("Scaling: %ux%u -> %ux%u (active%s)\n",
-                       vinfo.xres, vinfo.yres, width, height,
-                       g_de_version == DE_VERSION_2 ? ", auto by DE2" : "");
-            } else {
-                printf("Scaling: none (1:1)\n");
-            }
-        }
-    } else {
-        printf("Failed to read framebuffer info\n");
+    if (!d->active) return 0;
+    if (d->scale_pct != 100) {
+        d->scale_pct = 100;
+        ret = drs_apply(d);
     }
+    d->active = 0;
+    return ret;
+}
 
-    if (g_de_version == DE_VERSION_2) {
-        printf("\nNote: DE2 handles scaling automatically via VSU/GSU hardware.\n");
-        printf("      Change FB resolution with 'fb set' or 'scale' to adjust.\n");
-    }
+/*
+ * DE2 video overlay:
+ * A second layer scanning out a YUV buffer at physical addresses supplied
+ * by the caller (VPU output, ION/CMA allocations). Colour conversion and
+ * scaling happen in the mixer's VI channel (channel 0 has the VSU video
+ * scaler), so the CPU never touches the pixels. The layer config is read
+ * from the driver once and cached; each later update - new frame address,
+ * window or enable state - is one LAYER_SET_CONFIG. disp2 takes the enable
+ * state from the config, so that is how enable/disable are issued.
+ */
+#define DE2_OVERLAY_CHANNEL     0
+#define DE2_OVERLAY_LAYER       0
 
-    printf("\n--- Supported HDMI modes ---\n");
-    printf("  Mode  Name      Resolution   Supported\n");
-    printf("  ----  --------  -----------  ---------\n");
-    for (int i = 0; mode_table[i].name != NULL; i++) {
-        /* Skip 4K modes for DE1 (A20 doesn't support them) */
-        if (g_de_version == DE_VERSION_1 && mode_table[i].mode >= DISP_TV_MOD_3840_2160P_30HZ)
-            continue;
+typedef struct {
+    const char         *name;
+    de2_pixel_format    format;
+    int                 planes;     /* 1 packed, 2 semi-planar, 3 planar */
+} de2_overlay_fmt_t;
+
+static const de2_overlay_fmt_t de2_overlay_fmts[] = {
+    { "nv12",    DE2_FORMAT_YUV420_SP_UVUV, 2 },
+    { "nv21",    DE2_FORMAT_YUV420_SP_VUVU, 2 },
+    { "yuv420",  DE2_FORMAT_YUV420_P,       3 },
+    { "yuyv",    DE2_FORMAT_YUV422_I_YUYV,  1 },
+    { NULL,      0,                         0 }
+};
 
-        int supported = hdmi_mode_supported(mode_table[i].mode);
-        printf("  %2d    %-8s  %4dx%-4d    %s\n",
-               mode_table[i].mode, mode_table[i].name,
-               mode_table[i].width, mode_table[i].height,
-               supported > 0 ? "Yes" : "No");
+typedef struct {
+    int                 valid;      /* cfg mirrors the driver */
+    de2_layer_config    cfg;
+    const de2_overlay_fmt_t *fmt;
+} de2_overlay_t;
+
+static de2_overlay_t g_overlay[CAPS_MAX_SCREENS];
+
+static const de2_overlay_fmt_t *de2_overlay_fmt_find(const char *name)
+{
+    for (int i = 0; de2_overlay_fmts[i].name; i++) {
+        if (strcasecmp(de2_overlay_fmts[i].name, name) == 0)
+            return &de2_overlay_fmts[i];
     }
-    printf("\nNote: Mode support detection requires HDMI cable connected.\n");
+    return NULL;
 }
 
-static void show_debug_info(void)
+static const de2_overlay_fmt_t *de2_overlay_fmt_of(de2_pixel_format format)
 {
-    printf("=== Structure Size Debug Info ===\n\n");
-
-    printf("Display Engine: %s\n\n", de_version_name(g_de_version));
-
-    printf("Basic types:\n");
-    printf("  sizeof(__bool)     = %zu\n", sizeof(__bool));
-    printf("  sizeof(__u8)       = %zu\n", sizeof(__u8));
-    printf("  sizeof(__u16)      = %zu\n", sizeof(__u16));
-    printf("  sizeof(__u32)      = %zu\n", sizeof(__u32));
-    printf("  sizeof(__s32)      = %zu\n", sizeof(__s32));
-    printf("  sizeof(bool)       = %zu\n", sizeof(bool));
-    printf("  sizeof(enum)       = %zu\n", sizeof(disp_tv_mode));
+    for (int i = 0; de2_overlay_fmts[i].name; i++) {
+        if (de2_overlay_fmts[i].format == format)
+            return &de2_overlay_fmts[i];
+    }
+    return NULL;
+}
 
-    printf("\nCommon structures:\n");
-    printf("  sizeof(disp_rect)    = %zu\n", sizeof(disp_rect));
-    printf("  sizeof(disp_rectsz)  = %zu\n", sizeof(disp_rectsz));
+/* Cached overlay state for the current screen, loaded from the driver */
+static de2_overlay_t *de2_overlay_get(int channel, int layer)
+{
+    de2_overlay_t *o = &g_overlay[g_screen < CAPS_MAX_SCREENS ? g_screen : 0];
+
+    if (o->valid && (channel < 0 || (int)o->cfg.channel == channel) &&
+        (layer < 0 || (int)o->cfg.layer_id == layer))
+        return o;
+
+    memset(o, 0, sizeof(*o));
+    o->cfg.channel = channel >= 0 ? channel : DE2_OVERLAY_CHANNEL;
+    o->cfg.layer_id = layer >= 0 ? layer : DE2_OVERLAY_LAYER;
+    if (de2_layer_get_config(&o->cfg, 1) < 0) {
+        perror("DE2 LAYER_GET_CONFIG failed");
+        return NULL;
+    }
+    o->fmt = de2_overlay_fmt_of(o->cfg.info.fb.format);
+    o->valid = 1;
+    return o;
+}
 
-    printf("\nDE1 structures:\n");
-    printf("  sizeof(de1_fb_t)             = %zu (expected: 64)\n", sizeof(de1_fb_t));
-    printf("  sizeof(de1_layer_info_t)     = %zu (expected: 116)\n", sizeof(de1_layer_info_t));
-    printf("  sizeof(de1_fb_create_para_t) = %zu (expected: 56)\n", sizeof(de1_fb_create_para_t));
+static int de2_overlay_commit(de2_overlay_t *o)
+{
+    if (de2_layer_set_config(&o->cfg, 1) < 0) {
+        perror("DE2 LAYER_SET_CONFIG failed");
+        o->valid = 0;   /* Re-read next time */
+        return -1;
+    }
+    return 0;
+}
 
-    printf("\nDE2 structures:\n");
-    printf("  sizeof(de2_fb_info)       = %zu\n", sizeof(de2_fb_info));
-    printf("  sizeof(de2_layer_info)    = %zu\n", sizeof(de2_layer_info));
-    printf("  sizeof(de2_layer_config)  = %zu\n", sizeof(de2_layer_config));
-    printf("  sizeof(de2_fb_create_info)= %zu\n", sizeof(de2_fb_create_info));
-    printf("  sizeof(de2_rect64)        = %zu\n", sizeof(de2_rect64));
+/* Plane addresses for a contiguous w x h frame starting at addr */
+static void de2_overlay_set_planes(de2_overlay_t *o, unsigned long long addr)
+{
+    de2_fb_info *fb = &o->cfg.info.fb;
+    unsigned long long luma = (unsigned long long)fb->size[0].width * fb->size[0].height;
+
+    fb->addr[0] = addr;
+    fb->addr[1] = 0;
+    fb->addr[2] = 0;
+    if (o->fmt && o->fmt->planes >= 2)
+        fb->addr[1] = addr + luma;
+    if (o->fmt && o->fmt->planes == 3)
+        fb->addr[2] = fb->addr[1] + luma / 4;
 }
 
 /*
- * ============================================================================
- * Argument Parsing
- * ============================================================================
+ * Configure and enable the overlay: src_w x src_h frame of the given
+ * format at addr, shown in win at zorder. The fbdev layer is refused.
  */
-static int parse_resolution(const char *str, uint32_t *width, uint32_t *height, uint32_t *refresh)
+static int de2_overlay_setup(int channel, int layer, const de2_overlay_fmt_t *fmt,
+                             uint32_t src_w, uint32_t src_h, unsigned long long addr,
+                             const disp_rect *win, int zorder, de2_color_space cs)
 {
-    uint32_t dummy_refresh = 0;
-    uint32_t *refresh_ptr = refresh ? refresh : &dummy_refresh;
+    de2_layer_config fbcfg;
+    de2_overlay_t *o;
+    de2_fb_info *fb;
+    int chroma_div = (fmt->planes == 1) ? 1 : 2;
+
+    if (de2_fb_layer_find(&fbcfg) == 0) {
+        int ch = channel >= 0 ? channel : DE2_OVERLAY_CHANNEL;
+        int l = layer >= 0 ? layer : DE2_OVERLAY_LAYER;
+        if ((int)fbcfg.channel == ch && (int)fbcfg.layer_id == l) {
+            fprintf(stderr, "Channel %d layer %d is the fbdev layer, pick another\n", ch, l);
+            return -1;
+        }
+        if (zorder < 0) zorder = fbcfg.info.zorder + 1;
+    }
+    if (zorder < 0) zorder = 1;
+
+    o = de2_overlay_get(channel, layer);
+    if (!o) return -1;
+
+    o->fmt = fmt;
+    o->cfg.enable = 1;
+    o->cfg.info.mode = DE2_LAYER_MODE_BUFFER;
+    o->cfg.info.zorder = (unsigned char)zorder;
+    o->cfg.info.alpha_mode = 1;         /* Global alpha */
+    o->cfg.info.alpha_value = 0xff;
+    o->cfg.info.screen_win = *win;
+
+    fb = &o->cfg.info.fb;
+    memset(fb, 0, sizeof(*fb));
+    fb->format = fmt->format;
+    fb->color_space = cs;
+    fb->size[0].width = src_w;
+    fb->size[0].height = src_h;
+    for (int p = 1; p < fmt->planes; p++) {
+        fb->size[p].width = src_w / 2;
+        fb->size[p].height = src_h / chroma_div;
+    }
+    fb->crop.width = (long long)src_w << DE2_CROP_SHIFT;
+    fb->crop.height = (long long)src_h << DE2_CROP_SHIFT;
+    de2_overlay_set_planes(o, addr);
+
+    DEBUG("overlay: ch%u/l%u %s %ux%u @0x%llx -> %d,%d %ux%u z=%d",
+          o->cfg.channel, o->cfg.layer_id, fmt->name, src_w, src_h, addr,
+          win->x, win->y, win->width, win->height, zorder);
+    return de2_overlay_commit(o);
+}
 
-    *refresh_ptr = 0;
-    if (sscanf(str, "%ux%u@%u", width, height, refresh_ptr) >= 2) return 0;
-    if (sscanf(str, "%ux%u", width, height) == 2) return 0;
-    return -1;
+/* Per-frame update: point the overlay at the next decoded frame */
+static int de2_overlay_frame(unsigned long long addr)
+{
+    de2_overlay_t *o = de2_overlay_get(-1, -1);
+
+    if (!o) return -1;
+    de2_overlay_set_planes(o, addr);
+    return de2_overlay_commit(o);
 }
 
-static int parse_resolution_depth(const char *str, uint32_t *width, uint32_t *height, int *depth)
+static int de2_overlay_move(const disp_rect *win)
 {
-    if (sscanf(str, "%ux%ux%d", width, height, depth) == 3) return 0;
-    return -1;
+    de2_overlay_t *o = de2_overlay_get(-1, -1);
+
+    if (!o) return -1;
+    o->cfg.info.screen_win = *win;
+    return de2_overlay_commit(o);
+}
+
+static int de2_overlay_enable(int enable)
+{
+    de2_overlay_t *o = de2_overlay_get(-1, -1);
+
+    if (!o) return -1;
+    o->cfg.enable = enable ? 1 : 0;
+    return de2_overlay_commit(o);
 }
 
 /*
- * ============================================================================
- * Usage
- * ============================================================================
+ * DE2 transactions: read every staged layer with one array-form
+ * LAYER_GET_CONFIG, apply the changes, and write them all back with one
+ * LAYER_SET_CONFIG. The mixer sees the whole new layout at the same vblank.
  */
-static void print_usage(const char *prog)
+static int de2_layer_txn_commit(const layer_txn_t *txn)
 {
-    printf("Sunxi HDMI and Framebuffer Control Utility\n");
-    printf("Supports A10/A20 (DE1) and H3/H5/A64 (DE2)\n\n");
-    printf("Usage: %s [-v] [-f] [-s screen] <command> [options]\n\n", prog);
-    printf("Options:\n");
-    printf("  -v                            Verbose output\n");
-    printf("  -f                            Force mode (bypass EDID check)\n");
-    printf("  -s <screen>                   Select screen (0 or 1)\n\n");
-    printf("Commands:\n");
-    printf("  info                          Show display and framebuffer info\n");
-    printf("  debug                         Show structure sizes for debugging\n");
-    printf("  hdmi on                       Enable HDMI output\n");
-    printf("  hdmi off                      Disable HDMI output\n");
-    printf("  hdmi mode <name|num>          Set HDMI mode\n");
-    printf("  hdmi init <W>x<H>[@Hz]        Initialize HDMI with resolution\n");
-    printf("  fb set <W>x<H>x<depth>        Set framebuffer resolution\n");
-    printf("  scale <fbW>x<fbH> <scnW>x<scnH> <depth>  Setup scaling\n");
-    printf("  autoscale [depth]             Scale current FB to screen\n");
-    printf("  noscale [depth]               Disable scaling\n");
-    printf("\nHDMI modes:\n");
-    for (int i = 0; mode_table[i].name != NULL; i++) {
-        printf("  %2d  %-8s  %4dx%d @%dHz\n",
-               mode_table[i].mode, mode_table[i].name,
-               mode_table[i].width, mode_table[i].height,
-               mode_table[i].refresh);
+    de2_layer_config cfg[LAYER_TXN_MAX];
+
+    memset(cfg, 0, sizeof(cfg));
+    for (int i = 0; i < txn->count; i++) {
+        cfg[i].channel = txn->changes[i].channel;
+        cfg[i].layer_id = txn->changes[i].layer;
     }
-    printf("\nExamples:\n");
-    printf("  %s info\n", prog);
-    printf("  %s hdmi mode 720p60\n", prog);
-    printf("  %s scale 640x480 1280x720 32\n", prog);
-    printf("  %s autoscale\n", prog);
-    printf("  %s noscale\n", prog);
+    if (de2_layer_get_config(cfg, (unsigned int)txn->count) < 0) {
+        perror("DE2 LAYER_GET_CONFIG failed");
+        return -1;
+    }
+
+    for (int i = 0; i < txn->count; i++) {
+        const layer_change_t *c = &txn->changes[i];
+        if (c->set & LAYER_SET_ENABLE) cfg[i].enable = c->enable ? 1 : 0;
+        if (c->set & LAYER_SET_CROP) {
+            cfg[i].info.fb.crop.x = (long long)c->crop.x << DE2_CROP_SHIFT;
+            cfg[i].info.fb.crop.y = (long long)c->crop.y << DE2_CROP_SHIFT;
+            cfg[i].info.fb.crop.width = (long long)c->crop.width << DE2_CROP_SHIFT;
+            cfg[i].info.fb.crop.height = (long long)c->crop.height << DE2_CROP_SHIFT;
+        }
+        if (c->set & LAYER_SET_WIN) cfg[i].info.screen_win = c->win;
+        if (c->set & LAYER_SET_ZORDER) cfg[i].info.zorder = (unsigned char)c->zorder;
+        if (c->set & LAYER_SET_ALPHA) {
+            cfg[i].info.alpha_mode = c->alpha >= 0 ? 1 : 0;    /* Global / pixel */
+            cfg[i].info.alpha_value = c->alpha >= 0 ? (unsigned char)c->alpha : 0xff;
+        }
+    }
+
+    if (de2_layer_set_config(cfg, (unsigned int)txn->count) < 0) {
+        perror("DE2 LAYER_SET_CONFIG failed");
+        return -1;
+    }
+
+    /* Keep the overlay cache coherent with what was just written */
+    for (int i = 0; i < txn->count; i++) {
+        de2_overlay_t *o = &g_overlay[g_screen < CAPS_MAX_SCREENS ? g_screen : 0];
+        if (o->valid && o->cfg.channel == cfg[i].channel && o->cfg.layer_id == cfg[i].layer_id)
+            o->cfg = cfg[i];
+    }
+    return 0;
 }
 
 /*
  * ============================================================================
- * Main
+ * EDID Parsing
  * ============================================================================
+ *
+ * The sink's EDID is fetched once (DE2_CMD_HDMI_GET_EDID, or a sysfs node
+ * on DE1/BSPs that export one) and parsed into a bitmap of mode_table
+ * modes: detailed timing descriptors from the base block and CEA
+ * extensions, CEA short video descriptors, and HDMI VSDB 4K VICs.
+ * Mode support checks are then answered from the bitmap instead of one
+ * HDMI_SUPPORT_MODE ioctl per mode.
  */
-int main(int argc, char *argv[])
-{
-    int ret = 0;
-    int arg_start = 1;
-    int orig_argc = argc;
+#define EDID_BLOCK_SIZE     128
+#define EDID_MAX_SIZE       1024
+
+static const char *const edid_sysfs_paths[] = {
+    "/sys/class/hdmi/hdmi/attr/edid",
+    "/sys/devices/platform/hdmi/edid",
+    "/sys/class/drm/card0-HDMI-A-1/edid",
+    NULL
+};
 
-    install_signal_handlers();
+typedef struct {
+    int          tried;
+    int          valid;
+    uint32_t     supported;     /* bit n: disp_tv_mode n listed by the sink */
+    int          preferred;     /* disp_tv_mode, or -1 if not in mode_table */
+    uint32_t     native_w;      /* preferred timing from the first DTD */
+    uint32_t     native_h;
+    uint32_t     native_refresh;
+    char         name[14];      /* monitor name descriptor */
+    uint32_t     sink_id;       /* FNV-1a of the base block, never 0 */
+    const char  *source;
+} edid_info_t;
+
+static __thread edid_info_t g_edid;      /* Sink of this thread's screen */
+
+/* CEA-861 VIC -> mode_table mode (0 entries are unmapped) */
+static const struct { uint8_t vic; disp_tv_mode mode; } cea_vic_map[] = {
+    {  2, DISP_TV_MOD_480P },         {  3, DISP_TV_MOD_480P },
+    {  4, DISP_TV_MOD_720P_60HZ },    {  5, DISP_TV_MOD_1080I_60HZ },
+    {  6, DISP_TV_MOD_480I },         {  7, DISP_TV_MOD_480I },
+    { 16, DISP_TV_MOD_1080P_60HZ },   { 17, DISP_TV_MOD_576P },
+    { 18, DISP_TV_MOD_576P },         { 19, DISP_TV_MOD_720P_50HZ },
+    { 20, DISP_TV_MOD_1080I_50HZ },   { 21, DISP_TV_MOD_576I },
+    { 22, DISP_TV_MOD_576I },         { 31, DISP_TV_MOD_1080P_50HZ },
+    { 32, DISP_TV_MOD_1080P_24HZ },   { 33, DISP_TV_MOD_1080P_25HZ },
+    { 34, DISP_TV_MOD_1080P_30HZ },   { 93, DISP_TV_MOD_3840_2160P_24HZ },
+    { 94, DISP_TV_MOD_3840_2160P_25HZ }, { 95, DISP_TV_MOD_3840_2160P_30HZ },
+    {  0, 0 }
+};
 
-    if (argc < 2) {
-        print_usage(argv[0]);
-        return 1;
+static int edid_mode_from_vic(uint8_t vic)
+{
+    for (int i = 0; cea_vic_map[i].vic; i++) {
+        if (cea_vic_map[i].vic == vic) return cea_vic_map[i].mode;
+    }
+    return -1;
+}
+
+/* Map a detailed timing to a mode_table entry (refresh within 1 Hz) */
+static int edid_mode_from_timing(uint32_t w, uint32_t h, uint32_t refresh, int interlaced)
+{
+    for (int i = 0; mode_table[i].name != NULL; i++) {
+        const mode_info_t *m = &mode_table[i];
+        int m_interlaced = strchr(m->name, 'i') != NULL;
+        if (m->width != w || m->height != h || m_interlaced != interlaced) continue;
+        if (refresh + 1 >= m->refresh && refresh <= m->refresh + 1) return m->mode;
     }
+    return -1;
+}
 
-    /* Parse options */
-    while (arg_start < argc && argv[arg_start][0] == '-') {
-        if (strcmp(argv[arg_start], "-v") == 0) {
-            g_verbose = 1;
-            arg_start++;
-        }
-        else if (strcmp(argv[arg_start], "-f") == 0) {
-            g_force = 1;
-            arg_start++;
-        }
-        else if (strcmp(argv[arg_start], "-s") == 0 && arg_start + 1 < argc) {
-            g_screen = (uint32_t)atoi(argv[arg_start + 1]);
-            if (g_screen > 1) {
-                fprintf(stderr, "Invalid screen: %s\n", argv[arg_start + 1]);
-                return 1;
-            }
-            arg_start += 2;
-        }
-        else if (strcmp(argv[arg_start], "-h") == 0 || strcmp(argv[arg_start], "--help") == 0) {
-            print_usage(argv[0]);
-            return 0;
-        }
-        else {
-            fprintf(stderr, "Unknown option: %s\n", argv[arg_start]);
-            return 1;
+static void edid_set_mode(edid_info_t *e, int mode)
+{
+    if (mode >= 0 && mode < 32) e->supported |= 1u << mode;
+}
+
+/* Parse an 18-byte descriptor; the first DTD in the base block is preferred */
+static void edid_parse_descriptor(edid_info_t *e, const uint8_t *d, int preferred)
+{
+    uint32_t clock = d[0] | (d[1] << 8);   /* 10 kHz units */
+
+    if (clock == 0) {
+        /* Display descriptor; 0xfc is the monitor name */
+        if (d[3] == 0xfc) {
+            int n = 0;
+            for (; n < 13 && d[5 + n] != 0x0a; n++)
+                e->name[n] = (char)d[5 + n];
+            e->name[n] = '\0';
         }
+        return;
     }
 
-    if (arg_start >= orig_argc) {
-        print_usage(argv[0]);
-        return 1;
+    uint32_t hact = d[2] | ((d[4] & 0xf0) << 4);
+    uint32_t hblank = d[3] | ((d[4] & 0x0f) << 8);
+    uint32_t vact = d[5] | ((d[7] & 0xf0) << 4);
+    uint32_t vblank = d[6] | ((d[7] & 0x0f) << 8);
+    int interlaced = (d[17] & 0x80) != 0;
+    uint32_t htotal = hact + hblank;
+    uint32_t vtotal = vact + vblank;
+    uint32_t refresh = 0;
+
+    /*
+     * Interlaced DTDs give per-field lines, so the rate below is already
+     * the field rate (1080i60: 74.25 MHz / (2200 * 562) = 60), which is
+     * what mode_table lists for interlaced modes.
+     */
+    if (interlaced) vact *= 2;
+    if (htotal && vtotal) {
+        refresh = (uint32_t)(((uint64_t)clock * 10000 + (uint64_t)htotal * vtotal / 2) /
+                             ((uint64_t)htotal * vtotal));
     }
 
-    if (disp_open() < 0) return 1;
+    int mode = edid_mode_from_timing(hact, vact, refresh, interlaced);
+    DEBUG("EDID DTD: %ux%u%s@%u -> mode %d", hact, vact, interlaced ? "i" : "p", refresh, mode);
+    edid_set_mode(e, mode);
 
-    /* info command */
-    if (strcmp(argv[arg_start], "info") == 0) {
-        show_info();
-    }
-    /* debug command */
-    else if (strcmp(argv[arg_start], "debug") == 0) {
-        show_debug_info();
+    if (preferred && e->native_w == 0) {
+        e->native_w = hact;
+        e->native_h = vact;
+        e->native_refresh = refresh;
+        e->preferred = mode;
+    }
+}
+
+static void edid_parse_cea(edid_info_t *e, const uint8_t *b)
+{
+    uint8_t dtd_start = b[2];
+    int first_native = -1;
+
+    if (b[0] != 0x02 || dtd_start > EDID_BLOCK_SIZE - 1) return;
+
+    /* Data block collection */
+    for (int i = 4; i < dtd_start && dtd_start >= 4; ) {
+        int tag = b[i] >> 5;
+        int len = b[i] & 0x1f;
+        const uint8_t *p = &b[i + 1];
+
+        if (i + 1 + len > dtd_start) break;
+
+        if (tag == 2) {
+            /* Video data block: short video descriptors */
+            for (int j = 0; j < len; j++) {
+                uint8_t svd = p[j];
+                int native = (svd & 0x80) && (svd & 0x7f) <= 64;
+                uint8_t vic = native ? (svd & 0x7f) : svd;
+                int mode = edid_mode_from_vic(vic);
+                edid_set_mode(e, mode);
+                if (native && first_native < 0) first_native = mode;
+            }
+        } else if (tag == 3 && len >= 8 && p[0] == 0x03 && p[1] == 0x0c && p[2] == 0x00) {
+            /* HDMI VSDB: HDMI_VICs for 4K modes */
+            int idx = 8;
+            if (p[7] & 0x80) idx += 2;      /* Latency fields */
+            if (p[7] & 0x40) idx += 2;      /* Interlaced latency fields */
+            if ((p[7] & 0x20) && idx + 1 < len) {
+                int vic_len = p[idx + 1] >> 5;
+                for (int j = 0; j < vic_len && idx + 2 + j < len; j++) {
+                    switch (p[idx + 2 + j]) {
+                        case 1: edid_set_mode(e, DISP_TV_MOD_3840_2160P_30HZ); break;
+                        case 2: edid_set_mode(e, DISP_TV_MOD_3840_2160P_25HZ); break;
+                        case 3: edid_set_mode(e, DISP_TV_MOD_3840_2160P_24HZ); break;
+                    }
+                }
+            }
+        }
+        i += 1 + len;
+    }
+
+    /* Detailed timings in the extension block */
+    for (int off = dtd_start; dtd_start >= 4 && off + 18 <= EDID_BLOCK_SIZE - 1; off += 18) {
+        if (b[off] == 0 && b[off + 1] == 0) break;
+        edid_parse_descriptor(e, &b[off], 0);
+    }
+
+    if (e->preferred < 0 && first_native >= 0) e->preferred = first_native;
+}
+
+static int edid_checksum_ok(const uint8_t *b)
+{
+    uint8_t sum = 0;
+    for (int i = 0; i < EDID_BLOCK_SIZE; i++) sum += b[i];
+    return sum == 0;
+}
+
+static int edid_parse(edid_info_t *e, const uint8_t *buf, size_t len)
+{
+    static const uint8_t header[8] = { 0x00, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0x00 };
+    size_t blocks;
+
+    if (len < EDID_BLOCK_SIZE || memcmp(buf, header, sizeof(header)) != 0) return -1;
+    if (!edid_checksum_ok(buf)) {
+        DEBUG("EDID base block checksum mismatch");
+        return -1;
+    }
+
+    e->supported = 0;
+    e->preferred = -1;
+    e->native_w = e->native_h = e->native_refresh = 0;
+    e->name[0] = '\0';
+
+    for (int i = 0; i < 4; i++)
+        edid_parse_descriptor(e, &buf[54 + i * 18], i == 0);
+
+    blocks = 1 + buf[126];
+    if (blocks * EDID_BLOCK_SIZE > len) blocks = len / EDID_BLOCK_SIZE;
+    for (size_t b = 1; b < blocks; b++) {
+        const uint8_t *ext = &buf[b * EDID_BLOCK_SIZE];
+        if (!edid_checksum_ok(ext)) continue;
+        edid_parse_cea(e, ext);
+    }
+
+    /* DE1 cannot drive 4K modes regardless of what the sink accepts */
+    if (g_de_version == DE_VERSION_1) {
+        e->supported &= ~((1u << DISP_TV_MOD_3840_2160P_30HZ) |
+                          (1u << DISP_TV_MOD_3840_2160P_25HZ) |
+                          (1u << DISP_TV_MOD_3840_2160P_24HZ));
+    }
+
+    return 0;
+}
+
+static ssize_t edid_read_sysfs(uint8_t *buf, size_t size, const char **source)
+{
+    for (int i = 0; edid_sysfs_paths[i]; i++) {
+        int fd = open(edid_sysfs_paths[i], O_RDONLY | O_CLOEXEC);
+        ssize_t n, total = 0;
+        if (fd < 0) continue;
+        while ((size_t)total < size && (n = read(fd, buf + total, size - total)) > 0)
+            total += n;
+        close(fd);
+        if (total >= EDID_BLOCK_SIZE) {
+            *source = edid_sysfs_paths[i];
+            return total;
+        }
+    }
+    return -1;
+}
+
+/* Fetch and parse the EDID once. Returns 0 if a valid EDID is available. */
+static int edid_load(void)
+{
+    uint8_t buf[EDID_MAX_SIZE];
+    ssize_t len = -1;
+
+    if (g_edid.tried) return g_edid.valid ? 0 : -1;
+    g_edid.tried = 1;
+    g_edid.valid = 0;
+
+    memset(buf, 0, sizeof(buf));
+    if (g_de_version == DE_VERSION_2) {
+        unsigned long args[4] = {g_screen, (unsigned long)buf, sizeof(buf), 0};
+        if (disp_ioctl(DE2_CMD_HDMI_GET_EDID, args) >= 0) {
+            len = sizeof(buf);
+            g_edid.source = "DE2_CMD_HDMI_GET_EDID";
+        }
+    }
+    if (len < 0 || edid_parse(&g_edid, buf, (size_t)len) < 0) {
+        memset(buf, 0, sizeof(buf));
+        len = edid_read_sysfs(buf, sizeof(buf), &g_edid.source);
+        if (len < 0 || edid_parse(&g_edid, buf, (size_t)len) < 0) {
+            DEBUG("No valid EDID available");
+            return -1;
+        }
+    }
+
+    g_edid.valid = 1;
+    g_edid.sink_id = 2166136261u;
+    for (int i = 0; i < EDID_BLOCK_SIZE; i++)
+        g_edid.sink_id = (g_edid.sink_id ^ buf[i]) * 16777619u;
+    if (g_edid.sink_id == 0) g_edid.sink_id = 1;
+    DEBUG("EDID from %s: supported=0x%08x preferred=%d native=%ux%u@%u sink=%08x",
+          g_edid.source, g_edid.supported, g_edid.preferred,
+          g_edid.native_w, g_edid.native_h, g_edid.native_refresh, g_edid.sink_id);
+    return 0;
+}
+
+/* Forget the parsed EDID so the next query re-reads it (e.g. after hotplug) */
+static void edid_reset(void)
+{
+    memset(&g_edid, 0, sizeof(g_edid));
+}
+
+/*
+ * ============================================================================
+ * Unified API (dispatches to DE1 or DE2)
+ * ============================================================================
+ */
+
+static int get_screen_size(uint32_t *width, uint32_t *height)
+{
+    switch (g_de_version) {
+        case DE_VERSION_1: return de1_get_screen_size(width, height);
+        case DE_VERSION_2: return de2_get_screen_size(width, height);
+        default: return -1;
+    }
+}
+
+static int get_output_type(void)
+{
+    switch (g_de_version) {
+        case DE_VERSION_1: return de1_get_output_type();
+        case DE_VERSION_2: return de2_get_output_type();
+        default: return -1;
+    }
+}
+
+static int hdmi_get_hpd(void)
+{
+    /* Try sysfs first (works for both) */
+    int state = hdmi_get_hpd_sysfs();
+    if (state >= 0) return state;
+
+    switch (g_de_version) {
+        case DE_VERSION_1: return de1_hdmi_get_hpd();
+        case DE_VERSION_2: return de2_hdmi_get_hpd();
+        default: return -1;
+    }
+}
+
+static int hdmi_mode_supported(disp_tv_mode mode)
+{
+    int hpd = hdmi_get_hpd_sysfs();
+    uint32_t sink;
+    int supported;
+
+    /* The EDID identifies the sink the cached answers belong to */
+    sink = (hpd > 0 && edid_load() == 0) ? g_edid.sink_id : 0;
+    if (caps_mode_lookup(g_screen, mode, hpd, sink, &supported)) {
+        DEBUG("mode %d support from cache: %d", mode, supported);
+        return supported;
+    }
+
+    /* One EDID read answers (and caches) every mode_table entry */
+    if (hpd != 0 && get_mode_info(mode) && edid_load() == 0) {
+        for (int i = 0; mode_table[i].name != NULL; i++) {
+            disp_tv_mode m = mode_table[i].mode;
+            caps_mode_store(g_screen, m, hpd, sink, (g_edid.supported >> m) & 1);
+        }
+        return (g_edid.supported >> mode) & 1;
+    }
+
+    switch (g_de_version) {
+        case DE_VERSION_1: supported = de1_hdmi_mode_supported(mode); break;
+        case DE_VERSION_2: supported = de2_hdmi_mode_supported(mode); break;
+        default: return 0;
+    }
+
+    caps_mode_store(g_screen, mode, hpd, sink, supported);
+    return supported;
+}
+
+static disp_tv_mode hdmi_get_mode(void)
+{
+    switch (g_de_version) {
+        case DE_VERSION_1: return de1_hdmi_get_mode();
+        case DE_VERSION_2: return de2_hdmi_get_mode();
+        default: return (disp_tv_mode)-1;
+    }
+}
+
+/* True if the screen is already driving HDMI in the given mode */
+static int hdmi_mode_active(disp_tv_mode mode)
+{
+    int type = get_output_type();
+    disp_tv_mode cur;
+
+    if (type != DISP_OUTPUT_TYPE_HDMI) return 0;
+    cur = hdmi_get_mode();
+    DEBUG("hdmi_mode_active: type=%d mode=%d want=%d", type, cur, mode);
+    return cur == mode;
+}
+
+/*
+ * Set an HDMI mode, skipping the off/on cycle (and the sink resync) when
+ * the mode is already active. Returns STATE_UNCHANGED in that case.
+ * force skips the EDID check; hdmi_init() takes it from -f.
+ */
+static int hdmi_set_mode(disp_tv_mode mode, int force)
+{
+    if (!g_reapply && hdmi_mode_active(mode))
+        return STATE_UNCHANGED;
+
+    switch (g_de_version) {
+        case DE_VERSION_1: return de1_hdmi_init(mode, force);
+        case DE_VERSION_2: return de2_hdmi_init(mode, force);
+        default: return -1;
+    }
+}
+
+static int hdmi_init(disp_tv_mode mode)
+{
+    return hdmi_set_mode(mode, g_force);
+}
+
+/* Default HDMI mode when current mode is unknown/unsupported */
+static int hdmi_on(void)
+{
+    disp_tv_mode mode;
+    int ret;
+
+    switch (g_de_version) {
+        case DE_VERSION_1:
+            /* Try simple on first */
+            ret = de1_hdmi_on();
+            if (ret < 0) {
+                /* Fall back to init with default mode, force it */
+                DEBUG("Simple HDMI on failed, forcing default mode %d", DEFAULT_HDMI_MODE);
+                /* Force mode - can't check EDID when off */
+                ret = de1_hdmi_init(DEFAULT_HDMI_MODE, 1);
+            }
+            return ret;
+        case DE_VERSION_2:
+            /* Get current mode, use default if invalid or unsupported (like 480i) */
+            mode = hdmi_get_mode();
+            DEBUG("hdmi_on DE2: current mode = %d", mode);
+            if ((int)mode <= 0 || mode == DISP_TV_MOD_480I || mode == DISP_TV_MOD_576I) {
+                DEBUG("Current mode %d invalid/unsuitable, using default %d", mode, DEFAULT_HDMI_MODE);
+                mode = DEFAULT_HDMI_MODE;
+            }
+            DEBUG("hdmi_on DE2: will use mode %d", mode);
+            if (!g_reapply && hdmi_mode_active(mode))
+                return STATE_UNCHANGED;
+            /* Force the mode - can't reliably check EDID when HDMI is off */
+            ret = de2_hdmi_init(mode, 1);
+            DEBUG("hdmi_on DE2: de2_hdmi_init returned %d", ret);
+            return ret;
+        default:
+            return -1;
+    }
+}
+
+static int hdmi_off(void)
+{
+    switch (g_de_version) {
+        case DE_VERSION_1: return de1_hdmi_off();
+        case DE_VERSION_2: return de2_hdmi_off();
+        default: return -1;
+    }
+}
+
+/*
+ * Content frame-rate matching:
+ * A mode is judder-free for content at fps if its refresh is an integer
+ * multiple of the content rate (NTSC 23.976/29.97/59.94 count as 24/30/60
+ * - the mode table has no fractional refresh). Among supported modes the
+ * best is chosen by, in order: judder-free, resolution fit (smallest mode
+ * covering WxH, or the current resolution if no size is given), progressive
+ * over interlaced, then higher refresh.
+ */
+static int mode_is_interlaced(const mode_info_t *m)
+{
+    return strchr(m->name, 'i') != NULL;
+}
+
+static uint32_t content_rate(double fps)
+{
+    return (uint32_t)(fps + 0.5);   /* 23.976 -> 24, 29.97 -> 30, 59.94 -> 60 */
+}
+
+/* Higher is better; see the ordering above */
+static long match_score(const mode_info_t *m, uint32_t rate, uint32_t w, uint32_t h)
+{
+    long score = 0;
+    uint64_t area = (uint64_t)m->width * m->height;
+
+    if (rate && m->refresh % rate == 0) score += 1000000000L;
+
+    if (m->width >= w && m->height >= h)
+        score += 100000000L - (long)((area - (uint64_t)w * h) / 1024);  /* Smallest cover */
+    else
+        score += (long)(area / 1024);   /* Largest that does not cover */
+
+    if (!mode_is_interlaced(m)) score += 1000;
+    score += m->refresh;
+    return score;
+}
+
+/*
+ * Pick the best mode for content at fps (w/h 0 = keep the current
+ * resolution). Returns NULL if no supported mode exists.
+ */
+static const mode_info_t *hdmi_match_mode(double fps, uint32_t w, uint32_t h)
+{
+    const mode_info_t *best = NULL;
+    uint32_t rate = content_rate(fps);
+    long best_score = 0;
+
+    if (w == 0 || h == 0) {
+        const mode_info_t *cur = get_mode_info(hdmi_get_mode());
+        w = cur ? cur->width : 1920;
+        h = cur ? cur->height : 1080;
+    }
+
+    for (int i = 0; mode_table[i].name != NULL; i++) {
+        const mode_info_t *m = &mode_table[i];
+        long score;
+
+        if (g_de_version == DE_VERSION_1 && m->mode >= DISP_TV_MOD_3840_2160P_30HZ)
+            continue;
+        if (!g_force && hdmi_mode_supported(m->mode) != 1)
+            continue;
+
+        score = match_score(m, rate, w, h);
+        DEBUG("match: %s score %ld", m->name, score);
+        if (!best || score > best_score) {
+            best = m;
+            best_score = score;
+        }
+    }
+    return best;
+}
+
+/*
+ * Switch to the best mode for the content, but only when it changes the
+ * refresh: a current mode that is already judder-free (and big enough)
+ * is kept. The mode in use before the first switch is remembered in
+ * MATCH_STATE.N (per screen) for hdmi_match_restore(). Returns the mode
+ * now active.
+ */
+static void match_state_path(char *buf, size_t size)
+{
+    snprintf(buf, size, "%s.%u", MATCH_STATE, g_screen);
+}
+
+static const mode_info_t *hdmi_match(double fps, uint32_t w, uint32_t h)
+{
+    const mode_info_t *cur = get_mode_info(hdmi_get_mode());
+    const mode_info_t *best;
+    uint32_t rate = content_rate(fps);
+    char path[64], buf[32];
+    int fd;
+
+    if (cur && rate && cur->refresh % rate == 0 &&
+        (w == 0 || (cur->width >= w && cur->height >= h))) {
+        DEBUG("match: current %s already suits %.3f fps", cur->name, fps);
+        return cur;
+    }
+
+    best = hdmi_match_mode(fps, w, h);
+    if (!best) {
+        fprintf(stderr, "No supported HDMI mode for %.3f fps\n", fps);
+        return NULL;
+    }
+    if (cur && cur->refresh == best->refresh && cur->width == best->width &&
+        cur->height == best->height)
+        return cur;
+
+    /* Remember what to go back to, unless an earlier match already did */
+    match_state_path(path, sizeof(path));
+    if (cur && access(path, F_OK) != 0) {
+        fd = open(path, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+        if (fd >= 0) {
+            int n = snprintf(buf, sizeof(buf), "%d\n", cur->mode);
+            if (write(fd, buf, (size_t)n) != n)
+                DEBUG("match: failed to write %s", path);
+            close(fd);
+        }
+    }
+
+    if (hdmi_init(best->mode) < 0) return NULL;
+    return best;
+}
+
+/* Return to the mode saved by the first hdmi_match(); 1 if nothing saved */
+static int hdmi_match_restore(void)
+{
+    char path[64], buf[32];
+    int mode;
+
+    match_state_path(path, sizeof(path));
+    read_text_file(path, buf, sizeof(buf));
+    if (sscanf(buf, "%d", &mode) != 1) return 1;
+    if (hdmi_init((disp_tv_mode)mode) < 0) return -1;
+    unlink(path);
+    return 0;
+}
+
+static int setup_fb_with_scaling(uint32_t fb_id, uint32_t fb_w, uint32_t fb_h,
+                                 uint32_t scn_w, uint32_t scn_h, int depth)
+{
+    switch (g_de_version) {
+        case DE_VERSION_1:
+            return de1_setup_fb_with_scaling(fb_id, fb_w, fb_h, scn_w, scn_h, depth);
+        case DE_VERSION_2:
+            return de2_setup_fb_with_scaling(fb_id, fb_w, fb_h, scn_w, scn_h, depth);
+        default:
+            return -1;
+    }
+}
+
+/* Scale by reprogramming the FB layer windows, keeping the allocation */
+static int setup_layer_scaling(uint32_t fb_w, uint32_t fb_h,
+                               uint32_t scn_w, uint32_t scn_h, int depth)
+{
+    switch (g_de_version) {
+        case DE_VERSION_1:
+            return de1_setup_layer_scaling(fb_w, fb_h, scn_w, scn_h, depth);
+        case DE_VERSION_2:
+            return de2_setup_layer_scaling(fb_w, fb_h, scn_w, scn_h, depth);
+        default:
+            return -1;
+    }
+}
+
+/*
+ * ============================================================================
+ * Scaler Capability Model
+ * ============================================================================
+ *
+ * A scaled layer is fetched and filtered during the active part of every
+ * frame, so each DE has a ceiling on the input it can sustain at a given
+ * refresh. The model checks the scaler line buffer (input width), the
+ * ratio range, the scaler's input pixel rate and the DRAM fetch budget
+ * left for the layer. Rates are taken at the active-area burst rate, i.e.
+ * the frame average times SCALER_BLANK_FACTOR. Interlaced modes fetch one
+ * field (half the lines) per refresh. Unscaled (1:1) layers bypass the
+ * scaler and are not limited here.
+ *
+ * The figures are conservative: DEFE/UI scaler line buffer and ratio
+ * limits from the BSP, pixel rate at ~0.8 of the DE clock, and a DRAM
+ * budget that leaves CPU, GPU and video decoding room next to scanout.
+ * The DE1 budget sits below the 32 bpp 1080p60 sizes (1600x900 and up)
+ * that are seen to underrun; DE2 is limited by its line buffer first.
+ */
+#define SCALER_BLANK_FACTOR 1.2     /* 1080p: 2200x1125 total / 1920x1080 active */
+#define SCALER_ALIGN        8       /* Suggested sizes: width multiple of 8 */
+
+typedef struct {
+    uint32_t    max_in_w;       /* Scaler line buffer */
+    uint32_t    max_in_h;
+    uint32_t    max_down;       /* Largest downscale factor per axis */
+    uint32_t    max_up;         /* Largest upscale factor per axis */
+    double      max_mpix;       /* Input pixel rate, Mpixel/s */
+    double      max_mbs;        /* DRAM fetch budget for the layer, MB/s */
+} scaler_caps_t;
+
+static const scaler_caps_t de1_scaler_caps = { 2048, 2048, 4, 32, 240, 400 };
+static const scaler_caps_t de2_scaler_caps = { 2048, 4096, 4, 32, 340, 1300 };
+
+static const scaler_caps_t *scaler_caps(void)
+{
+    switch (g_de_version) {
+        case DE_VERSION_1: return &de1_scaler_caps;
+        case DE_VERSION_2: return &de2_scaler_caps;
+        default: return NULL;
+    }
+}
+
+/* Frames fetched per second in the current mode (fields count as half frames) */
+static double scaler_fetch_hz(const mode_info_t *info)
+{
+    if (!info || !info->refresh) return 60;
+    return strchr(info->name, 'i') ? info->refresh / 2.0 : info->refresh;
+}
+
+/*
+ * Check in_w x in_h scaled to out_w x out_h at depth bpp. Returns 0 if it
+ * can be sustained, -1 with a reason in why otherwise. load (may be NULL)
+ * is the larger of the rate and bandwidth use, as a fraction of the limit.
+ */
+static int scaler_check(uint32_t in_w, uint32_t in_h, uint32_t out_w, uint32_t out_h,
+                        int depth, double fetch_hz, char *why, size_t why_len, double *load)
+{
+    const scaler_caps_t *c = scaler_caps();
+    double mpix, mbs, l;
+
+    if (load) *load = 0;
+    if (!c || (in_w == out_w && in_h == out_h)) return 0;
+    if (!in_w || !in_h || !out_w || !out_h) {
+        snprintf(why, why_len, "empty window");
+        return -1;
+    }
+    if (in_w > c->max_in_w || in_h > c->max_in_h) {
+        snprintf(why, why_len, "input %ux%u exceeds the scaler limit %ux%u",
+                 in_w, in_h, c->max_in_w, c->max_in_h);
+        return -1;
+    }
+    if (in_w > out_w * c->max_down || in_h > out_h * c->max_down) {
+        snprintf(why, why_len, "downscale beyond 1/%u", c->max_down);
+        return -1;
+    }
+    if (out_w > in_w * c->max_up || out_h > in_h * c->max_up) {
+        snprintf(why, why_len, "upscale beyond %ux", c->max_up);
+        return -1;
+    }
+
+    mpix = (double)in_w * in_h * fetch_hz * SCALER_BLANK_FACTOR / 1e6;
+    mbs = mpix * ((depth + 7) / 8);
+    l = mpix / c->max_mpix > mbs / c->max_mbs ? mpix / c->max_mpix : mbs / c->max_mbs;
+    if (load) *load = l;
+    if (mpix > c->max_mpix) {
+        snprintf(why, why_len, "scaler input %.0f Mpix/s exceeds %.0f", mpix, c->max_mpix);
+        return -1;
+    }
+    if (mbs > c->max_mbs) {
+        snprintf(why, why_len, "layer fetch %.0f MB/s exceeds the %.0f MB/s budget",
+                 mbs, c->max_mbs);
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Largest size with the aspect of out_w x out_h (width a multiple of
+ * SCALER_ALIGN, height even, not above the output) that passes
+ * scaler_check() and, if fill_mpix > 0, renders within fill_mpix at fps.
+ * The unscaled output size itself is only a candidate if native is set.
+ */
+static int scaler_largest(uint32_t out_w, uint32_t out_h, int depth, double fetch_hz,
+                          double fill_mpix, double fps, int native, uint32_t *w, uint32_t *h)
+{
+    char why[96];
+
+    for (uint32_t y = out_h & ~1u; y >= 16; y -= 2) {
+        uint32_t x = (uint32_t)((uint64_t)y * out_w / out_h) & ~(uint32_t)(SCALER_ALIGN - 1);
+        if (x == 0) break;
+        if (y == out_h && (x != out_w || !native)) continue;
+        if (fill_mpix > 0 && (double)x * y * fps / 1e6 > fill_mpix) continue;
+        if (scaler_check(x, y, out_w, out_h, depth, fetch_hz, why, sizeof(why), NULL) == 0) {
+            *w = x;
+            *h = y;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+static double scaler_current_hz(void)
+{
+    const mode_info_t *info = NULL;
+
+    if (get_output_type() == DISP_OUTPUT_TYPE_HDMI)
+        info = get_mode_info(hdmi_get_mode());
+    return scaler_fetch_hz(info);
+}
+
+/*
+ * Gate for scale/autoscale: 0 if in -> out is sustainable in the current
+ * mode (or -f is given, with a warning), -1 after explaining why not.
+ */
+static int scaler_admit(uint32_t in_w, uint32_t in_h, uint32_t out_w, uint32_t out_h, int depth)
+{
+    double hz = scaler_current_hz();
+    uint32_t w, h;
+    char why[96];
+
+    if (scaler_check(in_w, in_h, out_w, out_h, depth, hz, why, sizeof(why), NULL) == 0)
+        return 0;
+    if (g_force) {
+        printf("Warning: %s, scanout may underrun (forced)\n", why);
+        return 0;
+    }
+    fprintf(stderr, "Scaling %ux%u -> %ux%u @ %d bpp is not sustainable on %s at %.0f Hz: %s\n",
+            in_w, in_h, out_w, out_h, depth, de_version_name(g_de_version), hz, why);
+    if (scaler_largest(out_w, out_h, depth, hz, 0, 0, 0, &w, &h) == 0)
+        fprintf(stderr, "Largest scaled size for %ux%u: %ux%u (see 'advise'; -f to override)\n",
+                out_w, out_h, w, h);
+    return -1;
+}
+
+/*
+ * ============================================================================
+ * Layer Transactions
+ * ============================================================================
+ */
+static void layer_txn_begin(layer_txn_t *txn)
+{
+    memset(txn, 0, sizeof(*txn));
+}
+
+/* Stage a change; changes to the same layer are merged. Returns -1 if full. */
+static int layer_txn_stage(layer_txn_t *txn, const layer_change_t *change)
+{
+    layer_change_t *c = NULL;
+
+    for (int i = 0; i < txn->count; i++) {
+        if (txn->changes[i].channel == change->channel && txn->changes[i].layer == change->layer) {
+            c = &txn->changes[i];
+            break;
+        }
+    }
+    if (!c) {
+        if (txn->count >= LAYER_TXN_MAX) return -1;
+        c = &txn->changes[txn->count++];
+        memset(c, 0, sizeof(*c));
+        c->channel = change->channel;
+        c->layer = change->layer;
+    }
+
+    if (change->set & LAYER_SET_ENABLE) c->enable = change->enable;
+    if (change->set & LAYER_SET_CROP) c->crop = change->crop;
+    if (change->set & LAYER_SET_WIN) c->win = change->win;
+    if (change->set & LAYER_SET_ZORDER) c->zorder = change->zorder;
+    if (change->set & LAYER_SET_ALPHA) c->alpha = change->alpha;
+    c->set |= change->set;
+    return 0;
+}
+
+/* Apply every staged change at once */
+static int layer_txn_commit(const layer_txn_t *txn)
+{
+    if (txn->count == 0) return 0;
+
+    switch (g_de_version) {
+        case DE_VERSION_1: return de1_layer_txn_commit(txn);
+        case DE_VERSION_2: return de2_layer_txn_commit(txn);
+        default: return -1;
+    }
+}
+
+/*
+ * ============================================================================
+ * Framebuffer Configuration via fbdev
+ * ============================================================================
+ */
+static int fb_configure(uint32_t width, uint32_t height, int depth)
+{
+    struct fb_var_screeninfo vinfo;
+    struct fb_fix_screeninfo finfo;
+    uint32_t xv, yv;
+
+    if (fb_open() < 0) return -1;
+    if (fb_virtual_size(width, height, 1, &xv, &yv) < 0) return -1;
+
+    if (fb_ioctl(FBIOGET_VSCREENINFO, &vinfo) < 0) {
+        perror("FBIOGET_VSCREENINFO failed");
+        return -1;
+    }
+
+    if (!g_reapply && vinfo.xres == width && vinfo.yres == height &&
+        vinfo.xres_virtual == xv && vinfo.yres_virtual == yv &&
+        vinfo.bits_per_pixel == (unsigned)depth) {
+        printf("Framebuffer already configured: %dx%d @ %d bpp (no-op)\n",
+               width, height, depth);
+        return 0;
+    }
+
+    if (fb_ioctl(FBIOGET_FSCREENINFO, &finfo) == 0)
+        fb_mem_check(xv, yv, depth, finfo.smem_len);
+
+    vinfo.xres = width;
+    vinfo.yres = height;
+    vinfo.xres_virtual = xv;
+    vinfo.yres_virtual = yv;
+    vinfo.yoffset = 0;
+    vinfo.bits_per_pixel = depth;
+
+    if (depth == 16) {
+        vinfo.red.offset = 11; vinfo.red.length = 5;
+        vinfo.green.offset = 5; vinfo.green.length = 6;
+        vinfo.blue.offset = 0; vinfo.blue.length = 5;
+        vinfo.transp.offset = 0; vinfo.transp.length = 0;
+    } else if (depth == 24 || depth == 32) {
+        vinfo.red.offset = 16; vinfo.red.length = 8;
+        vinfo.green.offset = 8; vinfo.green.length = 8;
+        vinfo.blue.offset = 0; vinfo.blue.length = 8;
+        vinfo.transp.offset = (depth == 32) ? 24 : 0;
+        vinfo.transp.length = (depth == 32) ? 8 : 0;
+    }
+
+    if (fb_ioctl(FBIOPUT_VSCREENINFO, &vinfo) < 0) {
+        perror("FBIOPUT_VSCREENINFO failed");
+        return -1;
+    }
+
+    if (fb_ioctl(FBIOGET_FSCREENINFO, &finfo) < 0) {
+        perror("FBIOGET_FSCREENINFO failed");
+        return -1;
+    }
+
+    printf("Framebuffer configured: %dx%d @ %d bpp, virtual %ux%u\n",
+           vinfo.xres, vinfo.yres, vinfo.bits_per_pixel, vinfo.xres_virtual, vinfo.yres_virtual);
+    printf("Line length: %d bytes, Total size: %d bytes\n",
+           finfo.line_length, finfo.smem_len);
+
+    return 0;
+}
+
+static int get_fb_info(struct fb_var_screeninfo *vinfo, struct fb_fix_screeninfo *finfo)
+{
+    if (fb_open() < 0) return -1;
+
+    if (vinfo && fb_ioctl(FBIOGET_VSCREENINFO, vinfo) < 0)
+        return -1;
+
+    if (finfo && fb_ioctl(FBIOGET_FSCREENINFO, finfo) < 0)
+        return -1;
+
+    return 0;
+}
+
+/*
+ * ============================================================================
+ * Display Lock
+ * ============================================================================
+ *
+ * Hotplug handlers, players, config managers and the daemon can all change
+ * the display at the same time. If a mode set from one process interleaves
+ * with a framebuffer resize from another, the fbdev buffer and the layer
+ * can end up out of step. display_lock() holds an exclusive flock() on a
+ * per-screen lock file while a change is in progress:
+ * - It nests per thread, so a helper can lock whether or not its caller
+ *   already does.
+ * - Each screen has its own lock, so '-s 0,1' still switches both at once.
+ * - The holder's pid is written to the file for the busy message.
+ * - Where /run is not writable (not root), changes run unlocked.
+ */
+#define LOCK_WAIT_MS    30000   /* Give up on a holder that seems stuck */
+#define LOCK_POLL_MS    10
+
+static __thread int g_lock_fd = -1;
+static __thread int g_lock_depth = 0;
+
+static int display_lock(void)
+{
+    struct timespec t0;
+    char path[64], owner[16];
+    int fd, len, waited = 0;
+
+    if (g_lock_depth++ > 0) return 0;
+
+    snprintf(path, sizeof(path), LOCK_FILE_FMT, g_screen);
+    fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        DEBUG("lock: %s: %s, running unlocked", path, strerror(errno));
+        return 0;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    while (flock(fd, LOCK_EX | LOCK_NB) < 0) {
+        ssize_t n;
+
+        if (errno != EWOULDBLOCK && errno != EINTR) {
+            DEBUG("lock: flock failed (errno=%d), running unlocked", errno);
+            close(fd);
+            return 0;
+        }
+        if (g_stop_requested || elapsed_ms(&t0) >= LOCK_WAIT_MS) {
+            n = pread(fd, owner, sizeof(owner) - 1, 0);
+            owner[n > 0 ? n : 0] = '\0';
+            owner[strcspn(owner, "\n")] = '\0';
+            fprintf(stderr, "Screen %u is busy: locked by %s%s for %.0f ms\n", g_screen,
+                    owner[0] ? "pid " : "another process", owner, elapsed_ms(&t0));
+            close(fd);
+            g_lock_depth--;
+            errno = EBUSY;
+            return -1;
+        }
+        if (!waited++)
+            DEBUG("lock: screen %u busy, waiting", g_screen);
+        usleep(LOCK_POLL_MS * 1000);
+    }
+    if (waited)
+        DEBUG("lock: screen %u acquired after %.1f ms", g_screen, elapsed_ms(&t0));
+
+    len = snprintf(owner, sizeof(owner), "%d\n", (int)getpid());
+    if (ftruncate(fd, 0) < 0 || pwrite(fd, owner, (size_t)len, 0) != len)
+        DEBUG("lock: failed to record owner (errno=%d)", errno);
+    g_lock_fd = fd;
+    return 0;
+}
+
+static void display_unlock(void)
+{
+    if (g_lock_depth == 0 || --g_lock_depth > 0) return;
+    if (g_lock_fd >= 0) {
+        close(g_lock_fd);   /* Releases the flock */
+        g_lock_fd = -1;
+    }
+}
+
+/*
+ * ============================================================================
+ * Asynchronous Mode Switch
+ * ============================================================================
+ *
+ * HDMI_SET_MODE/HDMI_ON (DE1) and DEVICE_SWITCH (DE2) block while the
+ * transmitter and the sink renegotiate, which can take seconds. A switch
+ * started with mode_async_start() runs on its own thread with the caller's
+ * screen context, and returns an eventfd that becomes readable (counter 1)
+ * once the switch is finished, so a caller can keep rendering or handling
+ * input and poll() the fd with everything else.
+ *
+ * The new mode counts as confirmed when hdmi_get_mode() reads it back on
+ * an HDMI output and the first vblank after that has passed
+ * (FBIO_WAITFORVSYNC, skipped on BSPs without it). An optional
+ * framebuffer/scaling change follows. If the mode is not confirmed within
+ * the timeout, or a step fails, the previous mode is restored. A blocking
+ * ioctl cannot be cut short, so the timeout is checked when it returns.
+ */
+#define ASYNC_TIMEOUT_MS    5000    /* Default confirmation timeout */
+#define ASYNC_POLL_MS       20      /* Mode read-back interval */
+
+typedef struct {
+    pthread_t       thread;
+    pthread_mutex_t lock;
+    uint32_t        screen;
+    disp_tv_mode    mode;           /* (disp_tv_mode)-1: keep the mode */
+    disp_tv_mode    prev_mode;      /* Restored on failure or timeout */
+    uint32_t        fb_w, fb_h;     /* 0: no framebuffer change */
+    int             depth;
+    uint32_t        timeout_ms;
+    int             efd;            /* Readable once done */
+    int             notify_fd;      /* Daemon client awaiting the result, or -1 */
+    void           *log_ctx;        /* Library context for messages */
+    int             quiet;          /* Detached: no terminal for messages */
+    run_flags_t     flags;          /* The caller's, for the worker thread */
+    /* Results, valid once done is set */
+    int             done;
+    int             status;         /* 0, STATE_UNCHANGED or -1 */
+    int             timed_out;
+    int             rolled_back;
+    int             err;            /* errno of the failing step */
+    double          confirm_ms;     /* Start until the mode was confirmed */
+    double          total_ms;
+} mode_async_t;
+
+/* Wait until the mode reads back and one vblank has passed, within the timeout */
+static int mode_async_confirm(const mode_async_t *op, const struct timespec *t0)
+{
+    uint32_t crtc = 0;
+
+    while (get_output_type() != DISP_OUTPUT_TYPE_HDMI || hdmi_get_mode() != op->mode) {
+        if (elapsed_ms(t0) >= op->timeout_ms) return -1;
+        usleep(ASYNC_POLL_MS * 1000);
+    }
+    if (fb_open() == 0 && fb_ioctl(FBIO_WAITFORVSYNC, &crtc) < 0)
+        DEBUG("async: no FBIO_WAITFORVSYNC (errno=%d), confirmed by read-back only", errno);
+    return elapsed_ms(t0) <= op->timeout_ms ? 0 : -1;
+}
+
+/* Daemon reply: 0 = switched (or unchanged), 1 = failed, 2 = timed out */
+static void mode_async_reply(mode_async_t *op)
+{
+    int32_t status = op->timed_out ? 2 : op->status < 0 ? 1 : 0;
+
+    if (write(op->notify_fd, &status, sizeof(status)) != (ssize_t)sizeof(status))
+        DEBUG("async: failed to send result (errno=%d)", errno);
+    close(op->notify_fd);
+    op->notify_fd = -1;
+}
+
+static void *mode_async_worker(void *arg)
+{
+    mode_async_t *op = arg;
+    struct timespec t0;
+    uint64_t one = 1;
+    int ret = 0, locked;
+
+    g_screen = op->screen;
+    g_fb_index = op->screen;
+    run_flags_load(&op->flags);
+#ifdef SUNXI_DISP_LIB
+    g_ctx = op->log_ctx;
+#else
+    g_mute = op->quiet;
+#endif
+    /* The worker, not the caller, holds the lock while the switch runs */
+    locked = display_lock() == 0;
+    if (!locked) {
+        op->err = errno;
+        ret = -1;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+
+    if (ret == 0 && op->mode != (disp_tv_mode)-1) {
+        ret = hdmi_init(op->mode);
+        if (ret < 0) {
+            op->err = errno;
+        } else if (mode_async_confirm(op, &t0) < 0) {
+            DEBUG("async: mode %d not confirmed within %u ms", op->mode, op->timeout_ms);
+            op->timed_out = 1;
+            op->err = ETIMEDOUT;
+            ret = -1;
+        }
+    }
+    op->confirm_ms = elapsed_ms(&t0);
+
+    if (ret >= 0 && op->fb_w) {
+        uint32_t scn_w, scn_h;
+        int r = get_screen_size(&scn_w, &scn_h);
+
+        if (r == 0)
+            r = setup_fb_with_scaling(g_fb_index, op->fb_w, op->fb_h, scn_w, scn_h, op->depth);
+        if (r < 0) {
+            op->err = errno;
+            ret = -1;
+        } else if (ret == STATE_UNCHANGED) {
+            ret = r;    /* Unchanged only if both steps were */
+        }
+    }
+
+    /*
+     * Roll back: the previous mode was active, so it needs no EDID check.
+     * The outcome is only recorded; the caller reports it, since a switch
+     * finishing after a daemon reply has no terminal of its own.
+     */
+    if (locked && ret < 0 && op->mode != (disp_tv_mode)-1 && (int)op->prev_mode >= 0 &&
+        op->prev_mode != op->mode) {
+        if (hdmi_set_mode(op->prev_mode, 1) >= 0)
+            op->rolled_back = 1;
+        else
+            DEBUG("async: failed to restore mode %d", op->prev_mode);
+    }
+    fb_close();
+    if (locked) display_unlock();
+
+    pthread_mutex_lock(&op->lock);
+    op->status = ret;
+    op->total_ms = elapsed_ms(&t0);
+    op->done = 1;
+    if (op->notify_fd >= 0)
+        mode_async_reply(op);
+    pthread_mutex_unlock(&op->lock);
+
+    if (write(op->efd, &one, sizeof(one)) != (ssize_t)sizeof(one))
+        DEBUG("async: eventfd write failed (errno=%d)", errno);
+    return NULL;
+}
+
+/*
+ * Start a switch on the calling thread's screen: mode (or -1 to keep it),
+ * then fb_w x fb_h @ depth scaled to the screen if fb_w is not 0.
+ * timeout_ms 0 selects ASYNC_TIMEOUT_MS. The worker runs with a copy of
+ * the caller's flags; with quiet set it prints nothing. Returns NULL on
+ * failure.
+ */
+static mode_async_t *mode_async_start(disp_tv_mode mode, uint32_t fb_w, uint32_t fb_h,
+                                      int depth, uint32_t timeout_ms, void *log_ctx,
+                                      int quiet)
+{
+    mode_async_t *op = calloc(1, sizeof(*op));
+
+    if (!op) {
+        perror("Failed to allocate switch");
+        return NULL;
+    }
+    op->screen = g_screen;
+    op->mode = mode;
+    op->prev_mode = (disp_tv_mode)-1;
+    if (mode != (disp_tv_mode)-1 && get_output_type() == DISP_OUTPUT_TYPE_HDMI)
+        op->prev_mode = hdmi_get_mode();
+    op->fb_w = fb_w;
+    op->fb_h = fb_h;
+    op->depth = depth;
+    op->timeout_ms = timeout_ms ? timeout_ms : ASYNC_TIMEOUT_MS;
+    op->notify_fd = -1;
+    op->log_ctx = log_ctx;
+    op->quiet = quiet;
+    run_flags_save(&op->flags);
+    pthread_mutex_init(&op->lock, NULL);
+
+    op->efd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (op->efd < 0) {
+        perror("eventfd failed");
+        free(op);
+        return NULL;
+    }
+    errno = pthread_create(&op->thread, NULL, mode_async_worker, op);
+    if (errno != 0) {
+        perror("Failed to start switch thread");
+        close(op->efd);
+        free(op);
+        return NULL;
+    }
+    DEBUG("async: screen %u mode %d -> %d, fb %ux%u, timeout %u ms",
+          op->screen, op->prev_mode, mode, fb_w, fb_h, op->timeout_ms);
+    return op;
+}
+
+/* Send the result to fd (a daemon client) when done; now if already done */
+static void mode_async_notify(mode_async_t *op, int fd)
+{
+    pthread_mutex_lock(&op->lock);
+    op->notify_fd = fd;
+    if (op->done)
+        mode_async_reply(op);
+    pthread_mutex_unlock(&op->lock);
+}
+
+/*
+ * Wait for the switch and release it. Returns its status (0, STATE_UNCHANGED
+ * or -1 with errno set); result, if given, receives a copy of the record.
+ */
+static int mode_async_finish(mode_async_t *op, mode_async_t *result)
+{
+    int ret;
+
+    pthread_join(op->thread, NULL);
+    ret = op->status;
+    if (result) *result = *op;
+    errno = op->err;
+    if (op->notify_fd >= 0) close(op->notify_fd);
+    close(op->efd);
+    pthread_mutex_destroy(&op->lock);
+    free(op);
+    return ret;
+}
+
+#ifdef SUNXI_DISP_LIB
+/*
+ * ============================================================================
+ * Library API (libsunxidisp, see sunxi_disp.h)
+ * ============================================================================
+ *
+ * A context holds what the CLI keeps in the per-thread screen context: the
+ * screen and its fbdev handle. Each call loads it into the calling thread's
+ * g_screen/g_fb_fd, runs the same helpers the commands use and stores the
+ * handle back, so contexts can be driven from any thread, like the
+ * 'screens' workers. A helper's -1 is mapped to an error code from errno.
+ */
+struct sunxi_disp {
+    uint32_t            screen;
+    int                 fb_fd;
+    unsigned int        flags;
+    int                 last_errno;
+    char                last_error[256];
+    sunxi_disp_log_fn   log;
+    void               *log_arg;
+    mode_async_t       *async;      /* Switch in progress */
+};
+
+static pthread_mutex_t g_lib_lock = PTHREAD_MUTEX_INITIALIZER;
+static int g_lib_users = 0;             /* Open contexts sharing g_disp_fd */
+
+static void lib_vlog(int level, const char *fmt, va_list ap)
+{
+    char msg[256];
+    size_t len;
+
+    if (!g_ctx) return;
+    vsnprintf(msg, sizeof(msg), fmt, ap);
+    len = strlen(msg);
+    while (len > 0 && msg[len - 1] == '\n')
+        msg[--len] = '\0';
+    if (len == 0) return;
+
+    /* The first error of a call is the specific one */
+    if (level == SUNXI_DISP_LOG_ERROR && g_ctx->last_error[0] == '\0')
+        memcpy(g_ctx->last_error, msg, len + 1);
+    if (g_ctx->log)
+        g_ctx->log(g_ctx->log_arg, level, msg);
+}
+
+static int lib_printf(const char *fmt, ...)
+{
+    va_list ap;
+
+    va_start(ap, fmt);
+    lib_vlog(strncmp(fmt, "[DEBUG]", 7) == 0 ? SUNXI_DISP_LOG_DEBUG : SUNXI_DISP_LOG_INFO,
+             fmt, ap);
+    va_end(ap);
+    return 0;
+}
+
+static int lib_fprintf(FILE *f, const char *fmt, ...)
+{
+    va_list ap;
+    int ret = 0;
+
+    va_start(ap, fmt);
+    if (f == stderr)
+        lib_vlog(strncmp(fmt, "Warning", 7) == 0 ? SUNXI_DISP_LOG_INFO : SUNXI_DISP_LOG_ERROR,
+                 fmt, ap);
+    else if (f == stdout)
+        lib_vlog(SUNXI_DISP_LOG_INFO, fmt, ap);
+    else
+        ret = vfprintf(f, fmt, ap);
+    va_end(ap);
+    return ret;
+}
+
+static void lib_perror(const char *s)
+{
+    int err = errno;
+
+    if (g_ctx) g_ctx->last_errno = err;
+    lib_fprintf(stderr, "%s: %s\n", s, strerror(err));
+    errno = err;
+}
+
+static void ctx_enter(sunxi_disp_t *ctx)
+{
+    g_ctx = ctx;
+    g_screen = ctx->screen;
+    g_fb_index = ctx->screen;
+    g_fb_fd = ctx->fb_fd;
+    g_force = (ctx->flags & SUNXI_DISP_FORCE) != 0;
+    g_reapply = (ctx->flags & SUNXI_DISP_REAPPLY) != 0;
+    g_verbose = (ctx->flags & SUNXI_DISP_DEBUG) != 0;
+    ctx->last_errno = 0;
+    ctx->last_error[0] = '\0';
+    errno = 0;
+}
+
+/* ret >= 0 passes through (0 or STATE_UNCHANGED), -1 becomes an error code */
+static int ctx_leave(sunxi_disp_t *ctx, int ret)
+{
+    int err = ctx->last_errno ? ctx->last_errno : errno;
+
+    ctx->fb_fd = g_fb_fd;
+    g_fb_fd = -1;
+    g_ctx = NULL;
+    if (ret >= 0) return ret;
+
+    ctx->last_errno = err;
+    switch (err) {
+        case ENOMEM: return SUNXI_DISP_ERR_NOMEM;
+        case ENOENT:
+        case ENODEV:
+        case ENXIO:
+        case EACCES: return SUNXI_DISP_ERR_NODEV;
+        case ETIMEDOUT: return SUNXI_DISP_ERR_TIMEOUT;
+        default: return SUNXI_DISP_ERR_IO;
+    }
+}
+
+/* Leave with a specific error code; the message was reported as usual */
+static int ctx_fail(sunxi_disp_t *ctx, int code)
+{
+    ctx_leave(ctx, 0);
+    return code;
+}
+
+/* ctx_leave() for a call that holds the display lock */
+static int ctx_unlock(sunxi_disp_t *ctx, int ret)
+{
+    int err = errno;
+
+    display_unlock();
+    errno = err;
+    return ctx_leave(ctx, ret);
+}
+
+int sunxi_disp_open(sunxi_disp_t **out, unsigned int screen)
+{
+    sunxi_disp_t *ctx;
+    int ret = 0;
+
+    if (!out) return SUNXI_DISP_ERR_INVALID;
+    *out = NULL;
+    if (screen >= CAPS_MAX_SCREENS) return SUNXI_DISP_ERR_INVALID;
+    ctx = calloc(1, sizeof(*ctx));
+    if (!ctx) return SUNXI_DISP_ERR_NOMEM;
+    ctx->screen = screen;
+    ctx->fb_fd = -1;
+
+    ctx_enter(ctx);
+    pthread_mutex_lock(&g_lib_lock);
+    if (g_lib_users == 0)
+        ret = disp_open();
+    if (ret == 0 && screen >= g_caps.screen_count) {
+        fprintf(stderr, "Screen %u not available (%u screen%s)\n",
+                screen, g_caps.screen_count, g_caps.screen_count == 1 ? "" : "s");
+        if (g_lib_users == 0) disp_close();
+        pthread_mutex_unlock(&g_lib_lock);
+        ctx_leave(ctx, 0);
+        free(ctx);
+        return SUNXI_DISP_ERR_NODEV;
+    }
+    if (ret == 0) g_lib_users++;
+    pthread_mutex_unlock(&g_lib_lock);
+
+    ret = ctx_leave(ctx, ret);
+    if (ret < 0) {
+        free(ctx);
+        return ret;
+    }
+    *out = ctx;
+    return SUNXI_DISP_OK;
+}
+
+void sunxi_disp_close(sunxi_disp_t *ctx)
+{
+    if (!ctx) return;
+
+    if (ctx->async)
+        mode_async_finish(ctx->async, NULL);
+    ctx_enter(ctx);
+    fb_close();
+    pthread_mutex_lock(&g_lib_lock);
+    if (--g_lib_users == 0) {
+        caps_save();
+        disp_close();
+    }
+    pthread_mutex_unlock(&g_lib_lock);
+    ctx_leave(ctx, 0);
+    free(ctx);
+}
+
+void sunxi_disp_set_log(sunxi_disp_t *ctx, sunxi_disp_log_fn fn, void *arg)
+{
+    ctx->log = fn;
+    ctx->log_arg = arg;
+}
+
+void sunxi_disp_set_flags(sunxi_disp_t *ctx, unsigned int flags)
+{
+    ctx->flags = flags;
+}
+
+const char *sunxi_disp_strerror(int err)
+{
+    switch (err) {
+        case SUNXI_DISP_OK:                 return "Success";
+        case SUNXI_DISP_UNCHANGED:          return "Already active";
+        case SUNXI_DISP_ERR_NODEV:          return "Display device not available";
+        case SUNXI_DISP_ERR_IO:             return "Display driver request failed";
+        case SUNXI_DISP_ERR_UNSUPPORTED:    return "Not supported";
+        case SUNXI_DISP_ERR_INVALID:        return "Invalid argument";
+        case SUNXI_DISP_ERR_NOMEM:          return "Out of memory";
+        case SUNXI_DISP_ERR_TIMEOUT:        return "Not confirmed in time, previous mode restored";
+        case SUNXI_DISP_ERR_BUSY:           return "Switch in progress or screen locked";
+        default:                            return "Unknown error";
+    }
+}
+
+const char *sunxi_disp_last_error(const sunxi_disp_t *ctx)
+{
+    return ctx->last_error;
+}
+
+int sunxi_disp_de_version(const sunxi_disp_t *ctx)
+{
+    (void)ctx;
+    return (int)g_de_version;
+}
+
+int sunxi_disp_mode_lookup(const char *name)
+{
+    const mode_info_t *info = name ? find_mode_by_name(name) : NULL;
+
+    return info ? (int)info->mode : SUNXI_DISP_ERR_INVALID;
+}
+
+int sunxi_disp_mode_info(int mode, uint32_t *width, uint32_t *height, uint32_t *refresh)
+{
+    const mode_info_t *info = get_mode_info((disp_tv_mode)mode);
+
+    if (!info) return SUNXI_DISP_ERR_INVALID;
+    if (width) *width = info->width;
+    if (height) *height = info->height;
+    if (refresh) *refresh = info->refresh;
+    return SUNXI_DISP_OK;
+}
+
+int sunxi_disp_screen_size(sunxi_disp_t *ctx, uint32_t *width, uint32_t *height)
+{
+    if (!width || !height) return SUNXI_DISP_ERR_INVALID;
+    ctx_enter(ctx);
+    return ctx_leave(ctx, get_screen_size(width, height));
+}
+
+int sunxi_disp_output_type(sunxi_disp_t *ctx)
+{
+    ctx_enter(ctx);
+    return ctx_leave(ctx, get_output_type());
+}
+
+int sunxi_disp_hdmi_hpd(sunxi_disp_t *ctx)
+{
+    ctx_enter(ctx);
+    return ctx_leave(ctx, hdmi_get_hpd());
+}
+
+int sunxi_disp_hdmi_mode(sunxi_disp_t *ctx)
+{
+    ctx_enter(ctx);
+    return ctx_leave(ctx, (int)hdmi_get_mode());
+}
+
+int sunxi_disp_hdmi_mode_supported(sunxi_disp_t *ctx, int mode)
+{
+    if (!get_mode_info((disp_tv_mode)mode)) return SUNXI_DISP_ERR_INVALID;
+    ctx_enter(ctx);
+    return ctx_leave(ctx, hdmi_mode_supported((disp_tv_mode)mode));
+}
+
+int sunxi_disp_hdmi_set_mode(sunxi_disp_t *ctx, int mode)
+{
+    if (!get_mode_info((disp_tv_mode)mode)) return SUNXI_DISP_ERR_INVALID;
+    ctx_enter(ctx);
+    /* Checked here so that "not supported" has its own code */
+    if (!g_force && !hdmi_mode_active((disp_tv_mode)mode) &&
+        !hdmi_mode_supported((disp_tv_mode)mode)) {
+        fprintf(stderr, "HDMI mode %d not supported by the sink\n", mode);
+        return ctx_fail(ctx, SUNXI_DISP_ERR_UNSUPPORTED);
+    }
+    if (display_lock() < 0) return ctx_fail(ctx, SUNXI_DISP_ERR_BUSY);
+    return ctx_unlock(ctx, hdmi_init((disp_tv_mode)mode));
+}
+
+int sunxi_disp_hdmi_on(sunxi_disp_t *ctx)
+{
+    ctx_enter(ctx);
+    if (display_lock() < 0) return ctx_fail(ctx, SUNXI_DISP_ERR_BUSY);
+    return ctx_unlock(ctx, hdmi_on());
+}
+
+int sunxi_disp_hdmi_off(sunxi_disp_t *ctx)
+{
+    ctx_enter(ctx);
+    if (display_lock() < 0) return ctx_fail(ctx, SUNXI_DISP_ERR_BUSY);
+    return ctx_unlock(ctx, hdmi_off());
+}
+
+/* Common argument checks; fills in the screen size for scn_w/scn_h of 0 */
+static int lib_fb_args(uint32_t fb_w, uint32_t fb_h, uint32_t *scn_w, uint32_t *scn_h,
+                       int depth)
+{
+    if (fb_w == 0 || fb_h == 0 || (depth != 16 && depth != 24 && depth != 32)) {
+        fprintf(stderr, "Invalid framebuffer %ux%u @ %d bpp\n", fb_w, fb_h, depth);
+        errno = EINVAL;
+        return -1;
+    }
+    if ((*scn_w == 0 || *scn_h == 0) && get_screen_size(scn_w, scn_h) < 0)
+        return -1;
+    return 0;
+}
+
+int sunxi_disp_setup_fb(sunxi_disp_t *ctx, uint32_t fb_w, uint32_t fb_h,
+                        uint32_t scn_w, uint32_t scn_h, int depth)
+{
+    ctx_enter(ctx);
+    if (display_lock() < 0) return ctx_fail(ctx, SUNXI_DISP_ERR_BUSY);
+    if (lib_fb_args(fb_w, fb_h, &scn_w, &scn_h, depth) < 0) {
+        if (errno != EINVAL) return ctx_unlock(ctx, -1);
+        ctx_unlock(ctx, 0);
+        return SUNXI_DISP_ERR_INVALID;
+    }
+    return ctx_unlock(ctx, setup_fb_with_scaling(g_fb_index, fb_w, fb_h, scn_w, scn_h, depth));
+}
+
+int sunxi_disp_setup_layer_scaling(sunxi_disp_t *ctx, uint32_t fb_w, uint32_t fb_h,
+                                   uint32_t scn_w, uint32_t scn_h, int depth)
+{
+    ctx_enter(ctx);
+    if (display_lock() < 0) return ctx_fail(ctx, SUNXI_DISP_ERR_BUSY);
+    if (lib_fb_args(fb_w, fb_h, &scn_w, &scn_h, depth) < 0) {
+        if (errno != EINVAL) return ctx_unlock(ctx, -1);
+        ctx_unlock(ctx, 0);
+        return SUNXI_DISP_ERR_INVALID;
+    }
+    return ctx_unlock(ctx, setup_layer_scaling(fb_w, fb_h, scn_w, scn_h, depth));
+}
+
+int sunxi_disp_switch_async(sunxi_disp_t *ctx, int mode, uint32_t fb_w, uint32_t fb_h,
+                            int depth, unsigned int timeout_ms)
+{
+    uint32_t scn_w = 1, scn_h = 1;  /* Resolved by the switch thread */
+
+    if (ctx->async) return SUNXI_DISP_ERR_BUSY;
+    if (mode != -1 && !get_mode_info((disp_tv_mode)mode)) return SUNXI_DISP_ERR_INVALID;
+    ctx_enter(ctx);
+    if (fb_w && lib_fb_args(fb_w, fb_h, &scn_w, &scn_h, depth) < 0)
+        return ctx_fail(ctx, SUNXI_DISP_ERR_INVALID);
+    if (mode == -1 && fb_w == 0) {
+        fprintf(stderr, "Nothing to switch\n");
+        return ctx_fail(ctx, SUNXI_DISP_ERR_INVALID);
+    }
+    if (mode != -1 && !g_force && !hdmi_mode_active((disp_tv_mode)mode) &&
+        !hdmi_mode_supported((disp_tv_mode)mode)) {
+        fprintf(stderr, "HDMI mode %d not supported by the sink\n", mode);
+        return ctx_fail(ctx, SUNXI_DISP_ERR_UNSUPPORTED);
+    }
+    ctx->async = mode_async_start((disp_tv_mode)mode, fb_w, fb_h, depth, timeout_ms, ctx, 0);
+    if (!ctx->async)
+        return ctx_leave(ctx, -1);
+    ctx_leave(ctx, 0);
+    return ctx->async->efd;
+}
+
+int sunxi_disp_switch_result(sunxi_disp_t *ctx)
+{
+    mode_async_t res;
+    int ret;
+
+    if (!ctx->async) return SUNXI_DISP_ERR_INVALID;
+    ret = mode_async_finish(ctx->async, &res);
+    ctx->async = NULL;
+    if (ret >= 0) return ret;
+    ctx->last_errno = res.err;
+    if (res.timed_out) {
+        snprintf(ctx->last_error, sizeof(ctx->last_error),
+                 "Mode %d not confirmed within %u ms, %s", res.mode, res.timeout_ms,
+                 res.rolled_back ? "previous mode restored" : "previous mode not restored");
+        return SUNXI_DISP_ERR_TIMEOUT;
+    }
+    return res.err == ENOMEM ? SUNXI_DISP_ERR_NOMEM : SUNXI_DISP_ERR_IO;
+}
+#endif /* SUNXI_DISP_LIB */
+
+#ifndef SUNXI_DISP_LIB
+/*
+ * ============================================================================
+ * Page Flipping
+ * ============================================================================
+ *
+ * With yres_virtual = N * yres (-b 2 or 3) the framebuffer holds N pages.
+ * fb_flip() pans scanout to the next page with FBIOPAN_DISPLAY and then
+ * waits on FBIO_WAITFORVSYNC. When it returns, the previous front page is
+ * no longer scanned out and can be rendered into. The gap between
+ * successive vblanks is compared to the frame period to count missed ones.
+ * The pan changes what is on screen, so each one holds the display lock
+ * (not the vblank wait), and a flip loop cannot starve other changes.
+ */
+typedef struct {
+    uint32_t        nbuf;       /* Pages in the virtual framebuffer */
+    uint32_t        front;      /* Page currently scanned out */
+    uint32_t        yres;
+    double          period_ms;  /* Frame period of the current mode */
+    int             have_vsync; /* FBIO_WAITFORVSYNC works on this BSP */
+    int             have_last;
+    struct timespec last;       /* Time of the previous vblank */
+    uint32_t        flips;
+    uint32_t        missed;
+} flip_state_t;
+
+static __thread flip_state_t g_flip;
+
+/* Read the page layout from fbdev. Returns the page count or -1. */
+static int fb_flip_init(void)
+{
+    struct fb_var_screeninfo vinfo;
+    const mode_info_t *info;
+
+    memset(&g_flip, 0, sizeof(g_flip));
+    if (get_fb_info(&vinfo, NULL) < 0) {
+        perror("FBIOGET_VSCREENINFO failed");
+        return -1;
+    }
+    if (vinfo.yres == 0) return -1;
+
+    g_flip.yres = vinfo.yres;
+    g_flip.nbuf = vinfo.yres_virtual / vinfo.yres;
+    g_flip.front = vinfo.yoffset / vinfo.yres;
+    if (g_flip.front >= g_flip.nbuf) g_flip.front = 0;
+    g_flip.have_vsync = 1;
+
+    info = get_mode_info(hdmi_get_mode());
+    g_flip.period_ms = 1000.0 / ((info && info->refresh) ? info->refresh : 60);
+
+    DEBUG("flip: %u page(s) of %u lines, front=%u, period=%.2f ms",
+          g_flip.nbuf, g_flip.yres, g_flip.front, g_flip.period_ms);
+    return (int)g_flip.nbuf;
+}
+
+/*
+ * Show the next page and wait for it to reach the screen. Returns the
+ * page now free for rendering, or -1 on error.
+ */
+static int fb_flip(void)
+{
+    struct fb_var_screeninfo vinfo;
+    uint32_t crtc = 0;
+    uint32_t next;
+
+    if (g_flip.nbuf < 2) {
+        fprintf(stderr, "Framebuffer has a single page (set it up with -b 2 or -b 3)\n");
+        return -1;
+    }
+
+    if (display_lock() < 0) return -1;
+    if (fb_ioctl(FBIOGET_VSCREENINFO, &vinfo) < 0) {
+        perror("FBIOGET_VSCREENINFO failed");
+        display_unlock();
+        return -1;
+    }
+    next = (g_flip.front + 1) % g_flip.nbuf;
+    /* Another process may have resized the buffer since fb_flip_init() */
+    if (vinfo.yres != g_flip.yres || vinfo.yres_virtual < (next + 1) * g_flip.yres) {
+        fprintf(stderr, "Framebuffer changed to %ux%u (virtual %ux%u), stopping flips\n",
+                vinfo.xres, vinfo.yres, vinfo.xres_virtual, vinfo.yres_virtual);
+        display_unlock();
+        return -1;
+    }
+    vinfo.xoffset = 0;
+    vinfo.yoffset = next * g_flip.yres;
+    if (fb_ioctl(FBIOPAN_DISPLAY, &vinfo) < 0) {
+        perror("FBIOPAN_DISPLAY failed");
+        display_unlock();
+        return -1;
+    }
+    display_unlock();
+
+    if (g_flip.have_vsync && fb_ioctl(FBIO_WAITFORVSYNC, &crtc) < 0) {
+        DEBUG("flip: FBIO_WAITFORVSYNC unavailable (errno=%d), not pacing", errno);
+        g_flip.have_vsync = 0;
+    }
+
+    if (g_flip.have_vsync) {
+        if (g_flip.have_last) {
+            double gap = elapsed_ms(&g_flip.last);
+            int frames = (int)(gap / g_flip.period_ms + 0.5);
+            if (frames > 1) g_flip.missed += frames - 1;
+        }
+        clock_gettime(CLOCK_MONOTONIC, &g_flip.last);
+        g_flip.have_last = 1;
+    }
+
+    g_flip.flips++;
+    g_flip.front = next;
+    return (int)((next + g_flip.nbuf - 1) % g_flip.nbuf);
+}
+
+/* flip [count]: flip continuously and report pacing */
+static int flip_run(int argc, char *argv[])
+{
+    struct timespec t0;
+    long count = 1;
+    double ms;
+
+    if (argc >= 1) {
+        count = atol(argv[0]);
+        if (count < 1) {
+            fprintf(stderr, "Invalid flip count: %s\n", argv[0]);
+            return 1;
+        }
+    }
+
+    if (fb_flip_init() < 0) return 1;
+
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    for (long i = 0; i < count; i++) {
+        if (fb_flip() < 0) return 1;
+    }
+    ms = elapsed_ms(&t0);
+
+    printf("Flipped %u time(s) over %u pages in %.1f ms (%.2f ms/flip)\n",
+           g_flip.flips, g_flip.nbuf, ms, ms / g_flip.flips);
+    if (g_flip.have_vsync)
+        printf("Missed vblanks: %u (frame period %.2f ms)\n", g_flip.missed, g_flip.period_ms);
+    else
+        printf("FBIO_WAITFORVSYNC not supported - flips were not vsync-paced\n");
+    printf("Front page: %u\n", g_flip.front);
+    return 0;
+}
+
+/*
+ * ============================================================================
+ * Vblank Timing
+ * ============================================================================
+ *
+ * vsync measure timestamps successive FBIO_WAITFORVSYNC returns with
+ * CLOCK_MONOTONIC. The frame period is the least-squares slope of the
+ * timestamps over the vblank number, where a gap of more than 1.5 periods
+ * counts as missed vblanks, so late wakeups do not bias the rate. Jitter is
+ * the spread of the single-frame intervals around that period. The rate is
+ * compared with the nominal refresh of the current mode (drift in ppm) and
+ * with the nearest broadcast rate: the 1000/1001 variants (23.976 vs 24 Hz)
+ * are 1000 ppm apart, well above pixel clock tolerance, so a window of a few
+ * seconds tells which one the mode switch really produced.
+ */
+#define VSYNC_DEFAULT_S     5
+#define VSYNC_MAX_FRAMES    36000   /* 10 minutes at 60 Hz */
+#define VSYNC_MATCH_PPM     300     /* Default expect= tolerance */
+
+typedef struct {
+    uint32_t    intervals;  /* Vblank intervals timestamped */
+    uint32_t    vblanks;    /* Vblanks spanned, including missed ones */
+    uint32_t    missed;
+    double      window_s;
+    double      period_ms;
+    double      hz;
+    double      stddev_us;  /* Interval jitter */
+    double      p99_us;     /* 99th percentile of |interval - period| */
+    double      max_us;
+    double      nominal_hz; /* 0 if the mode is unknown */
+    double      closest_hz; /* Nearest broadcast rate */
+} vsync_stats_t;
+
+static const double vsync_std_rates[] = {
+    24000.0 / 1001, 24, 25, 30000.0 / 1001, 30, 50, 60000.0 / 1001, 60,
+};
+
+static double vsync_ppm(double hz, double ref)
+{
+    return (hz - ref) / ref * 1e6;
+}
+
+static double vsync_abs(double x)
+{
+    return x < 0 ? -x : x;
+}
+
+/* Newton iteration, so the tool still links without libm */
+static double vsync_sqrt(double x)
+{
+    double r = x > 1 ? x : 1;
+
+    if (x <= 0) return 0;
+    for (int i = 0; i < 64; i++) {
+        double next = (r + x / r) / 2;
+        if (next >= r) break;
+        r = next;
+    }
+    return r;
+}
+
+static int cmp_double(const void *a, const void *b)
+{
+    double da = *(const double *)a, db = *(const double *)b;
+    return (da > db) - (da < db);
+}
+
+/*
+ * Append vblank timestamps (ms) to ts[n..max-1] until ts[n-1] - ts[0]
+ * reaches window_ms. Returns the new count or -1.
+ */
+static int vsync_collect(double *ts, uint32_t n, uint32_t max, double window_ms)
+{
+    struct timespec now;
+    uint32_t crtc = 0;
+
+    while (n < max && !g_stop_requested) {
+        if (fb_ioctl(FBIO_WAITFORVSYNC, &crtc) < 0) {
+            if (errno == EINTR) continue;
+            if (errno == ENOTTY || errno == EINVAL)
+                fprintf(stderr, "FBIO_WAITFORVSYNC not supported by this BSP\n");
+            else
+                perror("FBIO_WAITFORVSYNC failed");
+            return -1;
+        }
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        ts[n++] = now.tv_sec * 1000.0 + now.tv_nsec / 1e6;
+        if (ts[n - 1] - ts[0] >= window_ms) break;
+    }
+    return (int)n;
+}
+
+/* Fill vs from n timestamps; dev needs room for n doubles. Returns -1 if too few. */
+static int vsync_analyse(const double *ts, uint32_t n, double *dev, vsync_stats_t *vs)
+{
+    double med, kmean, tmean, sxy = 0, sxx = 0, sum = 0, sum2 = 0;
+    uint32_t k, nsingle = 0;
+
+    vs->intervals = vs->vblanks = vs->missed = 0;
+    if (n < 3) {
+        fprintf(stderr, "Too few vblanks to measure (%u)\n", n);
+        return -1;
+    }
+
+    for (uint32_t i = 1; i < n; i++) dev[i - 1] = ts[i] - ts[i - 1];
+    qsort(dev, n - 1, sizeof(double), cmp_double);
+    med = dev[(n - 1) / 2];
+    if (med < 1.0) {
+        fprintf(stderr, "FBIO_WAITFORVSYNC returns without waiting (%.3f ms)\n", med);
+        return -1;
+    }
+
+    /* Number each vblank, then fit ts = t0 + k * period */
+    k = 0;
+    kmean = tmean = 0;
+    for (uint32_t i = 1; i < n; i++) {
+        uint32_t steps = (uint32_t)((ts[i] - ts[i - 1]) / med + 0.5);
+        if (steps < 1) steps = 1;
+        vs->missed += steps - 1;
+        k += steps;
+        kmean += k;
+        tmean += ts[i] - ts[0];
+    }
+    kmean /= n;
+    tmean /= n;
+    k = 0;
+    for (uint32_t i = 0; i < n; i++) {
+        if (i > 0) {
+            uint32_t steps = (uint32_t)((ts[i] - ts[i - 1]) / med + 0.5);
+            k += steps < 1 ? 1 : steps;
+        }
+        sxy += (k - kmean) * (ts[i] - ts[0] - tmean);
+        sxx += (k - kmean) * (k - kmean);
+    }
+
+    vs->intervals = n - 1;
+    vs->vblanks = k;
+    vs->window_s = (ts[n - 1] - ts[0]) / 1000.0;
+    vs->period_ms = sxy / sxx;
+    vs->hz = 1000.0 / vs->period_ms;
+
+    /* Jitter over the intervals that did not skip a vblank */
+    for (uint32_t i = 1; i < n; i++) {
+        double d = (ts[i] - ts[i - 1] - vs->period_ms) * 1000.0;
+        if (d > vs->period_ms * 500.0) continue;
+        sum += d;
+        sum2 += d * d;
+        dev[nsingle++] = vsync_abs(d);
+    }
+    vs->stddev_us = vs->p99_us = vs->max_us = 0;
+    if (nsingle > 0) {
+        uint32_t idx = (nsingle * 99 + 99) / 100;
+        double var = sum2 / nsingle - (sum / nsingle) * (sum / nsingle);
+        qsort(dev, nsingle, sizeof(double), cmp_double);
+        vs->stddev_us = var > 0 ? vsync_sqrt(var) : 0;
+        vs->p99_us = dev[idx > 0 ? idx - 1 : 0];
+        vs->max_us = dev[nsingle - 1];
+    }
+
+    vs->closest_hz = vsync_std_rates[0];
+    for (size_t i = 1; i < sizeof(vsync_std_rates) / sizeof(vsync_std_rates[0]); i++) {
+        if (vsync_abs(vsync_ppm(vs->hz, vsync_std_rates[i])) <
+            vsync_abs(vsync_ppm(vs->hz, vs->closest_hz)))
+            vs->closest_hz = vsync_std_rates[i];
+    }
+    return 0;
+}
+
+static void vsync_print_json(FILE *f, const vsync_stats_t *vs, double expect_hz, int ok)
+{
+    fprintf(f, "{\"screen\": %u, \"fb\": %u, \"window_s\": %.3f, \"intervals\": %u, "
+            "\"missed\": %u, \"hz\": %.5f, \"period_ms\": %.5f, ",
+            g_screen, g_fb_index, vs->window_s, vs->intervals, vs->missed,
+            vs->hz, vs->period_ms);
+    if (vs->nominal_hz > 0)
+        fprintf(f, "\"nominal_hz\": %.0f, \"drift_ppm\": %.1f, ", vs->nominal_hz,
+                vsync_ppm(vs->hz, vs->nominal_hz));
+    else
+        fprintf(f, "\"nominal_hz\": null, \"drift_ppm\": null, ");
+    fprintf(f, "\"closest_hz\": %.3f, \"closest_ppm\": %.1f, "
+            "\"jitter_stddev_us\": %.1f, \"jitter_p99_us\": %.1f, \"jitter_max_us\": %.1f",
+            vs->closest_hz, vsync_ppm(vs->hz, vs->closest_hz),
+            vs->stddev_us, vs->p99_us, vs->max_us);
+    if (expect_hz > 0)
+        fprintf(f, ", \"expect_hz\": %.3f, \"expect_ppm\": %.1f, \"expect_ok\": %s",
+                expect_hz, vsync_ppm(vs->hz, expect_hz), ok ? "true" : "false");
+    fprintf(f, "}\n");
+}
+
+/* Replace path with the latest stats, for collectors polling the file */
+static void vsync_export(const char *path, const vsync_stats_t *vs)
+{
+    char tmp[256];
+    FILE *f;
+
+    snprintf(tmp, sizeof(tmp), "%s.%d", path, (int)getpid());
+    f = fopen(tmp, "w");
+    if (!f) {
+        DEBUG("vsync: cannot write %s: %s", tmp, strerror(errno));
+        return;
+    }
+    vsync_print_json(f, vs, 0, 0);
+    if (fclose(f) != 0 || rename(tmp, path) < 0) {
+        DEBUG("vsync: cannot export to %s: %s", path, strerror(errno));
+        unlink(tmp);
+    }
+}
+
+/*
+ * vsync [measure] [-t seconds | -n frames] [-o json] [expect=<Hz>] [ppm=<n>]
+ * vsync watch [-t interval_s] [-o json] [export=<file>]
+ *
+ * measure returns 1 if expect= is given and the rate is further than ppm
+ * (default VSYNC_MATCH_PPM) from it. watch prints one line per interval
+ * until SIGINT/SIGTERM, reusing one buffer and leaving the CPU idle in the
+ * ioctl between vblanks.
+ */
+static int vsync_run(int argc, char *argv[])
+{
+    const mode_info_t *info = NULL;
+    const char *export_path = NULL;
+    double seconds = 0, expect_hz = 0, tol_ppm = VSYNC_MATCH_PPM;
+    long frames = 0;
+    int watch = 0, json = 0, ok = 1, ret = 1, n;
+    double *ts, *dev;
+    uint32_t max;
+    vsync_stats_t vs;
+
+    if (argc >= 1 && (strcmp(argv[0], "measure") == 0 || strcmp(argv[0], "watch") == 0)) {
+        watch = argv[0][0] == 'w';
+        argc--;
+        argv++;
+    }
+    for (int i = 0; i < argc; i++) {
+        if (strcmp(argv[i], "-t") == 0 && i + 1 < argc) {
+            seconds = atof(argv[++i]);
+            if (seconds <= 0) {
+                fprintf(stderr, "Invalid duration: %s\n", argv[i]);
+                return 1;
+            }
+        } else if (strcmp(argv[i], "-n") == 0 && i + 1 < argc && !watch) {
+            frames = atol(argv[++i]);
+            if (frames < 2 || frames >= VSYNC_MAX_FRAMES) {
+                fprintf(stderr, "Invalid frame count: %s (2-%d)\n", argv[i], VSYNC_MAX_FRAMES - 1);
+                return 1;
+            }
+        } else if (strcmp(argv[i], "-o") == 0 && i + 1 < argc) {
+            if (strcmp(argv[++i], "json") != 0) {
+                fprintf(stderr, "Unknown output format: %s (use json)\n", argv[i]);
+                return 1;
+            }
+            json = 1;
+        } else if (strncmp(argv[i], "expect=", 7) == 0 && !watch) {
+            expect_hz = atof(argv[i] + 7);
+            if (expect_hz <= 0) {
+                fprintf(stderr, "Invalid refresh: %s\n", argv[i] + 7);
+                return 1;
+            }
+        } else if (strncmp(argv[i], "ppm=", 4) == 0 && !watch) {
+            tol_ppm = atof(argv[i] + 4);
+        } else if (strncmp(argv[i], "export=", 7) == 0 && watch) {
+            export_path = argv[i] + 7;
+        } else {
+            fprintf(stderr, "Unknown vsync option: %s\n", argv[i]);
+            return 1;
+        }
+    }
+    if (watch && g_in_daemon) {
+        fprintf(stderr, "'vsync watch' runs until stopped, not available in the daemon\n");
+        return 1;
+    }
+    if (seconds == 0) seconds = watch ? 10 : VSYNC_DEFAULT_S;
+
+    max = frames ? (uint32_t)frames + 1 : VSYNC_MAX_FRAMES;
+    ts = malloc(max * sizeof(double));
+    dev = malloc(max * sizeof(double));
+    if (!ts || !dev) {
+        fprintf(stderr, "Out of memory\n");
+        goto out;
+    }
+
+    if (get_output_type() == DISP_OUTPUT_TYPE_HDMI)
+        info = get_mode_info(hdmi_get_mode());
+
+    if (!watch) {
+        n = vsync_collect(ts, 0, max, frames ? 1e12 : seconds * 1000.0);
+        if (n < 0 || vsync_analyse(ts, (uint32_t)n, dev, &vs) < 0) goto out;
+        vs.nominal_hz = info ? info->refresh : 0;
+        if (expect_hz > 0) ok = vsync_abs(vsync_ppm(vs.hz, expect_hz)) <= tol_ppm;
+
+        if (json) {
+            vsync_print_json(stdout, &vs, expect_hz, ok);
+        } else {
+            printf("Vblank timing, fb%u: %u intervals over %.2f s\n",
+                   g_fb_index, vs.intervals, vs.window_s);
+            printf("  Refresh: %.4f Hz (period %.4f ms)\n", vs.hz, vs.period_ms);
+            if (info)
+                printf("  Nominal: %u Hz (%s), drift %+.0f ppm\n", info->refresh,
+                       info->name, vsync_ppm(vs.hz, vs.nominal_hz));
+            printf("  Closest: %.3f Hz (%+.0f ppm)\n", vs.closest_hz,
+                   vsync_ppm(vs.hz, vs.closest_hz));
+            printf("  Jitter:  stddev %.1f us, p99 %.1f us, max %.1f us\n",
+                   vs.stddev_us, vs.p99_us, vs.max_us);
+            printf("  Missed:  %u vblank%s\n", vs.missed, vs.missed == 1 ? "" : "s");
+            if (expect_hz > 0)
+                printf("Expected %.3f Hz: %+.0f ppm (limit %.0f) - %s\n", expect_hz,
+                       vsync_ppm(vs.hz, expect_hz), tol_ppm, ok ? "OK" : "MISMATCH");
+        }
+        ret = ok ? 0 : 1;
+        goto out;
+    }
+
+    install_stop_handlers();
+    if (!json)
+        printf("Measuring vblanks on fb%u every %.0f s%s%s, Ctrl-C to stop\n", g_fb_index,
+               seconds, export_path ? ", exporting to " : "", export_path ? export_path : "");
+    fflush(stdout);
+
+    /* Each window starts at the last vblank of the previous one */
+    n = 0;
+    while (!g_stop_requested) {
+        n = vsync_collect(ts, n ? 1 : 0, max, seconds * 1000.0);
+        if (n < 0) goto out;
+        if (g_stop_requested) break;
+        if (vsync_analyse(ts, (uint32_t)n, dev, &vs) < 0) goto out;
+        vs.nominal_hz = info ? info->refresh : 0;
+
+        if (json) {
+            vsync_print_json(stdout, &vs, 0, 0);
+        } else {
+            printf("%.4f Hz", vs.hz);
+            if (info) printf("  drift %+.0f ppm", vsync_ppm(vs.hz, vs.nominal_hz));
+            printf("  jitter %.1f/%.1f us (stddev/p99)  missed %u\n",
+                   vs.stddev_us, vs.p99_us, vs.missed);
+        }
+        fflush(stdout);
+        if (export_path) vsync_export(export_path, &vs);
+        ts[0] = ts[n - 1];
+    }
+    ret = 0;
+
+out:
+    free(ts);
+    free(dev);
+    return ret;
+}
+
+/*
+ * ============================================================================
+ * Framebuffer Memory Access
+ * ============================================================================
+ *
+ * fb clear / pattern / bwtest write the mmap()ed framebuffer directly.
+ * Scanout memory is often mapped write-combined or uncached, so the
+ * kernels below only issue sequential full-width stores and never read
+ * the mapping back. They also avoid libc memset()/memcpy(): on arm64 those
+ * may use DC ZVA, which faults on non-cacheable memory. The NEON paths are
+ * used when built with NEON (-mfpu=neon on ARMv7, always on arm64).
+ * The portable fallback stores through volatile pointers, so the compiler
+ * cannot turn the loops back into memset().
+ */
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#define FB_HAVE_NEON 1
+#else
+#define FB_HAVE_NEON 0
+#endif
+
+typedef struct {
+    uint8_t                    *base;   /* Start of the whole mapping */
+    size_t                      len;    /* smem_len */
+    struct fb_var_screeninfo    var;
+    struct fb_fix_screeninfo    fix;
+} fb_map_t;
+
+static int fb_map(fb_map_t *m)
+{
+    memset(m, 0, sizeof(*m));
+    if (get_fb_info(&m->var, &m->fix) < 0) {
+        perror("Failed to read framebuffer info");
+        return -1;
+    }
+    if (m->var.bits_per_pixel != 16 && m->var.bits_per_pixel != 24 &&
+        m->var.bits_per_pixel != 32) {
+        fprintf(stderr, "Unsupported framebuffer depth: %u bpp\n", m->var.bits_per_pixel);
+        return -1;
+    }
+
+    m->len = m->fix.smem_len;
+    m->base = mmap(NULL, m->len, PROT_READ | PROT_WRITE, MAP_SHARED, g_fb_fd, 0);
+    if (m->base == MAP_FAILED) {
+        perror("Failed to mmap " FB_DEV);
+        m->base = NULL;
+        return -1;
+    }
+    DEBUG("fb_map: %zu bytes at %p, line_length=%u, %ux%u (virtual %ux%u) @ %u bpp",
+          m->len, (void *)m->base, m->fix.line_length, m->var.xres, m->var.yres,
+          m->var.xres_virtual, m->var.yres_virtual, m->var.bits_per_pixel);
+    return 0;
+}
+
+static void fb_unmap(fb_map_t *m)
+{
+    if (m->base) munmap(m->base, m->len);
+    m->base = NULL;
+}
+
+/* First line of the page currently panned to, clipped to the mapping */
+static uint8_t *fb_map_page(const fb_map_t *m, uint32_t *lines)
+{
+    size_t off = (size_t)m->var.yoffset * m->fix.line_length;
+    size_t avail = (off < m->len) ? (m->len - off) / m->fix.line_length : 0;
+
+    *lines = m->var.yres < avail ? m->var.yres : (uint32_t)avail;
+    return m->base + off;
+}
+
+/* Pack 8-bit RGB using the channel layout fbdev reports */
+static uint32_t fb_pack_rgb(const struct fb_var_screeninfo *v, uint8_t r, uint8_t g, uint8_t b)
+{
+    uint32_t px = 0;
+
+    if (v->red.length)   px |= (uint32_t)(r >> (8 - v->red.length)) << v->red.offset;
+    if (v->green.length) px |= (uint32_t)(g >> (8 - v->green.length)) << v->green.offset;
+    if (v->blue.length)  px |= (uint32_t)(b >> (8 - v->blue.length)) << v->blue.offset;
+    if (v->transp.length)
+        px |= (uint32_t)(0xff >> (8 - v->transp.length)) << v->transp.offset;
+    return px;
+}
+
+/* Fill npix pixels of one line with a packed pixel value */
+static void fb_fill_row(uint8_t *dst, uint32_t npix, uint32_t px, uint32_t bpp)
+{
+    uint32_t i = 0;
+
+    if (bpp == 32) {
+        volatile uint32_t *d = (volatile uint32_t *)dst;
+#if FB_HAVE_NEON
+        uint32x4_t v = vdupq_n_u32(px);
+        while (i < npix && ((uintptr_t)&d[i] & 15)) d[i++] = px;
+        for (; i + 16 <= npix; i += 16) {
+            vst1q_u32((uint32_t *)&d[i], v);
+            vst1q_u32((uint32_t *)&d[i + 4], v);
+            vst1q_u32((uint32_t *)&d[i + 8], v);
+            vst1q_u32((uint32_t *)&d[i + 12], v);
+        }
+        for (; i + 4 <= npix; i += 4) vst1q_u32((uint32_t *)&d[i], v);
+#else
+        uint64_t p2 = ((uint64_t)px << 32) | px;
+        if (i < npix && ((uintptr_t)&d[i] & 7)) d[i++] = px;
+        for (; i + 2 <= npix; i += 2) *(volatile uint64_t *)&d[i] = p2;
+#endif
+        for (; i < npix; i++) d[i] = px;
+    } else if (bpp == 16) {
+        volatile uint16_t *d = (volatile uint16_t *)dst;
+        uint16_t p = (uint16_t)px;
+#if FB_HAVE_NEON
+        uint16x8_t v = vdupq_n_u16(p);
+        while (i < npix && ((uintptr_t)&d[i] & 15)) d[i++] = p;
+        for (; i + 32 <= npix; i += 32) {
+            vst1q_u16((uint16_t *)&d[i], v);
+            vst1q_u16((uint16_t *)&d[i + 8], v);
+            vst1q_u16((uint16_t *)&d[i + 16], v);
+            vst1q_u16((uint16_t *)&d[i + 24], v);
+        }
+        for (; i + 8 <= npix; i += 8) vst1q_u16((uint16_t *)&d[i], v);
+#else
+        uint64_t p4 = p * 0x0001000100010001ULL;
+        while (i < npix && ((uintptr_t)&d[i] & 7)) d[i++] = p;
+        for (; i + 4 <= npix; i += 4) *(volatile uint64_t *)&d[i] = p4;
+#endif
+        for (; i < npix; i++) d[i] = p;
+    } else {
+        volatile uint8_t *d = dst;
+        uint8_t c0 = px & 0xff, c1 = (px >> 8) & 0xff, c2 = (px >> 16) & 0xff;
+#if FB_HAVE_NEON
+        uint8x16x3_t v;
+        v.val[0] = vdupq_n_u8(c0);
+        v.val[1] = vdupq_n_u8(c1);
+        v.val[2] = vdupq_n_u8(c2);
+        for (; i + 16 <= npix; i += 16) vst3q_u8((uint8_t *)&d[i * 3], v);
+#endif
+        for (; i < npix; i++) {
+            d[i * 3] = c0;
+            d[i * 3 + 1] = c1;
+            d[i * 3 + 2] = c2;
+        }
+    }
+}
+
+/* Copy one line from normal memory into the mapping */
+static void fb_copy_row(uint8_t *dst, const uint8_t *src, size_t bytes)
+{
+    volatile uint8_t *d = dst;
+    size_t i = 0;
+
+#if FB_HAVE_NEON
+    while (i < bytes && ((uintptr_t)&d[i] & 15)) { d[i] = src[i]; i++; }
+    for (; i + 64 <= bytes; i += 64) {
+        uint8x16_t a = vld1q_u8(src + i), b = vld1q_u8(src + i + 16);
+        uint8x16_t c = vld1q_u8(src + i + 32), e = vld1q_u8(src + i + 48);
+        vst1q_u8((uint8_t *)&d[i], a);
+        vst1q_u8((uint8_t *)&d[i + 16], b);
+        vst1q_u8((uint8_t *)&d[i + 32], c);
+        vst1q_u8((uint8_t *)&d[i + 48], e);
+    }
+    for (; i + 16 <= bytes; i += 16) vst1q_u8((uint8_t *)&d[i], vld1q_u8(src + i));
+#else
+    while (i < bytes && ((uintptr_t)&d[i] & 7)) { d[i] = src[i]; i++; }
+    for (; i + 8 <= bytes; i += 8) {
+        uint64_t t;
+        memcpy(&t, src + i, sizeof(t));
+        *(volatile uint64_t *)&d[i] = t;
+    }
+#endif
+    for (; i < bytes; i++) d[i] = src[i];
+}
+
+/* Read a region back (for the bandwidth probe); returns a checksum */
+static uint32_t fb_read_region(const uint8_t *src, size_t bytes)
+{
+    size_t i = 0;
+    uint32_t sum = 0;
+
+#if FB_HAVE_NEON
+    uint32x4_t acc = vdupq_n_u32(0);
+    for (; i + 64 <= bytes; i += 64) {
+        acc = veorq_u32(acc, vld1q_u32((const uint32_t *)(src + i)));
+        acc = veorq_u32(acc, vld1q_u32((const uint32_t *)(src + i + 16)));
+        acc = veorq_u32(acc, vld1q_u32((const uint32_t *)(src + i + 32)));
+        acc = veorq_u32(acc, vld1q_u32((const uint32_t *)(src + i + 48)));
+    }
+    sum = vgetq_lane_u32(acc, 0) ^ vgetq_lane_u32(acc, 1) ^
+          vgetq_lane_u32(acc, 2) ^ vgetq_lane_u32(acc, 3);
+#else
+    for (; i + 8 <= bytes; i += 8) {
+        uint64_t t = *(const volatile uint64_t *)(src + i);
+        sum ^= (uint32_t)t ^ (uint32_t)(t >> 32);
+    }
+#endif
+    for (; i < bytes; i++) sum ^= ((const volatile uint8_t *)src)[i];
+    return sum;
+}
+
+/* Write one line's worth of pixels into a row template in normal memory */
+static void fb_row_put(uint8_t *row, uint32_t x, uint32_t px, uint32_t bpp)
+{
+    switch (bpp) {
+        case 32: ((uint32_t *)row)[x] = px; break;
+        case 16: ((uint16_t *)row)[x] = (uint16_t)px; break;
+        default:
+            row[x * 3] = px & 0xff;
+            row[x * 3 + 1] = (px >> 8) & 0xff;
+            row[x * 3 + 2] = (px >> 16) & 0xff;
+            break;
+    }
+}
+
+static int parse_color(const char *str, uint8_t *r, uint8_t *g, uint8_t *b)
+{
+    char *end;
+    unsigned long v = strtoul(str, &end, 16);
+
+    if (*str == '\0' || *end != '\0' || v > 0xffffff) {
+        fprintf(stderr, "Invalid color: %s (use RRGGBB hex)\n", str);
+        return -1;
+    }
+    *r = (v >> 16) & 0xff;
+    *g = (v >> 8) & 0xff;
+    *b = v & 0xff;
+    return 0;
+}
+
+/* fb clear [RRGGBB]: fill every page of the virtual framebuffer */
+static int fb_clear(int argc, char *argv[])
+{
+    fb_map_t m;
+    struct timespec t0;
+    uint8_t r = 0, g = 0, b = 0;
+    uint32_t px, lines;
+    double ms;
+
+    if (argc >= 1 && parse_color(argv[0], &r, &g, &b) < 0) return 1;
+    if (fb_map(&m) < 0) return 1;
+
+    px = fb_pack_rgb(&m.var, r, g, b);
+    lines = (uint32_t)(m.len / m.fix.line_length);
+    if (lines > m.var.yres_virtual) lines = m.var.yres_virtual;
+
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    for (uint32_t y = 0; y < lines; y++)
+        fb_fill_row(m.base + (size_t)y * m.fix.line_length, m.var.xres_virtual,
+                    px, m.var.bits_per_pixel);
+    ms = elapsed_ms(&t0);
+
+    printf("Cleared %u lines to %02x%02x%02x in %.2f ms (%.0f MB/s)\n", lines, r, g, b, ms,
+           ms > 0 ? (double)lines * m.fix.line_length / (ms * 1e3) : 0);
+    fb_unmap(&m);
+    return 0;
+}
+
+/* fb pattern bars|gradient|checker: draw into the visible page */
+static int fb_pattern(int argc, char *argv[])
+{
+    static const uint8_t bars[8][3] = {     /* 75% color bars */
+        { 191, 191, 191 }, { 191, 191, 0 }, { 0, 191, 191 }, { 0, 191, 0 },
+        { 191, 0, 191 }, { 191, 0, 0 }, { 0, 0, 191 }, { 0, 0, 0 }
+    };
+    const uint32_t cell = 32;
+    fb_map_t m;
+    struct timespec t0;
+    uint8_t *page, *row[2];
+    uint32_t lines, w, bpp;
+    size_t row_bytes;
+    int kind;
+    double ms;
+
+    if (argc < 1) {
+        fprintf(stderr, "Usage: fb pattern bars|gradient|checker\n");
+        return 1;
+    }
+    if (strcmp(argv[0], "bars") == 0) kind = 0;
+    else if (strcmp(argv[0], "gradient") == 0) kind = 1;
+    else if (strcmp(argv[0], "checker") == 0) kind = 2;
+    else {
+        fprintf(stderr, "Unknown pattern: %s (use bars, gradient or checker)\n", argv[0]);
+        return 1;
+    }
+
+    if (fb_map(&m) < 0) return 1;
+    page = fb_map_page(&m, &lines);
+    w = m.var.xres;
+    bpp = m.var.bits_per_pixel;
+    row_bytes = (size_t)w * (bpp / 8);
+
+    /* Patterns are built as row templates in RAM, then streamed out */
+    row[0] = malloc(row_bytes);
+    row[1] = malloc(row_bytes);
+    if (!row[0] || !row[1]) {
+        perror("malloc");
+        free(row[0]);
+        free(row[1]);
+        fb_unmap(&m);
+        return 1;
+    }
+    for (uint32_t x = 0; x < w; x++) {
+        uint32_t p0, p1;
+        if (kind == 0) {
+            const uint8_t *c = bars[x * 8 / w];
+            p0 = p1 = fb_pack_rgb(&m.var, c[0], c[1], c[2]);
+        } else if (kind == 1) {
+            uint8_t v = (uint8_t)(w > 1 ? x * 255 / (w - 1) : 0);
+            p0 = p1 = fb_pack_rgb(&m.var, v, v, v);
+        } else {
+            int odd = (x / cell) & 1;
+            p0 = fb_pack_rgb(&m.var, odd ? 0 : 255, odd ? 0 : 255, odd ? 0 : 255);
+            p1 = fb_pack_rgb(&m.var, odd ? 255 : 0, odd ? 255 : 0, odd ? 255 : 0);
+        }
+        fb_row_put(row[0], x, p0, bpp);
+        fb_row_put(row[1], x, p1, bpp);
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    for (uint32_t y = 0; y < lines; y++) {
+        const uint8_t *src = row[(kind == 2) ? (y / cell) & 1 : 0];
+        fb_copy_row(page + (size_t)y * m.fix.line_length, src, row_bytes);
+    }
+    ms = elapsed_ms(&t0);
+
+    printf("Pattern '%s' drawn at %ux%u @ %u bpp (page y=%u) in %.2f ms (%.0f MB/s)\n",
+           argv[0], w, lines, bpp, m.var.yoffset, ms,
+           ms > 0 ? (double)row_bytes * lines / (ms * 1e3) : 0);
+
+    free(row[0]);
+    free(row[1]);
+    fb_unmap(&m);
+    return 0;
+}
+
+/* fb bwtest [passes]: fill, copy and read bandwidth on the visible page */
+static int fb_bwtest(int argc, char *argv[])
+{
+    fb_map_t m;
+    struct timespec t0;
+    uint8_t *page, *src;
+    uint32_t lines, px, sum = 0;
+    size_t row_bytes, total;
+    int passes = 20;
+    double fill_ms, copy_ms, read_ms;
+
+    if (argc >= 1) {
+        passes = atoi(argv[0]);
+        if (passes < 1) {
+            fprintf(stderr, "Invalid pass count: %s\n", argv[0]);
+            return 1;
+        }
+    }
+
+    if (fb_map(&m) < 0) return 1;
+    page = fb_map_page(&m, &lines);
+    row_bytes = (size_t)m.var.xres * (m.var.bits_per_pixel / 8);
+    total = row_bytes * lines * (size_t)passes;
+
+    src = malloc(row_bytes);
+    if (!src) {
+        perror("malloc");
+        fb_unmap(&m);
+        return 1;
+    }
+    for (size_t i = 0; i < row_bytes; i++) src[i] = (uint8_t)(i * 7);
+    px = fb_pack_rgb(&m.var, 0, 0, 0);
+
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    for (int p = 0; p < passes; p++)
+        for (uint32_t y = 0; y < lines; y++)
+            fb_fill_row(page + (size_t)y * m.fix.line_length, m.var.xres, px,
+                        m.var.bits_per_pixel);
+    fill_ms = elapsed_ms(&t0);
+
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    for (int p = 0; p < passes; p++)
+        for (uint32_t y = 0; y < lines; y++)
+            fb_copy_row(page + (size_t)y * m.fix.line_length, src, row_bytes);
+    copy_ms = elapsed_ms(&t0);
+
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    for (int p = 0; p < passes; p++)
+        for (uint32_t y = 0; y < lines; y++)
+            sum ^= fb_read_region(page + (size_t)y * m.fix.line_length, row_bytes);
+    read_ms = elapsed_ms(&t0);
+
+    /* Leave the page black rather than a copy pattern */
+    for (uint32_t y = 0; y < lines; y++)
+        fb_fill_row(page + (size_t)y * m.fix.line_length, m.var.xres, px, m.var.bits_per_pixel);
+
+    printf("Framebuffer bandwidth: %ux%u @ %u bpp, %d pass%s, %s kernels\n",
+           m.var.xres, lines, m.var.bits_per_pixel, passes, passes == 1 ? "" : "es",
+           FB_HAVE_NEON ? "NEON" : "scalar");
+    printf("  fill:  %8.1f MB/s\n", fill_ms > 0 ? total / (fill_ms * 1e3) : 0);
+    printf("  copy:  %8.1f MB/s (RAM -> FB)\n", copy_ms > 0 ? total / (copy_ms * 1e3) : 0);
+    printf("  read:  %8.1f MB/s (FB -> CPU)\n", read_ms > 0 ? total / (read_ms * 1e3) : 0);
+    DEBUG("bwtest: checksum 0x%08x", sum);
+
+    free(src);
+    fb_unmap(&m);
+    return 0;
+}
+
+/*
+ * fb load: the source file is mmap()ed and each row is converted straight
+ * into scanout memory. Supported sources are binary PPM (P6, RGB), BMP
+ * (uncompressed 24/32 bpp, BGR; the 4th byte of 32 bpp is reserved, so
+ * alpha is set opaque) and raw frames in the framebuffer's own layout
+ * (geometry given as WxHxDEPTH). When the framebuffer uses the layout
+ * fb_configure() programs (RGB565 / (A)RGB8888), rows go through NEON
+ * kernels. Other channel layouts are packed per pixel with fb_pack_rgb().
+ */
+static int parse_resolution_depth(const char *str, uint32_t *width, uint32_t *height, int *depth);
+static int check_depth(int depth);
+
+enum { IMG_BGR24, IMG_BGRA32, IMG_RGB24, IMG_RGB565, IMG_BGRX32 };
+
+typedef struct {
+    const uint8_t  *map;        /* Whole file mapping */
+    size_t          map_len;
+    const uint8_t  *data;       /* First stored row */
+    uint32_t        width;
+    uint32_t        height;
+    size_t          stride;
+    int             bottom_up;  /* BMP rows are stored last-first */
+    int             fmt;
+    const char     *kind;
+} img_src_t;
+
+static const uint32_t img_bytes[] = { 3, 4, 3, 2, 4 };
+
+static uint32_t le32(const uint8_t *p) { return p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24; }
+static uint16_t le16(const uint8_t *p) { return (uint16_t)(p[0] | p[1] << 8); }
+
+/* Next whitespace-separated PPM header number, skipping '#' comments */
+static int ppm_number(const uint8_t *b, size_t len, size_t *pos, uint32_t *out)
+{
+    uint32_t v = 0;
+    int digits = 0;
+
+    while (*pos < len) {
+        if (b[*pos] == '#') {
+            while (*pos < len && b[*pos] != '\n') (*pos)++;
+        } else if (b[*pos] == ' ' || b[*pos] == '\t' || b[*pos] == '\n' || b[*pos] == '\r') {
+            (*pos)++;
+        } else {
+            break;
+        }
+    }
+    while (*pos < len && b[*pos] >= '0' && b[*pos] <= '9' && digits < 9) {
+        v = v * 10 + (b[(*pos)++] - '0');
+        digits++;
+    }
+    *out = v;
+    return digits ? 0 : -1;
+}
+
+/* Larger than any DE layer; keeps stride * height within size_t on 32-bit */
+#define IMG_MAX_DIM     8192
+
+static int img_parse(img_src_t *img, const char *geometry)
+{
+    const uint8_t *b = img->map;
+    size_t len = img->map_len;
+    size_t off, align = 1;          /* Row alignment in bytes */
+
+    if (len >= 2 && b[0] == 'P' && b[1] == '6') {
+        size_t pos = 2;
+        uint32_t maxval;
+        if (ppm_number(b, len, &pos, &img->width) < 0 ||
+            ppm_number(b, len, &pos, &img->height) < 0 ||
+            ppm_number(b, len, &pos, &maxval) < 0 || maxval != 255) {
+            fprintf(stderr, "Unsupported PPM header (need P6 with maxval 255)\n");
+            return -1;
+        }
+        pos++;  /* Single whitespace before the raster */
+        img->kind = "PPM";
+        img->fmt = IMG_RGB24;
+        off = pos;
+    } else if (len >= 54 && b[0] == 'B' && b[1] == 'M') {
+        int32_t h = (int32_t)le32(b + 22);
+        uint16_t bpp = le16(b + 28);
+        uint32_t compression = le32(b + 30);
+
+        if ((bpp != 24 && bpp != 32) || !(compression == 0 || (bpp == 32 && compression == 3))) {
+            fprintf(stderr, "Unsupported BMP (need uncompressed 24 or 32 bpp)\n");
+            return -1;
+        }
+        /* BI_BITFIELDS: only the masks of plain BGRX are supported */
+        if (compression == 3 && (len < 66 || le32(b + 54) != 0x00ff0000 ||
+                                 le32(b + 58) != 0x0000ff00 || le32(b + 62) != 0x000000ff)) {
+            fprintf(stderr, "Unsupported BMP channel masks (need BGRX 8888)\n");
+            return -1;
+        }
+        img->kind = "BMP";
+        img->fmt = (bpp == 32) ? IMG_BGRX32 : IMG_BGR24;
+        img->width = le32(b + 18);
+        img->height = (uint32_t)(h < 0 ? -h : h);
+        img->bottom_up = h > 0;
+        off = le32(b + 10);
+        align = 4;
+    } else {
+        int depth;
+        if (!geometry || parse_resolution_depth(geometry, &img->width, &img->height, &depth) < 0 ||
+            check_depth(depth) < 0) {
+            fprintf(stderr, "Raw frames need their geometry: fb load <file> <W>x<H>x<depth>\n");
+            return -1;
+        }
+        img->kind = "raw";
+        img->fmt = (depth == 32) ? IMG_BGRA32 : (depth == 24) ? IMG_BGR24 : IMG_RGB565;
+        off = 0;
+    }
+
+    /* Header values are untrusted: bound them before any size arithmetic */
+    if (img->width == 0 || img->height == 0 ||
+        img->width > IMG_MAX_DIM || img->height > IMG_MAX_DIM) {
+        fprintf(stderr, "Unsupported image size %ux%u (%s, max %ux%u)\n",
+                img->width, img->height, img->kind, IMG_MAX_DIM, IMG_MAX_DIM);
+        return -1;
+    }
+    img->stride = ((size_t)img->width * img_bytes[img->fmt] + align - 1) / align * align;
+    if (off > len || img->height > (len - off) / img->stride) {
+        fprintf(stderr, "Image data truncated (%ux%u %s, %zu bytes)\n",
+                img->width, img->height, img->kind, len);
+        return -1;
+    }
+    img->data = b + off;
+    return 0;
+}
+
+/* True if fbdev uses the channel layout fb_configure() sets up */
+static int fb_std_layout(const struct fb_var_screeninfo *v)
+{
+    if (v->bits_per_pixel == 16)
+        return v->red.offset == 11 && v->red.length == 5 && v->green.offset == 5 &&
+               v->green.length == 6 && v->blue.offset == 0 && v->blue.length == 5;
+    return v->red.offset == 16 && v->red.length == 8 && v->green.offset == 8 &&
+           v->green.length == 8 && v->blue.offset == 0 && v->blue.length == 8;
+}
+
+static void img_read_px(const uint8_t *s, int fmt, uint8_t *r, uint8_t *g, uint8_t *b)
+{
+    switch (fmt) {
+        case IMG_RGB24: *r = s[0]; *g = s[1]; *b = s[2]; break;
+        case IMG_RGB565: {
+            uint16_t v = le16(s);
+            uint8_t r5 = v >> 11, g6 = (v >> 5) & 0x3f, b5 = v & 0x1f;
+            *r = (uint8_t)(r5 << 3 | r5 >> 2);
+            *g = (uint8_t)(g6 << 2 | g6 >> 4);
+            *b = (uint8_t)(b5 << 3 | b5 >> 2);
+            break;
+        }
+        default: *b = s[0]; *g = s[1]; *r = s[2]; break;
+    }
+}
+
+/*
+ * Convert npix source pixels into one framebuffer line. tmp is a RAM row of
+ * at least npix * 4 bytes, used for the scalar tail.
+ */
+static void fb_convert_row(uint8_t *dst, const struct fb_var_screeninfo *v, int std,
+                           const uint8_t *src, int fmt, uint32_t npix, uint8_t *tmp)
+{
+    uint32_t dbytes = v->bits_per_pixel / 8;
+    uint32_t sbytes = img_bytes[fmt];
+    uint32_t i = 0;
+
+    /* Same layout on both sides: plain row copy */
+    if (std && ((fmt == IMG_BGRA32 && dbytes == 4) || (fmt == IMG_BGR24 && dbytes == 3) ||
+                (fmt == IMG_RGB565 && dbytes == 2))) {
+        fb_copy_row(dst, src, (size_t)npix * dbytes);
+        return;
+    }
+
+#if FB_HAVE_NEON
+    if (std && fmt != IMG_RGB565) {
+        for (; i + 16 <= npix; i += 16) {
+            uint8x16_t r, g, b;
+            if (sbytes == 4) {
+                uint8x16x4_t p = vld4q_u8(src + i * 4);
+                b = p.val[0]; g = p.val[1]; r = p.val[2];
+            } else {
+                uint8x16x3_t p = vld3q_u8(src + i * 3);
+                g = p.val[1];
+                r = (fmt == IMG_RGB24) ? p.val[0] : p.val[2];
+                b = (fmt == IMG_RGB24) ? p.val[2] : p.val[0];
+            }
+
+            if (dbytes == 4) {
+                uint8x16x4_t o;
+                o.val[0] = b; o.val[1] = g; o.val[2] = r; o.val[3] = vdupq_n_u8(0xff);
+                vst4q_u8(dst + i * 4, o);
+            } else if (dbytes == 3) {
+                uint8x16x3_t o;
+                o.val[0] = b; o.val[1] = g; o.val[2] = r;
+                vst3q_u8(dst + i * 3, o);
+            } else {
+                /* RGB565: r in the top 5 bits, then g 6, then b 5 */
+                uint16x8_t lo = vshll_n_u8(vget_low_u8(r), 8);
+                uint16x8_t hi = vshll_n_u8(vget_high_u8(r), 8);
+                lo = vsriq_n_u16(lo, vshll_n_u8(vget_low_u8(g), 8), 5);
+                hi = vsriq_n_u16(hi, vshll_n_u8(vget_high_u8(g), 8), 5);
+                lo = vsriq_n_u16(lo, vshll_n_u8(vget_low_u8(b), 8), 11);
+                hi = vsriq_n_u16(hi, vshll_n_u8(vget_high_u8(b), 8), 11);
+                vst1q_u16((uint16_t *)(dst + i * 2), lo);
+                vst1q_u16((uint16_t *)(dst + i * 2 + 16), hi);
+            }
+        }
+    }
+#endif
+
+    /* Scalar remainder, staged in RAM and streamed out */
+    for (uint32_t x = i; x < npix; x++) {
+        uint8_t r, g, b;
+        img_read_px(src + (size_t)x * sbytes, fmt, &r, &g, &b);
+        fb_row_put(tmp, x - i, fb_pack_rgb(v, r, g, b), v->bits_per_pixel);
+    }
+    if (i < npix)
+        fb_copy_row(dst + (size_t)i * dbytes, tmp, (size_t)(npix - i) * dbytes);
+}
+
+/* fb load <file> [WxHxDEPTH] [back] [flip] */
+static int fb_load(int argc, char *argv[])
+{
+    const char *path, *geometry = NULL;
+    img_src_t img;
+    fb_map_t m;
+    struct stat st;
+    struct timespec t0;
+    uint32_t nbuf, page, ox, oy, dx, dy, w, h;
+    uint8_t *dst, *tmp;
+    int back = 0, flip = 0, std, fd;
+    double ms;
+
+    if (argc < 1) {
+        fprintf(stderr, "Usage: fb load <file> [WxHxDEPTH] [back] [flip]\n");
+        return 1;
+    }
+    path = argv[0];
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "back") == 0) back = 1;
+        else if (strcmp(argv[i], "flip") == 0) back = flip = 1;
+        else geometry = argv[i];
+    }
+
+    memset(&img, 0, sizeof(img));
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0 || fstat(fd, &st) < 0 || st.st_size == 0) {
+        fprintf(stderr, "Cannot read %s: %s\n", path, fd < 0 ? strerror(errno) : "empty file");
+        if (fd >= 0) close(fd);
+        return 1;
+    }
+    img.map_len = (size_t)st.st_size;
+    img.map = mmap(NULL, img.map_len, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (img.map == MAP_FAILED) {
+        perror("Failed to mmap image");
+        return 1;
+    }
+    if (img_parse(&img, geometry) < 0) {
+        munmap((void *)img.map, img.map_len);
+        return 1;
+    }
+
+    if (fb_map(&m) < 0) {
+        munmap((void *)img.map, img.map_len);
+        return 1;
+    }
+
+    /* Target page: the one panned to, or the next one for back-buffer staging */
+    nbuf = m.var.yres ? m.var.yres_virtual / m.var.yres : 1;
+    page = m.var.yres ? m.var.yoffset / m.var.yres : 0;
+    if (back) {
+        if (nbuf < 2) {
+            fprintf(stderr, "No back buffer (set the framebuffer up with -b 2 or -b 3)\n");
+            fb_unmap(&m);
+            munmap((void *)img.map, img.map_len);
+            return 1;
+        }
+        page = (page + 1) % nbuf;
+    }
+    if ((size_t)(page + 1) * m.var.yres * m.fix.line_length > m.len) page = 0;
+
+    /* Centre the image, cropping whatever does not fit */
+    w = img.width < m.var.xres ? img.width : m.var.xres;
+    h = img.height < m.var.yres ? img.height : m.var.yres;
+    ox = (img.width - w) / 2;
+    oy = (img.height - h) / 2;
+    dx = (m.var.xres - w) / 2;
+    dy = (m.var.yres - h) / 2;
+    std = fb_std_layout(&m.var);
+
+    tmp = malloc((size_t)w * 4);
+    if (!tmp) {
+        perror("malloc");
+        fb_unmap(&m);
+        munmap((void *)img.map, img.map_len);
+        return 1;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    dst = m.base + ((size_t)page * m.var.yres + dy) * m.fix.line_length +
+          (size_t)dx * (m.var.bits_per_pixel / 8);
+    for (uint32_t y = 0; y < h; y++) {
+        uint32_t sy = oy + y;
+        const uint8_t *src = img.data +
+            (size_t)(img.bottom_up ? img.height - 1 - sy : sy) * img.stride +
+            (size_t)ox * img_bytes[img.fmt];
+        fb_convert_row(dst + (size_t)y * m.fix.line_length, &m.var, std, src, img.fmt, w, tmp);
+    }
+    ms = elapsed_ms(&t0);
+
+    printf("Loaded %s %ux%u into page %u at %u,%u (%ux%u @ %u bpp) in %.2f ms\n",
+           img.kind, img.width, img.height, page, dx, dy, w, h, m.var.bits_per_pixel, ms);
+
+    free(tmp);
+    fb_unmap(&m);
+    munmap((void *)img.map, img.map_len);
+
+    if (flip) {
+        if (fb_flip_init() < 0 || fb_flip() < 0) return 1;
+        printf("Flipped to page %u\n", g_flip.front);
+    }
+    return 0;
+}
+
+/*
+ * ============================================================================
+ * Framebuffer Capture
+ * ============================================================================
+ *
+ * fb capture reads the page currently panned to (yoffset from
+ * FBIOGET_VSCREENINFO) through the mapping instead of read() on /dev/fb0.
+ * Full-size raw frames are handed to writev() straight from the mapping,
+ * one iovec per line, so the CPU never touches the pixels. PPM output and
+ * thumbnails copy lines into RAM with burst (NEON) loads, the only access
+ * pattern that is tolerable on uncached scanout memory, and convert there.
+ * A thumbnail reads two source lines per output line and averages 2x2
+ * pixels, so its cost follows the thumbnail height, not the screen's.
+ *
+ * --stream polls at most fps times per second. A poll hashes one line in
+ * every CAPTURE_SAMPLE_STEP (sample=), starting at a line that rotates with
+ * each poll, and compares the hash with the previous poll of the same
+ * phase. A frame is rendered and sent only when a hash, the page panned to
+ * or the geometry changed: an idle screen costs 1/16 of a frame read per
+ * poll, and every line is looked at within 16 polls. Sending a frame
+ * re-hashes all phases (one more frame read), so each change is sent once.
+ */
+#define CAPTURE_SAMPLE_STEP 16
+#define CAPTURE_MAX_STEP    64
+#define CAPTURE_IOV         64      /* Lines per writev() */
+
+enum { CAPTURE_PPM, CAPTURE_RAW };
+
+typedef struct {
+    fb_map_t    m;
+    int         fd;         /* Output */
+    int         format;
+    int         std;        /* fb_std_layout() */
+    uint32_t    tw, th;     /* Thumbnail size as requested, 0 = full size */
+    uint32_t    ow, oh;     /* Output frame size */
+    uint32_t    step;       /* Stream: hash one line in step */
+    uint32_t    phase;
+    uint64_t    seen;       /* Phases with a stored hash */
+    uint32_t    sums[CAPTURE_MAX_STEP];
+    uint32_t    yoffset;    /* Page of the last frame sent */
+    uint8_t    *rows;       /* Two source lines, in RAM */
+    uint8_t    *rgb;        /* The same as RGB24 */
+    uint8_t    *out;        /* RGB24 output frame; NULL for full-size raw */
+} capture_t;
+
+/* Copy one line out of the mapping into normal memory */
+static void fb_read_row(uint8_t *dst, const uint8_t *src, size_t bytes)
+{
+    const volatile uint8_t *s = src;
+    size_t i = 0;
+
+#if FB_HAVE_NEON
+    while (i < bytes && ((uintptr_t)&s[i] & 15)) { dst[i] = s[i]; i++; }
+    for (; i + 64 <= bytes; i += 64) {
+        uint8x16_t a = vld1q_u8((const uint8_t *)&s[i]);
+        uint8x16_t b = vld1q_u8((const uint8_t *)&s[i + 16]);
+        uint8x16_t c = vld1q_u8((const uint8_t *)&s[i + 32]);
+        uint8x16_t e = vld1q_u8((const uint8_t *)&s[i + 48]);
+        vst1q_u8(dst + i, a);
+        vst1q_u8(dst + i + 16, b);
+        vst1q_u8(dst + i + 32, c);
+        vst1q_u8(dst + i + 48, e);
+    }
+    for (; i + 16 <= bytes; i += 16) vst1q_u8(dst + i, vld1q_u8((const uint8_t *)&s[i]));
+#else
+    while (i < bytes && ((uintptr_t)&s[i] & 7)) { dst[i] = s[i]; i++; }
+    for (; i + 8 <= bytes; i += 8) {
+        uint64_t t = *(const volatile uint64_t *)&s[i];
+        memcpy(dst + i, &t, sizeof(t));
+    }
+#endif
+    for (; i < bytes; i++) dst[i] = s[i];
+}
+
+/* Expand one channel of a packed pixel to 8 bits */
+static uint8_t fb_unpack_channel(uint32_t px, const struct fb_bitfield *f)
+{
+    uint32_t c;
+    uint8_t v;
+
+    if (!f->length) return 0;
+    c = (px >> f->offset) & ((1u << f->length) - 1);
+    if (f->length >= 8) return (uint8_t)(c >> (f->length - 8));
+    v = (uint8_t)(c << (8 - f->length));
+    if (f->length >= 4) v |= (uint8_t)(c >> (2 * f->length - 8));
+    return v;
+}
+
+/* Convert npix pixels of a line in RAM to RGB24 */
+static void fb_row_to_rgb(uint8_t *dst, const uint8_t *src, const struct fb_var_screeninfo *v,
+                          int std, uint32_t npix)
+{
+    uint32_t bpp = v->bits_per_pixel;
+    uint32_t i = 0;
+
+#if FB_HAVE_NEON
+    if (std && bpp == 32) {
+        for (; i + 16 <= npix; i += 16) {
+            uint8x16x4_t p = vld4q_u8(src + i * 4);
+            uint8x16x3_t o;
+            o.val[0] = p.val[2]; o.val[1] = p.val[1]; o.val[2] = p.val[0];
+            vst3q_u8(dst + i * 3, o);
+        }
+    } else if (std && bpp == 24) {
+        for (; i + 16 <= npix; i += 16) {
+            uint8x16x3_t p = vld3q_u8(src + i * 3);
+            uint8x16_t t = p.val[0];
+            p.val[0] = p.val[2];
+            p.val[2] = t;
+            vst3q_u8(dst + i * 3, p);
+        }
+    }
+#else
+    (void)std;
+#endif
+
+    for (; i < npix; i++) {
+        uint32_t px;
+        switch (bpp) {
+            case 32: memcpy(&px, src + i * 4, 4); break;
+            case 16: px = le16(src + i * 2); break;
+            default: px = src[i * 3] | src[i * 3 + 1] << 8 | (uint32_t)src[i * 3 + 2] << 16; break;
+        }
+        dst[i * 3] = fb_unpack_channel(px, &v->red);
+        dst[i * 3 + 1] = fb_unpack_channel(px, &v->green);
+        dst[i * 3 + 2] = fb_unpack_channel(px, &v->blue);
+    }
+}
+
+static void capture_free(capture_t *c)
+{
+    fb_unmap(&c->m);
+    free(c->rows);
+    free(c->rgb);
+    free(c->out);
+    c->rows = c->rgb = c->out = NULL;
+}
+
+/* Map the framebuffer and size the buffers for the current geometry */
+static int capture_setup(capture_t *c)
+{
+    size_t row_bytes;
+
+    if (fb_map(&c->m) < 0) return -1;
+    c->std = fb_std_layout(&c->m.var);
+    c->ow = c->tw ? c->tw : c->m.var.xres;
+    c->oh = c->th ? c->th : c->m.var.yres;
+    if (c->tw && !c->th)
+        c->oh = c->m.var.xres ? (uint32_t)((uint64_t)c->m.var.yres * c->tw / c->m.var.xres) : 0;
+    if (c->oh == 0) c->oh = 1;
+    if (c->ow > c->m.var.xres || c->oh > c->m.var.yres) {
+        fprintf(stderr, "Thumbnail %ux%u is larger than the screen (%ux%u)\n",
+                c->ow, c->oh, c->m.var.xres, c->m.var.yres);
+        capture_free(c);
+        return -1;
+    }
+
+    row_bytes = (size_t)c->m.var.xres * (c->m.var.bits_per_pixel / 8);
+    c->rows = malloc(row_bytes * 2);
+    c->rgb = malloc((size_t)c->m.var.xres * 3 * 2);
+    if (c->tw || c->format == CAPTURE_PPM)
+        c->out = malloc((size_t)c->ow * c->oh * 3);
+    if (!c->rows || !c->rgb || ((c->tw || c->format == CAPTURE_PPM) && !c->out)) {
+        fprintf(stderr, "Out of memory\n");
+        capture_free(c);
+        return -1;
+    }
+    c->seen = 0;
+    DEBUG("capture: %ux%u @ %u bpp -> %ux%u %s", c->m.var.xres, c->m.var.yres,
+          c->m.var.bits_per_pixel, c->ow, c->oh, c->format == CAPTURE_PPM ? "ppm" : "raw");
+    return 0;
+}
+
+/* Refresh the pan offset. Returns 1 if the geometry changed (buffers remade), -1 on error. */
+static int capture_sync(capture_t *c)
+{
+    struct fb_var_screeninfo v;
+
+    if (fb_ioctl(FBIOGET_VSCREENINFO, &v) < 0) {
+        perror("FBIOGET_VSCREENINFO failed");
+        return -1;
+    }
+    if (v.xres == c->m.var.xres && v.yres == c->m.var.yres &&
+        v.xres_virtual == c->m.var.xres_virtual && v.yres_virtual == c->m.var.yres_virtual &&
+        v.bits_per_pixel == c->m.var.bits_per_pixel) {
+        c->m.var.xoffset = v.xoffset;
+        c->m.var.yoffset = v.yoffset;
+        return 0;
+    }
+    capture_free(c);
+    return capture_setup(c) < 0 ? -1 : 1;
+}
+
+static uint32_t capture_hash(const uint8_t *p, size_t bytes)
+{
+    uint32_t h = 2166136261u;
+    size_t i = 0;
+
+    for (; i + 4 <= bytes; i += 4) {
+        uint32_t w;
+        memcpy(&w, p + i, 4);
+        h = (h ^ w) * 16777619u;
+    }
+    for (; i < bytes; i++) h = (h ^ p[i]) * 16777619u;
+    return h;
+}
+
+static uint32_t capture_sample(capture_t *c, uint32_t phase)
+{
+    size_t row_bytes = (size_t)c->m.var.xres * (c->m.var.bits_per_pixel / 8);
+    uint32_t lines, h = 2166136261u;
+    const uint8_t *page = fb_map_page(&c->m, &lines);
+
+    for (uint32_t y = phase; y < lines; y += c->step) {
+        fb_read_row(c->rows, page + (size_t)y * c->m.fix.line_length, row_bytes);
+        h = (h ^ capture_hash(c->rows, row_bytes)) * 16777619u;
+    }
+    return h;
+}
+
+/* Hash this poll's sample lines; 1 if they differ from the last poll of the phase */
+static int capture_changed(capture_t *c)
+{
+    uint32_t h = capture_sample(c, c->phase);
+    int changed = ((c->seen >> c->phase) & 1) && c->sums[c->phase] != h;
+
+    c->sums[c->phase] = h;
+    c->seen |= 1ull << c->phase;
+    c->phase = (c->phase + 1) % c->step;
+    return changed || c->m.var.yoffset != c->yoffset;
+}
+
+/*
+ * Re-hash every phase before sending a frame. Otherwise a single change
+ * would be found again by each phase in turn and sent step times.
+ */
+static void capture_rebase(capture_t *c)
+{
+    for (uint32_t p = 0; p < c->step; p++)
+        c->sums[p] = capture_sample(c, p);
+    c->seen = c->step >= 64 ? ~0ull : (1ull << c->step) - 1;
+}
+
+/* Fill c->out with the visible page, full size or reduced by 2x2 averaging */
+static void capture_render(capture_t *c)
+{
+    const struct fb_var_screeninfo *v = &c->m.var;
+    size_t row_bytes = (size_t)v->xres * (v->bits_per_pixel / 8);
+    uint32_t lines;
+    const uint8_t *page = fb_map_page(&c->m, &lines);
+
+    if (lines == 0) {
+        memset(c->out, 0, (size_t)c->ow * c->oh * 3);
+        return;
+    }
+    if (!c->tw) {
+        for (uint32_t y = 0; y < lines; y++) {
+            fb_read_row(c->rows, page + (size_t)y * c->m.fix.line_length, row_bytes);
+            fb_row_to_rgb(c->out + (size_t)y * c->ow * 3, c->rows, v, c->std, v->xres);
+        }
+        if (lines < c->oh)
+            memset(c->out + (size_t)lines * c->ow * 3, 0, (size_t)(c->oh - lines) * c->ow * 3);
+        return;
+    }
+
+    for (uint32_t y = 0; y < c->oh; y++) {
+        uint32_t sy = (uint32_t)((uint64_t)y * lines / c->oh);
+        uint32_t sy1 = sy + 1 < lines ? sy + 1 : sy;
+        const uint8_t *r0 = c->rgb, *r1 = c->rgb + (size_t)v->xres * 3;
+        uint8_t *d = c->out + (size_t)y * c->ow * 3;
+
+        fb_read_row(c->rows, page + (size_t)sy * c->m.fix.line_length, row_bytes);
+        fb_read_row(c->rows + row_bytes, page + (size_t)sy1 * c->m.fix.line_length, row_bytes);
+        fb_row_to_rgb(c->rgb, c->rows, v, c->std, v->xres);
+        fb_row_to_rgb(c->rgb + (size_t)v->xres * 3, c->rows + row_bytes, v, c->std, v->xres);
+
+        for (uint32_t x = 0; x < c->ow; x++) {
+            uint32_t sx = (uint32_t)((uint64_t)x * v->xres / c->ow);
+            uint32_t sx1 = sx + 1 < v->xres ? sx + 1 : sx;
+            for (int k = 0; k < 3; k++)
+                d[x * 3 + k] = (uint8_t)((r0[sx * 3 + k] + r0[sx1 * 3 + k] +
+                                          r1[sx * 3 + k] + r1[sx1 * 3 + k] + 2) / 4);
+        }
+    }
+}
+
+/* writev() the whole vector, resuming after short writes */
+static int capture_writev(int fd, struct iovec *iov, int n)
+{
+    while (n > 0) {
+        ssize_t w = writev(fd, iov, n);
+        if (w < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        while (n > 0 && (size_t)w >= iov->iov_len) {
+            w -= (ssize_t)iov->iov_len;
+            iov++;
+            n--;
+        }
+        if (n > 0) {
+            iov->iov_base = (uint8_t *)iov->iov_base + w;
+            iov->iov_len -= (size_t)w;
+        }
+    }
+    return 0;
+}
+
+/* Send one frame in the configured format */
+static int capture_send(capture_t *c)
+{
+    struct iovec iov[CAPTURE_IOV];
+    char header[32];
+    int n = 0;
+
+    c->yoffset = c->m.var.yoffset;
+    if (c->out) {
+        capture_render(c);
+        if (c->format == CAPTURE_PPM) {
+            iov[n].iov_base = header;
+            iov[n++].iov_len = (size_t)snprintf(header, sizeof(header), "P6\n%u %u\n255\n",
+                                                c->ow, c->oh);
+        }
+        iov[n].iov_base = c->out;
+        iov[n++].iov_len = (size_t)c->ow * c->oh * 3;
+        return capture_writev(c->fd, iov, n);
+    }
+
+    /* Full-size raw: the lines go out straight from the mapping */
+    {
+        size_t row_bytes = (size_t)c->m.var.xres * (c->m.var.bits_per_pixel / 8);
+        uint32_t lines;
+        uint8_t *page = fb_map_page(&c->m, &lines);
+
+        for (uint32_t y = 0; y < lines; y++) {
+            iov[n].iov_base = page + (size_t)y * c->m.fix.line_length;
+            iov[n++].iov_len = row_bytes;
+            if (n == CAPTURE_IOV || y + 1 == lines) {
+                if (capture_writev(c->fd, iov, n) < 0) return -1;
+                n = 0;
+            }
+        }
+    }
+    return 0;
+}
+
+/* Output: "-" (stdout), unix:<path> (connect to a stream socket) or a file/FIFO */
+static int capture_open_output(const char *target)
+{
+    int fd;
+
+    if (strncmp(target, "unix:", 5) == 0) {
+        struct sockaddr_un addr;
+
+        memset(&addr, 0, sizeof(addr));
+        addr.sun_family = AF_UNIX;
+        if (strlen(target + 5) >= sizeof(addr.sun_path)) {
+            fprintf(stderr, "Socket path too long: %s\n", target + 5);
+            return -1;
+        }
+        strcpy(addr.sun_path, target + 5);
+        fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (fd < 0 || connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+            fprintf(stderr, "Cannot connect to %s: %s\n", target + 5, strerror(errno));
+            if (fd >= 0) close(fd);
+            return -1;
+        }
+        return fd;
+    }
+    fd = open(target, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) fprintf(stderr, "Cannot write %s: %s\n", target, strerror(errno));
+    return fd;
+}
+
+/*
+ * fb capture [file|unix:<path>|-] [ppm|raw] [thumb=<W>[x<H>]]
+ *            [--stream [fps=<n>] [sample=<n>]]
+ *
+ * Full-size raw is the framebuffer's own byte order (xres * bpp per line,
+ * no padding); PPM and every thumbnail are RGB24. When writing to stdout,
+ * messages go to stderr for the duration of the command.
+ */
+static int fb_capture(int argc, char *argv[])
+{
+    const char *target = "-";
+    capture_t c;
+    struct timespec next, t0;
+    double fps = 1;
+    long period_ns;
+    uint32_t sent = 0, skipped = 0;
+    int stream = 0, ret = 1, saved_stdout = -1;
+
+    memset(&c, 0, sizeof(c));
+    c.format = CAPTURE_PPM;
+    c.step = CAPTURE_SAMPLE_STEP;
+    for (int i = 0; i < argc; i++) {
+        if (strcmp(argv[i], "ppm") == 0) {
+            c.format = CAPTURE_PPM;
+        } else if (strcmp(argv[i], "raw") == 0) {
+            c.format = CAPTURE_RAW;
+        } else if (strcmp(argv[i], "--stream") == 0) {
+            stream = 1;
+        } else if (strncmp(argv[i], "thumb=", 6) == 0) {
+            char *end;
+            c.tw = (uint32_t)strtoul(argv[i] + 6, &end, 10);
+            if (*end == 'x') c.th = (uint32_t)strtoul(end + 1, &end, 10);
+            if (c.tw == 0 || *end) {
+                fprintf(stderr, "Invalid thumbnail size: %s\n", argv[i] + 6);
+                return 1;
+            }
+        } else if (strncmp(argv[i], "fps=", 4) == 0) {
+            fps = atof(argv[i] + 4);
+            if (fps <= 0 || fps > 60) {
+                fprintf(stderr, "Invalid frame rate: %s (0-60)\n", argv[i] + 4);
+                return 1;
+            }
+        } else if (strncmp(argv[i], "sample=", 7) == 0) {
+            c.step = (uint32_t)atoi(argv[i] + 7);
+            if (c.step < 1 || c.step > CAPTURE_MAX_STEP) {
+                fprintf(stderr, "Invalid sample step: %s (1-%d)\n", argv[i] + 7, CAPTURE_MAX_STEP);
+                return 1;
+            }
+        } else if (argv[i][0] != '-' || argv[i][1] == '\0') {
+            target = argv[i];
+        } else {
+            fprintf(stderr, "Unknown capture option: %s\n", argv[i]);
+            return 1;
+        }
+    }
+    if (g_in_daemon && (stream || strcmp(target, "-") == 0)) {
+        fprintf(stderr, "Capture to stdout or --stream is not available in the daemon\n");
+        return 1;
+    }
+
+    if (strcmp(target, "-") == 0) {
+        /* Keep stdout for the frames; printf/DEBUG go to stderr meanwhile */
+        fflush(stdout);
+        saved_stdout = dup(STDOUT_FILENO);
+        if (saved_stdout < 0 || dup2(STDERR_FILENO, STDOUT_FILENO) < 0) {
+            perror("dup failed");
+            if (saved_stdout >= 0) close(saved_stdout);
+            return 1;
+        }
+        c.fd = saved_stdout;
+    } else {
+        c.fd = capture_open_output(target);
+        if (c.fd < 0) return 1;
+    }
+    if (capture_setup(&c) < 0) goto out;
+
+    if (!stream) {
+        clock_gettime(CLOCK_MONOTONIC, &t0);
+        if (capture_send(&c) < 0) {
+            perror("Failed to write frame");
+            goto out;
+        }
+        fprintf(stderr, "Captured %ux%u %s from page %u in %.2f ms\n", c.ow, c.oh,
+                c.format == CAPTURE_PPM ? "PPM" : (c.tw ? "RGB24" : "raw"),
+                c.m.var.yres ? c.m.var.yoffset / c.m.var.yres : 0, elapsed_ms(&t0));
+        ret = 0;
+        goto out;
+    }
+
+    install_stop_handlers();
+    signal(SIGPIPE, SIG_IGN);
+    fprintf(stderr, "Streaming %ux%u %s at up to %.2f fps, Ctrl-C to stop\n", c.ow, c.oh,
+            c.format == CAPTURE_PPM ? "PPM" : (c.tw ? "RGB24" : "raw"), fps);
+
+    period_ns = (long)(1e9 / fps);
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    next = t0;
+    while (!g_stop_requested) {
+        struct timespec now;
+        int geometry = capture_sync(&c);
+
+        if (geometry < 0) goto out;
+        if (capture_changed(&c) || geometry > 0 || sent == 0) {
+            capture_rebase(&c);
+            if (capture_send(&c) < 0) {
+                if (errno == EPIPE) break;      /* Reader went away */
+                perror("Failed to write frame");
+                goto out;
+            }
+            sent++;
+        } else {
+            skipped++;
+        }
+
+        next.tv_nsec += period_ns;
+        while (next.tv_nsec >= 1000000000L) {
+            next.tv_nsec -= 1000000000L;
+            next.tv_sec++;
+        }
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        if (now.tv_sec > next.tv_sec || (now.tv_sec == next.tv_sec && now.tv_nsec > next.tv_nsec))
+            next = now;     /* Running late: do not try to catch up */
+        else
+            clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL);
+    }
+    fprintf(stderr, "Sent %u frame%s, skipped %u unchanged poll%s in %.1f s\n",
+            sent, sent == 1 ? "" : "s", skipped, skipped == 1 ? "" : "s",
+            elapsed_ms(&t0) / 1000.0);
+    ret = 0;
+
+out:
+    capture_free(&c);
+    if (saved_stdout >= 0) {
+        fflush(stdout);
+        dup2(saved_stdout, STDOUT_FILENO);
+        close(saved_stdout);
+    } else if (c.fd >= 0) {
+        close(c.fd);
+    }
+    return ret;
+}
+
+/*
+ * ============================================================================
+ * Shadow Framebuffer
+ * ============================================================================
+ *
+ * Applications draw into a cached copy of the visible page in system
+ * memory, report what they touched with fb_shadow_damage() and call
+ * fb_shadow_present(). Only the damaged spans are copied to the
+ * framebuffer, with the same store-only row kernel as fb bwtest, so
+ * small widget updates do not cost a full-screen copy. Write-combined
+ * scanout memory is read only once, when fb_shadow_init() seeds the
+ * shadow from the front page with the capture's burst-read kernel.
+ *
+ * Damage is kept as a short list of rectangles. A new rectangle is
+ * merged into an existing one whenever their bounding box is no larger
+ * than the two areas together, which keeps the list compact without
+ * copying pixels that were not damaged. If the list is full, the pair
+ * whose union grows least is merged.
+ *
+ * With two or three pages, present stages into the back page and flips.
+ * A back page is as old as nbuf - 1 frames, so its flush also replays
+ * the damage of those earlier frames. A page that has never been flushed
+ * gets a full copy.
+ */
+#define SHADOW_MAX_RECTS    16
+#define SHADOW_MAX_PAGES    3
+
+typedef struct { uint32_t x, y, w, h; } fb_rect_t;
+
+typedef struct {
+    fb_rect_t   r[SHADOW_MAX_RECTS];
+    int         n;
+} fb_damage_t;
+
+typedef struct {
+    fb_map_t    map;
+    uint8_t    *pixels;         /* Cached copy, width * bytespp per line */
+    size_t      pitch;
+    uint32_t    width, height, bytespp;
+    uint32_t    nbuf;
+    fb_damage_t damage;         /* Since the last present */
+    fb_damage_t history[SHADOW_MAX_PAGES - 1];  /* Previous frames, newest first */
+    int         page_valid[SHADOW_MAX_PAGES];
+    uint64_t    flushed_bytes;
+    uint32_t    presents;
+    uint32_t    flushed_rects;
+} fb_shadow_t;
+
+static uint64_t rect_area(const fb_rect_t *r)
+{
+    return (uint64_t)r->w * r->h;
+}
+
+static fb_rect_t rect_union(const fb_rect_t *a, const fb_rect_t *b)
+{
+    fb_rect_t u;
+    uint32_t x1 = a->x + a->w > b->x + b->w ? a->x + a->w : b->x + b->w;
+    uint32_t y1 = a->y + a->h > b->y + b->h ? a->y + a->h : b->y + b->h;
+
+    u.x = a->x < b->x ? a->x : b->x;
+    u.y = a->y < b->y ? a->y : b->y;
+    u.w = x1 - u.x;
+    u.h = y1 - u.y;
+    return u;
+}
+
+/* Add a (clipped, non-empty) rectangle to a damage list */
+static void damage_add(fb_damage_t *d, fb_rect_t r)
+{
+    int merged;
+
+    /* Absorb every rectangle the new one can be merged with */
+    do {
+        merged = 0;
+        for (int i = 0; i < d->n; i++) {
+            fb_rect_t u = rect_union(&d->r[i], &r);
+            if (rect_area(&u) <= rect_area(&d->r[i]) + rect_area(&r)) {
+                r = u;
+                d->r[i] = d->r[--d->n];
+                merged = 1;
+                break;
+            }
+        }
+    } while (merged);
+
+    if (d->n == SHADOW_MAX_RECTS) {
+        /* Full: fold the new rectangle into the one it costs least to grow */
+        int best = 0;
+        uint64_t best_grow = UINT64_MAX;
+        for (int i = 0; i < d->n; i++) {
+            fb_rect_t u = rect_union(&d->r[i], &r);
+            uint64_t grow = rect_area(&u) - rect_area(&d->r[i]);
+            if (grow < best_grow) {
+                best_grow = grow;
+                best = i;
+            }
+        }
+        r = rect_union(&d->r[best], &r);
+        d->r[best] = d->r[--d->n];
+        damage_add(d, r);
+        return;
+    }
+    d->r[d->n++] = r;
+}
+
+static int fb_shadow_init(fb_shadow_t *s)
+{
+    uint8_t *page;
+    uint32_t lines, front;
+
+    memset(s, 0, sizeof(*s));
+    if (fb_map(&s->map) < 0) return -1;
+
+    s->width = s->map.var.xres;
+    s->bytespp = s->map.var.bits_per_pixel / 8;
+    s->pitch = (size_t)s->width * s->bytespp;
+    s->nbuf = s->map.var.yres ? s->map.var.yres_virtual / s->map.var.yres : 1;
+    if (s->nbuf > SHADOW_MAX_PAGES) s->nbuf = SHADOW_MAX_PAGES;
+    while (s->nbuf > 1 && (size_t)s->nbuf * s->map.var.yres * s->map.fix.line_length > s->map.len)
+        s->nbuf--;
+
+    page = fb_map_page(&s->map, &lines);
+    s->height = lines;
+    s->pixels = malloc(s->pitch * lines);
+    if (!s->pixels) {
+        perror("malloc");
+        fb_unmap(&s->map);
+        return -1;
+    }
+
+    /* Start from what is on screen (the one readback): the front page needs no full copy */
+    for (uint32_t y = 0; y < lines; y++)
+        fb_read_row(s->pixels + y * s->pitch, page + (size_t)y * s->map.fix.line_length, s->pitch);
+    front = s->map.var.yres ? s->map.var.yoffset / s->map.var.yres : 0;
+    if (front < SHADOW_MAX_PAGES) s->page_valid[front] = 1;
+
+    if (s->nbuf >= 2 && fb_flip_init() < 0) s->nbuf = 1;
+    DEBUG("shadow: %ux%u, %u bytes/px, %u page(s)", s->width, s->height, s->bytespp, s->nbuf);
+    return 0;
+}
+
+static void fb_shadow_free(fb_shadow_t *s)
+{
+    free(s->pixels);
+    s->pixels = NULL;
+    fb_unmap(&s->map);
+}
+
+/* Record that x,y,w,h of the shadow changed */
+static void fb_shadow_damage(fb_shadow_t *s, uint32_t x, uint32_t y, uint32_t w, uint32_t h)
+{
+    fb_rect_t r;
+
+    if (x >= s->width || y >= s->height || w == 0 || h == 0) return;
+    r.x = x;
+    r.y = y;
+    r.w = w < s->width - x ? w : s->width - x;
+    r.h = h < s->height - y ? h : s->height - y;
+    damage_add(&s->damage, r);
+}
+
+/* Fill a rectangle of the shadow with a packed pixel and damage it */
+static void fb_shadow_fill(fb_shadow_t *s, uint32_t x, uint32_t y, uint32_t w, uint32_t h,
+                           uint32_t px)
+{
+    if (x >= s->width || y >= s->height) return;
+    if (w > s->width - x) w = s->width - x;
+    if (h > s->height - y) h = s->height - y;
+
+    for (uint32_t j = 0; j < h; j++) {
+        uint8_t *row = s->pixels + (size_t)(y + j) * s->pitch;
+        for (uint32_t i = 0; i < w; i++)
+            fb_row_put(row, x + i, px, s->bytespp * 8);
+    }
+    fb_shadow_damage(s, x, y, w, h);
+}
+
+/* Copy the damaged spans of the shadow into one framebuffer page */
+static void fb_shadow_flush(fb_shadow_t *s, uint32_t page)
+{
+    uint8_t *base = s->map.base + (size_t)page * s->map.var.yres * s->map.fix.line_length;
+    fb_damage_t todo = s->damage;
+
+    if (page >= SHADOW_MAX_PAGES || !s->page_valid[page]) {
+        todo.n = 1;
+        todo.r[0].x = todo.r[0].y = 0;
+        todo.r[0].w = s->width;
+        todo.r[0].h = s->height;
+    } else {
+        for (uint32_t i = 0; i + 1 < s->nbuf && i < SHADOW_MAX_PAGES - 1; i++)
+            for (int j = 0; j < s->history[i].n; j++)
+                damage_add(&todo, s->history[i].r[j]);
+    }
+
+    for (int i = 0; i < todo.n; i++) {
+        const fb_rect_t *r = &todo.r[i];
+        size_t off = (size_t)r->x * s->bytespp, bytes = (size_t)r->w * s->bytespp;
+        for (uint32_t y = r->y; y < r->y + r->h; y++)
+            fb_copy_row(base + (size_t)y * s->map.fix.line_length + off,
+                        s->pixels + (size_t)y * s->pitch + off, bytes);
+        s->flushed_bytes += bytes * r->h;
+    }
+    s->flushed_rects += (uint32_t)todo.n;
+    if (page < SHADOW_MAX_PAGES) s->page_valid[page] = 1;
+}
+
+/*
+ * Put the shadow on screen: flush into the back page and flip if there
+ * is one, otherwise into the visible page. Returns 0 or -1.
+ */
+static int fb_shadow_present(fb_shadow_t *s)
+{
+    if (s->nbuf >= 2) {
+        fb_shadow_flush(s, (g_flip.front + 1) % s->nbuf);
+        if (fb_flip() < 0) return -1;
+    } else {
+        fb_shadow_flush(s, s->map.var.yres ? s->map.var.yoffset / s->map.var.yres : 0);
+    }
+
+    memmove(&s->history[1], &s->history[0], sizeof(s->history) - sizeof(s->history[0]));
+    s->history[0] = s->damage;
+    s->damage.n = 0;
+    s->presents++;
+    return 0;
+}
+
+/*
+ * fb damage [frames] [widgets] [flip]: a status-screen style load
+ * through the shadow buffer - a few small widgets change every frame -
+ * reporting the bytes actually written to the framebuffer.
+ */
+static int fb_damage_test(int argc, char *argv[])
+{
+    fb_shadow_t s;
+    struct timespec t0;
+    int frames = 100, widgets = 4, flip = 0, nnum = 0;
+    uint32_t ww, wh;
+    uint64_t full;
+    double ms;
+
+    for (int i = 0; i < argc; i++) {
+        if (strcmp(argv[i], "flip") == 0) {
+            flip = 1;
+        } else if (argv[i][0] >= '0' && argv[i][0] <= '9' && nnum < 2) {
+            int v = atoi(argv[i]);
+            if (v < 1) {
+                fprintf(stderr, "Invalid count: %s\n", argv[i]);
+                return 1;
+            }
+            if (nnum++ == 0) frames = v;
+            else widgets = v;
+        } else {
+            fprintf(stderr, "Usage: fb damage [frames] [widgets] [flip]\n");
+            return 1;
+        }
+    }
+
+    if (fb_shadow_init(&s) < 0) return 1;
+    if (!flip) s.nbuf = 1;
+    else if (s.nbuf < 2) {
+        fprintf(stderr, "No back buffer (set the framebuffer up with -b 2 or -b 3)\n");
+        fb_shadow_free(&s);
+        return 1;
+    }
+
+    /* Widgets of 1/8 x 1/16 of the screen along the top edge */
+    ww = s.width / 8 ? s.width / 8 : 1;
+    wh = s.height / 16 ? s.height / 16 : 1;
+
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    for (int f = 0; f < frames && !g_stop_requested; f++) {
+        for (int w = 0; w < widgets; w++) {
+            uint8_t v = (uint8_t)(f * 8 + w * 64);
+            uint32_t x = (uint32_t)(w % 8) * ww, y = (uint32_t)(w / 8) * wh * 2;
+            fb_shadow_fill(&s, x, y, ww - 2, wh, fb_pack_rgb(&s.map.var, v, 255 - v, 128));
+        }
+        if (fb_shadow_present(&s) < 0) break;
+    }
+    ms = elapsed_ms(&t0);
+
+    full = (uint64_t)s.pitch * s.height * s.presents;
+    printf("Shadow framebuffer: %ux%u @ %u bpp, %u frame%s, %d widget%s, %s, %s kernels\n",
+           s.width, s.height, s.bytespp * 8, s.presents, s.presents == 1 ? "" : "s",
+           widgets, widgets == 1 ? "" : "s", s.nbuf >= 2 ? "flipped" : "single page",
+           FB_HAVE_NEON ? "NEON" : "scalar");
+    if (s.presents) {
+        printf("  flushed: %.1f KiB/frame in %.1f rects (%.1f%% of a full copy)\n",
+               s.flushed_bytes / 1024.0 / s.presents, (double)s.flushed_rects / s.presents,
+               full ? 100.0 * s.flushed_bytes / full : 0);
+        printf("  time:    %.3f ms/frame%s\n", ms / s.presents,
+               s.nbuf >= 2 ? " (including vsync wait)" : "");
+    }
+
+    fb_shadow_free(&s);
+    return 0;
+}
+
+/*
+ * ============================================================================
+ * Screen Blanking
+ * ============================================================================
+ *
+ * blank turns the fbdev layer off so the display engine shows its
+ * background colour: the HDMI link stays up and nothing is fetched from
+ * memory. With "all" (DE2) a colour-mode layer is also put on top of
+ * every other layer, hiding a video overlay as well. unblank re-enables
+ * the fbdev layer (and drops the colour layer); the driver latches it at
+ * the next vblank, so the picture is back within one frame.
+ *
+ * What was turned off is kept per screen in BLANK_STATE.N, because the
+ * disabled fbdev layer can no longer be found by scanning for it.
+ */
+typedef struct {
+    long    fb_a, fb_b;         /* DE2 channel/layer, DE1 handle/-1 */
+    long    cover_ch, cover_l;  /* DE2 colour layer, -1 if none */
+} blank_state_t;
+
+static void blank_state_path(char *buf, size_t size)
+{
+    snprintf(buf, size, "%s.%u", BLANK_STATE, g_screen);
+}
+
+static int blank_state_load(blank_state_t *st)
+{
+    char path[64], buf[96];
+
+    blank_state_path(path, sizeof(path));
+    read_text_file(path, buf, sizeof(buf));
+    return sscanf(buf, "%ld %ld %ld %ld", &st->fb_a, &st->fb_b,
+                  &st->cover_ch, &st->cover_l) == 4 ? 0 : -1;
+}
+
+static int blank_state_save(const blank_state_t *st)
+{
+    char path[64];
+    FILE *f;
+
+    blank_state_path(path, sizeof(path));
+    f = fopen(path, "w");
+    if (!f || fprintf(f, "%ld %ld %ld %ld\n", st->fb_a, st->fb_b,
+                      st->cover_ch, st->cover_l) < 0 || fclose(f) != 0) {
+        fprintf(stderr, "Cannot record blank state in %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+static int de1_blank(const disp_color *color, int all, blank_state_t *st)
+{
+    unsigned long hlayer;
+
+    if (all) {
+        fprintf(stderr, "DE1 has no colour layers; 'all' is not available\n");
+        return -1;
+    }
+    if (de1_set_bkcolor(color) < 0) {
+        perror("DE1 SET_BKCOLOR failed");
+        return -1;
+    }
+    if (st->fb_a >= 0) return 0;    /* Already blank: colour change only */
+
+    if (de1_fb_layer_handle(&hlayer) < 0) {
+        perror("FBIOGET_LAYER_HDL failed");
+        return -1;
+    }
+    if (de1_layer_enable(hlayer, 0) < 0) {
+        perror("DE1 LAYER_CLOSE failed");
+        return -1;
+    }
+    st->fb_a = (long)hlayer;
+    st->fb_b = -1;
+    return 0;
+}
+
+static int de1_unblank(const blank_state_t *st)
+{
+    if (de1_layer_enable((unsigned long)st->fb_a, 1) < 0) {
+        perror("DE1 LAYER_OPEN failed");
+        return -1;
+    }
+    return 0;
+}
+
+/* A disabled layer above every enabled one, for the colour cover */
+static int de2_cover_find(de2_layer_config *cover)
+{
+    de2_layer_config cfg;
+    int found = 0, top = 0;
+
+    for (int ch = DE2_MAX_CHANNELS - 1; ch >= 0; ch--) {
+        for (int l = DE2_MAX_LAYERS - 1; l >= 0; l--) {
+            memset(&cfg, 0, sizeof(cfg));
+            cfg.channel = ch;
+            cfg.layer_id = l;
+            if (de2_layer_get_config(&cfg, 1) < 0) continue;
+            if (cfg.enable) {
+                if (cfg.info.zorder >= top) top = cfg.info.zorder + 1;
+            } else if (!found) {
+                *cover = cfg;
+                found = 1;
+            }
+        }
+    }
+    if (!found) {
+        fprintf(stderr, "No free DE2 layer for the colour cover\n");
+        return -1;
+    }
+    cover->info.zorder = (unsigned char)top;
+    return 0;
+}
+
+static int de2_blank(const disp_color *color, int all, blank_state_t *st)
+{
+    de2_layer_config cfg[2];
+    unsigned int n = 0;
+    uint32_t scn_w, scn_h;
+
+    if (de2_set_bkcolor(color) < 0) {
+        perror("DE2 SET_BKCOLOR failed");
+        return -1;
+    }
+
+    if (st->fb_a < 0) {
+        if (de2_fb_layer_find(&cfg[n]) < 0) return -1;
+        cfg[n].enable = 0;
+        st->fb_a = (long)cfg[n].channel;
+        st->fb_b = (long)cfg[n].layer_id;
+        n++;
+    }
+
+    if (all) {
+        if (st->cover_ch >= 0) {
+            memset(&cfg[n], 0, sizeof(cfg[n]));
+            cfg[n].channel = (unsigned int)st->cover_ch;
+            cfg[n].layer_id = (unsigned int)st->cover_l;
+            if (de2_layer_get_config(&cfg[n], 1) < 0) return -1;
+        } else if (de2_cover_find(&cfg[n]) < 0 || get_screen_size(&scn_w, &scn_h) < 0) {
+            return -1;
+        } else {
+            cfg[n].info.screen_win.x = 0;
+            cfg[n].info.screen_win.y = 0;
+            cfg[n].info.screen_win.width = scn_w;
+            cfg[n].info.screen_win.height = scn_h;
+        }
+        cfg[n].enable = 1;
+        cfg[n].info.mode = DE2_LAYER_MODE_COLOR;
+        cfg[n].info.alpha_mode = 1;     /* Global alpha */
+        cfg[n].info.alpha_value = 0xff;
+        cfg[n].info.color = 0xff000000u | (uint32_t)color->red << 16 |
+                            (uint32_t)color->green << 8 | color->blue;
+        st->cover_ch = (long)cfg[n].channel;
+        st->cover_l = (long)cfg[n].layer_id;
+        n++;
+    }
+
+    /* fbdev layer off and cover on in one latch */
+    if (n && de2_layer_set_config(cfg, n) < 0) {
+        perror("DE2 LAYER_SET_CONFIG failed");
+        return -1;
+    }
+    return 0;
+}
+
+static int de2_unblank(const blank_state_t *st)
+{
+    de2_layer_config cfg[2];
+    unsigned int n = 0;
+
+    memset(cfg, 0, sizeof(cfg));
+    cfg[n].channel = (unsigned int)st->fb_a;
+    cfg[n].layer_id = (unsigned int)st->fb_b;
+    n++;
+    if (st->cover_ch >= 0) {
+        cfg[n].channel = (unsigned int)st->cover_ch;
+        cfg[n].layer_id = (unsigned int)st->cover_l;
+        n++;
+    }
+    if (de2_layer_get_config(cfg, n) < 0) {
+        perror("DE2 LAYER_GET_CONFIG failed");
+        return -1;
+    }
+    cfg[0].enable = 1;
+    if (n > 1) cfg[1].enable = 0;
+    if (de2_layer_set_config(cfg, n) < 0) {
+        perror("DE2 LAYER_SET_CONFIG failed");
+        return -1;
+    }
+    return 0;
+}
+
+/* blank [RRGGBB] [all]: show a solid colour, keep the link up */
+static int screen_blank(int argc, char *argv[])
+{
+    disp_color color = { 0xff, 0, 0, 0 };
+    blank_state_t st = { -1, -1, -1, -1 };
+    int all = 0, was_blank, ret;
+
+    for (int i = 0; i < argc; i++) {
+        if (strcmp(argv[i], "all") == 0) all = 1;
+        else if (parse_color(argv[i], &color.red, &color.green, &color.blue) < 0) return 1;
+    }
+
+    was_blank = blank_state_load(&st) == 0;
+    switch (g_de_version) {
+        case DE_VERSION_1: ret = de1_blank(&color, all, &st); break;
+        case DE_VERSION_2: ret = de2_blank(&color, all, &st); break;
+        default: ret = -1; break;
+    }
+    if (ret < 0) return 1;
+    if (blank_state_save(&st) < 0) return 1;
+
+    printf("Screen %u %s: %02x%02x%02x%s\n", g_screen, was_blank ? "already blank, colour" : "blanked",
+           color.red, color.green, color.blue, st.cover_ch >= 0 ? " (covering all layers)" : "");
+    return 0;
+}
+
+static int screen_unblank(void)
+{
+    blank_state_t st;
+    char path[64];
+    int ret;
+
+    if (blank_state_load(&st) < 0) {
+        printf("Screen %u is not blanked (no-op)\n", g_screen);
+        return 0;
+    }
+    switch (g_de_version) {
+        case DE_VERSION_1: ret = de1_unblank(&st); break;
+        case DE_VERSION_2: ret = de2_unblank(&st); break;
+        default: ret = -1; break;
+    }
+    if (ret < 0) return 1;
+
+    blank_state_path(path, sizeof(path));
+    unlink(path);
+    printf("Screen %u unblanked\n", g_screen);
+    return 0;
+}
+
+/*
+ * ============================================================================
+ * Information Display
+ * ============================================================================
+ */
+static void show_info(int fast)
+{
+    uint32_t width, height;
+    disp_tv_mode mode;
+    const mode_info_t *info;
+    int hpd, output_type;
+    struct fb_var_screeninfo vinfo;
+    struct fb_fix_screeninfo finfo;
+
+    printf("=== Sunxi Display Information ===\n\n");
+
+    printf("Display Engine: %s\n", de_version_name(g_de_version));
+    printf("Screen: %u (of %u)\n", g_screen, g_caps.screen_count);
+
+    output_type = get_output_type();
+    printf("Output type: ");
+    switch (output_type) {
+        case DISP_OUTPUT_TYPE_NONE: printf("None\n"); break;
+        case DISP_OUTPUT_TYPE_LCD:  printf("LCD\n"); break;
+        case DISP_OUTPUT_TYPE_TV:   printf("TV\n"); break;
+        case DISP_OUTPUT_TYPE_HDMI: printf("HDMI\n"); break;
+        case DISP_OUTPUT_TYPE_VGA:  printf("VGA\n"); break;
+        default: printf("Unknown (%d)\n", output_type); break;
+    }
+
+    hpd = hdmi_get_hpd();
+    printf("HDMI Hot Plug: %s (raw: %d)\n",
+           hpd > 0 ? "Connected" : (hpd == 0 ? "Disconnected" : "Error"), hpd);
+
+    mode = hdmi_get_mode();
+    info = get_mode_info(mode);
+    printf("Current HDMI mode: %d", (int)mode);
+    if (info) {
+        printf(" = %s (%dx%d @ %dHz)\n",
+               info->name, info->width, info->height, info->refresh);
+    } else {
+        printf(" (not in table)\n");
+    }
+
+    if (get_screen_size(&width, &height) == 0) {
+        printf("Screen size: %ux%u\n", width, height);
+    } else {
+        printf("Screen size: failed to read\n");
+    }
+
+    printf("\n--- Framebuffer (" FB_DEV ") ---\n");
+    if (get_fb_info(&vinfo, &finfo) == 0) {
+        printf("Resolution: %ux%u", vinfo.xres, vinfo.yres);
+        if (vinfo.xres_virtual != vinfo.xres || vinfo.yres_virtual != vinfo.yres) {
+            printf(" (virtual: %ux%u)", vinfo.xres_virtual, vinfo.yres_virtual);
+        }
+        printf("\n");
+        printf("Color depth: %u bpp\n", vinfo.bits_per_pixel);
+        printf("Color format: R%u@%u G%u@%u B%u@%u",
+               vinfo.red.length, vinfo.red.offset,
+               vinfo.green.length, vinfo.green.offset,
+               vinfo.blue.length, vinfo.blue.offset);
+        if (vinfo.transp.length > 0) {
+            printf(" A%u@%u", vinfo.transp.length, vinfo.transp.offset);
+        }
+        printf("\n");
+        printf("Line length: %u bytes\n", finfo.line_length);
+        printf("Memory size: %u bytes (%.2f MB)\n",
+               finfo.smem_len, finfo.smem_len / (1024.0 * 1024.0));
+        printf("Physical address: 0x%lx\n", finfo.smem_start);
+
+        if (get_screen_size(&width, &height) == 0) {
+            if (vinfo.xres != width || vinfo.yres != height) {
+                printf("Scaling: %ux%u -> %ux%u (active%s)\n",
+                       vinfo.xres, vinfo.yres, width, height,
+                       g_de_version == DE_VERSION_2 ? ", auto by DE2" : "");
+            } else {
+                printf("Scaling: none (1:1)\n");
+            }
+        }
+    } else {
+        printf("Failed to read framebuffer info\n");
+    }
+
+    if (g_de_version == DE_VERSION_2) {
+        printf("\nNote: DE2 handles scaling automatically via VSU/GSU hardware.\n");
+        printf("      Change FB resolution with 'fb set' or 'scale' to adjust.\n");
+    }
+
+    if (fast) {
+        uint32_t probed = g_screen < CAPS_MAX_SCREENS ? g_caps.mode_probed[g_screen] : 0;
+        uint32_t sup = g_screen < CAPS_MAX_SCREENS ? g_caps.mode_supported[g_screen] : 0;
+
+        printf("\n--- Supported HDMI modes (cached) ---\n ");
+        for (int i = 0; mode_table[i].name != NULL; i++) {
+            disp_tv_mode m = mode_table[i].mode;
+            if (probed & sup & (1u << m)) printf(" %s", mode_table[i].name);
+        }
+        printf("%s\n", probed ? "" : " (none cached)");
+        return;
+    }
+
+    if (hpd != 0 && edid_load() == 0) {
+        const mode_info_t *pref = g_edid.preferred >= 0 ?
+            get_mode_info((disp_tv_mode)g_edid.preferred) : NULL;
+        printf("Sink: %s, native %ux%u @ %uHz, preferred %s\n",
+               g_edid.name[0] ? g_edid.name : "(unnamed)",
+               g_edid.native_w, g_edid.native_h, g_edid.native_refresh,
+               pref ? pref->name : "(not in table)");
+    }
+
+    printf("\n--- Supported HDMI modes ---\n");
+    printf("  Mode  Name      Resolution   Supported\n");
+    printf("  ----  --------  -----------  ---------\n");
+    for (int i = 0; mode_table[i].name != NULL; i++) {
+        /* Skip 4K modes for DE1 (A20 doesn't support them) */
+        if (g_de_version == DE_VERSION_1 && mode_table[i].mode >= DISP_TV_MOD_3840_2160P_30HZ)
+            continue;
+
+        int supported = hdmi_mode_supported(mode_table[i].mode);
+        printf("  %2d    %-8s  %4dx%-4d    %s\n",
+               mode_table[i].mode, mode_table[i].name,
+               mode_table[i].width, mode_table[i].height,
+               supported > 0 ? "Yes" : "No");
+    }
+    printf("\nNote: Mode support detection requires HDMI cable connected.\n");
+}
+
+/*
+ * Machine-readable status for monitoring agents:
+ *   info --json [--fast]
+ * The schema is versioned; fields are only ever added. Values that could
+ * not be read are null. --fast (also valid for the text output) skips
+ * everything beyond one read per field: no EDID, no mode-support ioctls
+ * (the modes object then reports the capability cache) and no DE2 layer
+ * scan.
+ */
+#define INFO_SCHEMA_VERSION 1
+
+static const char *output_type_name(int type)
+{
+    switch (type) {
+        case DISP_OUTPUT_TYPE_NONE: return "none";
+        case DISP_OUTPUT_TYPE_LCD:  return "lcd";
+        case DISP_OUTPUT_TYPE_TV:   return "tv";
+        case DISP_OUTPUT_TYPE_HDMI: return "hdmi";
+        case DISP_OUTPUT_TYPE_VGA:  return "vga";
+        default: return "unknown";
+    }
+}
+
+/* JSON string; EDID names are ASCII but may contain anything */
+static void json_print_str(const char *s)
+{
+    putchar('"');
+    for (; *s; s++) {
+        unsigned char c = (unsigned char)*s;
+        if (c == '"' || c == '\\') printf("\\%c", c);
+        else if (c < 0x20 || c >= 0x7f) printf("\\u%04x", c);
+        else putchar(c);
+    }
+    putchar('"');
+}
+
+static void show_info_json(int fast)
+{
+    struct fb_var_screeninfo vinfo;
+    struct fb_fix_screeninfo finfo;
+    uint32_t scn_w = 0, scn_h = 0, probed = 0, supported = 0;
+    const mode_info_t *info;
+    disp_tv_mode mode;
+    int have_scn, have_fb, output_type, hpd;
+
+    output_type = get_output_type();
+    hpd = hdmi_get_hpd();
+    mode = hdmi_get_mode();
+    info = get_mode_info(mode);
+    have_scn = get_screen_size(&scn_w, &scn_h) == 0;
+    have_fb = get_fb_info(&vinfo, &finfo) == 0;
+
+    printf("{\"schema\":%d,\"fast\":%s,", INFO_SCHEMA_VERSION, fast ? "true" : "false");
+    printf("\"de\":{\"version\":%d,\"name\":\"%s\"},", (int)g_de_version,
+           g_de_version == DE_VERSION_1 ? "DE1" : g_de_version == DE_VERSION_2 ? "DE2" : "unknown");
+    printf("\"screen\":{\"id\":%u,\"count\":%u,", g_screen, g_caps.screen_count);
+    if (have_scn) printf("\"width\":%u,\"height\":%u},", scn_w, scn_h);
+    else printf("\"width\":null,\"height\":null},");
+
+    printf("\"output\":{\"type\":\"%s\",\"raw\":%d},", output_type_name(output_type), output_type);
+    if (hpd >= 0) printf("\"hpd\":%s,", hpd > 0 ? "true" : "false");
+    else printf("\"hpd\":null,");
+
+    if ((int)mode >= 0) {
+        printf("\"mode\":{\"id\":%d,", (int)mode);
+        if (info)
+            printf("\"name\":\"%s\",\"width\":%d,\"height\":%d,\"refresh\":%d},",
+                   info->name, info->width, info->height, info->refresh);
+        else
+            printf("\"name\":null,\"width\":null,\"height\":null,\"refresh\":null},");
+    } else {
+        printf("\"mode\":null,");
+    }
+
+    if (have_fb) {
+        printf("\"fb\":{\"device\":\"" FB_DEV "\",\"xres\":%u,\"yres\":%u,"
+               "\"xres_virtual\":%u,\"yres_virtual\":%u,\"xoffset\":%u,\"yoffset\":%u,"
+               "\"bpp\":%u,", vinfo.xres, vinfo.yres, vinfo.xres_virtual,
+               vinfo.yres_virtual, vinfo.xoffset, vinfo.yoffset, vinfo.bits_per_pixel);
+        printf("\"red\":[%u,%u],\"green\":[%u,%u],\"blue\":[%u,%u],\"transp\":[%u,%u],",
+               vinfo.red.length, vinfo.red.offset, vinfo.green.length, vinfo.green.offset,
+               vinfo.blue.length, vinfo.blue.offset, vinfo.transp.length, vinfo.transp.offset);
+        printf("\"line_length\":%u,\"smem_len\":%u,\"smem_start\":%lu},",
+               finfo.line_length, finfo.smem_len, finfo.smem_start);
+    } else {
+        printf("\"fb\":null,");
+    }
+
+    /* Scaling: source is what the FB layer shows, destination its window */
+    if (have_fb && have_scn) {
+        uint32_t src_w = vinfo.xres, src_h = vinfo.yres;
+        uint32_t dst_w = scn_w, dst_h = scn_h;
+        const char *method = "fbdev";
+        de1_fb_create_para_t para;
+        de2_layer_config cfg;
+
+        if (g_de_version == DE_VERSION_1 && de1_fb_get_para(g_fb_index, &para) >= 0 && para.width) {
+            src_w = para.width;
+            src_h = para.height;
+            dst_w = para.output_width;
+            dst_h = para.output_height;
+            method = para.mode == DE1_LAYER_WORK_MODE_SCALER ? "scaler" : "normal";
+            if (para.mode != DE1_LAYER_WORK_MODE_SCALER && !fast) {
+                de1_layer_info_t info;
+                unsigned long hlayer;
+                if (de1_fb_layer_handle(&hlayer) == 0 && de1_layer_get_para(hlayer, &info) >= 0 &&
+                    info.mode == DE1_LAYER_WORK_MODE_SCALER) {
+                    method = "layer";
+                    src_w = info.src_win.width;
+                    src_h = info.src_win.height;
+                    dst_w = info.scn_win.width;
+                    dst_h = info.scn_win.height;
+                }
+            }
+        } else if (g_de_version == DE_VERSION_2 && !fast && de2_fb_layer_find(&cfg) == 0) {
+            uint32_t cw = (uint32_t)(cfg.info.fb.crop.width >> DE2_CROP_SHIFT);
+            uint32_t ch = (uint32_t)(cfg.info.fb.crop.height >> DE2_CROP_SHIFT);
+            if (cw && ch && (cw != vinfo.xres || ch != vinfo.yres)) method = "layer";
+            if (cw && ch) {
+                src_w = cw;
+                src_h = ch;
+            }
+            if (cfg.info.screen_win.width && cfg.info.screen_win.height) {
+                dst_w = cfg.info.screen_win.width;
+                dst_h = cfg.info.screen_win.height;
+            }
+        }
+        printf("\"scaling\":{\"active\":%s,\"method\":\"%s\",\"src\":[%u,%u],\"dst\":[%u,%u]},",
+               (src_w != dst_w || src_h != dst_h) ? "true" : "false", method,
+               src_w, src_h, dst_w, dst_h);
+    } else {
+        printf("\"scaling\":null,");
+    }
+
+    /* Supported modes: bit n = disp_tv_mode n */
+    if (fast) {
+        if (g_screen < CAPS_MAX_SCREENS) {
+            probed = g_caps.mode_probed[g_screen];
+            supported = g_caps.mode_supported[g_screen] & probed;
+        }
+    } else {
+        for (int i = 0; mode_table[i].name != NULL; i++) {
+            disp_tv_mode m = mode_table[i].mode;
+            if (g_de_version == DE_VERSION_1 && m >= DISP_TV_MOD_3840_2160P_30HZ) continue;
+            probed |= 1u << m;
+            if (hdmi_mode_supported(m) > 0) supported |= 1u << m;
+        }
+    }
+    printf("\"modes\":{\"source\":\"%s\",\"probed\":%u,\"supported\":%u,\"names\":[",
+           fast ? "cache" : (g_edid.valid ? "edid" : "driver"), probed, supported);
+    for (int i = 0, n = 0; mode_table[i].name != NULL; i++) {
+        if (!(supported & (1u << mode_table[i].mode))) continue;
+        printf("%s\"%s\"", n++ ? "," : "", mode_table[i].name);
+    }
+    printf("]},");
+
+    if (!fast && hpd != 0 && edid_load() == 0) {
+        printf("\"sink\":{\"name\":");
+        json_print_str(g_edid.name);
+        printf(",\"native\":[%u,%u,%u],\"preferred\":", g_edid.native_w, g_edid.native_h,
+               g_edid.native_refresh);
+        info = g_edid.preferred >= 0 ? get_mode_info((disp_tv_mode)g_edid.preferred) : NULL;
+        if (info) printf("\"%s\"}", info->name);
+        else printf("null}");
+    } else {
+        printf("\"sink\":null");
+    }
+    printf("}\n");
+}
+
+static void show_edid(void)
+{
+    const mode_info_t *info;
+
+    if (edid_load() < 0) {
+        printf("No valid EDID (sink disconnected or not exported by driver)\n");
+        return;
+    }
+
+    printf("=== Sink EDID (%s) ===\n\n", g_edid.source);
+    printf("Monitor name: %s\n", g_edid.name[0] ? g_edid.name : "(none)");
+    printf("Native timing: %ux%u @ %uHz\n",
+           g_edid.native_w, g_edid.native_h, g_edid.native_refresh);
+    info = g_edid.preferred >= 0 ? get_mode_info((disp_tv_mode)g_edid.preferred) : NULL;
+    printf("Preferred mode: %s\n", info ? info->name : "(not in mode table)");
+    printf("Supported modes (0x%08x):", g_edid.supported);
+    for (int i = 0; mode_table[i].name != NULL; i++) {
+        if ((g_edid.supported >> mode_table[i].mode) & 1)
+            printf(" %s", mode_table[i].name);
+    }
+    printf("\n");
+}
+
+static void show_caps(void)
+{
+    printf("=== Capability Cache (" CAPS_CACHE ") ===\n\n");
+    printf("Kernel: %s\n", g_caps.kernel);
+    printf("Board: %s\n", g_caps.board[0] ? g_caps.board : "(unknown)");
+    printf("Boot ID: %s\n", g_caps.boot_id);
+    printf("Display Engine: %s\n", de_version_name((de_version_t)g_caps.de_version));
+    printf("Screens: %u\n", g_caps.screen_count);
+    for (uint32_t i = 0; i < g_caps.screen_count; i++) {
+        printf("Screen %u modes: probed 0x%08x supported 0x%08x (sink %08x)\n",
+               i, g_caps.mode_probed[i], g_caps.mode_supported[i], g_caps.sink_id[i]);
+    }
+}
+
+/*
+ * mem [WxHxDEPTH [buffers]]: framebuffer and CMA footprint. With a
+ * configuration, also show what it would need and whether it fits.
+ */
+static int show_mem(int argc, char *argv[])
+{
+    struct fb_var_screeninfo vinfo;
+    struct fb_fix_screeninfo finfo;
+    long cma_total = meminfo_kb("CmaTotal");
+    long cma_free = meminfo_kb("CmaFree");
+    size_t page_bytes, used;
+    uint32_t nbuf;
+
+    if (get_fb_info(&vinfo, &finfo) < 0) {
+        fprintf(stderr, "Failed to read framebuffer info\n");
+        return 1;
+    }
+
+    page_bytes = (size_t)finfo.line_length * vinfo.yres;
+    used = (size_t)finfo.line_length * vinfo.yres_virtual;
+    nbuf = vinfo.yres ? vinfo.yres_virtual / vinfo.yres : 0;
+
+    printf("=== Framebuffer Memory ===\n");
+    printf("smem_start: 0x%lx\n", finfo.smem_start);
+    printf("smem_len: %u bytes (%.2f MiB)\n", finfo.smem_len, finfo.smem_len / 1048576.0);
+    printf("Visible: %ux%u @ %u bpp, line_length %u\n",
+           vinfo.xres, vinfo.yres, vinfo.bits_per_pixel, finfo.line_length);
+    printf("Per buffer: %zu bytes (%.2f MiB)\n", page_bytes, page_bytes / 1048576.0);
+    printf("Virtual: %ux%u = %u buffer%s, %zu bytes used\n",
+           vinfo.xres_virtual, vinfo.yres_virtual, nbuf, nbuf == 1 ? "" : "s", used);
+    if (finfo.smem_len > used)
+        printf("Unused tail of allocation: %zu bytes (%.2f MiB)\n",
+               finfo.smem_len - used, (finfo.smem_len - used) / 1048576.0);
+    if (nbuf > 1)
+        printf("Dropping to 1 buffer would free %.2f MiB\n",
+               (used - page_bytes) / 1048576.0);
+
+    printf("\n=== CMA ===\n");
+    if (cma_total < 0 || cma_free < 0) {
+        printf("Not reported in " MEMINFO " (kernel without CMA, FB from a carveout)\n");
+    } else {
+        printf("Total: %.1f MiB, free: %.1f MiB (%.0f%%)\n", cma_total / 1024.0,
+               cma_free / 1024.0, cma_total ? 100.0 * cma_free / cma_total : 0);
+        printf("Framebuffer share: %.1f%% of CMA\n",
+               cma_total ? 100.0 * finfo.smem_len / 1024 / cma_total : 0);
+    }
+
+    if (argc >= 1) {
+        uint32_t w, h, b = 1;
+        int depth;
+        long need;
+
+        if (parse_resolution_depth(argv[0], &w, &h, &depth) < 0 || check_depth(depth) < 0) {
+            fprintf(stderr, "Invalid format. Use: WxHxDEPTH\n");
+            return 1;
+        }
+        if (argc >= 2) {
+            b = (uint32_t)atoi(argv[1]);
+            if (b < 1 || b > 3) {
+                fprintf(stderr, "Invalid buffer count: %s (use 1, 2 or 3)\n", argv[1]);
+                return 1;
+            }
+        }
+        need = (long)(((uint64_t)w * h * b * (depth / 8) + 4095) / 4096 * 4);
+        printf("\n=== %ux%u @ %d bpp, %u buffer%s ===\n", w, h, depth, b, b == 1 ? "" : "s");
+        printf("Needs: %.2f MiB (%+.2f MiB vs current)\n", need / 1024.0,
+               (need - (long)(finfo.smem_len / 1024)) / 1024.0);
+        fb_mem_check(w, h * b, depth, finfo.smem_len);
+    }
+    return 0;
+}
+
+static void show_debug_info(void)
+{
+    printf("=== Structure Size Debug Info ===\n\n");
+
+    printf("Display Engine: %s\n\n", de_version_name(g_de_version));
+
+    printf("Basic types:\n");
+    printf("  sizeof(__bool)     = %zu\n", sizeof(__bool));
+    printf("  sizeof(__u8)       = %zu\n", sizeof(__u8));
+    printf("  sizeof(__u16)      = %zu\n", sizeof(__u16));
+    printf("  sizeof(__u32)      = %zu\n", sizeof(__u32));
+    printf("  sizeof(__s32)      = %zu\n", sizeof(__s32));
+    printf("  sizeof(bool)       = %zu\n", sizeof(bool));
+    printf("  sizeof(enum)       = %zu\n", sizeof(disp_tv_mode));
+
+    printf("\nCommon structures:\n");
+    printf("  sizeof(disp_rect)    = %zu\n", sizeof(disp_rect));
+    printf("  sizeof(disp_rectsz)  = %zu\n", sizeof(disp_rectsz));
+
+    printf("\nDE1 structures:\n");
+    printf("  sizeof(de1_fb_t)             = %zu (expected: 64)\n", sizeof(de1_fb_t));
+    printf("  sizeof(de1_layer_info_t)     = %zu (expected: 116)\n", sizeof(de1_layer_info_t));
+    printf("  sizeof(de1_fb_create_para_t) = %zu (expected: 56)\n", sizeof(de1_fb_create_para_t));
+
+    printf("\nDE2 structures:\n");
+    printf("  sizeof(de2_fb_info)       = %zu\n", sizeof(de2_fb_info));
+    printf("  sizeof(de2_layer_info)    = %zu\n", sizeof(de2_layer_info));
+    printf("  sizeof(de2_layer_config)  = %zu\n", sizeof(de2_layer_config));
+    printf("  sizeof(de2_fb_create_info)= %zu\n", sizeof(de2_fb_create_info));
+    printf("  sizeof(de2_rect64)        = %zu\n", sizeof(de2_rect64));
+}
+
+/*
+ * ============================================================================
+ * Argument Parsing
+ * ============================================================================
+ */
+static int parse_resolution(const char *str, uint32_t *width, uint32_t *height, uint32_t *refresh)
+{
+    uint32_t dummy_refresh = 0;
+    uint32_t *refresh_ptr = refresh ? refresh : &dummy_refresh;
+
+    *refresh_ptr = 0;
+    if (sscanf(str, "%ux%u@%u", width, height, refresh_ptr) >= 2) return 0;
+    if (sscanf(str, "%ux%u", width, height) == 2) return 0;
+    return -1;
+}
+
+static int parse_resolution_depth(const char *str, uint32_t *width, uint32_t *height, int *depth)
+{
+    if (sscanf(str, "%ux%ux%d", width, height, depth) == 3) return 0;
+    return -1;
+}
+
+/*
+ * ============================================================================
+ * Usage
+ * ============================================================================
+ */
+static void print_usage(const char *prog)
+{
+    printf("Sunxi HDMI and Framebuffer Control Utility\n");
+    printf("Supports A10/A20 (DE1) and H3/H5/A64 (DE2)\n\n");
+    printf("Usage: %s [-v] [-f] [-n] [-r] [-b n] [-s screen] [-c] [-S socket] <command> [options]\n\n", prog);
+    printf("Options:\n");
+    printf("  -v                            Verbose output\n");
+    printf("  -f                            Force mode (bypass EDID check)\n");
+    printf("  -s <screen>[,<screen>]        Select screen (0 or 1); 0,1 runs on both in parallel\n");
+    printf("  -n                            Ignore the capability cache\n");
+    printf("  -r                            Re-apply even if the state already matches\n");
+    printf("  -b <1|2|3>                    Framebuffer buffer count for fb set/scale\n");
+    printf("  -c                            Forward command to running daemon\n");
+    printf("  --stats[=json]                Print per-ioctl latency statistics\n");
+    printf("  -S <socket>                   Daemon socket (default " DAEMON_SOCKET ")\n\n");
+    printf("Commands:\n");
+    printf("  info [--json] [--fast]        Show display and framebuffer info (--fast: no probing)\n");
+    printf("  debug                         Show structure sizes for debugging\n");
+    printf("  hdmi on                       Enable HDMI output\n");
+    printf("  hdmi off                      Disable HDMI output\n");
+    printf("  hdmi mode <name|num>          Set HDMI mode\n");
+    printf("  hdmi init <W>x<H>[@Hz]        Initialize HDMI with resolution\n");
+    printf("  hdmi preferred                Set the sink's preferred mode (from EDID)\n");
+    printf("  hdmi match <fps> [WxH]        Switch to a judder-free mode for content\n");
+    printf("  hdmi match restore            Return to the mode before the first match\n");
+    printf("  edid                          Show the parsed sink EDID\n");
+    printf("  fb set <W>x<H>x<depth>        Set framebuffer resolution\n");
+    printf("  fb clear [RRGGBB]             Fill all framebuffer pages\n");
+    printf("  fb pattern bars|gradient|checker  Draw a test pattern\n");
+    printf("  fb bwtest [passes]            Measure framebuffer fill/copy/read MB/s\n");
+    printf("  fb load <file> [WxHxD] [back] [flip]  Show a PPM/BMP/raw image\n");
+    printf("  fb damage [frames] [widgets] [flip]   Widget updates via the shadow buffer\n");
+    printf("  fb capture [file|unix:<path>|-] [ppm|raw] [thumb=<W>[x<H>]]  Grab the visible page\n");
+    printf("  fb capture ... --stream [fps=<n>] [sample=<n>]  Send frames when the screen changes\n");
+    printf("  scale <fbW>x<fbH> <scnW>x<scnH> <depth> [fbdev|layer] [alloc]  Setup scaling\n");
+    printf("  autoscale [depth] [alloc]     Scale current FB to screen\n");
+    printf("  noscale [depth] [alloc]       Disable scaling\n");
+    printf("                                alloc: buffers=<1-3> virtual=<W>x<H>\n");
+    printf("  advise [mode] [depth] [fps=<n>] [fill=<Mpix/s>]  Largest FB that scans out cleanly\n");
+    printf("  mem [<W>x<H>x<depth> [bufs]]  Framebuffer and CMA memory report\n");
+    printf("  apply <mode|preferred|-> [fbWxH|native] [depth]  Reconcile to a desired state\n");
+    printf("  switch <mode|-> [WxH[xD]] [timeout=<ms>] [async]  Confirmed switch with rollback\n");
+    printf("  snapshot save [file]          Store the current display state (" SNAPSHOT_FILE ")\n");
+    printf("  snapshot apply [file]         Restore it without detection or EDID probing\n");
+    printf("  watch [-d ms] [<apply profile>]  Re-apply profile on HDMI hotplug\n");
+    printf("  flip [count]                  Page-flip on vsync, report missed vblanks\n");
+    printf("  vsync [measure] [-t s|-n frames] [-o json] [expect=<Hz>] [ppm=<n>]\n");
+    printf("                                Measure refresh rate, jitter and drift\n");
+    printf("  vsync watch [-t s] [-o json] [export=<file>]  Report vblank timing continuously\n");
+    printf("  drs start <ms> [min%%] [n]|frame <ms>|set <pct>|status|stop  DE2 dynamic resolution\n");
+    printf("  overlay set <fmt> <WxH> <addr> [win=X,Y,WxH] [z=N]  DE2 YUV video overlay\n");
+    printf("  overlay frame <addr>|move <X,Y,WxH>|enable|disable|status\n");
+    printf("  layer set <target> [enable|disable] [win=..] [crop=..] [z=N] [alpha=N] [+ ...]\n");
+    printf("                                Update several layers atomically\n");
+    printf("  blank [RRGGBB] [all]          Show a solid colour, HDMI stays up (all: DE2 cover)\n");
+    printf("  unblank                       Show the framebuffer again\n");
+    printf("  bench [-i n] [-o csv|json] [mode ...]  Time mode switch and scaling setup\n");
+    printf("  stress [-i n|-t s] [-w s] [-o csv|json] [scale[=WxH]] [hpd] [mode ...]\n");
+    printf("                                Cycle modes/scaling, track failures and latency\n");
+    printf("  daemon                        Keep display open, serve commands on socket\n");
+    printf("  cache show|clear              Show or drop the capability cache\n");
+    printf("  batch <cmd ; cmd ...>|@file|- Run several commands in one session\n");
+    printf("  screens <N cmd ; N cmd ...>|@file|-  Per-screen profile, screens in parallel\n");
+    printf("\nHDMI modes:\n");
+    for (int i = 0; mode_table[i].name != NULL; i++) {
+        printf("  %2d  %-8s  %4dx%d @%dHz\n",
+               mode_table[i].mode, mode_table[i].name,
+               mode_table[i].width, mode_table[i].height,
+               mode_table[i].refresh);
+    }
+    printf("\nExamples:\n");
+    printf("  %s info\n", prog);
+    printf("  %s hdmi mode 720p60\n", prog);
+    printf("  %s scale 640x480 1280x720 32\n", prog);
+    printf("  %s scale 1280x720 1920x1080 32 layer\n", prog);
+    printf("  %s autoscale\n", prog);
+    printf("  %s noscale\n", prog);
+    printf("  %s watch preferred native 32\n", prog);
+    printf("  %s daemon &\n", prog);
+    printf("  %s -c hdmi mode 1080p60\n", prog);
+    printf("  %s batch 'hdmi mode 1080p60; scale 1280x720 1920x1080 32; info'\n", prog);
+}
+
+/*
+ * ============================================================================
+ * Command Dispatch
+ * ============================================================================
+ */
+static const char *g_prog = "sunxi_hdmi_fb";
+
+/* "-s N" selects one screen, "-s 0,1" several (run in parallel) */
+static int parse_screen_list(const char *str)
+{
+    uint32_t mask = 0, first = 0;
+    int count = 0;
+    char *end;
+
+    do {
+        unsigned long s = strtoul(str, &end, 10);
+        if (end == str || s >= CAPS_MAX_SCREENS || (*end != ',' && *end != '\0')) return -1;
+        if (!(mask & (1u << s))) {
+            if (count++ == 0) first = (uint32_t)s;
+            mask |= 1u << s;
+        }
+        str = end + 1;
+    } while (*end == ',');
+
+    g_screen = first;
+    g_screen_mask = count > 1 ? mask : 0;
+    return 0;
+}
+
+/*
+ * Parse leading options. Returns the number of arguments consumed,
+ * -1 on error or -2 if help was requested. nested is set for a daemon
+ * request or a batch step: -c and -S configure the process and are
+ * refused there.
+ */
+static int parse_options(int argc, char *argv[], int nested)
+{
+    int i = 0;
+
+    while (i < argc && argv[i][0] == '-') {
+        if (strcmp(argv[i], "-v") == 0) {
+            g_verbose = 1;
+            i++;
+        }
+        else if (strcmp(argv[i], "-f") == 0) {
+            g_force = 1;
+            i++;
+        }
+        else if (strcmp(argv[i], "-s") == 0 && i + 1 < argc) {
+            if (parse_screen_list(argv[i + 1]) < 0) {
+                fprintf(stderr, "Invalid screen: %s\n", argv[i + 1]);
+                return -1;
+            }
+            i += 2;
+        }
+        else if (strcmp(argv[i], "-r") == 0) {
+            g_reapply = 1;
+            i++;
+        }
+        else if (strcmp(argv[i], "-b") == 0 && i + 1 < argc) {
+            g_buffers = (uint32_t)atoi(argv[i + 1]);
+            if (g_buffers < 1 || g_buffers > 3) {
+                fprintf(stderr, "Invalid buffer count: %s (use 1, 2 or 3)\n", argv[i + 1]);
+                return -1;
+            }
+            i += 2;
+        }
+        else if (strcmp(argv[i], "--stats") == 0) {
+            g_stats = 1;
+            i++;
+        }
+        else if (strcmp(argv[i], "--stats=json") == 0) {
+            g_stats = 2;
+            i++;
+        }
+        else if (strcmp(argv[i], "-n") == 0) {
+            g_no_cache = 1;
+            i++;
+        }
+        else if (nested && (strcmp(argv[i], "-c") == 0 || strcmp(argv[i], "-S") == 0)) {
+            fprintf(stderr, "Option %s is not allowed in a daemon request or batch\n", argv[i]);
+            return -1;
+        }
+        else if (strcmp(argv[i], "-c") == 0) {
+            g_client = 1;
+            i++;
+        }
+        else if (strcmp(argv[i], "-S") == 0 && i + 1 < argc) {
+            g_socket_path = argv[i + 1];
+            i += 2;
+        }
+        else if (strcmp(argv[i], "-h") == 0 || strcmp(argv[i], "--help") == 0) {
+            return -2;
+        }
+        else {
+            fprintf(stderr, "Unknown option: %s\n", argv[i]);
+            return -1;
+        }
+    }
+
+    return i;
+}
+
+static int check_depth(int depth)
+{
+    if (depth != 16 && depth != 24 && depth != 32) {
+        fprintf(stderr, "Invalid depth. Use 16, 24, or 32\n");
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Framebuffer allocation keywords accepted by scale/autoscale/noscale:
+ * buffers=N (like -b) and virtual=WxH. Returns 1 if arg was one of them,
+ * 0 if not, -1 if it was invalid.
+ */
+static int parse_fb_alloc_arg(const char *arg)
+{
+    if (strncmp(arg, "buffers=", 8) == 0) {
+        int n = atoi(arg + 8);
+        if (n < 1 || n > 3) {
+            fprintf(stderr, "Invalid buffer count: %s (use 1, 2 or 3)\n", arg + 8);
+            return -1;
+        }
+        g_buffers = (uint32_t)n;
+        return 1;
+    }
+    if (strncmp(arg, "virtual=", 8) == 0) {
+        if (parse_resolution(arg + 8, &g_virt_w, &g_virt_h, NULL) < 0 ||
+            g_virt_w == 0 || g_virt_h == 0) {
+            fprintf(stderr, "Invalid virtual size: %s\n", arg + 8);
+            return -1;
+        }
+        return 1;
+    }
+    return 0;
+}
+
+/* Optional leading depth, then allocation keywords; depth stays 0 if absent */
+static int parse_depth_alloc_args(int argc, char *argv[], int *depth)
+{
+    int i = 0;
+
+    *depth = 0;
+    if (argc >= 1 && argv[0][0] >= '0' && argv[0][0] <= '9') {
+        *depth = atoi(argv[0]);
+        if (check_depth(*depth) < 0) return -1;
+        i = 1;
+    }
+    for (; i < argc; i++) {
+        int r = parse_fb_alloc_arg(argv[i]);
+        if (r <= 0) {
+            if (r == 0) fprintf(stderr, "Unknown argument: %s\n", argv[i]);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Parse an HDMI mode given by name or number. Returns -1 if unknown;
+ * any number below DISP_TV_MODE_NUM is accepted, as for 'hdmi mode'.
+ */
+static int parse_mode_arg(const char *arg, disp_tv_mode *mode)
+{
+    const mode_info_t *info;
+    char *endptr;
+    long num = strtol(arg, &endptr, 10);
+
+    if (*endptr == '\0' && num >= 0 && num < DISP_TV_MODE_NUM) {
+        *mode = (disp_tv_mode)num;
+        return 0;
+    }
+    info = find_mode_by_name(arg);
+    if (!info) return -1;
+    *mode = info->mode;
+    return 0;
+}
+
+/*
+ * Reconcile the display with a desired state, issuing only the ioctls for
+ * the parts that differ:
+ *   apply <mode|preferred|-> [<fbW>x<fbH>|native] [depth]
+ * "preferred" takes the sink's EDID preferred mode, "-" keeps the current
+ * HDMI mode; "native" (the default) sizes the FB to
+ * the screen. Prints "no-op" when nothing had to change.
+ */
+static int apply_state(int argc, char *argv[])
+{
+    struct fb_var_screeninfo vinfo;
+    uint32_t fb_w = 0, fb_h = 0, scn_w, scn_h;
+    int depth = 0;
+    int changes = 0;
+    int ret;
+
+    if (strcmp(argv[0], "-") != 0) {
+        disp_tv_mode mode;
+        if (strcmp(argv[0], "preferred") == 0) {
+            if (edid_load() < 0 || g_edid.preferred < 0) {
+                fprintf(stderr, "Sink preferred mode unknown (no EDID or not in mode table)\n");
+                return 1;
+            }
+            mode = (disp_tv_mode)g_edid.preferred;
+        } else if (parse_mode_arg(argv[0], &mode) < 0) {
+            fprintf(stderr, "Unknown mode: %s\n", argv[0]);
+            return 1;
+        }
+        ret = hdmi_init(mode);
+        if (ret < 0) return 1;
+        if (ret == 0) {
+            printf("HDMI mode: set to %d\n", mode);
+            changes++;
+        } else {
+            DEBUG("apply: HDMI mode %d already active", mode);
+        }
+    }
+
+    if (argc >= 2 && strcmp(argv[1], "native") != 0 &&
+        parse_resolution(argv[1], &fb_w, &fb_h, NULL) < 0) {
+        fprintf(stderr, "Invalid resolution: %s\n", argv[1]);
+        return 1;
+    }
+    if (argc >= 3) {
+        depth = atoi(argv[2]);
+        if (check_depth(depth) < 0) return 1;
+    }
+
+    if (get_screen_size(&scn_w, &scn_h) < 0) {
+        fprintf(stderr, "Failed to get screen size\n");
+        return 1;
+    }
+    if (fb_w == 0) {
+        fb_w = scn_w;
+        fb_h = scn_h;
+    }
+    if (depth == 0) {
+        depth = (get_fb_info(&vinfo, NULL) == 0) ? (int)vinfo.bits_per_pixel : 32;
+    }
+
+    ret = setup_fb_with_scaling(g_fb_index, fb_w, fb_h, scn_w, scn_h, depth);
+    if (ret < 0) return 1;
+    if (ret == 0) changes++;
+
+    if (changes == 0)
+        printf("Display state: no-op (already %ux%u -> %ux%u @ %dbpp)\n",
+               fb_w, fb_h, scn_w, scn_h, depth);
+    else
+        printf("Display state: %d change%s applied\n", changes, changes == 1 ? "" : "s");
+    return 0;
+}
+
+/*
+ * Mode change, optionally with a framebuffer change, through the async
+ * switch path:
+ *   switch <mode|-> [<fbW>x<fbH>[x<depth>]] [timeout=<ms>] [async]
+ * The mode is confirmed by read-back and the first vblank, and the previous
+ * mode is restored on failure or timeout. The command waits for the result,
+ * except with 'async' in the daemon: the reply is sent as soon as the
+ * switch has started, and the final status (0 done, 1 failed, 2 timed out)
+ * follows on the same connection (see daemon_serve()).
+ */
+static mode_async_t *g_async[CAPS_MAX_SCREENS];    /* Daemon: switch per screen */
+static mode_async_t *g_async_started = NULL;        /* Awaiting its client fd */
+
+/* Release finished switches, and wait for those on the screens in mask */
+static void async_reap(uint32_t mask)
+{
+    for (uint32_t s = 0; s < CAPS_MAX_SCREENS; s++) {
+        mode_async_t *op = g_async[s];
+        int done;
+
+        if (!op) continue;
+        pthread_mutex_lock(&op->lock);
+        done = op->done;
+        pthread_mutex_unlock(&op->lock);
+        if (!done && !(mask & (1u << s))) continue;
+        if (!done) DEBUG("async: waiting for the switch on screen %u", s);
+        mode_async_finish(op, NULL);
+        g_async[s] = NULL;
+    }
+}
+
+static int switch_run(int argc, char *argv[])
+{
+    struct fb_var_screeninfo vinfo;
+    disp_tv_mode mode = (disp_tv_mode)-1;
+    mode_async_t *op, res;
+    uint32_t fb_w = 0, fb_h = 0, timeout_ms = 0;
+    int depth = 0, async = 0, detach = 0;
+    int ret;
+
+    if (argc < 1) {
+        fprintf(stderr, "Usage: switch <mode|-> [<fbW>x<fbH>[x<depth>]] [timeout=<ms>] [async]\n");
+        return 1;
+    }
+    if (strcmp(argv[0], "-") != 0 && parse_mode_arg(argv[0], &mode) < 0) {
+        fprintf(stderr, "Unknown mode: %s\n", argv[0]);
+        return 1;
+    }
+    for (int i = 1; i < argc; i++) {
+        if (strncmp(argv[i], "timeout=", 8) == 0) {
+            timeout_ms = (uint32_t)strtoul(argv[i] + 8, NULL, 10);
+        } else if (strcmp(argv[i], "async") == 0) {
+            async = 1;
+        } else if (parse_resolution_depth(argv[i], &fb_w, &fb_h, &depth) == 0) {
+            if (check_depth(depth) < 0) return 1;
+        } else if (parse_resolution(argv[i], &fb_w, &fb_h, NULL) == 0) {
+            depth = (get_fb_info(&vinfo, NULL) == 0) ? (int)vinfo.bits_per_pixel : 32;
+        } else {
+            fprintf(stderr, "Invalid switch argument: %s\n", argv[i]);
+            return 1;
+        }
+    }
+    if (mode == (disp_tv_mode)-1 && fb_w == 0) {
+        fprintf(stderr, "Nothing to switch\n");
+        return 1;
+    }
+
+    /* One switch per screen; the daemon can hand one per request to its client */
+    if (g_in_daemon && g_screen < CAPS_MAX_SCREENS) {
+        async_reap(1u << g_screen);
+        pthread_mutex_lock(&g_shared_lock);
+        detach = async && !g_async_started;
+        pthread_mutex_unlock(&g_shared_lock);
+    } else if (async) {
+        DEBUG("switch: not in the daemon, waiting for the result");
+    }
+
+    /* Checked here: a detached switch has no terminal for the message */
+    if (mode != (disp_tv_mode)-1 && !g_force && !hdmi_mode_active(mode) &&
+        !hdmi_mode_supported(mode)) {
+        fprintf(stderr, "HDMI mode %d not supported (use -f to force)\n", mode);
+        return 1;
+    }
+
+    op = mode_async_start(mode, fb_w, fb_h, depth, timeout_ms, NULL, detach);
+    if (!op) return 1;
+    if (detach) {
+        pthread_mutex_lock(&g_shared_lock);
+        g_async[g_screen] = op;
+        g_async_started = op;
+        pthread_mutex_unlock(&g_shared_lock);
+        printf("Switch started on screen %u\n", g_screen);
+        return 0;
+    }
+
+    ret = mode_async_finish(op, &res);
+    if (ret < 0 && res.timed_out) {
+        fprintf(stderr, "Switch not confirmed within %u ms, %s\n", res.timeout_ms,
+                res.rolled_back ? "previous mode restored" : "previous mode not restored");
+        return 2;
+    }
+    if (ret < 0) {
+        fprintf(stderr, "Switch failed%s%s%s\n", res.err ? ": " : "",
+                res.err ? strerror(res.err) : "",
+                res.rolled_back ? ", previous mode restored" : "");
+        return 1;
+    }
+    if (ret == STATE_UNCHANGED)
+        printf("Display state: no-op (already active)\n");
+    else
+        printf("Switched screen %u in %.0f ms (mode confirmed after %.0f ms)\n",
+               g_screen, res.total_ms, res.confirm_ms);
+    return 0;
+}
+
+/*
+ * ============================================================================
+ * Request Coalescing
+ * ============================================================================
+ *
+ * 'apply' requests that arrive while another change holds the display lock
+ * are merged rather than queued. Each request first merges its target into
+ * the screen's pending slot in PENDING_FILE and takes a sequence number:
+ * the fields it names replace those of earlier requests, the rest are kept.
+ * Whoever next gets the lock takes the whole merged target, applies it once
+ * through apply_state() and records the last sequence number it covered
+ * with the exit status. The other waiters find that their request is
+ * covered and return with the same status, without touching the display.
+ * A burst of requests during a switch therefore costs one more resync, not
+ * one per request. Taking a target empties the slot, so a later request
+ * starts from its own arguments again.
+ */
+#define PENDING_MAGIC       0x51504853  /* "SHPQ" */
+#define PENDING_VERSION     1
+#define PENDING_MODE_KEEP       (-1)
+#define PENDING_MODE_PREFERRED  (-2)
+
+typedef struct {
+    int32_t  mode;          /* disp_tv_mode or PENDING_MODE_* */
+    uint32_t fb_w, fb_h;    /* 0 = native */
+    int32_t  depth;         /* 0 = keep */
+    uint32_t seq;           /* Last request merged */
+    uint32_t done;          /* Last request applied */
+    int32_t  status;        /* Exit status of the apply that covered done */
+    uint32_t pending;       /* A target is waiting to be taken */
+} pending_slot_t;
+
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    pending_slot_t screen[CAPS_MAX_SCREENS];
+} pending_file_t;
+
+typedef struct {
+    int32_t  mode;
+    uint32_t fb_w, fb_h;
+    int      fb_named;      /* fb (including "native") given */
+    int32_t  depth;
+} apply_target_t;
+
+typedef enum { PENDING_POST, PENDING_TAKE, PENDING_DONE } pending_op_t;
+
+/* Same arguments as apply_state(); 0 or -1 after printing the error */
+static int apply_parse(int argc, char *argv[], apply_target_t *t)
+{
+    memset(t, 0, sizeof(*t));
+    t->mode = PENDING_MODE_KEEP;
+    if (strcmp(argv[0], "preferred") == 0) {
+        t->mode = PENDING_MODE_PREFERRED;
+    } else if (strcmp(argv[0], "-") != 0) {
+        disp_tv_mode mode;
+        if (parse_mode_arg(argv[0], &mode) < 0) {
+            fprintf(stderr, "Unknown mode: %s\n", argv[0]);
+            return -1;
+        }
+        t->mode = mode;
+    }
+    if (argc >= 2) {
+        t->fb_named = 1;
+        if (strcmp(argv[1], "native") != 0 &&
+            parse_resolution(argv[1], &t->fb_w, &t->fb_h, NULL) < 0) {
+            fprintf(stderr, "Invalid resolution: %s\n", argv[1]);
+            return -1;
+        }
+    }
+    if (argc >= 3) {
+        t->depth = atoi(argv[2]);
+        if (check_depth(t->depth) < 0) return -1;
+    }
+    return 0;
+}
+
+/*
+ * One locked read-modify-write of this screen's pending slot:
+ *   POST  merge *t, *seq = the request's number
+ *   TAKE  *t = the merged target and empty the slot, *seq = last covered,
+ *         *status = requests covered; returns 1 instead if request *seq
+ *         was already applied, with its exit status in *status
+ *   DONE  record *seq as applied with *status
+ * Returns -1 if the file is unusable; callers then apply directly.
+ */
+static int pending_update(pending_op_t op, apply_target_t *t, uint32_t *seq, int *status)
+{
+    pending_file_t pf;
+    pending_slot_t *sl;
+    int fd, ret = 0;
+
+    if (g_screen >= CAPS_MAX_SCREENS) return -1;
+    fd = open(PENDING_FILE, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        DEBUG("pending: %s: %s", PENDING_FILE, strerror(errno));
+        return -1;
+    }
+    while (flock(fd, LOCK_EX) < 0) {
+        if (errno != EINTR) {
+            close(fd);
+            return -1;
+        }
+    }
+    if (pread(fd, &pf, sizeof(pf), 0) != (ssize_t)sizeof(pf) ||
+        pf.magic != PENDING_MAGIC || pf.version != PENDING_VERSION) {
+        memset(&pf, 0, sizeof(pf));
+        pf.magic = PENDING_MAGIC;
+        pf.version = PENDING_VERSION;
+    }
+    sl = &pf.screen[g_screen];
+
+    switch (op) {
+        case PENDING_POST:
+            if (!sl->pending) {
+                sl->mode = PENDING_MODE_KEEP;
+                sl->fb_w = sl->fb_h = 0;
+                sl->depth = 0;
+                sl->pending = 1;
+            }
+            if (t->mode != PENDING_MODE_KEEP) sl->mode = t->mode;
+            if (t->fb_named) {
+                sl->fb_w = t->fb_w;
+                sl->fb_h = t->fb_h;
+            }
+            if (t->depth) sl->depth = t->depth;
+            *seq = ++sl->seq;
+            DEBUG("pending: screen %u request %u merged (mode %d, fb %ux%u, depth %d)",
+                  g_screen, *seq, sl->mode, sl->fb_w, sl->fb_h, sl->depth);
+            break;
+        case PENDING_TAKE:
+            if ((int32_t)(sl->done - *seq) >= 0) {
+                *status = sl->status;
+                ret = 1;
+                break;
+            }
+            if (!sl->pending) {
+                /* Taken by a caller that did not finish: apply our own */
+                ret = -1;
+                break;
+            }
+            memset(t, 0, sizeof(*t));
+            t->mode = sl->mode;
+            t->fb_w = sl->fb_w;
+            t->fb_h = sl->fb_h;
+            t->depth = sl->depth;
+            DEBUG("pending: screen %u takes requests %u..%u", g_screen, sl->done + 1, sl->seq);
+            *seq = sl->seq;
+            *status = (int)(sl->seq - sl->done);
+            sl->pending = 0;
+            break;
+        case PENDING_DONE:
+            if ((int32_t)(*seq - sl->done) > 0) {
+                sl->done = *seq;
+                sl->status = *status;
+            }
+            break;
+    }
+
+    if (op != PENDING_TAKE || ret == 0) {
+        if (pwrite(fd, &pf, sizeof(pf), 0) != (ssize_t)sizeof(pf)) {
+            DEBUG("pending: write failed (errno=%d)", errno);
+            ret = -1;
+        }
+    }
+    close(fd);
+    return ret;
+}
+
+/* apply_state() for a merged target */
+static int apply_target(const apply_target_t *t)
+{
+    char mode[16], fb[24], depth[8];
+    char *argv[3] = { mode, fb, depth };
+
+    if (t->mode == PENDING_MODE_KEEP)
+        snprintf(mode, sizeof(mode), "-");
+    else if (t->mode == PENDING_MODE_PREFERRED)
+        snprintf(mode, sizeof(mode), "preferred");
+    else
+        snprintf(mode, sizeof(mode), "%d", t->mode);
+    if (t->fb_w)
+        snprintf(fb, sizeof(fb), "%ux%u", t->fb_w, t->fb_h);
+    else
+        snprintf(fb, sizeof(fb), "native");
+    snprintf(depth, sizeof(depth), "%d", t->depth);
+    return apply_state(t->depth ? 3 : 2, argv);
+}
+
+/*
+ * 'apply' and the hotplug watcher's profile: post the request, wait for
+ * the display lock, then apply the merged target unless a concurrent
+ * caller already did.
+ */
+static int apply_request(int argc, char *argv[])
+{
+    apply_target_t t;
+    uint32_t seq;
+    int ret;
+
+    if (apply_parse(argc, argv, &t) < 0) return 1;
+
+    /* Already holding the lock, or no pending file: nothing to merge with */
+    if (g_lock_depth > 0 || pending_update(PENDING_POST, &t, &seq, NULL) < 0) {
+        if (display_lock() < 0) return 1;
+        ret = apply_state(argc, argv);
+        display_unlock();
+        return ret;
+    }
+
+    if (display_lock() < 0) return 1;
+    switch (pending_update(PENDING_TAKE, &t, &seq, &ret)) {
+        case 1:
+            printf("Display state: merged into a concurrent request (%s)\n",
+                   ret == 0 ? "applied" : "failed");
+            break;
+        case 0:
+            if (ret > 1)
+                printf("Display state: applying %d merged requests\n", ret);
+            ret = apply_target(&t);
+            pending_update(PENDING_DONE, &t, &seq, &ret);
+            break;
+        default:
+            ret = apply_state(argc, argv);
+            break;
+    }
+    display_unlock();
+    return ret;
+}
+
+/*
+ * ============================================================================
+ * Display Snapshots
+ * ============================================================================
+ *
+ * A snapshot is the complete working display state in a small binary
+ * record, meant for early boot:
+ *   snapshot save [file]    capture the current state
+ *   snapshot apply [file]   replay it
+ * Apply takes the DE version and screen from the record instead of
+ * detecting them, does no EDID or mode-support probing (the mode was in
+ * use when the snapshot was taken) and uses the saved screen size. The
+ * remaining steps go through the normal reconcile paths, so booting into
+ * the same configuration costs only the state reads: output type/mode and
+ * the fbdev geometry (plus one LAYER_GET_CONFIG for layer-window scaling).
+ */
+#define SNAP_MAGIC      0x50534853  /* "SHSP" */
+#define SNAP_VERSION    1
+
+#define SNAP_SCALE_FB       0   /* FB allocated at fb_w x fb_h (scaled or 1:1) */
+#define SNAP_SCALE_LAYER    1   /* Layer window: crop of a larger FB */
+
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    char     board[64];         /* Refuse to apply on a different board */
+    uint32_t de_version;
+    uint32_t screen;
+    uint32_t screen_count;
+    uint32_t output_type;       /* DISP_OUTPUT_TYPE_* */
+    uint32_t tv_mode;
+    uint32_t scn_w, scn_h;
+    uint32_t fb_w, fb_h;        /* fbdev allocation (DE1: FB_REQUEST size) */
+    uint32_t virt_w, virt_h;
+    uint32_t depth;
+    uint32_t scale_mode;        /* SNAP_SCALE_* */
+    int32_t  channel, layer;    /* DE2 fbdev layer */
+    uint32_t crop_w, crop_h;    /* Scaled region for SNAP_SCALE_LAYER */
+} snapshot_t;
+
+/* Read and validate a snapshot; errors are only printed if verbose */
+static int snapshot_load(const char *path, snapshot_t *snap, int verbose)
+{
+    char board[64];
+    ssize_t n;
+    int fd;
+
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        if (verbose) fprintf(stderr, "Cannot open snapshot %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+    n = read(fd, snap, sizeof(*snap));
+    close(fd);
+
+    if (n != (ssize_t)sizeof(*snap) || snap->magic != SNAP_MAGIC ||
+        snap->version != SNAP_VERSION) {
+        if (verbose) fprintf(stderr, "%s is not a snapshot from this version\n", path);
+        return -1;
+    }
+    if ((snap->de_version != DE_VERSION_1 && snap->de_version != DE_VERSION_2) ||
+        snap->screen_count < 1 || snap->screen_count > CAPS_MAX_SCREENS ||
+        snap->screen >= snap->screen_count ||
+        (snap->depth != 16 && snap->depth != 24 && snap->depth != 32)) {
+        if (verbose) fprintf(stderr, "Snapshot %s is corrupt\n", path);
+        return -1;
+    }
+
+    snap->board[sizeof(snap->board) - 1] = '\0';
+    read_text_file(BOARD_MODEL, board, sizeof(board));
+    if (strcmp(board, snap->board) != 0) {
+        if (verbose)
+            fprintf(stderr, "Snapshot was taken on \"%s\", this is \"%s\"\n",
+                    snap->board, board);
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Called before disp_open() for "snapshot apply" so that the DE version
+ * comes from the record and detection is skipped altogether.
+ */
+static void snapshot_preload(const char *path)
+{
+    snapshot_t snap;
+
+    if (snapshot_load(path, &snap, 0) < 0) return;  /* apply reports it */
+    if (de_version_set((de_version_t)snap.de_version) < 0) return;
+    g_de_preset = 1;
+    g_screen = snap.screen;
+    /* Not a valid cache record (no magic), so caps_save() leaves it alone */
+    g_caps.de_version = snap.de_version;
+    g_caps.screen_count = snap.screen_count;
+}
+
+static int snapshot_save(const char *path)
+{
+    struct fb_var_screeninfo vinfo;
+    snapshot_t snap;
+    char tmp[256];
+    int fd;
+
+    memset(&snap, 0, sizeof(snap));
+    snap.magic = SNAP_MAGIC;
+    snap.version = SNAP_VERSION;
+    read_text_file(BOARD_MODEL, snap.board, sizeof(snap.board));
+    snap.de_version = g_de_version;
+    snap.screen = g_screen;
+    snap.screen_count = g_caps.screen_count ? g_caps.screen_count : g_screen + 1;
+    snap.channel = snap.layer = -1;
+
+    snap.output_type = (uint32_t)get_output_type();
+    if (snap.output_type == DISP_OUTPUT_TYPE_HDMI)
+        snap.tv_mode = (uint32_t)hdmi_get_mode();
+    if (get_screen_size(&snap.scn_w, &snap.scn_h) < 0 || snap.scn_w == 0) {
+        fprintf(stderr, "Failed to get screen size\n");
+        return -1;
+    }
+    if (get_fb_info(&vinfo, NULL) < 0) {
+        perror("FBIOGET_VSCREENINFO failed");
+        return -1;
+    }
+    snap.fb_w = vinfo.xres;
+    snap.fb_h = vinfo.yres;
+    snap.virt_w = vinfo.xres_virtual;
+    snap.virt_h = vinfo.yres_virtual;
+    snap.depth = vinfo.bits_per_pixel;
+
+    switch (g_de_version) {
+        case DE_VERSION_1: {
+            de1_fb_create_para_t para;
+            /* FB_REQUEST geometry is what de1_setup_fb_with_scaling() compares */
+            de1_layer_info_t info;
+            unsigned long hlayer;
+            int have_para = de1_fb_get_para(g_fb_index, &para) >= 0;
+            if (have_para && para.width && para.height) {
+                snap.fb_w = para.width;
+                snap.fb_h = para.height;
+                snap.virt_w = para.width;
+                snap.virt_h = para.height * (para.buffer_num ? para.buffer_num : 1);
+            }
+            /* Scaler only on the layer: the allocation is the fbdev geometry as is */
+            if (have_para && para.mode != DE1_LAYER_WORK_MODE_SCALER &&
+                de1_fb_layer_handle(&hlayer) == 0 &&
+                de1_layer_get_para(hlayer, &info) >= 0 && info.mode == DE1_LAYER_WORK_MODE_SCALER) {
+                snap.fb_w = vinfo.xres;
+                snap.fb_h = vinfo.yres;
+                snap.virt_w = vinfo.xres_virtual;
+                snap.virt_h = vinfo.yres_virtual;
+                snap.scale_mode = SNAP_SCALE_LAYER;
+                snap.crop_w = info.src_win.width;
+                snap.crop_h = info.src_win.height;
+            }
+            break;
+        }
+        case DE_VERSION_2: {
+            de2_layer_config cfg;
+            uint32_t cw, ch;
+            if (de2_fb_layer_find(&cfg) < 0) break;
+            snap.channel = (int32_t)cfg.channel;
+            snap.layer = (int32_t)cfg.layer_id;
+            cw = (uint32_t)(cfg.info.fb.crop.width >> DE2_CROP_SHIFT);
+            ch = (uint32_t)(cfg.info.fb.crop.height >> DE2_CROP_SHIFT);
+            if ((cw && ch && (cw != vinfo.xres || ch != vinfo.yres)) ||
+                cfg.info.screen_win.width != snap.scn_w ||
+                cfg.info.screen_win.height != snap.scn_h) {
+                snap.scale_mode = SNAP_SCALE_LAYER;
+                snap.crop_w = cw;
+                snap.crop_h = ch;
+            }
+            break;
+        }
+        default:
+            return -1;
+    }
+
+    snprintf(tmp, sizeof(tmp), "%s.%d", path, (int)getpid());
+    fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        fprintf(stderr, "Cannot write %s: %s\n", tmp, strerror(errno));
+        return -1;
+    }
+    if (write(fd, &snap, sizeof(snap)) != (ssize_t)sizeof(snap) ||
+        fsync(fd) < 0 || close(fd) < 0 || rename(tmp, path) < 0) {
+        fprintf(stderr, "Failed to store snapshot %s: %s\n", path, strerror(errno));
+        unlink(tmp);
+        return -1;
+    }
+
+    printf("Snapshot saved to %s: %s, screen %u, ", path,
+           de_version_name(g_de_version), snap.screen);
+    if (snap.output_type == DISP_OUTPUT_TYPE_HDMI) {
+        const mode_info_t *info = get_mode_info((disp_tv_mode)snap.tv_mode);
+        printf("HDMI %s, ", info ? info->name : "?");
+    }
+    printf("FB %ux%u@%u (virtual %ux%u)", snap.fb_w, snap.fb_h, snap.depth,
+           snap.virt_w, snap.virt_h);
+    if (snap.scale_mode == SNAP_SCALE_LAYER)
+        printf(", layer %ux%u", snap.crop_w, snap.crop_h);
+    printf(" -> %ux%u\n", snap.scn_w, snap.scn_h);
+    return 0;
+}
+
+static int snapshot_apply(const char *path)
+{
+    snapshot_t snap;
+    uint32_t saved_vw = g_virt_w, saved_vh = g_virt_h;
+    int changes = 0;
+    int ret;
+
+    if (snapshot_load(path, &snap, 1) < 0) return -1;
+    if (snap.de_version != (uint32_t)g_de_version) {
+        fprintf(stderr, "Snapshot is for %s, running on %s\n",
+                de_version_name((de_version_t)snap.de_version), de_version_name(g_de_version));
+        return -1;
+    }
+    /* The caller holds the display lock of g_screen, so that is the one to change */
+    if (snap.screen != g_screen) {
+        fprintf(stderr, "Snapshot is for screen %u (use -s %u)\n", snap.screen, snap.screen);
+        return -1;
+    }
+
+    /* The mode was in use when saved: no support check, no EDID */
+    if (snap.output_type == DISP_OUTPUT_TYPE_HDMI) {
+        ret = hdmi_set_mode((disp_tv_mode)snap.tv_mode, 1);
+        if (ret < 0) {
+            fprintf(stderr, "Failed to set HDMI mode %u\n", snap.tv_mode);
+            return -1;
+        }
+        if (ret == 0) changes++;
+    }
+
+    g_virt_w = snap.virt_w;
+    g_virt_h = snap.virt_h;
+    if (snap.de_version == DE_VERSION_1 && snap.scale_mode == SNAP_SCALE_LAYER) {
+        /* Do not FB_REQUEST a scaled buffer: only the fbdev geometry is restored */
+        struct fb_var_screeninfo vinfo;
+        ret = STATE_UNCHANGED;
+        if (get_fb_info(&vinfo, NULL) < 0 || vinfo.xres != snap.fb_w ||
+            vinfo.yres != snap.fb_h || vinfo.xres_virtual != snap.virt_w ||
+            vinfo.yres_virtual != snap.virt_h || vinfo.bits_per_pixel != snap.depth)
+            ret = fb_configure(snap.fb_w, snap.fb_h, (int)snap.depth);
+    } else {
+        ret = setup_fb_with_scaling(g_fb_index, snap.fb_w, snap.fb_h, snap.scn_w, snap.scn_h,
+                                    (int)snap.depth);
+    }
+    g_virt_w = saved_vw;
+    g_virt_h = saved_vh;
+    if (ret < 0) return -1;
+    if (ret == 0) changes++;
+
+    if (snap.scale_mode == SNAP_SCALE_LAYER) {
+        /* Seed the fbdev layer lookup so it is a single GET_CONFIG */
+        if (snap.channel >= 0) {
+            g_de2_fb_channel[snap.screen] = snap.channel;
+            g_de2_fb_layer[snap.screen] = snap.layer;
+        }
+        ret = setup_layer_scaling(snap.crop_w, snap.crop_h, snap.scn_w, snap.scn_h,
+                                  (int)snap.depth);
+        if (ret < 0) return -1;
+        if (ret == 0) changes++;
+    }
+
+    if (changes == 0)
+        printf("Snapshot %s: no-op (display already in this state)\n", path);
+    else
+        printf("Snapshot %s: %d change%s applied\n", path, changes, changes == 1 ? "" : "s");
+    return 0;
+}
+
+/*
+ * ============================================================================
+ * Hotplug Watcher
+ * ============================================================================
+ *
+ * watch [-d debounce_ms] [<mode|preferred|-> [fbWxH|native] [depth]]
+ *
+ * Waits for switch-class uevents (NETLINK_KOBJECT_UEVENT) and POLLPRI on
+ * the HPD sysfs attribute. Events are debounced: the HPD state is read
+ * once no further event arrived for debounce_ms. On connect the profile
+ * is re-applied through apply_request(); on disconnect cached sink data is
+ * dropped. If neither event source is available, HPD is sampled.
+ */
+#define WATCH_DEBOUNCE_MS   300
+#define WATCH_SAMPLE_MS     500
+
+static int watch_open_uevent(void)
+{
+    struct sockaddr_nl addr;
+    int fd = socket(AF_NETLINK, SOCK_DGRAM | SOCK_CLOEXEC, NETLINK_KOBJECT_UEVENT);
+
+    if (fd < 0) return -1;
+    memset(&addr, 0, sizeof(addr));
+    addr.nl_family = AF_NETLINK;
+    addr.nl_pid = 0;
+    addr.nl_groups = 1;     /* Kernel uevent multicast group */
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/* True if a uevent message concerns the HDMI switch */
+static int watch_is_hdmi_uevent(const char *buf, size_t len)
+{
+    int is_switch = 0, is_hdmi = 0;
+
+    for (size_t pos = 0; pos < len; pos += strlen(&buf[pos]) + 1) {
+        const char *kv = &buf[pos];
+        if (strcmp(kv, "SUBSYSTEM=switch") == 0) is_switch = 1;
+        else if (strncmp(kv, "SWITCH_NAME=", 12) == 0 && strstr(kv + 12, "hdmi")) is_hdmi = 1;
+        else if (strncmp(kv, "DEVPATH=", 8) == 0 && strstr(kv + 8, "hdmi")) is_hdmi = 1;
+    }
+    return is_switch && is_hdmi;
+}
+
+static int watch_read_hpd_fd(int fd)
+{
+    char buf[16];
+    ssize_t n;
+
+    if (lseek(fd, 0, SEEK_SET) < 0) return -1;
+    n = read(fd, buf, sizeof(buf) - 1);
+    if (n <= 0) return -1;
+    buf[n] = '\0';
+    return atoi(buf);
+}
+
+static int watch_run(int argc, char *argv[])
+{
+    char *default_profile[] = { "-" };
+    char **profile = default_profile;
+    int nprofile = 1;
+    int debounce_ms = WATCH_DEBOUNCE_MS;
+    struct pollfd pfd[2];
+    struct timespec t_event;
+    int ev_fd, hpd_fd, nfds = 0;
+    int state, pending = 0, events = 0;
+
+    if (argc >= 2 && strcmp(argv[0], "-d") == 0) {
+        debounce_ms = atoi(argv[1]);
+        if (debounce_ms < 0) debounce_ms = 0;
+        argc -= 2;
+        argv += 2;
+    }
+    if (argc >= 1) {
+        profile = argv;
+        nprofile = argc;
+    }
+
+    ev_fd = watch_open_uevent();
+    hpd_fd = open(HDMI_STATE, O_RDONLY | O_CLOEXEC);
+    if (ev_fd >= 0) {
+        pfd[nfds].fd = ev_fd;
+        pfd[nfds].events = POLLIN;
+        nfds++;
+    }
+    if (hpd_fd >= 0) {
+        watch_read_hpd_fd(hpd_fd);  /* Arm POLLPRI */
+        pfd[nfds].fd = hpd_fd;
+        pfd[nfds].events = POLLPRI | POLLERR;
+        nfds++;
+    }
+    if (ev_fd < 0)
+        printf("uevent netlink unavailable, sampling HPD every %d ms\n", WATCH_SAMPLE_MS);
+
+    install_stop_handlers();
+
+    state = hdmi_get_hpd();
+    printf("Watching HDMI hotplug (debounce %d ms), sink %s\n", debounce_ms,
+           state > 0 ? "connected" : (state == 0 ? "disconnected" : "unknown"));
+    if (state > 0) {
+        apply_request(nprofile, profile);
+    }
+    fflush(stdout);
+
+    while (!g_stop_requested) {
+        int timeout;
+        int r;
+
+        if (pending) {
+            timeout = debounce_ms - (int)elapsed_ms(&t_event);
+            if (timeout < 0) timeout = 0;
+        } else {
+            timeout = (ev_fd < 0) ? WATCH_SAMPLE_MS : -1;
+        }
+
+        r = poll(pfd, nfds, timeout);
+        if (r < 0) {
+            if (errno == EINTR) continue;
+            perror("poll failed");
+            break;
+        }
+
+        for (int i = 0; i < nfds && r > 0; i++) {
+            if (!pfd[i].revents) continue;
+            if (pfd[i].fd == ev_fd) {
+                char buf[4096];
+                ssize_t n = recv(ev_fd, buf, sizeof(buf) - 1, MSG_DONTWAIT);
+                if (n <= 0) continue;
+                buf[n] = '\0';
+                if (!watch_is_hdmi_uevent(buf, (size_t)n)) continue;
+                DEBUG("watch: HDMI uevent");
+            } else {
+                watch_read_hpd_fd(hpd_fd);
+                DEBUG("watch: HPD sysfs notify");
+            }
+            /* Every event restarts the debounce window */
+            clock_gettime(CLOCK_MONOTONIC, &t_event);
+            if (!pending) events = 0;
+            pending = 1;
+            events++;
+        }
+
+        if (r == 0 && (pending || ev_fd < 0)) {
+            struct timespec t_apply;
+            int new_state = hdmi_get_hpd();
+            double settle_ms = pending ? elapsed_ms(&t_event) : 0;
+
+            pending = 0;
+            if (new_state == state) {
+                if (events > 0)
+                    DEBUG("watch: %d event(s), state unchanged (%d)", events, state);
+                events = 0;
+                continue;
+            }
+
+            state = new_state;
+            edid_reset();
+            caps_clear_modes(g_screen);
+
+            if (state > 0) {
+                clock_gettime(CLOCK_MONOTONIC, &t_apply);
+                printf("Hotplug: connected (%d event%s)\n", events, events == 1 ? "" : "s");
+                int ret = apply_request(nprofile, profile);
+                printf("Hotplug: profile %s in %.1f ms (%.1f ms after last event)\n",
+                       ret == 0 ? "applied" : "FAILED", elapsed_ms(&t_apply),
+                       settle_ms + elapsed_ms(&t_apply));
+            } else {
+                printf("Hotplug: disconnected (%d event%s)\n", events, events == 1 ? "" : "s");
+            }
+            caps_save();
+            events = 0;
+            fflush(stdout);
+        }
+    }
+
+    if (ev_fd >= 0) close(ev_fd);
+    if (hpd_fd >= 0) close(hpd_fd);
+    printf("Watch stopped\n");
+    return 0;
+}
+
+/*
+ * ============================================================================
+ * Scaling Advice
+ * ============================================================================
+ *
+ * Recommends a framebuffer size for a mode from the scaler capability model:
+ * the largest one that scans out cleanly and, with a fill target, that the
+ * application can redraw fps times a second within fill Mpix/s.
+ */
+static const uint32_t advise_heights[] = { 2160, 1440, 1200, 1080, 900, 768, 720, 576, 540, 480, 360, 0 };
+
+/* advise [mode] [depth] [fps=<n>] [fill=<Mpix/s>] */
+static int advise_run(int argc, char *argv[])
+{
+    const scaler_caps_t *c = scaler_caps();
+    const mode_info_t *info = NULL;
+    struct fb_var_screeninfo vinfo;
+    uint32_t out_w, out_h, w, h;
+    double hz, fps = 0, fill = 0, load;
+    int depth = 0;
+    char why[96];
+
+    for (int i = 0; i < argc; i++) {
+        if (strncmp(argv[i], "fps=", 4) == 0) {
+            fps = atof(argv[i] + 4);
+            if (fps <= 0) {
+                fprintf(stderr, "Invalid fps: %s\n", argv[i] + 4);
+                return 1;
+            }
+        } else if (strncmp(argv[i], "fill=", 5) == 0) {
+            fill = atof(argv[i] + 5);
+            if (fill <= 0) {
+                fprintf(stderr, "Invalid fill rate: %s\n", argv[i] + 5);
+                return 1;
+            }
+        } else if (argv[i][strspn(argv[i], "0123456789")] == '\0') {
+            depth = atoi(argv[i]);
+            if (check_depth(depth) < 0) return 1;
+        } else if (!(info = find_mode_by_name(argv[i]))) {
+            fprintf(stderr, "Unknown mode: %s\n", argv[i]);
+            return 1;
+        }
+    }
+    if (!c) {
+        fprintf(stderr, "No scaler model for this display engine\n");
+        return 1;
+    }
+
+    if (!info && get_output_type() == DISP_OUTPUT_TYPE_HDMI)
+        info = get_mode_info(hdmi_get_mode());
+    if (info) {
+        out_w = info->width;
+        out_h = info->height;
+    } else if (get_screen_size(&out_w, &out_h) < 0) {
+        fprintf(stderr, "Failed to get screen size\n");
+        return 1;
+    }
+    if (depth == 0)
+        depth = get_fb_info(&vinfo, NULL) == 0 && vinfo.bits_per_pixel ? (int)vinfo.bits_per_pixel : 32;
+    hz = scaler_fetch_hz(info);
+    if (fps == 0)
+        fps = info && info->refresh ? info->refresh : 60;
+
+    printf("Display Engine: %s\n", de_version_name(g_de_version));
+    printf("Output: %s %ux%u, %.0f frames/s fetched, %d bpp\n",
+           info ? info->name : "screen", out_w, out_h, hz, depth);
+    printf("Scaler: input <= %ux%u, 1/%u..%ux, %.0f Mpix/s, %.0f MB/s layer fetch\n",
+           c->max_in_w, c->max_in_h, c->max_down, c->max_up, c->max_mpix, c->max_mbs);
+    if (scaler_largest(out_w, out_h, depth, hz, 0, 0, 0, &w, &h) == 0) {
+        scaler_check(w, h, out_w, out_h, depth, hz, why, sizeof(why), &load);
+        printf("Largest scaled FB: %ux%u (%.0f%% of the scaler budget)\n", w, h, load * 100);
+    } else {
+        printf("Largest scaled FB: none\n");
+    }
+    if (scaler_largest(out_w, out_h, depth, hz, fill, fps, 1, &w, &h) == 0) {
+        printf("Recommended FB: %ux%u", w, h);
+        if (fill > 0)
+            printf(" (%.0f Mpix/s at %.0f fps, target %.0f)", (double)w * h * fps / 1e6, fps, fill);
+        printf("\n");
+    } else {
+        printf("Recommended FB: none fits %.0f Mpix/s at %.0f fps\n", fill, fps);
+    }
+
+    printf("\n%-11s %6s %9s  %s\n", "FB", "load", "fill", "status");
+    for (int i = 0; advise_heights[i]; i++) {
+        const char *status = "ok";
+        uint32_t y = advise_heights[i];
+        uint32_t x = y == out_h ? out_w :
+                     (uint32_t)((uint64_t)y * out_w / out_h) & ~(uint32_t)(SCALER_ALIGN - 1);
+        char size[24], pct[8];
+        double rate = (double)x * y * fps / 1e6;
+
+        if (y > out_h) continue;
+        snprintf(size, sizeof(size), "%ux%u", x, y);
+        if (scaler_check(x, y, out_w, out_h, depth, hz, why, sizeof(why), &load) != 0)
+            status = why;
+        else if (fill > 0 && rate > fill)
+            status = "over fill target";
+        else if (x == out_w && y == out_h)
+            status = "ok, native";
+        if (x == out_w && y == out_h)
+            snprintf(pct, sizeof(pct), "-");
+        else
+            snprintf(pct, sizeof(pct), "%.0f%%", load * 100);
+        printf("%-11s %6s %9.0f  %s\n", size, pct, rate, status);
+    }
+    return 0;
+}
+
+/*
+ * ============================================================================
+ * Benchmark
+ * ============================================================================
+ *
+ * A fixed matrix of mode_table entries x framebuffer sizes. Each case sets
+ * the mode (always re-applied), waits for the first vsync, sets up scaling
+ * with setup_fb_with_scaling() and reconfigures fbdev. Results are tagged
+ * with the DE version, kernel release and board, so runs from different
+ * images can be compared. The original mode and FB geometry are restored.
+ */
+#define BENCH_DEPTH 32
+
+static const struct { uint32_t w, h; } bench_fb_sizes[] = {
+    {  720,  480 },
+    { 1280,  720 },
+    { 1920, 1080 },
+    {    0,    0 }    /* Mode's native size */
+};
+
+typedef struct {
+    const mode_info_t *mode;
+    uint32_t    fb_w, fb_h;
+    int         iter;
+    const char *status;
+    double      mode_ms, vsync_ms, scale_ms, fbdev_ms;
+} bench_result_t;
+
+static double bench_time(int (*fn)(void *), void *arg, int *ret)
+{
+    struct timespec t0;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    *ret = fn(arg);
+    return elapsed_ms(&t0);
+}
+
+static int bench_set_mode(void *arg)
+{
+    return hdmi_init(((const mode_info_t *)arg)->mode);
+}
+
+static int bench_wait_vsync(void *arg)
+{
+    uint32_t crtc = 0;
+    (void)arg;
+    if (fb_open() < 0) return -1;
+    return fb_ioctl(FBIO_WAITFORVSYNC, &crtc);
+}
+
+static int bench_scale(void *arg)
+{
+    bench_result_t *r = arg;
+    return setup_fb_with_scaling(g_fb_index, r->fb_w, r->fb_h,
+                                 r->mode->width, r->mode->height, BENCH_DEPTH);
+}
+
+static int bench_fbdev(void *arg)
+{
+    bench_result_t *r = arg;
+    return fb_configure(r->fb_w, r->fb_h, BENCH_DEPTH);
+}
+
+/* Each case holds the display lock on its own, so other agents get a turn */
+static void bench_run_case(bench_result_t *r)
+{
+    int ret;
+
+    r->status = "ok";
+    r->mode_ms = r->vsync_ms = r->scale_ms = r->fbdev_ms = -1;
+
+    if (display_lock() < 0) { r->status = "busy"; return; }
+
+    r->mode_ms = bench_time(bench_set_mode, (void *)r->mode, &ret);
+    if (ret < 0) { r->status = "mode_failed"; goto out; }
+
+    r->vsync_ms = bench_time(bench_wait_vsync, NULL, &ret);
+    if (ret < 0) r->vsync_ms = -1;      /* No vsync ioctl on this BSP */
+
+    r->scale_ms = bench_time(bench_scale, r, &ret);
+    if (ret < 0) { r->status = "scale_failed"; goto out; }
+
+    r->fbdev_ms = bench_time(bench_fbdev, r, &ret);
+    if (ret < 0) r->status = "fbdev_failed";
+out:
+    display_unlock();
+}
+
+static void bench_print(FILE *out, int json, const bench_result_t *r, int n)
+{
+    if (json) {
+        fprintf(out, "{\"de\": \"%s\", \"kernel\": \"%s\", \"board\": \"%s\", "
+                "\"screen\": %u, \"depth\": %d, \"results\": [\n",
+                de_version_name(g_de_version), g_caps.kernel, g_caps.board,
+                g_screen, BENCH_DEPTH);
+        for (int i = 0; i < n; i++) {
+            fprintf(out, "  {\"mode\": \"%s\", \"fb\": \"%ux%u\", \"iter\": %d, "
+                    "\"status\": \"%s\", \"mode_set_ms\": %.3f, \"first_vsync_ms\": %.3f, "
+                    "\"scale_ms\": %.3f, \"fbdev_ms\": %.3f}%s\n",
+                    r[i].mode->name, r[i].fb_w, r[i].fb_h, r[i].iter, r[i].status,
+                    r[i].mode_ms, r[i].vsync_ms, r[i].scale_ms, r[i].fbdev_ms,
+                    i + 1 < n ? "," : "");
+        }
+        fprintf(out, "]}\n");
+    } else {
+        fprintf(out, "de,kernel,board,screen,mode,fb,depth,iter,status,"
+                "mode_set_ms,first_vsync_ms,scale_ms,fbdev_ms\n");
+        for (int i = 0; i < n; i++) {
+            fprintf(out, "\"%s\",\"%s\",\"%s\",%u,%s,%ux%u,%d,%d,%s,%.3f,%.3f,%.3f,%.3f\n",
+                    de_version_name(g_de_version), g_caps.kernel, g_caps.board,
+                    g_screen, r[i].mode->name, r[i].fb_w, r[i].fb_h, BENCH_DEPTH,
+                    r[i].iter, r[i].status, r[i].mode_ms, r[i].vsync_ms,
+                    r[i].scale_ms, r[i].fbdev_ms);
+        }
+    }
+    fflush(out);
+}
+
+/* Mode list: as given, or every supported mode_table entry. -1 on a bad name */
+static int bench_modes(int argc, char *argv[], const mode_info_t *modes[DISP_TV_MODE_NUM])
+{
+    int nmodes = 0;
+
+    if (argc > 0) {
+        for (int i = 0; i < argc && nmodes < DISP_TV_MODE_NUM; i++) {
+            const mode_info_t *info = find_mode_by_name(argv[i]);
+            if (!info) {
+                fprintf(stderr, "Unknown mode: %s\n", argv[i]);
+                return -1;
+            }
+            modes[nmodes++] = info;
+        }
+        return nmodes;
+    }
+    for (int i = 0; mode_table[i].name != NULL; i++) {
+        if (g_de_version == DE_VERSION_1 && mode_table[i].mode >= DISP_TV_MOD_3840_2160P_30HZ)
+            continue;
+        if (!g_force && hdmi_mode_supported(mode_table[i].mode) != 1)
+            continue;
+        modes[nmodes++] = &mode_table[i];
+    }
+    return nmodes;
+}
+
+/* bench [-i iterations] [-o csv|json] [mode ...] */
+static int bench_run(int argc, char *argv[])
+{
+    const mode_info_t *modes[DISP_TV_MODE_NUM];
+    struct fb_var_screeninfo orig;
+    bench_result_t *results;
+    disp_tv_mode orig_mode;
+    int nmodes = 0, nres = 0, nfail = 0;
+    int iterations = 1, json = 0;
+    int saved_reapply = g_reapply;
+    int null_fd, out_fd;
+    FILE *out;
+
+    while (argc >= 2 && argv[0][0] == '-') {
+        if (strcmp(argv[0], "-i") == 0) {
+            iterations = atoi(argv[1]);
+            if (iterations < 1) iterations = 1;
+        } else if (strcmp(argv[0], "-o") == 0) {
+            if (strcmp(argv[1], "json") == 0) json = 1;
+            else if (strcmp(argv[1], "csv") != 0) {
+                fprintf(stderr, "Unknown output format: %s (use csv or json)\n", argv[1]);
+                return 1;
+            }
+        } else {
+            break;
+        }
+        argc -= 2;
+        argv += 2;
+    }
+
+    nmodes = bench_modes(argc, argv, modes);
+    if (nmodes < 0) return 1;
+    if (nmodes == 0) {
+        fprintf(stderr, "No supported modes to benchmark (use -f to force all)\n");
+        return 1;
+    }
+
+    if (get_fb_info(&orig, NULL) < 0) {
+        fprintf(stderr, "Failed to read framebuffer settings\n");
+        return 1;
+    }
+    orig_mode = hdmi_get_mode();
+
+    results = calloc((size_t)nmodes * 4 * iterations, sizeof(*results));
+    if (!results) {
+        perror("calloc");
+        return 1;
+    }
+
+    /* The setup helpers print progress; keep it off the report unless -v */
+    fflush(stdout);
+    out_fd = dup(STDOUT_FILENO);
+    out = (out_fd >= 0) ? fdopen(out_fd, "w") : NULL;
+    if (!out) {
+        perror("Failed to duplicate stdout");
+        if (out_fd >= 0) close(out_fd);
+        free(results);
+        return 1;
+    }
+    fprintf(stderr, "Benchmarking %d mode(s) x %d FB size(s) x %d iteration(s) on %s\n",
+            nmodes, 4, iterations, de_version_name(g_de_version));
+    null_fd = g_verbose ? -1 : open("/dev/null", O_WRONLY | O_CLOEXEC);
+    if (null_fd >= 0) dup2(null_fd, STDOUT_FILENO);
+
+    g_reapply = 1;
+    for (int it = 0; it < iterations; it++) {
+        for (int m = 0; m < nmodes; m++) {
+            for (int s = 0; s < 4; s++) {
+                bench_result_t *r = &results[nres];
+                uint32_t w = bench_fb_sizes[s].w ? bench_fb_sizes[s].w : modes[m]->width;
+                uint32_t h = bench_fb_sizes[s].h ? bench_fb_sizes[s].h : modes[m]->height;
+
+                /* The native entry duplicates a fixed size for some modes */
+                if (bench_fb_sizes[s].w == 0 && s > 0) {
+                    int dup = 0;
+                    for (int k = 0; k < s; k++)
+                        if (bench_fb_sizes[k].w == w && bench_fb_sizes[k].h == h) dup = 1;
+                    if (dup) continue;
+                }
+
+                r->mode = modes[m];
+                r->fb_w = w;
+                r->fb_h = h;
+                r->iter = it;
+                bench_run_case(r);
+                if (strcmp(r->status, "ok") != 0) nfail++;
+                nres++;
+            }
+        }
+    }
+
+    /* Restore what was active before the run */
+    if (get_mode_info(orig_mode) && display_lock() == 0) {
+        const mode_info_t *info = get_mode_info(orig_mode);
+        g_reapply = 0;
+        if (hdmi_init(orig_mode) >= 0)
+            setup_fb_with_scaling(g_fb_index, orig.xres, orig.yres, info->width, info->height,
+                                  orig.bits_per_pixel);
+        display_unlock();
+    }
+    g_reapply = saved_reapply;
+
+    fflush(stdout);
+    if (null_fd >= 0) {
+        dup2(out_fd, STDOUT_FILENO);
+        close(null_fd);
+    }
+
+    bench_print(out, json, results, nres);
+    fclose(out);
+    free(results);
+
+    if (nfail)
+        fprintf(stderr, "%d of %d case(s) failed\n", nfail, nres);
+    return nfail ? 1 : 0;
+}
+
+/*
+ * ============================================================================
+ * Stress Test
+ * ============================================================================
+ *
+ * Soak test for kernel qualification: cycles through a set of modes for a
+ * number of iterations or a duration. In each step the mode is set (always
+ * re-applied) and the first vsync is waited for. With 'scale' the step
+ * goes on to a scaled framebuffer and back to 1:1. With 'hpd' it then
+ * cycles HDMI off/on with the EDID and HPD state dropped, which re-runs the
+ * hotplug-dependent paths. Every operation records its latency, return
+ * value and errno, and is read back: hdmi_get_mode() and get_screen_size()
+ * against the requested mode, and the fbdev geometry against the
+ * requested framebuffer. A watchdog (SIGALRM) names the operation that
+ * hung and exits with status 3, so a hang on a bad BSP still leaves a
+ * result.
+ */
+#define STRESS_BUCKETS      14      /* <1 ms, <2, <4, ... <4096, >= 4096 */
+#define STRESS_MAX_FAILS    64
+#define STRESS_WATCHDOG_S   10
+#define STRESS_REPORT_MS    10000   /* Progress line interval (text output) */
+
+typedef enum {
+    STRESS_MODE = 0,
+    STRESS_VSYNC,
+    STRESS_SCALE,
+    STRESS_NOSCALE,
+    STRESS_HPD,
+    STRESS_NOPS
+} stress_op_t;
+
+static const char *const stress_op_names[STRESS_NOPS] = {
+    "mode", "vsync", "scale", "noscale", "hpd"
+};
+
+typedef struct {
+    uint32_t    count;
+    uint32_t    errors;         /* Helper returned < 0 */
+    uint32_t    mismatches;     /* Succeeded, but the read-back differs */
+    double      total_ms, min_ms, max_ms;
+    uint32_t    hist[STRESS_BUCKETS];
+    int         err_no[STATS_MAX_ERRNOS];
+    uint32_t    err_count[STATS_MAX_ERRNOS + 1];    /* Last slot: other */
+} stress_stat_t;
+
+typedef struct {
+    uint32_t        iter;
+    stress_op_t     op;
+    const char     *mode;
+    int             err;
+    char            detail[64];
+} stress_fail_t;
+
+typedef struct {
+    stress_stat_t   stat[STRESS_NOPS];
+    stress_fail_t   fails[STRESS_MAX_FAILS];
+    uint32_t        nfails;         /* All failures, fails[] keeps the first */
+    int             have_vsync;
+    FILE           *log;            /* Per-operation CSV, or NULL */
+} stress_t;
+
+/* For the watchdog: what is running right now */
+static volatile sig_atomic_t g_stress_op = -1;
+static volatile sig_atomic_t g_stress_iter = 0;
+
+static void stress_watchdog(int sig)
+{
+    char msg[80];
+    size_t len = 0;
+    const char *op = g_stress_op >= 0 ? stress_op_names[g_stress_op] : "?";
+    char num[12];
+    int n = 0;
+    uint32_t it = (uint32_t)g_stress_iter;
+
+    (void)sig;
+    /* Only async-signal-safe calls here */
+    for (const char *p = "\nstress: watchdog fired in '"; *p; p++) msg[len++] = *p;
+    while (*op && len < 50) msg[len++] = *op++;
+    for (const char *p = "' at iteration "; *p; p++) msg[len++] = *p;
+    do { num[n++] = (char)('0' + it % 10); it /= 10; } while (it && n < 11);
+    while (n) msg[len++] = num[--n];
+    msg[len++] = '\n';
+    if (write(STDERR_FILENO, msg, len) < 0) { /* nothing left to do */ }
+    _exit(3);
+}
+
+static void stress_record(stress_t *st, stress_op_t op, uint32_t iter, const mode_info_t *m,
+                          double ms, int ret, int err, const char *mismatch)
+{
+    stress_stat_t *s = &st->stat[op];
+    int b = 0;
+
+    s->count++;
+    s->total_ms += ms;
+    if (s->count == 1 || ms < s->min_ms) s->min_ms = ms;
+    if (ms > s->max_ms) s->max_ms = ms;
+    while (b < STRESS_BUCKETS - 1 && ms >= (double)(1u << b)) b++;
+    s->hist[b]++;
+
+    if (ret < 0) {
+        int slot = 0;
+        s->errors++;
+        while (slot < STATS_MAX_ERRNOS && s->err_no[slot] != 0 && s->err_no[slot] != err) slot++;
+        if (slot < STATS_MAX_ERRNOS) s->err_no[slot] = err;
+        s->err_count[slot]++;
+    } else if (mismatch) {
+        s->mismatches++;
+    }
+
+    if (ret < 0 || mismatch) {
+        if (st->nfails < STRESS_MAX_FAILS) {
+            stress_fail_t *f = &st->fails[st->nfails];
+            f->iter = iter;
+            f->op = op;
+            f->mode = m->name;
+            f->err = ret < 0 ? err : 0;
+            snprintf(f->detail, sizeof(f->detail), "%s",
+                     ret < 0 ? strerror(err) : mismatch);
+        }
+        st->nfails++;
+    }
+
+    if (st->log)
+        fprintf(st->log, "%u,%s,%s,%.3f,%d,%d,%s\n", iter, stress_op_names[op], m->name,
+                ms, ret, ret < 0 ? err : 0, ret < 0 ? "error" : mismatch ? mismatch : "ok");
+}
+
+/* Start timing an operation and arm the watchdog */
+static void stress_begin(stress_op_t op, uint32_t iter, uint32_t watchdog_s,
+                         struct timespec *t0)
+{
+    g_stress_op = op;
+    g_stress_iter = (sig_atomic_t)iter;
+    alarm(watchdog_s);
+    errno = 0;
+    clock_gettime(CLOCK_MONOTONIC, t0);
+}
+
+static void stress_end(void)
+{
+    alarm(0);
+    g_stress_op = -1;
+}
+
+/* Compare the display with mode m; NULL if it matches */
+static const char *stress_check_mode(const mode_info_t *m, char *buf, size_t len)
+{
+    disp_tv_mode cur = hdmi_get_mode();
+    uint32_t w = 0, h = 0;
+
+    if (cur != m->mode) {
+        snprintf(buf, len, "mode %d, wanted %d", cur, m->mode);
+        return buf;
+    }
+    if (get_screen_size(&w, &h) < 0 || w != m->width || h != m->height) {
+        snprintf(buf, len, "screen %ux%u, wanted %ux%u", w, h, m->width, m->height);
+        return buf;
+    }
+    return NULL;
+}
+
+/* Compare the fbdev geometry with fb_w x fb_h; NULL if it matches */
+static const char *stress_check_fb(uint32_t fb_w, uint32_t fb_h, char *buf, size_t len)
+{
+    struct fb_var_screeninfo vinfo;
+
+    if (get_fb_info(&vinfo, NULL) < 0) {
+        snprintf(buf, len, "fbdev unreadable");
+        return buf;
+    }
+    if (vinfo.xres != fb_w || vinfo.yres != fb_h) {
+        snprintf(buf, len, "fb %ux%u, wanted %ux%u", vinfo.xres, vinfo.yres, fb_w, fb_h);
+        return buf;
+    }
+    return NULL;
+}
+
+static void stress_step(stress_t *st, const mode_info_t *m, uint32_t iter, uint32_t watchdog_s,
+                        uint32_t scale_w, uint32_t scale_h, int hpd)
+{
+    struct timespec t0;
+    char buf[64];
+    const char *bad;
+    uint32_t crtc = 0;
+    double ms;
+    int ret, err;
+
+    stress_begin(STRESS_MODE, iter, watchdog_s, &t0);
+    ret = hdmi_init(m->mode);
+    err = errno;
+    ms = elapsed_ms(&t0);
+    stress_end();
+    bad = ret >= 0 ? stress_check_mode(m, buf, sizeof(buf)) : NULL;
+    stress_record(st, STRESS_MODE, iter, m, ms, ret, err, bad);
+    if (ret < 0) return;
+
+    if (st->have_vsync && fb_open() == 0) {
+        stress_begin(STRESS_VSYNC, iter, watchdog_s, &t0);
+        ret = fb_ioctl(FBIO_WAITFORVSYNC, &crtc);
+        err = errno;
+        ms = elapsed_ms(&t0);
+        stress_end();
+        if (ret < 0 && st->stat[STRESS_VSYNC].count == 0 && (err == ENOTTY || err == EINVAL)) {
+            st->have_vsync = 0;     /* BSP without FBIO_WAITFORVSYNC, not a failure */
+        } else {
+            stress_record(st, STRESS_VSYNC, iter, m, ms, ret, err, NULL);
+        }
+    }
+
+    if (scale_w) {
+        stress_begin(STRESS_SCALE, iter, watchdog_s, &t0);
+        ret = setup_fb_with_scaling(g_fb_index, scale_w, scale_h, m->width, m->height, BENCH_DEPTH);
+        err = errno;
+        ms = elapsed_ms(&t0);
+        stress_end();
+        bad = ret >= 0 ? stress_check_fb(scale_w, scale_h, buf, sizeof(buf)) : NULL;
+        stress_record(st, STRESS_SCALE, iter, m, ms, ret, err, bad);
+
+        stress_begin(STRESS_NOSCALE, iter, watchdog_s, &t0);
+        ret = setup_fb_with_scaling(g_fb_index, m->width, m->height, m->width, m->height,
+                                    BENCH_DEPTH);
+        err = errno;
+        ms = elapsed_ms(&t0);
+        stress_end();
+        bad = ret >= 0 ? stress_check_fb(m->width, m->height, buf, sizeof(buf)) : NULL;
+        stress_record(st, STRESS_NOSCALE, iter, m, ms, ret, err, bad);
+    }
+
+    if (hpd) {
+        /* Forget what HPD/EDID told us, as after an unplug, and bring HDMI back */
+        stress_begin(STRESS_HPD, iter, watchdog_s, &t0);
+        edid_reset();
+        caps_clear_modes(g_screen);
+        ret = hdmi_off();
+        if (ret >= 0) ret = hdmi_on();
+        err = errno;
+        if (ret >= 0 && hdmi_get_hpd() == 1) hdmi_mode_supported(m->mode);
+        ms = elapsed_ms(&t0);
+        stress_end();
+        bad = NULL;
+        if (ret >= 0 && hdmi_get_hpd() != 1) {
+            snprintf(buf, sizeof(buf), "no sink after HDMI on");
+            bad = buf;
+        } else if (ret >= 0) {
+            bad = stress_check_mode(m, buf, sizeof(buf));
+        }
+        stress_record(st, STRESS_HPD, iter, m, ms, ret, err, bad);
+    }
+}
+
+static void stress_print(FILE *out, int json, const stress_t *st, uint32_t iters, double secs)
+{
+    uint32_t total = 0, failed = 0;
+
+    for (int o = 0; o < STRESS_NOPS; o++) {
+        total += st->stat[o].count;
+        failed += st->stat[o].errors + st->stat[o].mismatches;
+    }
+
+    if (json) {
+        fprintf(out, "{\"de\": \"%s\", \"kernel\": \"%s\", \"board\": \"%s\", \"screen\": %u, "
+                "\"iterations\": %u, \"seconds\": %.1f, \"operations\": %u, \"failed\": %u, "
+                "\"vsync\": %s, \"ops\": {",
+                de_version_name(g_de_version), g_caps.kernel, g_caps.board, g_screen,
+                iters, secs, total, failed, st->have_vsync ? "true" : "false");
+        for (int o = 0, first = 1; o < STRESS_NOPS; o++) {
+            const stress_stat_t *s = &st->stat[o];
+            if (s->count == 0) continue;
+            fprintf(out, "%s\n  \"%s\": {\"count\": %u, \"errors\": %u, \"mismatches\": %u, "
+                    "\"min_ms\": %.3f, \"avg_ms\": %.3f, \"max_ms\": %.3f, \"hist\": [",
+                    first ? "" : ",", stress_op_names[o], s->count, s->errors, s->mismatches,
+                    s->min_ms, s->total_ms / s->count, s->max_ms);
+            for (int b = 0; b < STRESS_BUCKETS; b++)
+                fprintf(out, "%s%u", b ? "," : "", s->hist[b]);
+            fprintf(out, "], \"errno\": {");
+            for (int e = 0, efirst = 1; e <= STATS_MAX_ERRNOS; e++) {
+                if (!s->err_count[e]) continue;
+                if (e < STATS_MAX_ERRNOS)
+                    fprintf(out, "%s\"%d\": %u", efirst ? "" : ", ", s->err_no[e], s->err_count[e]);
+                else
+                    fprintf(out, "%s\"other\": %u", efirst ? "" : ", ", s->err_count[e]);
+                efirst = 0;
+            }
+            fprintf(out, "}}");
+            first = 0;
+        }
+        fprintf(out, "\n}, \"failures\": [");
+        for (uint32_t i = 0; i < st->nfails && i < STRESS_MAX_FAILS; i++) {
+            const stress_fail_t *f = &st->fails[i];
+            fprintf(out, "%s\n  {\"iter\": %u, \"op\": \"%s\", \"mode\": \"%s\", \"errno\": %d, "
+                    "\"detail\": \"%s\"}", i ? "," : "", f->iter, stress_op_names[f->op],
+                    f->mode, f->err, f->detail);
+        }
+        fprintf(out, "%s]}\n", st->nfails ? "\n" : "");
+        fflush(out);
+        return;
+    }
+
+    fprintf(out, "=== Stress: %u iteration(s), %.1f s, %u operation(s), %u failed ===\n",
+            iters, secs, total, failed);
+    fprintf(out, "%s, kernel %s, board %s, screen %u, vsync %s\n\n",
+            de_version_name(g_de_version), g_caps.kernel, g_caps.board, g_screen,
+            st->have_vsync ? "present" : "not available");
+    fprintf(out, "%-8s %7s %6s %8s %9s %9s %9s\n",
+            "op", "count", "errors", "mismatch", "min_ms", "avg_ms", "max_ms");
+    for (int o = 0; o < STRESS_NOPS; o++) {
+        const stress_stat_t *s = &st->stat[o];
+        if (s->count == 0) continue;
+        fprintf(out, "%-8s %7u %6u %8u %9.3f %9.3f %9.3f\n", stress_op_names[o], s->count,
+                s->errors, s->mismatches, s->min_ms, s->total_ms / s->count, s->max_ms);
+        for (int e = 0; e <= STATS_MAX_ERRNOS; e++) {
+            if (!s->err_count[e]) continue;
+            if (e < STATS_MAX_ERRNOS)
+                fprintf(out, "           errno %d (%s): %u\n", s->err_no[e],
+                        strerror(s->err_no[e]), s->err_count[e]);
+            else
+                fprintf(out, "           other errno: %u\n", s->err_count[e]);
+        }
+    }
+
+    fprintf(out, "\nLatency histogram (ms):\n%-8s", "op");
+    for (int b = 0; b < STRESS_BUCKETS; b++) {
+        char label[8];
+        if (b < STRESS_BUCKETS - 1) snprintf(label, sizeof(label), "<%u", 1u << b);
+        else snprintf(label, sizeof(label), ">=%u", 1u << (b - 1));
+        fprintf(out, " %6s", label);
+    }
+    fprintf(out, "\n");
+    for (int o = 0; o < STRESS_NOPS; o++) {
+        if (st->stat[o].count == 0) continue;
+        fprintf(out, "%-8s", stress_op_names[o]);
+        for (int b = 0; b < STRESS_BUCKETS; b++)
+            fprintf(out, " %6u", st->stat[o].hist[b]);
+        fprintf(out, "\n");
+    }
+
+    if (st->nfails) {
+        fprintf(out, "\nFailures%s:\n", st->nfails > STRESS_MAX_FAILS ? " (first 64)" : "");
+        for (uint32_t i = 0; i < st->nfails && i < STRESS_MAX_FAILS; i++) {
+            const stress_fail_t *f = &st->fails[i];
+            fprintf(out, "  iter %u %-8s %-8s %s\n", f->iter, stress_op_names[f->op],
+                    f->mode, f->detail);
+        }
+    }
+    fflush(out);
+}
+
+/*
+ * stress [-i iterations | -t seconds] [-w watchdog_s] [-o csv|json]
+ *        [scale[=WxH]] [hpd] [mode ...]
+ */
+static int stress_run(int argc, char *argv[])
+{
+    const mode_info_t *modes[DISP_TV_MODE_NUM];
+    struct fb_var_screeninfo orig;
+    struct sigaction sa;
+    struct timespec t0;
+    stress_t *st;
+    disp_tv_mode orig_mode;
+    uint32_t iterations = 10, seconds = 0, watchdog_s = STRESS_WATCHDOG_S;
+    uint32_t scale_w = 0, scale_h = 0, iters = 0;
+    int nmodes, json = 0, csv = 0, hpd = 0, failed;
+    int saved_reapply = g_reapply;
+    double next_report_ms;
+    int null_fd, out_fd;
+    FILE *out;
+
+    while (argc >= 2 && argv[0][0] == '-') {
+        if (strcmp(argv[0], "-i") == 0) {
+            iterations = (uint32_t)atoi(argv[1]);
+            if (iterations < 1) iterations = 1;
+        } else if (strcmp(argv[0], "-t") == 0) {
+            seconds = (uint32_t)atoi(argv[1]);
+        } else if (strcmp(argv[0], "-w") == 0) {
+            watchdog_s = (uint32_t)atoi(argv[1]);
+        } else if (strcmp(argv[0], "-o") == 0) {
+            if (strcmp(argv[1], "json") == 0) json = 1;
+            else if (strcmp(argv[1], "csv") == 0) csv = 1;
+            else {
+                fprintf(stderr, "Unknown output format: %s (use csv or json)\n", argv[1]);
+                return 1;
+            }
+        } else {
+            break;
+        }
+        argc -= 2;
+        argv += 2;
+    }
+    while (argc > 0) {
+        if (strcmp(argv[0], "scale") == 0) {
+            scale_w = 1280;
+            scale_h = 720;
+        } else if (strncmp(argv[0], "scale=", 6) == 0) {
+            if (parse_resolution(argv[0] + 6, &scale_w, &scale_h, NULL) < 0) {
+                fprintf(stderr, "Invalid resolution: %s\n", argv[0] + 6);
+                return 1;
+            }
+        } else if (strcmp(argv[0], "hpd") == 0) {
+            hpd = 1;
+        } else {
+            break;
+        }
+        argc--;
+        argv++;
+    }
+
+    nmodes = bench_modes(argc, argv, modes);
+    if (nmodes < 0) return 1;
+    if (nmodes == 0) {
+        fprintf(stderr, "No supported modes to cycle (use -f to force all)\n");
+        return 1;
+    }
+    if (get_fb_info(&orig, NULL) < 0) {
+        fprintf(stderr, "Failed to read framebuffer settings\n");
+        return 1;
+    }
+    orig_mode = hdmi_get_mode();
+
+    st = calloc(1, sizeof(*st));
+    if (!st) {
+        perror("calloc");
+        return 1;
+    }
+    st->have_vsync = 1;
+
+    /* As in bench: helper output stays off the report unless -v */
+    fflush(stdout);
+    out_fd = dup(STDOUT_FILENO);
+    out = (out_fd >= 0) ? fdopen(out_fd, "w") : NULL;
+    if (!out) {
+        perror("Failed to duplicate stdout");
+        if (out_fd >= 0) close(out_fd);
+        free(st);
+        return 1;
+    }
+    if (csv) {
+        st->log = out;
+        fprintf(out, "iter,op,mode,ms,ret,errno,result\n");
+    }
+    if (seconds)
+        fprintf(stderr, "Stress: %d mode(s) for %u s on %s (watchdog %u s)\n",
+                nmodes, seconds, de_version_name(g_de_version), watchdog_s);
+    else
+        fprintf(stderr, "Stress: %d mode(s) x %u iteration(s) on %s (watchdog %u s)\n",
+                nmodes, iterations, de_version_name(g_de_version), watchdog_s);
+    null_fd = g_verbose ? -1 : open("/dev/null", O_WRONLY | O_CLOEXEC);
+    if (null_fd >= 0) dup2(null_fd, STDOUT_FILENO);
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = stress_watchdog;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGALRM, &sa, NULL);
+    install_stop_handlers();
+
+    g_reapply = 1;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    next_report_ms = STRESS_REPORT_MS;
+    while (!g_stop_requested) {
+        if (seconds ? elapsed_ms(&t0) >= seconds * 1000.0 : iters >= iterations) break;
+        for (int m = 0; m < nmodes && !g_stop_requested; m++) {
+            /* Locked per step, so other agents get the display in between */
+            if (display_lock() < 0) {
+                stress_record(st, STRESS_MODE, iters, modes[m], 0, -1, EBUSY, NULL);
+                continue;
+            }
+            stress_step(st, modes[m], iters, watchdog_s, scale_w, scale_h, hpd);
+            display_unlock();
+        }
+        iters++;
+        if (!json && !csv && elapsed_ms(&t0) >= next_report_ms) {
+            fprintf(stderr, "  %u iteration(s), %u failure(s)\n", iters, st->nfails);
+            next_report_ms += STRESS_REPORT_MS;
+        }
+    }
+    signal(SIGALRM, SIG_DFL);
+
+    /* Restore what was active before the run */
+    if (get_mode_info(orig_mode) && display_lock() == 0) {
+        const mode_info_t *info = get_mode_info(orig_mode);
+        g_reapply = 0;
+        if (hdmi_init(orig_mode) >= 0)
+            setup_fb_with_scaling(g_fb_index, orig.xres, orig.yres, info->width, info->height,
+                                  orig.bits_per_pixel);
+        display_unlock();
+    }
+    g_reapply = saved_reapply;
+
+    fflush(stdout);
+    if (null_fd >= 0) {
+        dup2(out_fd, STDOUT_FILENO);
+        close(null_fd);
+    }
+
+    stress_print(csv ? stderr : out, json, st, iters, elapsed_ms(&t0) / 1000.0);
+    fclose(out);
+    failed = st->nfails > 0;
+    free(st);
+    return failed ? 1 : 0;
+}
+
+/*
+ * drs start <target_ms> [min_pct] [hysteresis] | frame <ms> | set <pct> |
+ *     status | stop
+ * The controller state lives in the process, so 'frame' and 'set' are
+ * meant for the daemon (-c) or a batch, where it persists between calls.
+ */
+static int drs_run(int argc, char *argv[])
+{
+    drs_state_t *d = &g_drs[g_screen < CAPS_MAX_SCREENS ? g_screen : 0];
+
+    if (argc < 1) {
+        fprintf(stderr, "Usage: drs start <target_ms> [min_pct] [hysteresis] | frame <ms> | "
+                "set <pct> | status | stop\n");
+        return 1;
+    }
+
+    if (strcmp(argv[0], "start") == 0 && argc >= 2) {
+        double target = atof(argv[1]);
+        if (target <= 0) {
+            fprintf(stderr, "Invalid target frame time: %s\n", argv[1]);
+            return 1;
+        }
+        if (drs_begin(target, argc >= 3 ? atoi(argv[2]) : 0, argc >= 4 ? atoi(argv[3]) : 0) < 0)
+            return 1;
+        printf("Dynamic resolution: %ux%u buffer -> %ux%u, target %.2f ms, "
+               "min %d%%, hysteresis %d frames\n", d->buf_w, d->buf_h, d->scn_w, d->scn_h,
+               d->target_ms, d->min_pct, d->hysteresis);
+        return 0;
+    }
+
+    if (!d->active) {
+        fprintf(stderr, "Dynamic resolution not started on screen %u "
+                "(run 'drs start' in the daemon or batch)\n", g_screen);
+        return 1;
+    }
+
+    if (strcmp(argv[0], "frame") == 0 && argc >= 2) {
+        int r = drs_frame(atof(argv[1]));
+        if (r < 0) return 1;
+        if (r > 0) printf("render %ux%u (%d%%)\n", d->render_w, d->render_h, d->scale_pct);
+    } else if (strcmp(argv[0], "set") == 0 && argc >= 2) {
+        if (drs_set_scale(atoi(argv[1])) < 0) return 1;
+        printf("render %ux%u (%d%%)\n", d->render_w, d->render_h, d->scale_pct);
+    } else if (strcmp(argv[0], "status") == 0) {
+        printf("Screen %u: %d%%, render %ux%u of %ux%u -> %ux%u\n", g_screen, d->scale_pct,
+               d->render_w, d->render_h, d->buf_w, d->buf_h, d->scn_w, d->scn_h);
+        printf("Target %.2f ms, min %d%%, step %d%%, hysteresis %d; %u frames, %u changes\n",
+               d->target_ms, d->min_pct, d->step_pct, d->hysteresis, d->frames, d->changes);
+    } else if (strcmp(argv[0], "stop") == 0) {
+        if (drs_end() < 0) return 1;
+        printf("Dynamic resolution stopped, full %ux%u restored\n", d->buf_w, d->buf_h);
+    } else {
+        fprintf(stderr, "Unknown drs command: %s\n", argv[0]);
+        return 1;
+    }
+    return 0;
+}
+
+/* Parse a screen window "X,Y,WxH" */
+static int parse_window(const char *str, disp_rect *win)
+{
+    if (sscanf(str, "%d,%d,%ux%u", &win->x, &win->y, &win->width, &win->height) == 4 &&
+        win->width > 0 && win->height > 0)
+        return 0;
+    fprintf(stderr, "Invalid window: %s (use X,Y,WxH)\n", str);
+    return -1;
+}
+
+/*
+ * overlay set <fmt> <WxH> <addr> [win=X,Y,WxH] [z=N] [layer=C:L] [bt601|bt709]
+ * overlay frame <addr> | move <X,Y,WxH> | enable | disable | status
+ */
+static int overlay_run(int argc, char *argv[])
+{
+    de2_overlay_t *o;
+    char *end;
+
+    if (g_de_version != DE_VERSION_2) {
+        fprintf(stderr, "Video overlay needs a DE2 VI channel (not available on %s)\n",
+                de_version_name(g_de_version));
+        return 1;
+    }
+    if (argc < 1) {
+        fprintf(stderr, "Usage: overlay set <nv12|nv21|yuv420|yuyv> <WxH> <addr> [win=X,Y,WxH] "
+                "[z=N] [layer=C:L] [bt601|bt709]\n"
+                "       overlay frame <addr> | move <X,Y,WxH> | enable | disable | status\n");
+        return 1;
+    }
+
+    if (strcmp(argv[0], "set") == 0 && argc >= 4) {
+        const de2_overlay_fmt_t *fmt = de2_overlay_fmt_find(argv[1]);
+        unsigned long long addr;
+        uint32_t w, h;
+        disp_rect win = { 0, 0, 0, 0 };
+        int channel = -1, layer = -1, zorder = -1;
+        de2_color_space cs = DE2_BT709;
+
+        if (!fmt) {
+            fprintf(stderr, "Unknown overlay format: %s\n", argv[1]);
+            return 1;
+        }
+        if (parse_resolution(argv[2], &w, &h, NULL) < 0 || w == 0 || h == 0) {
+            fprintf(stderr, "Invalid source size: %s\n", argv[2]);
+            return 1;
+        }
+        addr = strtoull(argv[3], &end, 0);
+        if (*end != '\0' || addr == 0) {
+            fprintf(stderr, "Invalid buffer address: %s\n", argv[3]);
+            return 1;
+        }
+        for (int i = 4; i < argc; i++) {
+            if (strncmp(argv[i], "win=", 4) == 0) {
+                if (parse_window(argv[i] + 4, &win) < 0) return 1;
+            } else if (strncmp(argv[i], "z=", 2) == 0) {
+                zorder = atoi(argv[i] + 2);
+            } else if (strncmp(argv[i], "layer=", 6) == 0) {
+                if (sscanf(argv[i] + 6, "%d:%d", &channel, &layer) != 2 ||
+                    channel < 0 || channel >= DE2_MAX_CHANNELS || layer < 0 || layer >= DE2_MAX_LAYERS) {
+                    fprintf(stderr, "Invalid layer: %s (use channel:layer)\n", argv[i] + 6);
+                    return 1;
+                }
+            } else if (strcmp(argv[i], "bt601") == 0) {
+                cs = DE2_BT601;
+            } else if (strcmp(argv[i], "bt709") == 0) {
+                cs = DE2_BT709;
+            } else {
+                fprintf(stderr, "Unknown overlay option: %s\n", argv[i]);
+                return 1;
+            }
+        }
+        if (win.width == 0 && de2_get_screen_size(&win.width, &win.height) < 0) {
+            fprintf(stderr, "Failed to get screen size\n");
+            return 1;
+        }
+        if (de2_overlay_setup(channel, layer, fmt, w, h, addr, &win, zorder, cs) < 0)
+            return 1;
+        o = de2_overlay_get(-1, -1);
+        printf("Overlay on channel %u layer %u: %s %ux%u -> %d,%d %ux%u, z=%u\n",
+               o->cfg.channel, o->cfg.layer_id, fmt->name, w, h,
+               win.x, win.y, win.width, win.height, o->cfg.info.zorder);
+    }
+    else if (strcmp(argv[0], "frame") == 0 && argc >= 2) {
+        unsigned long long addr = strtoull(argv[1], &end, 0);
+        if (*end != '\0' || addr == 0) {
+            fprintf(stderr, "Invalid buffer address: %s\n", argv[1]);
+            return 1;
+        }
+        if (de2_overlay_frame(addr) < 0) return 1;
+    }
+    else if (strcmp(argv[0], "move") == 0 && argc >= 2) {
+        disp_rect win;
+        if (parse_window(argv[1], &win) < 0 || de2_overlay_move(&win) < 0) return 1;
+        printf("Overlay moved to %d,%d %ux%u\n", win.x, win.y, win.width, win.height);
+    }
+    else if (strcmp(argv[0], "enable") == 0 || strcmp(argv[0], "disable") == 0) {
+        int on = argv[0][0] == 'e';
+        if (de2_overlay_enable(on) < 0) return 1;
+        printf("Overlay %s\n", on ? "enabled" : "disabled");
+    }
+    else if (strcmp(argv[0], "status") == 0) {
+        o = de2_overlay_get(-1, -1);
+        if (!o) return 1;
+        printf("Overlay channel %u layer %u: %s, format %s (0x%x), z=%u\n",
+               o->cfg.channel, o->cfg.layer_id, o->cfg.enable ? "enabled" : "disabled",
+               o->fmt ? o->fmt->name : "non-YUV", o->cfg.info.fb.format, o->cfg.info.zorder);
+        printf("  Source %ux%u, planes 0x%llx 0x%llx 0x%llx\n",
+               o->cfg.info.fb.size[0].width, o->cfg.info.fb.size[0].height,
+               o->cfg.info.fb.addr[0], o->cfg.info.fb.addr[1], o->cfg.info.fb.addr[2]);
+        printf("  Window %d,%d %ux%u\n", o->cfg.info.screen_win.x, o->cfg.info.screen_win.y,
+               o->cfg.info.screen_win.width, o->cfg.info.screen_win.height);
+    }
+    else {
+        fprintf(stderr, "Unknown overlay command: %s\n", argv[0]);
+        return 1;
+    }
+    return 0;
+}
+
+/*
+ * layer set <target> [enable|disable] [win=X,Y,WxH] [crop=X,Y,WxH] [z=N]
+ *     [alpha=N|pixel] [+ <target> ...]
+ * Targets are channel:layer on DE2 and a layer handle on DE1. All targets
+ * are committed as one transaction.
+ */
+static int layer_run(int argc, char *argv[])
+{
+    layer_txn_t txn;
+    layer_change_t c;
+    int have = 0;
+
+    if (argc < 2 || strcmp(argv[0], "set") != 0) {
+        fprintf(stderr, "Usage: layer set <ch:layer|handle> [enable|disable] [win=X,Y,WxH] "
+                "[crop=X,Y,WxH] [z=N] [alpha=N|pixel] [+ <target> ...]\n");
+        return 1;
+    }
+
+    layer_txn_begin(&txn);
+    for (int i = 1; i <= argc; i++) {
+        const char *a = (i < argc) ? argv[i] : "+";
+
+        if (strcmp(a, "+") == 0) {
+            if (have && layer_txn_stage(&txn, &c) < 0) {
+                fprintf(stderr, "Too many layers in one transaction (max %d)\n", LAYER_TXN_MAX);
+                return 1;
+            }
+            have = 0;
+            continue;
+        }
+        if (!have) {
+            memset(&c, 0, sizeof(c));
+            if (g_de_version == DE_VERSION_2) {
+                if (sscanf(a, "%u:%u", &c.channel, &c.layer) != 2 ||
+                    c.channel >= DE2_MAX_CHANNELS || c.layer >= DE2_MAX_LAYERS) {
+                    fprintf(stderr, "Invalid layer: %s (use channel:layer)\n", a);
+                    return 1;
+                }
+            } else {
+                char *end;
+                c.layer = (uint32_t)strtoul(a, &end, 0);
+                if (*end != '\0') {
+                    fprintf(stderr, "Invalid layer handle: %s\n", a);
+                    return 1;
+                }
+            }
+            have = 1;
+        } else if (strcmp(a, "enable") == 0 || strcmp(a, "disable") == 0) {
+            c.set |= LAYER_SET_ENABLE;
+            c.enable = a[0] == 'e';
+        } else if (strncmp(a, "win=", 4) == 0) {
+            if (parse_window(a + 4, &c.win) < 0) return 1;
+            c.set |= LAYER_SET_WIN;
+        } else if (strncmp(a, "crop=", 5) == 0) {
+            if (parse_window(a + 5, &c.crop) < 0) return 1;
+            c.set |= LAYER_SET_CROP;
+        } else if (strncmp(a, "z=", 2) == 0) {
+            c.zorder = atoi(a + 2);
+            c.set |= LAYER_SET_ZORDER;
+        } else if (strncmp(a, "alpha=", 6) == 0) {
+            c.alpha = strcmp(a + 6, "pixel") == 0 ? -1 : atoi(a + 6);
+            if (c.alpha > 255) c.alpha = 255;
+            c.set |= LAYER_SET_ALPHA;
+        } else {
+            fprintf(stderr, "Unknown layer option: %s\n", a);
+            return 1;
+        }
+    }
+
+    if (layer_txn_commit(&txn) < 0) return 1;
+    printf("Committed %d layer change%s\n", txn.count, txn.count == 1 ? "" : "s");
+    return 0;
+}
+
+/* Commands that run until stopped and so cannot be nested or served */
+static int is_long_running(const char *cmd)
+{
+    return strcmp(cmd, "daemon") == 0 || strcmp(cmd, "watch") == 0 ||
+           strcmp(cmd, "batch") == 0 || strcmp(cmd, "screens") == 0 ||
+           strcmp(cmd, "stress") == 0;
+}
+
+/*
+ * Commands that change the display configuration run under display_lock().
+ * 'apply' locks in apply_request() and 'switch' in its worker thread.
+ */
+static int changes_display(int argc, char *argv[])
+{
+    static const char *const cmds[] = {
+        "hdmi", "scale", "autoscale", "noscale", "layer", "blank", "unblank", NULL
+    };
+
+    for (int i = 0; cmds[i]; i++)
+        if (strcmp(argv[0], cmds[i]) == 0) return 1;
+    if (argc < 2) return 0;
+    if (strcmp(argv[0], "fb") == 0) return strcmp(argv[1], "set") == 0;
+    if (strcmp(argv[0], "snapshot") == 0) return strcmp(argv[1], "apply") == 0;
+    if (strcmp(argv[0], "overlay") == 0) return strcmp(argv[1], "status") != 0;
+    return 0;
+}
+
+/*
+ * Run a single command against the already open display device.
+ * argv[0] is the command word. Returns the exit status.
+ */
+static int dispatch_command(int argc, char *argv[])
+{
+    int ret = 0;
+
+    if (!g_force && g_screen >= g_caps.screen_count) {
+        fprintf(stderr, "Screen %u not available (%u screen%s, use -f to force)\n",
+                g_screen, g_caps.screen_count, g_caps.screen_count == 1 ? "" : "s");
+        return 1;
+    }
+
+    /* info command */
+    if (strcmp(argv[0], "info") == 0) {
+        int json = 0, fast = 0;
+        for (int i = 1; i < argc; i++) {
+            if (strcmp(argv[i], "--json") == 0) json = 1;
+            else if (strcmp(argv[i], "--fast") == 0) fast = 1;
+            else {
+                fprintf(stderr, "Unknown info option: %s\n", argv[i]);
+                return 1;
+            }
+        }
+        if (json) show_info_json(fast);
+        else show_info(fast);
+    }
+    /* debug command */
+    else if (strcmp(argv[0], "debug") == 0) {
+        show_debug_info();
+    }
+    /* edid command */
+    else if (strcmp(argv[0], "edid") == 0) {
+        show_edid();
+    }
+    /* cache commands */
+    else if (strcmp(argv[0], "cache") == 0 && argc >= 2) {
+        if (strcmp(argv[1], "show") == 0) {
+            show_caps();
+        }
+        else if (strcmp(argv[1], "clear") == 0) {
+            if (unlink(CAPS_CACHE) < 0 && errno != ENOENT) {
+                perror("Failed to remove " CAPS_CACHE);
+                ret = 1;
+            } else {
+                for (uint32_t i = 0; i < CAPS_MAX_SCREENS; i++)
+                    caps_clear_modes(i);
+                g_caps_dirty = 0;
+                printf("Capability cache cleared\n");
+            }
+        }
+        else {
+            print_usage(g_prog);
+            ret = 1;
+        }
     }
     /* hdmi commands */
-    else if (strcmp(argv[arg_start], "hdmi") == 0 && orig_argc >= arg_start + 2) {
-        if (strcmp(argv[arg_start + 1], "on") == 0) {
+    else if (strcmp(argv[0], "hdmi") == 0 && argc >= 2) {
+        if (strcmp(argv[1], "on") == 0) {
             ret = hdmi_on();
-            if (ret == 0) {
+            if (ret == STATE_UNCHANGED) {
+                printf("HDMI already enabled (no-op)\n");
+                ret = 0;
+            } else if (ret == 0) {
                 /* Read back the actual mode that was set */
                 disp_tv_mode on_mode = hdmi_get_mode();
                 const mode_info_t *info = get_mode_info(on_mode);
@@ -1428,185 +9231,1149 @@ int main(int argc, char *argv[])
                 }
             }
         }
-        else if (strcmp(argv[arg_start + 1], "off") == 0) {
-            ret = hdmi_off();
-            if (ret == 0) printf("HDMI disabled\n");
+        else if (strcmp(argv[1], "off") == 0) {
+            ret = hdmi_off();
+            if (ret == 0) printf("HDMI disabled\n");
+        }
+        else if (strcmp(argv[1], "preferred") == 0) {
+            const mode_info_t *info;
+            if (edid_load() < 0 || g_edid.preferred < 0) {
+                fprintf(stderr, "Sink preferred mode unknown (no EDID or not in mode table)\n");
+                return 1;
+            }
+            info = get_mode_info((disp_tv_mode)g_edid.preferred);
+            ret = hdmi_init(info->mode);
+            if (ret == STATE_UNCHANGED) {
+                printf("HDMI mode %s already active (no-op)\n", info->name);
+                ret = 0;
+            } else if (ret == 0) {
+                printf("HDMI mode set to sink preferred %s (%dx%d @ %dHz)\n",
+                       info->name, info->width, info->height, info->refresh);
+            }
+        }
+        else if (strcmp(argv[1], "mode") == 0 && argc >= 3) {
+            const char *mode_arg = argv[2];
+            const mode_info_t *info = NULL;
+
+            char *endptr;
+            long mode_num = strtol(mode_arg, &endptr, 10);
+            if (*endptr == '\0' && mode_num >= 0 && mode_num < DISP_TV_MODE_NUM) {
+                info = get_mode_info((disp_tv_mode)mode_num);
+                if (!info) {
+                    ret = hdmi_init((disp_tv_mode)mode_num);
+                    if (ret == STATE_UNCHANGED) {
+                        printf("HDMI mode %ld already active (no-op)\n", mode_num);
+                        ret = 0;
+                    } else if (ret == 0) {
+                        printf("HDMI mode set to %ld\n", mode_num);
+                    }
+                }
+            } else {
+                info = find_mode_by_name(mode_arg);
+            }
+
+            if (info) {
+                ret = hdmi_init(info->mode);
+                if (ret == STATE_UNCHANGED) {
+                    printf("HDMI mode %s already active (no-op)\n", info->name);
+                    ret = 0;
+                } else if (ret == 0) {
+                    printf("HDMI mode set to %s (%dx%d @ %dHz)\n",
+                           info->name, info->width, info->height, info->refresh);
+                }
+            } else if (*endptr != '\0') {
+                fprintf(stderr, "Unknown mode: %s\n", mode_arg);
+                ret = 1;
+            }
+        }
+        else if (strcmp(argv[1], "match") == 0 && argc >= 3) {
+            const mode_info_t *info;
+            if (strcmp(argv[2], "restore") == 0) {
+                ret = hdmi_match_restore();
+                if (ret == 1) {
+                    printf("No saved mode to restore\n");
+                    ret = 0;
+                } else if (ret == 0) {
+                    info = get_mode_info(hdmi_get_mode());
+                    printf("HDMI mode restored to %s\n", info ? info->name : "saved mode");
+                } else {
+                    ret = 1;
+                }
+            } else {
+                double fps = atof(argv[2]);
+                uint32_t w = 0, h = 0;
+                const mode_info_t *prev = get_mode_info(hdmi_get_mode());
+
+                if (fps <= 0 || fps > 240) {
+                    fprintf(stderr, "Invalid frame rate: %s\n", argv[2]);
+                    return 1;
+                }
+                if (argc >= 4 && parse_resolution(argv[3], &w, &h, NULL) < 0) {
+                    fprintf(stderr, "Invalid resolution: %s\n", argv[3]);
+                    return 1;
+                }
+                info = hdmi_match(fps, w, h);
+                if (!info) {
+                    ret = 1;
+                } else if (info == prev) {
+                    printf("HDMI mode %s already suits %.3f fps (no-op)\n", info->name, fps);
+                } else {
+                    printf("HDMI mode set to %s (%dx%d @ %dHz) for %.3f fps content\n",
+                           info->name, info->width, info->height, info->refresh, fps);
+                }
+            }
+        }
+        else if (strcmp(argv[1], "init") == 0 && argc >= 3) {
+            uint32_t width, height, refresh;
+            if (parse_resolution(argv[2], &width, &height, &refresh) == 0) {
+                const mode_info_t *info = find_mode_by_resolution(width, height, refresh);
+                if (info) {
+                    ret = hdmi_init(info->mode);
+                    if (ret == STATE_UNCHANGED) {
+                        printf("HDMI mode %s already active (no-op)\n", info->name);
+                        ret = 0;
+                    } else if (ret == 0) {
+                        printf("HDMI initialized: %s (%dx%d @ %dHz)\n",
+                               info->name, info->width, info->height, info->refresh);
+                    }
+                } else {
+                    fprintf(stderr, "No matching mode for %dx%d\n", width, height);
+                    ret = 1;
+                }
+            } else {
+                fprintf(stderr, "Invalid resolution: %s\n", argv[2]);
+                ret = 1;
+            }
+        }
+        else {
+            print_usage(g_prog);
+            ret = 1;
+        }
+    }
+    /* fb commands */
+    else if (strcmp(argv[0], "fb") == 0 && argc >= 2) {
+        if (strcmp(argv[1], "set") == 0 && argc >= 3) {
+            uint32_t width, height;
+            int depth;
+            if (parse_resolution_depth(argv[2], &width, &height, &depth) == 0) {
+                ret = fb_configure(width, height, depth);
+            } else {
+                fprintf(stderr, "Invalid format. Use: WxHxDEPTH\n");
+                ret = 1;
+            }
+        }
+        else if (strcmp(argv[1], "clear") == 0) {
+            ret = fb_clear(argc - 2, &argv[2]);
+        }
+        else if (strcmp(argv[1], "pattern") == 0) {
+            ret = fb_pattern(argc - 2, &argv[2]);
+        }
+        else if (strcmp(argv[1], "bwtest") == 0) {
+            ret = fb_bwtest(argc - 2, &argv[2]);
+        }
+        else if (strcmp(argv[1], "load") == 0) {
+            ret = fb_load(argc - 2, &argv[2]);
+        }
+        else if (strcmp(argv[1], "damage") == 0) {
+            ret = fb_damage_test(argc - 2, &argv[2]);
+        }
+        else if (strcmp(argv[1], "capture") == 0) {
+            ret = fb_capture(argc - 2, &argv[2]);
+        }
+        else {
+            print_usage(g_prog);
+            ret = 1;
+        }
+    }
+    /* scale command */
+    else if (strcmp(argv[0], "scale") == 0 && argc >= 4) {
+        uint32_t fb_width, fb_height, scn_width, scn_height;
+        int depth;
+
+        if (parse_resolution(argv[1], &fb_width, &fb_height, NULL) == 0 &&
+            parse_resolution(argv[2], &scn_width, &scn_height, NULL) == 0) {
+            int use_layer = 0;
+
+            depth = atoi(argv[3]);
+            if (check_depth(depth) < 0) return 1;
+            for (int i = 4; i < argc; i++) {
+                int r;
+                if (strcmp(argv[i], "fbdev") == 0) { use_layer = 0; continue; }
+                if (strcmp(argv[i], "layer") == 0) { use_layer = 1; continue; }
+                r = parse_fb_alloc_arg(argv[i]);
+                if (r < 0) return 1;
+                if (r == 0) {
+                    fprintf(stderr, "Unknown scaling method: %s (use fbdev or layer)\n", argv[i]);
+                    return 1;
+                }
+            }
+            if (scaler_admit(fb_width, fb_height, scn_width, scn_height, depth) < 0)
+                return 1;
+
+            if (use_layer) {
+                if (g_buffers || g_virt_w)
+                    fprintf(stderr, "Note: layer scaling keeps the current allocation, "
+                            "buffers=/virtual= ignored\n");
+                ret = setup_layer_scaling(fb_width, fb_height, scn_width, scn_height, depth);
+                if (ret == STATE_UNCHANGED) ret = 0;
+            } else {
+                ret = setup_fb_with_scaling(g_fb_index, fb_width, fb_height,
+                                           scn_width, scn_height, depth);
+                if (ret == STATE_UNCHANGED) {
+                    ret = 0;
+                } else if (ret == 0) {
+                    printf("Framebuffer: %dx%d @ %dbpp\n", fb_width, fb_height, depth);
+                    printf("Screen output: %dx%d\n", scn_width, scn_height);
+                }
+            }
+        } else {
+            fprintf(stderr, "Invalid resolution format\n");
+            ret = 1;
+        }
+    }
+    /* autoscale command */
+    else if (strcmp(argv[0], "autoscale") == 0) {
+        struct fb_var_screeninfo vinfo;
+        uint32_t scn_width, scn_height;
+        int depth, clamped = 0;
+
+        if (get_fb_info(&vinfo, NULL) < 0) {
+            fprintf(stderr, "Failed to read framebuffer settings\n");
+            return 1;
+        }
+        if (get_screen_size(&scn_width, &scn_height) < 0) {
+            fprintf(stderr, "Failed to get screen size\n");
+            return 1;
+        }
+
+        if (parse_depth_alloc_args(argc - 1, &argv[1], &depth) < 0) return 1;
+        if (depth == 0) depth = vinfo.bits_per_pixel;
+
+        if (!g_force && (vinfo.xres != scn_width || vinfo.yres != scn_height)) {
+            double hz = scaler_current_hz();
+            uint32_t w, h;
+            char why[96];
+
+            /* Clamp to the largest size the scaler sustains in this mode */
+            if (scaler_check(vinfo.xres, vinfo.yres, scn_width, scn_height, depth, hz,
+                             why, sizeof(why), NULL) != 0 &&
+                scaler_largest(scn_width, scn_height, depth, hz, 0, 0, 0, &w, &h) == 0) {
+                printf("Clamping FB %ux%u to %ux%u: %s (-f to keep)\n",
+                       vinfo.xres, vinfo.yres, w, h, why);
+                vinfo.xres = w;
+                vinfo.yres = h;
+                clamped = 1;
+            }
+        }
+
+        if (vinfo.xres == scn_width && vinfo.yres == scn_height && !g_buffers && !g_virt_w) {
+            printf("FB (%ux%u) already matches screen - no scaling needed\n",
+                   vinfo.xres, vinfo.yres);
+        } else {
+            if (g_de_version == DE_VERSION_2 && !g_buffers && !g_virt_w && !clamped) {
+                printf("DE2 auto-scaling already active: %ux%u -> %ux%u\n",
+                       vinfo.xres, vinfo.yres, scn_width, scn_height);
+                printf("(DE2 handles scaling automatically - no action needed)\n");
+            } else {
+                printf("Scaling: %ux%u -> %ux%u @ %dbpp\n",
+                       vinfo.xres, vinfo.yres, scn_width, scn_height, depth);
+                ret = setup_fb_with_scaling(g_fb_index, vinfo.xres, vinfo.yres,
+                                           scn_width, scn_height, depth);
+                if (ret == STATE_UNCHANGED) ret = 0;
+            }
+        }
+    }
+    /* noscale command */
+    else if (strcmp(argv[0], "noscale") == 0) {
+        struct fb_var_screeninfo vinfo;
+        uint32_t scn_width, scn_height;
+        int depth;
+
+        if (get_screen_size(&scn_width, &scn_height) < 0) {
+            fprintf(stderr, "Failed to get screen size\n");
+            return 1;
+        }
+
+        if (parse_depth_alloc_args(argc - 1, &argv[1], &depth) < 0) return 1;
+        if (depth == 0) {
+            if (get_fb_info(&vinfo, NULL) == 0) {
+                depth = vinfo.bits_per_pixel;
+            } else {
+                depth = 32;
+            }
+        }
+
+        printf("Disabling scaling: FB -> %ux%u @ %dbpp\n",
+               scn_width, scn_height, depth);
+        ret = setup_fb_with_scaling(g_fb_index, scn_width, scn_height,
+                                   scn_width, scn_height, depth);
+        if (ret == STATE_UNCHANGED) ret = 0;
+    }
+    /* snapshot commands */
+    else if (strcmp(argv[0], "snapshot") == 0 && argc >= 2) {
+        const char *path = argc >= 3 ? argv[2] : SNAPSHOT_FILE;
+        if (strcmp(argv[1], "save") == 0) {
+            ret = snapshot_save(path) < 0 ? 1 : 0;
+        } else if (strcmp(argv[1], "apply") == 0) {
+            ret = snapshot_apply(path) < 0 ? 1 : 0;
+        } else {
+            fprintf(stderr, "Unknown snapshot command: %s\n", argv[1]);
+            ret = 1;
+        }
+    }
+    /* apply command */
+    else if (strcmp(argv[0], "apply") == 0 && argc >= 2) {
+        ret = apply_request(argc - 1, &argv[1]);
+    }
+    else if (strcmp(argv[0], "switch") == 0) {
+        ret = switch_run(argc - 1, &argv[1]);
+    }
+    /* watch command */
+    else if (strcmp(argv[0], "watch") == 0) {
+        ret = watch_run(argc - 1, &argv[1]);
+    }
+    /* flip command */
+    else if (strcmp(argv[0], "flip") == 0) {
+        ret = flip_run(argc - 1, &argv[1]);
+    }
+    /* vsync command */
+    else if (strcmp(argv[0], "vsync") == 0) {
+        ret = vsync_run(argc - 1, &argv[1]);
+    }
+    /* drs command */
+    else if (strcmp(argv[0], "drs") == 0) {
+        ret = drs_run(argc - 1, &argv[1]);
+    }
+    /* overlay command */
+    else if (strcmp(argv[0], "overlay") == 0) {
+        ret = overlay_run(argc - 1, &argv[1]);
+    }
+    /* layer command */
+    else if (strcmp(argv[0], "layer") == 0) {
+        ret = layer_run(argc - 1, &argv[1]);
+    }
+    /* blank commands */
+    else if (strcmp(argv[0], "blank") == 0) {
+        ret = screen_blank(argc - 1, &argv[1]);
+    }
+    else if (strcmp(argv[0], "unblank") == 0) {
+        ret = screen_unblank();
+    }
+    /* mem command */
+    else if (strcmp(argv[0], "mem") == 0) {
+        ret = show_mem(argc - 1, &argv[1]);
+    }
+    /* advise command */
+    else if (strcmp(argv[0], "advise") == 0) {
+        ret = advise_run(argc - 1, &argv[1]);
+    }
+    /* bench command */
+    else if (strcmp(argv[0], "bench") == 0) {
+        ret = bench_run(argc - 1, &argv[1]);
+    }
+    /* stress command */
+    else if (strcmp(argv[0], "stress") == 0) {
+        ret = stress_run(argc - 1, &argv[1]);
+    }
+    else {
+        print_usage(g_prog);
+        ret = 1;
+    }
+
+    return ret;
+}
+
+static int run_command(int argc, char *argv[])
+{
+    int ret;
+
+    if (!changes_display(argc, argv))
+        return dispatch_command(argc, argv);
+    if (display_lock() < 0) return 1;
+    ret = dispatch_command(argc, argv);
+    display_unlock();
+    return ret;
+}
+
+/*
+ * ============================================================================
+ * Batch Execution
+ * ============================================================================
+ *
+ * A script is a list of commands separated by ';' or newlines, with '#'
+ * starting a comment. Each step may carry its own leading options
+ * (e.g. "-s 1 hdmi mode 720p60"); otherwise the options given for the
+ * batch itself apply. All steps share the open display and fbdev handles.
+ * Execution stops at the first failing step.
+ */
+#define BATCH_SCRIPT_MAX    65536
+#define BATCH_MAX_STEPS     64
+#define BATCH_MAX_ARGS      16
+
+typedef struct {
+    char   *argv[BATCH_MAX_ARGS];
+    int     argc;
+    int     status;
+    int     ran;
+    double  ms;
+} batch_step_t;
+
+/* Read a whole script from a file ("-" is stdin) into a malloc'd buffer */
+static char *batch_read_script(const char *path)
+{
+    char *buf = malloc(BATCH_SCRIPT_MAX + 1);
+    size_t len = 0;
+    ssize_t n;
+    int fd;
+
+    if (!buf) return NULL;
+
+    fd = strcmp(path, "-") == 0 ? STDIN_FILENO : open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        fprintf(stderr, "Failed to open script %s: %s\n", path, strerror(errno));
+        free(buf);
+        return NULL;
+    }
+
+    while ((n = read(fd, buf + len, BATCH_SCRIPT_MAX - len)) > 0) {
+        len += (size_t)n;
+        if (len == BATCH_SCRIPT_MAX) {
+            fprintf(stderr, "Script too large (max %d bytes)\n", BATCH_SCRIPT_MAX);
+            n = -1;
+            errno = EFBIG;
+            break;
+        }
+    }
+    if (fd != STDIN_FILENO) close(fd);
+    if (n < 0) {
+        if (errno != EFBIG) perror("Failed to read script");
+        free(buf);
+        return NULL;
+    }
+
+    buf[len] = '\0';
+    return buf;
+}
+
+/* Split a script into steps. Returns step count or -1. */
+static int batch_parse(char *script, batch_step_t *steps, int max_steps)
+{
+    int nsteps = 0;
+    char *save_step, *step;
+
+    for (step = strtok_r(script, ";\n", &save_step); step;
+         step = strtok_r(NULL, ";\n", &save_step)) {
+        char *comment = strchr(step, '#');
+        char *save_tok, *tok;
+        batch_step_t *st;
+
+        if (comment) *comment = '\0';
+
+        if (nsteps >= max_steps) {
+            fprintf(stderr, "Too many steps (max %d)\n", max_steps);
+            return -1;
+        }
+        st = &steps[nsteps];
+        memset(st, 0, sizeof(*st));
+
+        for (tok = strtok_r(step, " \t\r", &save_tok); tok;
+             tok = strtok_r(NULL, " \t\r", &save_tok)) {
+            if (st->argc >= BATCH_MAX_ARGS) {
+                fprintf(stderr, "Too many arguments in step %d\n", nsteps + 1);
+                return -1;
+            }
+            st->argv[st->argc++] = tok;
+        }
+
+        if (st->argc > 0) nsteps++;
+    }
+
+    return nsteps;
+}
+
+static void batch_print_step(const batch_step_t *st)
+{
+    for (int i = 0; i < st->argc; i++)
+        printf("%s%s", i ? " " : "", st->argv[i]);
+}
+
+/*
+ * ============================================================================
+ * Parallel Screens
+ * ============================================================================
+ *
+ * Each job runs one command on one screen in its own thread, with that
+ * thread's screen context (g_screen, /dev/fbN as fbdev handle and DE1
+ * fb_id). HDMI/TCON resyncs of the two screens then overlap, so bring-up
+ * takes as long as the slowest screen instead of the sum:
+ *   -s 0,1 <command>                the same command on every listed screen
+ *   screens <N cmd ; N cmd ...>     a per-screen profile, batch syntax
+ * Output of the jobs may interleave; the summary gives per-screen results.
+ */
+typedef struct {
+    uint32_t    screen;
+    int         argc;
+    char      **argv;
+    int         status;
+    double      ms;
+    run_flags_t flags;      /* The caller's, for the job's thread */
+} screen_job_t;
+
+static void *screen_worker(void *arg)
+{
+    screen_job_t *job = arg;
+    struct timespec t0;
+
+    g_screen = job->screen;
+    g_fb_index = job->screen;
+    run_flags_load(&job->flags);
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    job->status = run_command(job->argc, job->argv);
+    job->ms = elapsed_ms(&t0);
+    fflush(stdout);
+    fb_close();
+    return NULL;
+}
+
+static int screen_job_allowed(const char *cmd)
+{
+    /*
+     * bench redirects stdout, the others manage their own sessions. A
+     * snapshot is one screen's state in one file.
+     */
+    return !is_long_running(cmd) && strcmp(cmd, "bench") != 0 &&
+           strcmp(cmd, "snapshot") != 0;
+}
+
+static int screens_run_jobs(screen_job_t *jobs, int njobs)
+{
+    pthread_t threads[CAPS_MAX_SCREENS];
+    int started[CAPS_MAX_SCREENS] = { 0 };
+    struct timespec t0;
+    int status = 0;
+    double total;
+
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    for (int i = 0; i < njobs; i++) {
+        run_flags_save(&jobs[i].flags);
+        if (pthread_create(&threads[i], NULL, screen_worker, &jobs[i]) == 0) {
+            started[i] = 1;
+        } else {
+            DEBUG("screens: no thread for screen %u, running inline", jobs[i].screen);
+            screen_worker(&jobs[i]);
+        }
+    }
+    for (int i = 0; i < njobs; i++)
+        if (started[i]) pthread_join(threads[i], NULL);
+    total = elapsed_ms(&t0);
+
+    printf("\n--- Screen summary ---\n");
+    for (int i = 0; i < njobs; i++) {
+        const screen_job_t *job = &jobs[i];
+        if (job->status == 0)
+            printf("  screen %u  ok       %7.1fms ", job->screen, job->ms);
+        else
+            printf("  screen %u  FAIL(%3d)%7.1fms ", job->screen, job->status, job->ms);
+        for (int a = 0; a < job->argc; a++)
+            printf("%s%s", a ? " " : "", job->argv[a]);
+        printf("\n");
+        if (job->status != 0 && status == 0) status = job->status;
+    }
+    printf("  total (parallel)  %7.1fms\n", total);
+    return status;
+}
+
+/* -s 0,1 <command>: the same command on each screen in g_screen_mask */
+static int screens_same(int argc, char *argv[])
+{
+    screen_job_t jobs[CAPS_MAX_SCREENS];
+    int njobs = 0;
+
+    if (!screen_job_allowed(argv[0])) {
+        fprintf(stderr, "'%s' cannot run on several screens at once\n", argv[0]);
+        return 1;
+    }
+    for (uint32_t s = 0; s < CAPS_MAX_SCREENS; s++) {
+        if (!(g_screen_mask & (1u << s))) continue;
+        if (!g_force && s >= g_caps.screen_count) {
+            fprintf(stderr, "Screen %u not available (%u screen%s, use -f to force)\n",
+                    s, g_caps.screen_count, g_caps.screen_count == 1 ? "" : "s");
+            return 1;
         }
-        else if (strcmp(argv[arg_start + 1], "mode") == 0 && orig_argc >= arg_start + 3) {
-            const char *mode_arg = argv[arg_start + 2];
-            const mode_info_t *info = NULL;
+        memset(&jobs[njobs], 0, sizeof(jobs[njobs]));
+        jobs[njobs].screen = s;
+        jobs[njobs].argc = argc;
+        jobs[njobs].argv = argv;
+        njobs++;
+    }
+    return screens_run_jobs(jobs, njobs);
+}
 
-            char *endptr;
-            long mode_num = strtol(mode_arg, &endptr, 10);
-            if (*endptr == '\0' && mode_num >= 0 && mode_num < DISP_TV_MODE_NUM) {
-                info = get_mode_info((disp_tv_mode)mode_num);
-                if (!info) {
-                    ret = hdmi_init((disp_tv_mode)mode_num);
-                    if (ret == 0) printf("HDMI mode set to %ld\n", mode_num);
-                }
-            } else {
-                info = find_mode_by_name(mode_arg);
-            }
+/*
+ * screens <N command ; N command ...>   profile on the command line
+ * screens @<file> | -                   profile from a file or stdin
+ */
+static int screens_run(int argc, char *argv[])
+{
+    batch_step_t steps[CAPS_MAX_SCREENS];
+    screen_job_t jobs[CAPS_MAX_SCREENS];
+    uint32_t seen = 0;
+    char *script, *end;
+    int nsteps, status;
+    size_t len = 0;
+
+    if (argc < 1) {
+        fprintf(stderr, "screens: no profile given\n");
+        return 1;
+    }
+    if (argc == 1 && (strcmp(argv[0], "-") == 0 || argv[0][0] == '@')) {
+        script = batch_read_script(argv[0][0] == '@' ? argv[0] + 1 : argv[0]);
+        if (!script) return 1;
+    } else {
+        for (int i = 0; i < argc; i++) len += strlen(argv[i]) + 1;
+        script = malloc(len + 1);
+        if (!script) return 1;
+        script[0] = '\0';
+        for (int i = 0; i < argc; i++) {
+            strcat(script, argv[i]);
+            strcat(script, " ");
+        }
+    }
 
-            if (info) {
-                ret = hdmi_init(info->mode);
-                if (ret == 0) {
-                    printf("HDMI mode set to %s (%dx%d @ %dHz)\n",
-                           info->name, info->width, info->height, info->refresh);
-                }
-            } else if (*endptr != '\0') {
-                fprintf(stderr, "Unknown mode: %s\n", mode_arg);
-                ret = 1;
-            }
+    nsteps = batch_parse(script, steps, CAPS_MAX_SCREENS);
+    if (nsteps <= 0) {
+        if (nsteps == 0) fprintf(stderr, "screens: profile has no commands\n");
+        free(script);
+        return 1;
+    }
+
+    for (int i = 0; i < nsteps; i++) {
+        unsigned long s = strtoul(steps[i].argv[0], &end, 10);
+
+        if (*end != '\0' || s >= CAPS_MAX_SCREENS || steps[i].argc < 2) {
+            fprintf(stderr, "screens: step %d must be '<screen> <command ...>'\n", i + 1);
+            free(script);
+            return 1;
         }
-        else if (strcmp(argv[arg_start + 1], "init") == 0 && orig_argc >= arg_start + 3) {
-            uint32_t width, height, refresh;
-            if (parse_resolution(argv[arg_start + 2], &width, &height, &refresh) == 0) {
-                const mode_info_t *info = find_mode_by_resolution(width, height, refresh);
-                if (info) {
-                    ret = hdmi_init(info->mode);
-                    if (ret == 0) {
-                        printf("HDMI initialized: %s (%dx%d @ %dHz)\n",
-                               info->name, info->width, info->height, info->refresh);
-                    }
-                } else {
-                    fprintf(stderr, "No matching mode for %dx%d\n", width, height);
-                    ret = 1;
-                }
-            } else {
-                fprintf(stderr, "Invalid resolution: %s\n", argv[arg_start + 2]);
-                ret = 1;
-            }
+        if (seen & (1u << s)) {
+            fprintf(stderr, "screens: screen %lu listed twice\n", s);
+            free(script);
+            return 1;
         }
-        else {
-            print_usage(argv[0]);
-            ret = 1;
+        if (!screen_job_allowed(steps[i].argv[1])) {
+            fprintf(stderr, "screens: '%s' is not allowed in a profile\n", steps[i].argv[1]);
+            free(script);
+            return 1;
         }
-    }
-    /* fb set command */
-    else if (strcmp(argv[arg_start], "fb") == 0 && orig_argc >= arg_start + 3) {
-        if (strcmp(argv[arg_start + 1], "set") == 0) {
-            uint32_t width, height;
-            int depth;
-            if (parse_resolution_depth(argv[arg_start + 2], &width, &height, &depth) == 0) {
-                ret = fb_configure(width, height, depth);
-            } else {
-                fprintf(stderr, "Invalid format. Use: WxHxDEPTH\n");
-                ret = 1;
-            }
+        if (!g_force && s >= g_caps.screen_count) {
+            fprintf(stderr, "Screen %lu not available (%u screen%s, use -f to force)\n",
+                    s, g_caps.screen_count, g_caps.screen_count == 1 ? "" : "s");
+            free(script);
+            return 1;
         }
-        else {
-            print_usage(argv[0]);
-            ret = 1;
+        seen |= 1u << s;
+        memset(&jobs[i], 0, sizeof(jobs[i]));
+        jobs[i].screen = (uint32_t)s;
+        jobs[i].argc = steps[i].argc - 1;
+        jobs[i].argv = &steps[i].argv[1];
+    }
+
+    status = screens_run_jobs(jobs, nsteps);
+    free(script);
+    return status;
+}
+
+/*
+ * batch <command ; command ...>   script given on the command line
+ * batch @<file>                   script read from a file
+ * batch -                         script read from stdin
+ */
+static int batch_run(int argc, char *argv[])
+{
+    batch_step_t steps[BATCH_MAX_STEPS];
+    int base_verbose = g_verbose, base_force = g_force, base_no_cache = g_no_cache;
+    int base_reapply = g_reapply;
+    uint32_t base_screen = g_screen, base_buffers = g_buffers, base_mask = g_screen_mask;
+    char *script;
+    int nsteps, status = 0;
+    int i;
+
+    if (argc < 1) {
+        fprintf(stderr, "batch: no script given\n");
+        return 1;
+    }
+
+    if (argc == 1 && (strcmp(argv[0], "-") == 0 || argv[0][0] == '@')) {
+        script = batch_read_script(argv[0][0] == '@' ? argv[0] + 1 : argv[0]);
+        if (!script) return 1;
+    } else {
+        size_t len = 0;
+        for (i = 0; i < argc; i++) len += strlen(argv[i]) + 1;
+        script = malloc(len + 1);
+        if (!script) return 1;
+        script[0] = '\0';
+        for (i = 0; i < argc; i++) {
+            strcat(script, argv[i]);
+            strcat(script, " ");
         }
     }
-    /* scale command */
-    else if (strcmp(argv[arg_start], "scale") == 0 && orig_argc >= arg_start + 4) {
-        uint32_t fb_width, fb_height, scn_width, scn_height;
-        int depth;
 
-        if (parse_resolution(argv[arg_start + 1], &fb_width, &fb_height, NULL) == 0 &&
-            parse_resolution(argv[arg_start + 2], &scn_width, &scn_height, NULL) == 0) {
-            depth = atoi(argv[arg_start + 3]);
-            if (depth != 16 && depth != 24 && depth != 32) {
-                fprintf(stderr, "Invalid depth. Use 16, 24, or 32\n");
-                ret = 1;
-            } else {
-                ret = setup_fb_with_scaling(0, fb_width, fb_height,
-                                           scn_width, scn_height, depth);
-                if (ret == 0) {
-                    printf("Framebuffer: %dx%d @ %dbpp\n", fb_width, fb_height, depth);
-                    printf("Screen output: %dx%d\n", scn_width, scn_height);
-                }
-            }
+    nsteps = batch_parse(script, steps, BATCH_MAX_STEPS);
+    if (nsteps <= 0) {
+        if (nsteps == 0) fprintf(stderr, "batch: script has no commands\n");
+        free(script);
+        return 1;
+    }
+
+    for (i = 0; i < nsteps; i++) {
+        batch_step_t *st = &steps[i];
+        struct timespec t0;
+        int nopt;
+
+        g_verbose = base_verbose;
+        g_force = base_force;
+        g_no_cache = base_no_cache;
+        g_reapply = base_reapply;
+        g_screen = base_screen;
+        g_screen_mask = base_mask;
+        g_buffers = base_buffers;
+        g_virt_w = g_virt_h = 0;
+
+        clock_gettime(CLOCK_MONOTONIC, &t0);
+        nopt = parse_options(st->argc, st->argv, 1);
+        if (nopt < 0 || nopt >= st->argc) {
+            fprintf(stderr, "Step %d: invalid options or missing command\n", i + 1);
+            st->status = 1;
+        } else if (is_long_running(st->argv[nopt])) {
+            fprintf(stderr, "Step %d: '%s' is not allowed in a batch\n", i + 1, st->argv[nopt]);
+            st->status = 1;
         } else {
-            fprintf(stderr, "Invalid resolution format\n");
-            ret = 1;
+            DEBUG("batch: step %d: %s", i + 1, st->argv[nopt]);
+            st->status = g_screen_mask ? screens_same(st->argc - nopt, &st->argv[nopt])
+                                       : run_command(st->argc - nopt, &st->argv[nopt]);
         }
-    }
-    /* autoscale command */
-    else if (strcmp(argv[arg_start], "autoscale") == 0) {
-        struct fb_var_screeninfo vinfo;
-        uint32_t scn_width, scn_height;
-        int depth;
+        st->ms = elapsed_ms(&t0);
+        st->ran = 1;
+        fflush(stdout);
 
-        if (get_fb_info(&vinfo, NULL) < 0) {
-            fprintf(stderr, "Failed to read framebuffer settings\n");
-            ret = 1;
+        if (st->status != 0) {
+            status = st->status;
+            break;
         }
-        else if (get_screen_size(&scn_width, &scn_height) < 0) {
-            fprintf(stderr, "Failed to get screen size\n");
-            ret = 1;
+    }
+
+    g_verbose = base_verbose;
+    g_force = base_force;
+    g_no_cache = base_no_cache;
+    g_reapply = base_reapply;
+    g_screen = base_screen;
+    g_screen_mask = base_mask;
+    g_buffers = base_buffers;
+    g_virt_w = g_virt_h = 0;
+
+    printf("\n--- Batch summary ---\n");
+    for (i = 0; i < nsteps; i++) {
+        const batch_step_t *st = &steps[i];
+        if (!st->ran)
+            printf("  %2d  skipped            ", i + 1);
+        else if (st->status == 0)
+            printf("  %2d  ok       %7.1fms ", i + 1, st->ms);
+        else
+            printf("  %2d  FAIL(%3d)%7.1fms ", i + 1, st->status, st->ms);
+        batch_print_step(st);
+        printf("\n");
+    }
+
+    free(script);
+    return status;
+}
+
+/* Top-level entry for a command line: a batch or a single command */
+static int exec_command(int argc, char *argv[])
+{
+    if (strcmp(argv[0], "batch") == 0)
+        return batch_run(argc - 1, &argv[1]);
+    if (strcmp(argv[0], "screens") == 0)
+        return screens_run(argc - 1, &argv[1]);
+    if (g_screen_mask)
+        return screens_same(argc, argv);
+    return run_command(argc, argv);
+}
+
+/*
+ * ============================================================================
+ * Daemon Mode
+ * ============================================================================
+ *
+ * The daemon keeps /dev/disp and /dev/fb0 open and the detected DE version
+ * resident, and runs commands received over a Unix socket. Each request is
+ * one message holding NUL-separated arguments (options first, then the
+ * command), with the client's stdin/stdout/stderr passed as SCM_RIGHTS so
+ * command output goes straight to the client's terminal and 'batch -'
+ * reads the client's input. The daemon replies
+ * with the command's exit status as an int32. Requests are served one at
+ * a time, so a client that does not send its request within
+ * DAEMON_RECV_MS is dropped instead of holding up the others.
+ */
+#define DAEMON_MSG_MAX      4096
+#define DAEMON_MAX_ARGS     64
+#define DAEMON_RECV_MS      1000
+
+/* Split a NUL-separated argument buffer. Returns argument count or -1. */
+static int daemon_split_args(char *buf, size_t len, char *argv[], int max_args)
+{
+    int argc = 0;
+    size_t pos = 0;
+
+    if (len == 0 || buf[len - 1] != '\0') return -1;
+
+    while (pos < len) {
+        if (argc >= max_args) return -1;
+        argv[argc++] = &buf[pos];
+        pos += strlen(&buf[pos]) + 1;
+    }
+    return argc;
+}
+
+static void daemon_serve(int cfd)
+{
+    char buf[DAEMON_MSG_MAX];
+    char cbuf[CMSG_SPACE(3 * sizeof(int))];
+    char *args[DAEMON_MAX_ARGS];
+    struct iovec iov = { buf, sizeof(buf) };
+    struct msghdr msg;
+    struct cmsghdr *cmsg;
+    struct timeval tv = { DAEMON_RECV_MS / 1000, (DAEMON_RECV_MS % 1000) * 1000 };
+    int fds[3] = { cfd, cfd, cfd };
+    int own_fds = 0;
+    int saved_in, saved_out, saved_err;
+    int argc, nopt;
+    int32_t status;
+    ssize_t n;
+
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = cbuf;
+    msg.msg_controllen = sizeof(cbuf);
+
+    if (setsockopt(cfd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv)) < 0)
+        DEBUG("daemon: SO_RCVTIMEO failed (errno=%d)", errno);
+    n = recvmsg(cfd, &msg, MSG_CMSG_CLOEXEC);
+    if (n <= 0) {
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            DEBUG("daemon: no request within %d ms, dropping the client", DAEMON_RECV_MS);
+        return;
+    }
+    /* Without passed fds cfd is also the client's stdin: no timeout there */
+    tv.tv_sec = tv.tv_usec = 0;
+    setsockopt(cfd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+    for (cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+        if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS &&
+            cmsg->cmsg_len == CMSG_LEN(sizeof(fds))) {
+            memcpy(fds, CMSG_DATA(cmsg), sizeof(fds));
+            own_fds = 1;
         }
-        else {
-            if (arg_start + 1 < orig_argc) {
-                depth = atoi(argv[arg_start + 1]);
-                if (depth != 16 && depth != 24 && depth != 32) {
-                    fprintf(stderr, "Invalid depth. Use 16, 24, or 32\n");
-                    ret = 1;
-                    goto done;
-                }
-            } else {
-                depth = vinfo.bits_per_pixel;
-            }
+    }
 
-            if (vinfo.xres == scn_width && vinfo.yres == scn_height) {
-                printf("FB (%ux%u) already matches screen - no scaling needed\n",
-                       vinfo.xres, vinfo.yres);
-            } else {
-                if (g_de_version == DE_VERSION_2) {
-                    printf("DE2 auto-scaling already active: %ux%u -> %ux%u\n",
-                           vinfo.xres, vinfo.yres, scn_width, scn_height);
-                    printf("(DE2 handles scaling automatically - no action needed)\n");
-                } else {
-                    printf("Scaling: %ux%u -> %ux%u @ %dbpp\n",
-                           vinfo.xres, vinfo.yres, scn_width, scn_height, depth);
-                    ret = setup_fb_with_scaling(0, vinfo.xres, vinfo.yres,
-                                               scn_width, scn_height, depth);
-                }
-            }
+    /* Route command output to the client for the duration of the request */
+    fflush(stdout);
+    fflush(stderr);
+    saved_in = dup(STDIN_FILENO);
+    saved_out = dup(STDOUT_FILENO);
+    saved_err = dup(STDERR_FILENO);
+    if (own_fds) dup2(fds[0], STDIN_FILENO);
+    dup2(fds[1], STDOUT_FILENO);
+    dup2(fds[2], STDERR_FILENO);
+
+    g_verbose = 0;
+    g_force = 0;
+    g_screen = 0;
+    g_screen_mask = 0;
+    g_no_cache = 0;
+    g_reapply = 0;
+    g_stats = 0;
+    g_buffers = 0;
+    g_virt_w = g_virt_h = 0;
+    edid_reset();
+    stats_reset();
+
+    argc = daemon_split_args(buf, (size_t)n, args, DAEMON_MAX_ARGS);
+    if (argc < 0) {
+        fprintf(stderr, "Malformed request\n");
+        status = 1;
+    } else {
+        nopt = parse_options(argc, args, 1);
+        if (nopt == -2) {
+            print_usage(g_prog);
+            status = 0;
+        } else if (nopt < 0) {
+            status = 1;
+        } else if (nopt >= argc) {
+            print_usage(g_prog);
+            status = 1;
+        } else if (strcmp(args[nopt], "daemon") == 0 || strcmp(args[nopt], "watch") == 0 ||
+                   strcmp(args[nopt], "stress") == 0) {
+            fprintf(stderr, "'%s' cannot run inside the daemon\n", args[nopt]);
+            status = 1;
+        } else {
+            DEBUG("daemon: running '%s'", args[nopt]);
+            async_reap(g_screen_mask ? g_screen_mask : 1u << g_screen);
+            g_in_daemon = 1;
+            status = exec_command(argc - nopt, &args[nopt]);
+            g_in_daemon = 0;
+            stats_print();
         }
     }
-    /* noscale command */
-    else if (strcmp(argv[arg_start], "noscale") == 0) {
-        struct fb_var_screeninfo vinfo;
-        uint32_t scn_width, scn_height;
-        int depth;
 
-        if (get_screen_size(&scn_width, &scn_height) < 0) {
-            fprintf(stderr, "Failed to get screen size\n");
-            ret = 1;
+    fflush(stdout);
+    fflush(stderr);
+    dup2(saved_in, STDIN_FILENO);
+    dup2(saved_out, STDOUT_FILENO);
+    dup2(saved_err, STDERR_FILENO);
+    close(saved_in);
+    close(saved_out);
+    close(saved_err);
+    if (own_fds) {
+        close(fds[0]);
+        close(fds[1]);
+        close(fds[2]);
+    }
+
+    caps_save();
+
+    if (write(cfd, &status, sizeof(status)) != (ssize_t)sizeof(status))
+        DEBUG("daemon: failed to send status (errno=%d)", errno);
+
+    /* 'switch async': the final status follows once the switch is done */
+    if (g_async_started) {
+        int nfd = dup(cfd);
+        if (nfd >= 0) mode_async_notify(g_async_started, nfd);
+        g_async_started = NULL;
+    }
+}
+
+static int daemon_run(void)
+{
+    struct sockaddr_un addr;
+    char path[sizeof(addr.sun_path)];   /* Own copy for the unlink at exit */
+    int sfd;
+
+    if (strlen(g_socket_path) >= sizeof(path)) {
+        fprintf(stderr, "Socket path too long: %s\n", g_socket_path);
+        return 1;
+    }
+    strcpy(path, g_socket_path);
+
+    sfd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (sfd < 0) {
+        perror("Failed to create socket");
+        return 1;
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+
+    unlink(path);
+    if (bind(sfd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        fprintf(stderr, "Failed to bind %s: %s\n", path, strerror(errno));
+        close(sfd);
+        return 1;
+    }
+    chmod(path, 0660);
+
+    if (listen(sfd, 8) < 0) {
+        perror("Failed to listen on socket");
+        close(sfd);
+        unlink(path);
+        return 1;
+    }
+
+    install_stop_handlers();
+    signal(SIGPIPE, SIG_IGN);
+
+    printf("Daemon listening on %s (%s)\n", path, de_version_name(g_de_version));
+    fflush(stdout);
+
+    while (!g_stop_requested) {
+        int cfd = accept4(sfd, NULL, NULL, SOCK_CLOEXEC);
+        if (cfd < 0) {
+            if (errno == EINTR) continue;
+            perror("accept failed");
+            break;
         }
-        else {
-            if (arg_start + 1 < orig_argc) {
-                depth = atoi(argv[arg_start + 1]);
-                if (depth != 16 && depth != 24 && depth != 32) {
-                    fprintf(stderr, "Invalid depth. Use 16, 24, or 32\n");
-                    ret = 1;
-                    goto done;
-                }
-            } else {
-                if (get_fb_info(&vinfo, NULL) == 0) {
-                    depth = vinfo.bits_per_pixel;
-                } else {
-                    depth = 32;
-                }
-            }
+        daemon_serve(cfd);
+        close(cfd);
+    }
+
+    async_reap(~0u);
+    close(sfd);
+    unlink(path);
+    printf("Daemon stopped\n");
+    return 0;
+}
 
-            printf("Disabling scaling: FB -> %ux%u @ %dbpp\n",
-                   scn_width, scn_height, depth);
-            ret = setup_fb_with_scaling(0, scn_width, scn_height,
-                                       scn_width, scn_height, depth);
+/* Forward the command to a running daemon and return its exit status */
+static int client_forward(int argc, char *argv[])
+{
+    char buf[DAEMON_MSG_MAX];
+    char cbuf[CMSG_SPACE(3 * sizeof(int))];
+    struct sockaddr_un addr;
+    struct iovec iov;
+    struct msghdr msg;
+    struct cmsghdr *cmsg;
+    int fds[3] = { STDIN_FILENO, STDOUT_FILENO, STDERR_FILENO };
+    size_t len = 0;
+    int32_t status;
+    char screen[16], buffers[16];
+    const char *opts[9];
+    int nopts = 0;
+    int sfd;
+
+    if (g_verbose) opts[nopts++] = "-v";
+    if (g_force) opts[nopts++] = "-f";
+    if (g_no_cache) opts[nopts++] = "-n";
+    if (g_reapply) opts[nopts++] = "-r";
+    if (g_stats) opts[nopts++] = (g_stats == 2) ? "--stats=json" : "--stats";
+    if (g_buffers) {
+        snprintf(buffers, sizeof(buffers), "%u", g_buffers);
+        opts[nopts++] = "-b";
+        opts[nopts++] = buffers;
+    }
+    if (g_screen_mask) {
+        size_t slen = 0;
+        screen[0] = '\0';
+        for (uint32_t s = 0; s < CAPS_MAX_SCREENS; s++)
+            if (g_screen_mask & (1u << s))
+                slen += snprintf(screen + slen, sizeof(screen) - slen, "%s%u", slen ? "," : "", s);
+    } else {
+        snprintf(screen, sizeof(screen), "%u", g_screen);
+    }
+    opts[nopts++] = "-s";
+    opts[nopts++] = screen;
+
+    for (int i = 0; i < nopts + argc; i++) {
+        const char *a = (i < nopts) ? opts[i] : argv[i - nopts];
+        size_t alen = strlen(a) + 1;
+        if (len + alen > sizeof(buf)) {
+            fprintf(stderr, "Command too long for daemon request\n");
+            return 1;
         }
+        memcpy(&buf[len], a, alen);
+        len += alen;
     }
-    else {
+
+    if (strlen(g_socket_path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "Socket path too long: %s\n", g_socket_path);
+        return 1;
+    }
+
+    sfd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (sfd < 0) {
+        perror("Failed to create socket");
+        return 1;
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, g_socket_path);
+
+    if (connect(sfd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        fprintf(stderr, "Failed to connect to daemon at %s: %s\n",
+                g_socket_path, strerror(errno));
+        close(sfd);
+        return 1;
+    }
+
+    iov.iov_base = buf;
+    iov.iov_len = len;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = cbuf;
+    msg.msg_controllen = sizeof(cbuf);
+    cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+
+    fflush(stdout);
+    fflush(stderr);
+    if (sendmsg(sfd, &msg, 0) < 0) {
+        perror("Failed to send request");
+        close(sfd);
+        return 1;
+    }
+
+    if (read(sfd, &status, sizeof(status)) != (ssize_t)sizeof(status)) {
+        fprintf(stderr, "Daemon closed connection without status\n");
+        close(sfd);
+        return 1;
+    }
+
+    close(sfd);
+    return status;
+}
+
+/*
+ * ============================================================================
+ * Main
+ * ============================================================================
+ */
+int main(int argc, char *argv[])
+{
+    int ret = 0;
+    int arg_start;
+
+    g_prog = argv[0];
+    install_signal_handlers();
+
+    if (argc < 2) {
         print_usage(argv[0]);
-        ret = 1;
+        return 1;
+    }
+
+    /* Parse options */
+    arg_start = parse_options(argc - 1, argv + 1, 0);
+    if (arg_start == -2) {
+        print_usage(argv[0]);
+        return 0;
+    }
+    if (arg_start < 0) return 1;
+    arg_start += 1;
+
+    if (arg_start >= argc) {
+        print_usage(argv[0]);
+        return 1;
+    }
+
+    /* Thin client: no device access, the daemon does the work */
+    if (g_client) {
+        return client_forward(argc - arg_start, &argv[arg_start]);
+    }
+
+    /* A snapshot names the DE version itself: skip detection for it */
+    if (argc - arg_start >= 2 && strcmp(argv[arg_start], "snapshot") == 0 &&
+        strcmp(argv[arg_start + 1], "apply") == 0)
+        snapshot_preload(argc - arg_start >= 3 ? argv[arg_start + 2] : SNAPSHOT_FILE);
+
+    if (disp_open() < 0) return 1;
+
+    if (strcmp(argv[arg_start], "daemon") == 0) {
+        ret = daemon_run();
+    } else {
+        ret = exec_command(argc - arg_start, &argv[arg_start]);
+        stats_print();
     }
 
-done:
-    if (g_fb_fd >= 0) close(g_fb_fd);
+    caps_save();
+    stats_reset();
+    fb_close();
     disp_close();
 
     return ret;
 }
+#endif /* !SUNXI_DISP_LIB */